@@ -93,6 +93,13 @@ if(USE_VTK)
   endif()
 endif()
 
+# Optional BLAS backend for the large matrix products in sccan
+option(USE_SCCAN_BLAS "Use a (multithreaded) BLAS for the matrix products in sccan" OFF)
+if(USE_SCCAN_BLAS)
+  find_package(BLAS REQUIRED)
+  add_definitions(-DANTS_SCCAN_USE_BLAS)
+endif()
+
 # With MS compilers on Win64, we need the /bigobj switch, else generated
 # code results in objects with number of sections exceeding object file
 # format.
@@ -31,16 +31,58 @@
 #include "itkOptimalSharpeningImageFilter.h"
 #include "itkLaplacianSharpeningImageFilter.h"
 #include "itkResampleImageFilter.h"
+#include "itkMultiThreaderBase.h"
+#include "itkPlatformMultiThreader.h"
+#include "antsAllocImage.h"
 #include <algorithm>
+#include <cmath>
+#include <exception>
+#include <vector>
 
 namespace ants
 {
+// Index of the first input image; an optional --statistics flag may follow
+// the Normalize argument.
+unsigned int GetFirstAverageImagesInput( unsigned int argc, char *argv[] )
+{
+  if( argc > 5 && std::string( argv[4] ) == std::string( "--statistics" ) )
+    {
+    return 5;
+    }
+  return 4;
+}
+
+template <typename TImage>
+bool ImagesShareGrid( const TImage * image, const TImage * reference )
+{
+  if( image->GetLargestPossibleRegion() != reference->GetLargestPossibleRegion() )
+    {
+    return false;
+    }
+  for( unsigned int d = 0; d < TImage::ImageDimension; d++ )
+    {
+    const double tolerance = 1.e-6 * reference->GetSpacing()[d];
+    if( std::fabs( image->GetSpacing()[d] - reference->GetSpacing()[d] ) > tolerance ||
+        std::fabs( image->GetOrigin()[d] - reference->GetOrigin()[d] ) > tolerance )
+      {
+      return false;
+      }
+    for( unsigned int e = 0; e < TImage::ImageDimension; e++ )
+      {
+      if( std::fabs( image->GetDirection()[d][e] - reference->GetDirection()[d][e] ) > 1.e-6 )
+        {
+        return false;
+        }
+      }
+    }
+  return true;
+}
+
 template <unsigned int ImageDimension, unsigned int NVectorComponents>
 int AverageImages1(unsigned int argc, char *argv[])
 {
   typedef float                                        PixelType;
   typedef itk::Image<PixelType, ImageDimension>        ImageType;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
   typedef itk::ImageFileReader<ImageType>              ImageFileReader;
   typedef itk::ImageFileWriter<ImageType>              writertype;
 
@@ -61,13 +103,15 @@ int AverageImages1(unsigned int argc, char *argv[])
       }
     }
 
-  const bool  normalizei = std::stoi(argv[3]);
-  const float numberofimages = (float)argc - 4.;
+  const bool         normalizei = std::stoi(argv[3]);
+  const unsigned int firstImage = GetFirstAverageImagesInput( argc, argv );
+  const bool         computeStatistics = ( firstImage > 4 );
+  const unsigned int numberofimages = argc - firstImage;
 
   typename ImageType::SizeType maxSize;
   maxSize.Fill( 0 );
   unsigned int bigimage = 0;
-  for( unsigned int j = 4; j < argc; j++ )
+  for( unsigned int j = firstImage; j < argc; j++ )
     {
     // Get the image dimension
     const std::string fn = std::string(argv[j]);
@@ -97,54 +141,221 @@ int AverageImages1(unsigned int argc, char *argv[])
   unsigned int vectorlength = reader->GetImageIO()->GetNumberOfComponents();
   std::cout << " Averaging " << numberofimages << " images with dim = " << ImageDimension << " vector components "
            << vectorlength << std::endl;
-  PixelType meanval = 0;
-  averageimage->FillBuffer(meanval);  // Reset all images to a mean of zero on the accumulator buffer.
-  for( unsigned int j = 4; j < argc; j++ )
+
+  // Inputs are read (and resampled only if their grid differs from the
+  // average) a batch at a time by a pool of readers, then every voxel
+  // accumulates the batch in input order in a single pass.  The next batch is
+  // read while the current one is accumulated.
+  const itk::SizeValueType numberOfVoxels = averageimage->GetBufferedRegion().GetNumberOfPixels();
+  std::vector<double>      sum( numberOfVoxels, 0.0 );
+  std::vector<double>      sumOfSquares( computeStatistics ? numberOfVoxels : 0, 0.0 );
+  // voxel-major copy of every input for the median
+  std::vector<PixelType>   samples( computeStatistics ? numberOfVoxels * numberofimages : 0 );
+
+  const unsigned int batchSize = std::max( 1u, static_cast<unsigned int>(
+                                             itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads() ) );
+  std::vector<typename ImageType::Pointer> batch( batchSize );
+  std::vector<typename ImageType::Pointer> nextBatch( batchSize );
+  std::vector<std::exception_ptr>          batchErrors( batchSize );
+  std::vector<std::exception_ptr>          nextBatchErrors( batchSize );
+
+  // the readers run ITK filters themselves, so they get their own threads
+  // rather than occupying the global pool
+  itk::PlatformMultiThreader::Pointer readers = itk::PlatformMultiThreader::New();
+  readers->SetNumberOfWorkUnits( batchSize );
+  itk::PlatformMultiThreader::Pointer overlap = itk::PlatformMultiThreader::New();
+  overlap->SetNumberOfWorkUnits( 2 );
+  itk::MultiThreaderBase::Pointer accumulator = itk::MultiThreaderBase::New();
+
+  constexpr itk::SizeValueType voxelsPerBlock = 16384;
+  const itk::SizeValueType     numberOfBlocks = ( numberOfVoxels + voxelsPerBlock - 1 ) / voxelsPerBlock;
+
+  // A failed read is kept with its input and rethrown on the calling thread
+  // rather than escaping a reader thread.
+  auto readBatch = [&]( unsigned int batchStart, std::vector<typename ImageType::Pointer> & images,
+                        std::vector<std::exception_ptr> & errors )
     {
-    std::cout << " reading " << std::string(argv[j]) << std::endl;
-    typename ImageFileReader::Pointer rdr = ImageFileReader::New();
-    rdr->SetFileName(argv[j]);
-    rdr->Update();
-    typedef itk::ResampleImageFilter<ImageType, ImageType, float> ResamplerType;
-    typename ResamplerType::Pointer resampler = ResamplerType::New();
-    // default to identity resampler->SetTransform( transform );
-    // default to linearinterp resampler->SetInterpolator( interpolator );
-    resampler->SetInput( rdr->GetOutput() );
-    resampler->SetOutputParametersFromImage( averageimage );
-    resampler->Update();
-
-    typename ImageType::Pointer image2 = resampler->GetOutput();
-    Iterator      vfIter2( image2,  image2->GetLargestPossibleRegion() );
-    unsigned long ct = 0;
-    if( normalizei )
-      {
-      meanval = 0;
-      for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+    const unsigned int currentBatchSize = std::min( batchSize, argc - batchStart );
+    readers->ParallelizeArray( 0, currentBatchSize,
+      [&]( itk::SizeValueType b )
         {
-        const PixelType & localp = image2->GetPixel( vfIter2.GetIndex() );
-        meanval = meanval + localp;
-        ct++;
-        }
-      if( ct > 0 )
+        errors[b] = nullptr;
+        try
+          {
+          typename ImageFileReader::Pointer rdr = ImageFileReader::New();
+          rdr->SetFileName(argv[batchStart + b]);
+          rdr->Update();
+          typename ImageType::Pointer image2 = rdr->GetOutput();
+          if( !ImagesShareGrid<ImageType>( image2, averageimage ) )
+            {
+            typedef itk::ResampleImageFilter<ImageType, ImageType, float> ResamplerType;
+            typename ResamplerType::Pointer resampler = ResamplerType::New();
+            // default to identity resampler->SetTransform( transform );
+            // default to linearinterp resampler->SetInterpolator( interpolator );
+            resampler->SetInput( image2 );
+            resampler->SetOutputParametersFromImage( averageimage );
+            resampler->Update();
+            image2 = resampler->GetOutput();
+            }
+
+          if( normalizei )
+            {
+            PixelType *  buffer = image2->GetBufferPointer();
+            double       meanval = 0;
+            for( itk::SizeValueType v = 0; v < numberOfVoxels; v++ )
+              {
+              meanval += buffer[v];
+              }
+            meanval /= static_cast<double>( numberOfVoxels );
+            if( meanval <= 0 )
+              {
+              meanval = 1;
+              }
+            for( itk::SizeValueType v = 0; v < numberOfVoxels; v++ )
+              {
+              buffer[v] = static_cast<PixelType>( buffer[v] / meanval );
+              }
+            }
+          images[b] = image2;
+          }
+        catch( ... )
+          {
+          images[b] = nullptr;
+          errors[b] = std::current_exception();
+          }
+        }, nullptr );
+    };
+
+  auto accumulateBatch = [&]( unsigned int batchStart, const std::vector<typename ImageType::Pointer> & images )
+    {
+    const unsigned int currentBatchSize = std::min( batchSize, argc - batchStart );
+    std::vector<const PixelType *> buffers( currentBatchSize );
+    for( unsigned int b = 0; b < currentBatchSize; b++ )
+      {
+      buffers[b] = images[b]->GetBufferPointer();
+      }
+    accumulator->ParallelizeArray( 0, numberOfBlocks,
+      [&]( itk::SizeValueType block )
         {
-        meanval = meanval / (float)ct;
-        }
-      if( meanval <= 0 )
+        const itk::SizeValueType last = std::min( numberOfVoxels, ( block + 1 ) * voxelsPerBlock );
+        for( itk::SizeValueType v = block * voxelsPerBlock; v < last; v++ )
+          {
+          for( unsigned int b = 0; b < currentBatchSize; b++ )
+            {
+            const PixelType value = buffers[b][v];
+            sum[v] += value;
+            if( computeStatistics )
+              {
+              sumOfSquares[v] += static_cast<double>( value ) * value;
+              samples[v * numberofimages + batchStart - firstImage + b] = value;
+              }
+            }
+          }
+        }, nullptr );
+    };
+
+  readBatch( firstImage, batch, batchErrors );
+  for( unsigned int batchStart = firstImage; batchStart < argc; batchStart += batchSize )
+    {
+    const unsigned int currentBatchSize = std::min( batchSize, argc - batchStart );
+    for( unsigned int b = 0; b < currentBatchSize; b++ )
+      {
+      if( batchErrors[b] )
         {
-        meanval = (1);
+        std::cerr << " could not read " << argv[batchStart + b] << std::endl;
+        std::rethrow_exception( batchErrors[b] );
         }
       }
-    for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+    std::cout << " read " << batchStart - firstImage + currentBatchSize << " of " << numberofimages << std::endl;
+
+    const unsigned int nextBatchStart = batchStart + batchSize;
+    if( nextBatchStart < argc )
       {
-      PixelType val = vfIter2.Get();
-      if( normalizei )
-        {
-        val /= meanval;
-        }
-      val = val / (float)numberofimages;
-      const PixelType & oldval = averageimage->GetPixel(vfIter2.GetIndex() );
-      averageimage->SetPixel(vfIter2.GetIndex(), val + oldval );
+      overlap->ParallelizeArray( 0, 2,
+        [&]( itk::SizeValueType task )
+          {
+          if( task == 0 )
+            {
+            readBatch( nextBatchStart, nextBatch, nextBatchErrors );
+            }
+          else
+            {
+            accumulateBatch( batchStart, batch );
+            }
+          }, nullptr );
       }
+    else
+      {
+      accumulateBatch( batchStart, batch );
+      }
+
+    for( unsigned int b = 0; b < currentBatchSize; b++ )
+      {
+      batch[b] = nullptr;
+      }
+    std::swap( batch, nextBatch );
+    std::swap( batchErrors, nextBatchErrors );
+    }
+
+  PixelType * averageBuffer = averageimage->GetBufferPointer();
+  for( itk::SizeValueType v = 0; v < numberOfVoxels; v++ )
+    {
+    averageBuffer[v] = static_cast<PixelType>( sum[v] / numberofimages );
+    }
+
+  // the extension starts at the first '.' of the file name (not of the
+  // directory), so "./x.nii.gz" gives "./x" and ".nii.gz"
+  std::string outname( argv[2] );
+  std::string::size_type nameStart = outname.find_last_of('/');
+  nameStart = ( nameStart == std::string::npos ) ? 0 : nameStart + 1;
+  std::string::size_type idx = outname.find('.', nameStart + 1);
+  if( idx == std::string::npos )
+    {
+    idx = outname.length();
+    }
+  std::string tempname = outname.substr(0, idx);
+  std::string extension = outname.substr(idx);
+  if( computeStatistics )
+    {
+    typename ImageType::Pointer varianceimage = AllocImage<ImageType>( averageimage, 0 );
+    typename ImageType::Pointer medianimage = AllocImage<ImageType>( averageimage, 0 );
+    PixelType * varianceBuffer = varianceimage->GetBufferPointer();
+    PixelType * medianBuffer = medianimage->GetBufferPointer();
+    accumulator->ParallelizeArray( 0, numberOfBlocks,
+      [&]( itk::SizeValueType block )
+        {
+        const itk::SizeValueType last = std::min( numberOfVoxels, ( block + 1 ) * voxelsPerBlock );
+        for( itk::SizeValueType v = block * voxelsPerBlock; v < last; v++ )
+          {
+          if( numberofimages > 1 )
+            {
+            const double mean = sum[v] / numberofimages;
+            varianceBuffer[v] = static_cast<PixelType>( std::max( 0.0,
+              ( sumOfSquares[v] - numberofimages * mean * mean ) / ( numberofimages - 1 ) ) );
+            }
+          PixelType * voxelSamples = &samples[v * numberofimages];
+          PixelType * middle = voxelSamples + numberofimages / 2;
+          std::nth_element( voxelSamples, middle, voxelSamples + numberofimages );
+          double median = *middle;
+          if( numberofimages % 2 == 0 )
+            {
+            median = 0.5 * ( median + *std::max_element( voxelSamples, middle ) );
+            }
+          medianBuffer[v] = static_cast<PixelType>( median );
+          }
+        }, nullptr );
+
+    std::string kname = tempname + std::string("_variance") + extension;
+    std::cout << " writing " << kname << std::endl;
+    typename writertype::Pointer writer = writertype::New();
+    writer->SetFileName( kname );
+    writer->SetInput( varianceimage );
+    writer->Update();
+    kname = tempname + std::string("_median") + extension;
+    std::cout << " writing " << kname << std::endl;
+    writer->SetFileName( kname );
+    writer->SetInput( medianimage );
+    writer->Update();
     }
 
   //  typedef itk::OptimalSharpeningImageFilter<ImageType,ImageType > sharpeningFilter;
@@ -178,7 +389,12 @@ int AverageImages(unsigned int argc, char *argv[])
   typedef itk::ImageFileWriter<ImageType>              writertype;
 
   //  bool  normalizei = std::stoi(argv[3]);
-  float numberofimages = (float)argc - 4.;
+  const unsigned int firstImage = GetFirstAverageImagesInput( argc, argv );
+  if( firstImage > 4 )
+    {
+    std::cout << " --statistics is only available for scalar images; computing the average only " << std::endl;
+    }
+  float numberofimages = (float)argc - (float)firstImage;
   typename ImageType::Pointer averageimage = nullptr;
   typename ImageType::Pointer image2 = nullptr;
 
@@ -187,8 +403,8 @@ int AverageImages(unsigned int argc, char *argv[])
   typename ImageType::SizeType maxSize;
   maxSize.Fill( 0 );
 
-  unsigned int bigimage = 4;
-  for( unsigned int j = 4; j < argc; j++ )
+  unsigned int bigimage = firstImage;
+  for( unsigned int j = firstImage; j < argc; j++ )
     {
     // Get the image dimension
     std::string fn = std::string(argv[j]);
@@ -226,7 +442,7 @@ int AverageImages(unsigned int argc, char *argv[])
   PixelType meanval = reader->GetOutput()->GetPixel(zindex);
   meanval.Fill(0);
   averageimage->FillBuffer(meanval);
-  for( unsigned int j = 4; j < argc; j++ )
+  for( unsigned int j = firstImage; j < argc; j++ )
     {
     std::cout << " reading " << std::string(argv[j]) << " for average " << std::endl;
     typename ImageFileReader::Pointer rdr = ImageFileReader::New();
@@ -305,7 +521,7 @@ private:
     {
     std::cout << "\n" << std::endl;
     std::cout << "Usage: \n" << std::endl;
-    std::cout << argv[0] << " ImageDimension Outputfname.nii.gz Normalize <images> \n" << std::endl;
+    std::cout << argv[0] << " ImageDimension Outputfname.nii.gz Normalize [--statistics] <images> \n" << std::endl;
     std::cout << " Compulsory arguments: \n" << std::endl;
     std::cout << " ImageDimension: 2 or 3 (for 2 or 3 dimensional input).\n " << std::endl;
     std::cout << " Outputfname.nii.gz: the name of the resulting image.\n" << std::endl;
@@ -313,6 +529,13 @@ private:
       <<
       " Normalize: 0 (false) or 1 (true); if true, the 2nd image is divided by its mean. This will select the largest image to average into.\n"
       << std::endl;
+    std::cout
+      <<
+      " --statistics: also write the voxelwise variance and median of the (normalized) scalar inputs to Outputfname_variance and Outputfname_median.  This keeps every input in memory.\n"
+      << std::endl;
+    std::cout
+      << " Inputs on the same grid as the largest image are used as is; others are linearly resampled to it.\n"
+      << std::endl;
     std::cout << " Example Usage:\n" << std::endl;
     std::cout << argv[0] << " 3 average.nii.gz  1  *.nii.gz \n" << std::endl;
     std::cout << " \n" << std::endl;
@@ -325,9 +548,10 @@ private:
     }
 
   const int                 dim = std::stoi( argv[1] );
+  const unsigned int        firstImage = GetFirstAverageImagesInput( argc, argv );
   itk::ImageIOBase::Pointer imageIO =
-    itk::ImageIOFactory::CreateImageIO(argv[4], itk::ImageIOFactory::ReadMode);
-  imageIO->SetFileName(argv[4]);
+    itk::ImageIOFactory::CreateImageIO(argv[firstImage], itk::ImageIOFactory::ReadMode);
+  imageIO->SetFileName(argv[firstImage]);
   imageIO->ReadImageInformation();
   unsigned int ncomponents = imageIO->GetNumberOfComponents();
 
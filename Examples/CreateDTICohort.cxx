@@ -7,13 +7,13 @@
 #include "itkArray2D.h"
 #include "itkDecomposeTensorFunction.h"
 #include "itkDiffusionTensor3D.h"
-#include "itkImageDuplicator.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkImageRegionConstIterator.h"
 #include "itkImageRegionIterator.h"
 #include "itkLabelGeometryImageFilter.h"
 #include "itkMersenneTwisterRandomVariateGenerator.h"
+#include "itkMultiThreaderBase.h"
 #include "itkNumericSeriesFileNames.h"
 #include "itkTimeProbe.h"
 #include "itkVariableSizeMatrix.h"
@@ -29,6 +29,7 @@
 #include <algorithm>
 #include <vector>
 #include <fstream>
+#include <mutex>
 
 namespace ants
 {
@@ -88,6 +89,102 @@ double CalculateMeanDiffusivity( TensorType tensor )
   return mean;
 }
 
+/**
+ * Reconstruct a tensor after applying the eigenvalue changes of the simulated
+ * pathology and the intersubject variability projections.  The eigenvectors
+ * are preserved so the diffusion direction does not change.
+ */
+template <typename TensorType, typename RealType>
+TensorType SimulateSubjectTensor( const TensorType & tensor,
+                                  RealType pathologyLongitudinalChange,
+                                  RealType pathologyTransverseChange,
+                                  RealType isvLongitudinalProjection,
+                                  RealType isvTransverseProjection )
+{
+  const unsigned int ImageDimension = TensorType::Dimension;
+
+  typename TensorType::EigenValuesArrayType eigenvalues;
+  typename TensorType::EigenVectorsMatrixType eigenvectors;
+  tensor.ComputeEigenAnalysis( eigenvalues, eigenvectors );
+
+  if( eigenvalues[0] < 0 )
+    {
+    eigenvalues[0] = eigenvalues[1];
+    }
+  if( ImageDimension == 3 && eigenvalues[2] < 0 )
+    {
+    eigenvalues[2] = eigenvalues[1];
+    }
+
+  typename TensorType::EigenValuesArrayType newEigenvalues;
+
+  if( ImageDimension == 2 )
+    {
+    newEigenvalues[1] = eigenvalues[1]
+      + eigenvalues[1] * pathologyLongitudinalChange
+      + isvLongitudinalProjection;
+    newEigenvalues[0] = eigenvalues[0] * ( 1.0 + eigenvalues[0] )
+      * pathologyTransverseChange + isvTransverseProjection;
+    if( newEigenvalues[0] >= newEigenvalues[1] )
+      {
+      newEigenvalues[0] = newEigenvalues[1] - 1.0e-6;
+      }
+    }
+  else
+    {
+    newEigenvalues[2] = eigenvalues[2]
+      + eigenvalues[2] * pathologyLongitudinalChange
+      + isvLongitudinalProjection;
+    RealType eigenAverage = 0.5 * ( eigenvalues[1] + eigenvalues[0] );
+    newEigenvalues[1] = ( 2.0 * eigenAverage
+                          * ( 1.0 + pathologyTransverseChange )
+                          + isvTransverseProjection ) / ( eigenvalues[0] / eigenvalues[1] + 1.0 );
+    if( newEigenvalues[1] >= newEigenvalues[2] )
+      {
+      newEigenvalues[1] = newEigenvalues[2] - 1.0e-6;
+      }
+    newEigenvalues[0] = ( eigenvalues[0] / eigenvalues[1] )
+      * newEigenvalues[1];
+    }
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    if( std::isnan( newEigenvalues[d] ) )
+      {
+      newEigenvalues[d] = 0.0;
+      }
+    }
+
+  if( newEigenvalues[0] < 0 )
+    {
+    newEigenvalues[0] = newEigenvalues[1];
+    }
+  if( ImageDimension == 3 && newEigenvalues[2] < 0 )
+    {
+    newEigenvalues[2] = newEigenvalues[1];
+    }
+
+  typename TensorType::MatrixType eigenvalueMatrix;
+  eigenvalueMatrix.Fill( 0.0 );
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    eigenvalueMatrix(d, d) = newEigenvalues[d];
+    }
+
+  typename TensorType::MatrixType D( eigenvectors.GetTranspose() );
+  D *= eigenvalueMatrix;
+  D *= eigenvectors;
+
+  TensorType newTensor;
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    for( unsigned int j = i; j < ImageDimension; j++ )
+      {
+      newTensor(i, j) = D(i, j);
+      }
+    }
+  return newTensor;
+}
+
 template <unsigned int ImageDimension>
 int CreateDTICohort( itk::ants::CommandLineParser *parser )
 {
@@ -553,256 +650,256 @@ int CreateDTICohort( itk::ants::CommandLineParser *parser )
     noiseSigma = parser->Convert<RealType>( noiseOption->GetFunction()->GetName() );
     }
 
+  //
+  // Get the random seed.  Each subject draws from its own generator seeded
+  // from the master generator so that the cohort can be generated in
+  // parallel and is reproducible whenever a fixed seed is given.
+  //
+  int antsRandomSeed = 0;
+
+  typename itk::ants::CommandLineParser::OptionType::Pointer randomSeedOption =
+    parser->GetOption( "random-seed" );
+  if( randomSeedOption && randomSeedOption->GetNumberOfFunctions() )
+    {
+    antsRandomSeed = parser->Convert<int>( randomSeedOption->GetFunction( 0 )->GetName() );
+    }
+  else
+    {
+    char* envSeed = getenv( "ANTS_RANDOM_SEED" );
+    if( envSeed != nullptr )
+      {
+      antsRandomSeed = std::stoi( envSeed );
+      }
+    }
+  if( antsRandomSeed != 0 )
+    {
+    randomizer->Initialize( static_cast<typename RandomizerType::IntegerType>( antsRandomSeed ) );
+    }
+
   //
   // Create the simulated diffusion-weighted images.  For each image, we
   // perform the following steps:
-  //   1. Copy the atlas
-  //   2. Construct new DTI
-  //     2a. Apply pathology (only for the experimentals).
-  //     2b. Introduce subject intervariability
-  //   3. For each direction, write new DWI
-  //     3a. Use DTI from 2 to reconstruct DWI in current direction
-  //     3b. Add Rician noise
+  //   1. Construct new DTI from the atlas
+  //     1a. Apply pathology (only for the experimentals).
+  //     1b. Introduce subject intervariability
+  //   2. For each direction, write new DWI
+  //     2a. Use DTI from 1 to reconstruct DWI in current direction
+  //     2b. Add Rician noise
+  //
+  // The subjects are independent so they are distributed over the available
+  // threads.  Each thread reuses a single DTI and a single DWI buffer for all
+  // of its subjects and each DWI volume is written as soon as it is created,
+  // so memory is bounded by the number of threads, not the cohort size.
   //
   itksys::SystemTools::MakeDirectory( outputDirectory.c_str() );
 
+  std::cout << "--- Calculating regional average FA and MD values (original and "
+           << "pathology + intersubject variability) ---" << std::endl << std::endl;
+
   itk::Array2D<RealType> meanFAandMD( labels.size(), 5 );
   meanFAandMD.Fill( 0.0 );
-  for( unsigned n = 0; n <= numberOfControls + numberOfExperimentals; n++ )
+
+  vnl_vector<RealType> eigenISVProjection( 1 );
+  if( applyISV )
     {
-    if( n == 0 )
+    vnl_vector<RealType> R( ISV.cols() );
+    for( float & d : R )
       {
-      std::cout << "--- Calculating regional average FA and MD values (original and "
-               << "pathology + intersubject variability) ---" << std::endl << std::endl;
+      d = randomizer->GetNormalVariate( 0.0, 1.0 );
       }
-    else if( n <= numberOfControls )
+    eigenISVProjection = ISV * R;
+    }
+
+  unsigned long count = 0;
+
+  itk::ImageRegionConstIterator<TensorImageType> ItA( inputAtlas,
+                                                      inputAtlas->GetLargestPossibleRegion() );
+  itk::ImageRegionConstIterator<MaskImageType> ItM( maskImage,
+                                                    maskImage->GetLargestPossibleRegion() );
+  for( ItA.GoToBegin(), ItM.GoToBegin(); !ItA.IsAtEnd(); ++ItA, ++ItM )
+    {
+    LabelType label = ItM.Get();
+
+    auto it = std::find( labels.begin(), labels.end(), label );
+    if( it == labels.end() )
       {
-      if( n == 1 )
-        {
-        std::cout << std::endl << "--- Writing images ---" << std::endl << std::endl;
-        }
-      std::cout << "Writing control " << n
-               << " (of " << numberOfControls << ") DWI images." << std::endl;
+      std::cout << "ERROR:  unknown label." << std::endl;
       }
-    else
+    unsigned int labelIndex = it - labels.begin();
+
+    RealType pathologyLongitudinalChange = 0.0;
+    RealType pathologyTransverseChange = 0.0;
+    if( randomizer->GetUniformVariate( 0.0, 1.0 ) <= pathologyParameters(labelIndex, 2) )
       {
-      std::cout << "Writing experimental " << n - numberOfControls
-               << " (of " << numberOfExperimentals << ") DWI images." << std::endl;
+      pathologyLongitudinalChange = pathologyParameters(labelIndex, 0);
+      pathologyTransverseChange = pathologyParameters(labelIndex, 1);
       }
 
-    // copy atlas
-    typedef itk::ImageDuplicator<TensorImageType> DuplicatorType;
-    typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
-    duplicator->SetInputImage( inputAtlas );
-    duplicator->Update();
-
-    typename TensorImageType::Pointer dti = duplicator->GetOutput();
+    RealType isvLongitudinalProjection = 0.0;
+    RealType isvTransverseProjection = 0.0;
+    if( label != 0 && applyISV )
+      {
+      isvLongitudinalProjection = eigenISVProjection(count);
+      isvTransverseProjection = eigenISVProjection(totalMaskVolume + count);
+      count++;
+      }
 
-    // If we are to apply intersubject variability, we calculate random
-    // projection.
-    vnl_vector<RealType> eigenISVProjection( 1 );
-    if( applyISV )
+    if( label != 0 )
       {
-      vnl_vector<RealType> R( ISV.cols() );
-      for(float & d : R)
-        {
-        d = randomizer->GetNormalVariate( 0.0, 1.0 );
-        }
-      eigenISVProjection = ISV * R;
+      TensorType tensor = ItA.Get();
+      TensorType newTensor = SimulateSubjectTensor<TensorType, RealType>( tensor,
+        pathologyLongitudinalChange, pathologyTransverseChange,
+        isvLongitudinalProjection, isvTransverseProjection );
+
+      meanFAandMD(labelIndex, 0) +=
+        CalculateFractionalAnisotropy<TensorType>( tensor );
+      meanFAandMD(labelIndex, 1) +=
+        CalculateMeanDiffusivity<TensorType>( tensor );
+      meanFAandMD(labelIndex, 2) +=
+        CalculateFractionalAnisotropy<TensorType>( newTensor );
+      meanFAandMD(labelIndex, 3) +=
+        CalculateMeanDiffusivity<TensorType>( newTensor );
+      meanFAandMD(labelIndex, 4)++;
       }
+    }
 
-    //
-    // Iterate through the image to apply pathology and inter-subject variability
-    //
-    unsigned long count = 0;
+  std::cout << "   " << std::left << std::setw( 7 ) << "Region"
+           << std::left << std::setw( 15 ) << "FA (original)"
+           << std::left << std::setw( 15 ) << "FA (path+isv)"
+           << std::left << std::setw( 15 ) << "FA (% change)"
+           << std::left << std::setw( 15 ) << "MD (original)"
+           << std::left << std::setw( 15 ) << "MD (path+isv)"
+           << std::left << std::setw( 15 ) << "MD (% change)"
+           << std::endl;
+  for( unsigned int l = 1; l < labels.size(); l++ )
+    {
+    std::cout << "   " << std::left << std::setw( 7 ) << labels[l]
+             << std::left << std::setw( 15 ) << meanFAandMD(l, 0) / meanFAandMD(l, 4)
+             << std::left << std::setw( 15 ) << meanFAandMD(l, 2) / meanFAandMD(l, 4)
+             << std::left << std::setw( 15 )
+             << ( meanFAandMD(l, 2) - meanFAandMD(l, 0) ) / meanFAandMD(l, 0)
+             << std::left << std::setw( 15 ) << meanFAandMD(l, 1) / meanFAandMD(l, 4)
+             << std::left << std::setw( 15 ) << meanFAandMD(l, 3) / meanFAandMD(l, 4)
+             << std::left << std::setw( 15 )
+             << ( meanFAandMD(l, 3) - meanFAandMD(l, 1) ) / meanFAandMD(l, 1)
+             << std::endl;
+    }
 
-    itk::ImageRegionIterator<TensorImageType> It( dti,
-                                                  dti->GetLargestPossibleRegion() );
-    itk::ImageRegionIterator<MaskImageType> ItM( maskImage,
-                                                 maskImage->GetLargestPossibleRegion() );
-    for( It.GoToBegin(), ItM.GoToBegin(); !It.IsAtEnd(); ++It, ++ItM )
-      {
-      LabelType  label = ItM.Get();
-      TensorType tensor = It.Get();
+  const unsigned int numberOfSubjects = numberOfControls + numberOfExperimentals;
+  if( numberOfSubjects == 0 )
+    {
+    return EXIT_SUCCESS;
+    }
 
-      typename TensorType::EigenValuesArrayType eigenvalues;
-      typename TensorType::EigenVectorsMatrixType eigenvectors;
-      tensor.ComputeEigenAnalysis( eigenvalues, eigenvectors );
+  std::vector<typename RandomizerType::IntegerType> subjectSeeds( numberOfSubjects );
+  for( unsigned int n = 0; n < numberOfSubjects; n++ )
+    {
+    subjectSeeds[n] = randomizer->GetIntegerVariate();
+    }
 
-      if( eigenvalues[0] < 0 )
-        {
-        eigenvalues[0] = eigenvalues[1];
-        }
-      if( ImageDimension == 3 && eigenvalues[2] < 0 )
-        {
-        eigenvalues[2] = eigenvalues[1];
-        }
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  const unsigned int numberOfWorkers = std::max( 1u, std::min( numberOfSubjects,
+    static_cast<unsigned int>( itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads() ) ) );
+  threader->SetNumberOfWorkUnits( numberOfWorkers );
 
-      auto it = std::find( labels.begin(),
-                                                             labels.end(), label );
-      if( it == labels.end() )
-        {
-        std::cout << "ERROR:  unknown label." << std::endl;
-        }
-      unsigned int labelIndex = it - labels.begin();
+  std::cout << std::endl << "--- Writing images (" << numberOfWorkers
+           << " thread(s)) ---" << std::endl << std::endl;
 
-      typename TensorType::EigenValuesArrayType newEigenvalues;
+  std::mutex outputMutex;
 
-      //
-      // Only apply pathology to a certain fraction of the voxels for a
-      // particular label.  We "throw the dice" to determine whether or not
-      // to apply to the current voxel.
-      //
-      RealType pathologyLongitudinalChange = 0.0;
-      RealType pathologyTransverseChange = 0.0;
-      if( ( n == 0 || n > numberOfControls ) && randomizer->GetUniformVariate(
-            0.0, 1.0 ) <= pathologyParameters(labelIndex, 2) )
-        {
-        pathologyLongitudinalChange = pathologyParameters(labelIndex, 0);
-        pathologyTransverseChange = pathologyParameters(labelIndex, 1);
-        }
+  auto generateSubjects = [&]( itk::SizeValueType worker )
+    {
+    typename RandomizerType::Pointer subjectRandomizer = RandomizerType::New();
 
-      //
-      // Apply intersubject variability
-      //
-      RealType isvLongitudinalProjection = 0.0;
-      RealType isvTransverseProjection = 0.0;
-      if( label != 0 && applyISV )
-        {
-        isvLongitudinalProjection = eigenISVProjection(count);
-        isvTransverseProjection = eigenISVProjection(totalMaskVolume + count);
-        count++;
-        }
+    typename TensorImageType::Pointer dti = AllocImage<TensorImageType>( inputAtlas );
+    typename ImageType::Pointer dwi = AllocImage<ImageType>( inputAtlas );
 
-      //
-      // Reconstruct the tensor
-      //
-      if( ImageDimension == 2 )
+    for( unsigned int n = 1 + worker; n <= numberOfSubjects; n += numberOfWorkers )
+      {
+      subjectRandomizer->Initialize( subjectSeeds[n - 1] );
+
+      const bool isControl = ( n <= numberOfControls );
+
+      // If we are to apply intersubject variability, we calculate random
+      // projection.
+      vnl_vector<RealType> subjectISVProjection( 1 );
+      if( applyISV )
         {
-        newEigenvalues[1] = eigenvalues[1]
-          + eigenvalues[1] * pathologyLongitudinalChange
-          + isvLongitudinalProjection;
-        newEigenvalues[0] = eigenvalues[0] * ( 1.0 + eigenvalues[0] )
-          * pathologyTransverseChange + isvTransverseProjection;
-        if( newEigenvalues[0] >= newEigenvalues[1] )
+        vnl_vector<RealType> R( ISV.cols() );
+        for( float & d : R )
           {
-          newEigenvalues[0] = newEigenvalues[1] - 1.0e-6;
+          d = subjectRandomizer->GetNormalVariate( 0.0, 1.0 );
           }
+        subjectISVProjection = ISV * R;
         }
-      else
+
+      //
+      // Iterate through the atlas to apply pathology and inter-subject variability
+      //
+      unsigned long subjectCount = 0;
+
+      itk::ImageRegionConstIterator<TensorImageType> ItS( inputAtlas,
+                                                          inputAtlas->GetLargestPossibleRegion() );
+      itk::ImageRegionConstIterator<MaskImageType> ItL( maskImage,
+                                                        maskImage->GetLargestPossibleRegion() );
+      itk::ImageRegionIterator<TensorImageType> ItT( dti,
+                                                     dti->GetLargestPossibleRegion() );
+      for( ItS.GoToBegin(), ItL.GoToBegin(), ItT.GoToBegin(); !ItS.IsAtEnd(); ++ItS, ++ItL, ++ItT )
         {
-        newEigenvalues[2] = eigenvalues[2]
-          + eigenvalues[2] * pathologyLongitudinalChange
-          + isvLongitudinalProjection;
-        RealType eigenAverage = 0.5 * ( eigenvalues[1] + eigenvalues[0] );
-        newEigenvalues[1] = ( 2.0 * eigenAverage
-                              * ( 1.0 + pathologyTransverseChange )
-                              + isvTransverseProjection ) / ( eigenvalues[0] / eigenvalues[1] + 1.0 );
-        if( newEigenvalues[1] >= newEigenvalues[2] )
+        LabelType label = ItL.Get();
+
+        unsigned int labelIndex =
+          std::find( labels.begin(), labels.end(), label ) - labels.begin();
+
+        //
+        // Only apply pathology to a certain fraction of the voxels for a
+        // particular label.  We "throw the dice" to determine whether or not
+        // to apply to the current voxel.
+        //
+        RealType pathologyLongitudinalChange = 0.0;
+        RealType pathologyTransverseChange = 0.0;
+        if( !isControl && labelIndex < labels.size() &&
+            subjectRandomizer->GetUniformVariate( 0.0, 1.0 ) <= pathologyParameters(labelIndex, 2) )
           {
-          newEigenvalues[1] = newEigenvalues[2] - 1.0e-6;
+          pathologyLongitudinalChange = pathologyParameters(labelIndex, 0);
+          pathologyTransverseChange = pathologyParameters(labelIndex, 1);
           }
-        newEigenvalues[0] = ( eigenvalues[0] / eigenvalues[1] )
-          * newEigenvalues[1];
-        }
-      for( unsigned int d = 0; d < ImageDimension; d++ )
-        {
-        if( std::isnan( newEigenvalues[d] ) )
+
+        //
+        // Apply intersubject variability
+        //
+        RealType isvLongitudinalProjection = 0.0;
+        RealType isvTransverseProjection = 0.0;
+        if( label != 0 && applyISV )
           {
-          newEigenvalues[d] = 0.0;
+          isvLongitudinalProjection = subjectISVProjection(subjectCount);
+          isvTransverseProjection = subjectISVProjection(totalMaskVolume + subjectCount);
+          subjectCount++;
           }
-        }
 
-      if( newEigenvalues[0] < 0 )
-        {
-        newEigenvalues[0] = newEigenvalues[1];
-        }
-      if( ImageDimension == 3 && newEigenvalues[2] < 0 )
-        {
-        newEigenvalues[2] = newEigenvalues[1];
-        }
-
-      typename TensorType::MatrixType eigenvalueMatrix;
-      eigenvalueMatrix.Fill( 0.0 );
-      for( unsigned int d = 0; d < ImageDimension; d++ )
-        {
-        eigenvalueMatrix(d, d) = newEigenvalues[d];
-        }
-
-      typename TensorType::MatrixType D( eigenvectors.GetTranspose() );
-      D *= eigenvalueMatrix;
-      D *= eigenvectors;
-
-      TensorType newTensor;
-      for( unsigned int i = 0; i < ImageDimension; i++ )
-        {
-        for( unsigned int j = i; j < ImageDimension; j++ )
+        TensorType newTensor = SimulateSubjectTensor<TensorType, RealType>( ItS.Get(),
+          pathologyLongitudinalChange, pathologyTransverseChange,
+          isvLongitudinalProjection, isvTransverseProjection );
+        for( unsigned int i = 0; i < newTensor.GetNumberOfComponents(); i++ )
           {
-          newTensor(i, j) = D(i, j);
+          if( std::isnan( newTensor[i] ) )
+            {
+            newTensor[i] = 0.0;
+            }
           }
+        ItT.Set( newTensor );
         }
 
-      if( label != 0 && n == 0 )
-        {
-        meanFAandMD(labelIndex, 0) +=
-          CalculateFractionalAnisotropy<TensorType>( tensor );
-        meanFAandMD(labelIndex, 1) +=
-          CalculateMeanDiffusivity<TensorType>( tensor );
-        meanFAandMD(labelIndex, 2) +=
-          CalculateFractionalAnisotropy<TensorType>( newTensor );
-        meanFAandMD(labelIndex, 3) +=
-          CalculateMeanDiffusivity<TensorType>( newTensor );
-        meanFAandMD(labelIndex, 4)++;
-        }
-      else if( n != 0 )
-        {
-        It.Set( newTensor );
-        }
-      }
-
-    if( n == 0 )
-      {
-      std::cout << "   " << std::left << std::setw( 7 ) << "Region"
-               << std::left << std::setw( 15 ) << "FA (original)"
-               << std::left << std::setw( 15 ) << "FA (path+isv)"
-               << std::left << std::setw( 15 ) << "FA (% change)"
-               << std::left << std::setw( 15 ) << "MD (original)"
-               << std::left << std::setw( 15 ) << "MD (path+isv)"
-               << std::left << std::setw( 15 ) << "MD (% change)"
-               << std::endl;
-      for( unsigned int l = 1; l < labels.size(); l++ )
-        {
-        std::cout << "   " << std::left << std::setw( 7 ) << labels[l]
-                 << std::left << std::setw( 15 ) << meanFAandMD(l, 0) / meanFAandMD(l, 4)
-                 << std::left << std::setw( 15 ) << meanFAandMD(l, 2) / meanFAandMD(l, 4)
-                 << std::left << std::setw( 15 )
-                 << ( meanFAandMD(l, 2) - meanFAandMD(l, 0) ) / meanFAandMD(l, 0)
-                 << std::left << std::setw( 15 ) << meanFAandMD(l, 1) / meanFAandMD(l, 4)
-                 << std::left << std::setw( 15 ) << meanFAandMD(l, 3) / meanFAandMD(l, 4)
-                 << std::left << std::setw( 15 )
-                 << ( meanFAandMD(l, 3) - meanFAandMD(l, 1) ) / meanFAandMD(l, 1)
-                 << std::endl;
-        }
-      }
-    else
-      {
       std::string which;
-      if( n <= numberOfControls )
-        {
-        which = std::string( "Control" );
-        }
-      else
-        {
-        which = std::string( "Experimental" );
-        }
-
       std::stringstream istream;
-      if( n <= numberOfControls )
+      if( isControl )
         {
+        which = std::string( "Control" );
         istream << n;
         }
       else
         {
+        which = std::string( "Experimental" );
         istream << ( n - numberOfControls );
         }
       std::string dwiSeriesFileNames = outputDirectory + which + istream.str()
@@ -816,54 +913,43 @@ int CreateDTICohort( itk::ants::CommandLineParser *parser )
       std::vector<std::string> dwiImageNames = dwiFileNamesCreator->GetFileNames();
       for( unsigned int d = 0; d < directions.size(); d++ )
         {
-        vnl_vector<RealType> bk = directions[d];
-        RealType             bvalue = bvalues[d];
-
-        std::cout << "  Applying direction " << d << " (of "
-                 << directions.size() - 1 << "): [" << bk << "]"
-                 << ", bvalue = " << bvalue << std::endl;
+        const vnl_vector<RealType> & bk = directions[d];
+        const RealType bvalue = bvalues[d];
 
-        typename ImageType::Pointer dwi =
-          AllocImage<ImageType>(dti, 0);
+        dwi->FillBuffer( 0.0 );
 
+        itk::ImageRegionConstIterator<TensorImageType> ItD( dti,
+                                                            dti->GetLargestPossibleRegion() );
         itk::ImageRegionConstIterator<ImageType> ItB( b0Image,
                                                       b0Image->GetLargestPossibleRegion() );
-        itk::ImageRegionIterator<ImageType> ItD( dwi,
+        itk::ImageRegionIterator<ImageType> ItW( dwi,
                                                  dwi->GetLargestPossibleRegion() );
-        for( It.GoToBegin(), ItB.GoToBegin(), ItD.GoToBegin(); !It.IsAtEnd();
-             ++It, ++ItB, ++ItD )
+        for( ItD.GoToBegin(), ItB.GoToBegin(), ItW.GoToBegin(); !ItD.IsAtEnd();
+             ++ItD, ++ItB, ++ItW )
           {
-          TensorType tensor = It.Get();
-          for( unsigned int i = 0; i < tensor.GetNumberOfComponents(); i++ )
-            {
-            if( std::isnan( tensor[i] ) )
-              {
-              tensor[i] = 0.0;
-              }
-            }
+          const TensorType & tensor = ItD.Get();
 
-          vnl_matrix<RealType> D(ImageDimension, ImageDimension);
+          // b^T D b evaluated directly on the symmetric tensor
+          RealType bDb = 0.0;
           for( unsigned int i = 0; i < ImageDimension; i++ )
             {
             for( unsigned int j = 0; j < ImageDimension; j++ )
               {
-              D(i, j) = tensor(i, j);
+              bDb += bk[i] * tensor(i, j) * bk[j];
               }
             }
 
-          vnl_vector<RealType> bkD = bk * D;
-
-          RealType signal = ItB.Get() * std::exp( -bvalue * inner_product( bkD, bk ) );
+          RealType signal = ItB.Get() * std::exp( -bvalue * bDb );
 
           // Add Rician noise
           RealType realNoise = 0.0;
           RealType imagNoise = 0.0;
           if( noiseSigma > 0.0 )
             {
-            realNoise = randomizer->GetNormalVariate( 0.0,
-                                                      itk::Math::sqr ( noiseSigma ) );
-            imagNoise = randomizer->GetNormalVariate( 0.0,
-                                                      itk::Math::sqr ( noiseSigma ) );
+            realNoise = subjectRandomizer->GetNormalVariate( 0.0,
+                                                             itk::Math::sqr ( noiseSigma ) );
+            imagNoise = subjectRandomizer->GetNormalVariate( 0.0,
+                                                             itk::Math::sqr ( noiseSigma ) );
             }
           RealType realSignal = signal + realNoise;
           RealType imagSignal = imagNoise;
@@ -874,7 +960,7 @@ int CreateDTICohort( itk::ants::CommandLineParser *parser )
 
           if( signal <= ItB.Get() )
             {
-            ItD.Set( finalSignal );
+            ItW.Set( finalSignal );
             }
           }
         typedef itk::ImageFileWriter<ImageType> WriterType;
@@ -883,8 +969,23 @@ int CreateDTICohort( itk::ants::CommandLineParser *parser )
         writer->SetInput( dwi );
         writer->Update();
         }
+
+      std::lock_guard<std::mutex> lock( outputMutex );
+      if( isControl )
+        {
+        std::cout << "Wrote control " << n
+                 << " (of " << numberOfControls << ") DWI images." << std::endl;
+        }
+      else
+        {
+        std::cout << "Wrote experimental " << n - numberOfControls
+                 << " (of " << numberOfExperimentals << ") DWI images." << std::endl;
+        }
       }
-    }
+    };
+
+  threader->ParallelizeArray( 0, numberOfWorkers, generateSubjects, nullptr );
+
   return EXIT_SUCCESS;
 }
 
@@ -1030,7 +1131,9 @@ void InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
       + std::string( "for each subject.  Each file name is prepended with the " )
       + std::string( "word 'Control' or 'Experimental'.  The number of control " )
       + std::string( "and experimental subjects can be also be specified on the " )
-      + std::string( "command line.  Default is 10 for each group." );
+      + std::string( "command line.  Default is 10 for each group.  Subjects are " )
+      + std::string( "generated in parallel (see ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS) " )
+      + std::string( "and each DWI volume is written to disk as soon as it is created." );
 
     OptionType::Pointer option = OptionType::New();
     option->SetLongName( "output" );
@@ -1041,6 +1144,22 @@ void InitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
     parser->AddOption( option );
     }
 
+    {
+    std::string description =
+      std::string( "Use a fixed seed for random number generation so that the " )
+      + std::string( "simulated cohort is reproducible.  Each subject is generated " )
+      + std::string( "from its own random stream derived from this seed, so the " )
+      + std::string( "output does not depend on the number of threads.  If not " )
+      + std::string( "specified (or zero), the ANTS_RANDOM_SEED environment variable " )
+      + std::string( "is used, falling back to the system time." );
+
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "random-seed" );
+    option->SetUsageOption( 0, "seedValue" );
+    option->SetDescription( description );
+    parser->AddOption( option );
+    }
+
     {
     std::string description = std::string( "Print the help menu (short version)." );
 
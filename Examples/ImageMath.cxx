@@ -281,7 +281,7 @@ private:
     std::cout << "    Usage        : TimeSeriesAssemble time_spacing time_origin *images.nii.gz " << std::endl;
     std::cout
       <<
-      " TimeSeriesToMatrix : Converts a 4D image + mask to matrix (stored as csv file) where rows are time and columns are space ."
+      " TimeSeriesToMatrix : Converts a 4D image + mask to matrix (stored as csv, mha or binary .bmat file) where rows are time and columns are space ."
       << std::endl;
     std::cout << "    Usage        : TimeSeriesToMatrix 4D_TimeSeries.nii.gz mask " << std::endl;
     std::cout
@@ -657,12 +657,16 @@ private:
       << std::endl;
     std::cout
       <<
-      "      Usage        : PropagateLabelsThroughMask speed/binaryimagemask.nii.gz initiallabelimage.nii.gz Optional-Stopping-Value  0/1/2"
+      "      Usage        : PropagateLabelsThroughMask speed/binaryimagemask.nii.gz initiallabelimage.nii.gz Optional-Stopping-Value  0/1/2 [multi-label-blocks=0]"
       << std::endl;
     std::cout
       <<
       "      0/1/2  =>  0, no topology constraint, 1 - strict topology constraint, 2 - no handles "
       << std::endl;
+    std::cout
+      <<
+      "      multi-label-blocks  =>  0, march each label in turn, N > 0, march all labels in a single pass split into N parallel blocks (no topology constraint) "
+      << std::endl;
 
     std::cout << "\n  PValueImage        : " << std::endl;
     std::cout << "      Usage        : PValueImage TValueImage dof" << std::endl;
@@ -123,12 +123,18 @@
 #include "itkTransformFactory.h"
 #include "itkSurfaceImageCurvature.h"
 #include "itkMultiScaleLaplacianBlobDetectorImageFilter.h"
+#include "itkMultiThreaderBase.h"
 
+#include <cstdint>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <map> // Here I'm using a map but you could choose even other containers
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "ReadWriteData.h"
 #include "TensorFunctions.h"
@@ -174,6 +180,825 @@ std::string ants_to_string(T t)
   return istream.str();
 }
 
+/**
+ * Neighbors of the voxels of an image as linear buffer indices:  every offset
+ * of the (2*radius+1)^D box closer than maximumDistance (in voxels) to the
+ * center, the center included, in NeighborhoodIterator order.  Neighbors
+ * outside the image are clamped to the boundary like the zero flux Neumann
+ * condition of a NeighborhoodIterator.
+ */
+template <typename TImage>
+class LabelNeighborhood
+{
+public:
+  enum { ImageDimension = TImage::ImageDimension };
+
+  LabelNeighborhood( const TImage *image, unsigned int radius, double maximumDistance )
+  {
+    const typename TImage::RegionType region = image->GetBufferedRegion();
+    long stride = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      this->m_Size[d] = static_cast<long>( region.GetSize()[d] );
+      this->m_Strides[d] = stride;
+      stride *= this->m_Size[d];
+      }
+    this->m_Radius = static_cast<long>( radius );
+
+    const long   width = 2 * this->m_Radius + 1;
+    unsigned int boxSize = 1;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      boxSize *= width;
+      }
+    for( unsigned int i = 0; i < boxSize; i++ )
+      {
+      long         offset[ImageDimension];
+      unsigned int remainder = i;
+      double       distance = 0;
+      long         bufferOffset = 0;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        offset[d] = static_cast<long>( remainder % width ) - this->m_Radius;
+        remainder /= width;
+        distance += static_cast<double>( offset[d] * offset[d] );
+        bufferOffset += offset[d] * this->m_Strides[d];
+        }
+      if( std::sqrt( distance ) < maximumDistance )
+        {
+        this->m_Offsets.insert( this->m_Offsets.end(), offset, offset + ImageDimension );
+        this->m_BufferOffsets.push_back( bufferOffset );
+        }
+      }
+  }
+
+  unsigned int GetNumberOfNeighbors() const
+  {
+    return this->m_BufferOffsets.size();
+  }
+
+  void GetNeighbors( unsigned long v, std::vector<unsigned long> & neighbors ) const
+  {
+    neighbors.resize( this->m_BufferOffsets.size() );
+
+    long index[ImageDimension];
+    bool isInterior = true;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      index[d] = ( static_cast<long>( v ) / this->m_Strides[d] ) % this->m_Size[d];
+      if( index[d] < this->m_Radius || index[d] + this->m_Radius >= this->m_Size[d] )
+        {
+        isInterior = false;
+        }
+      }
+    if( isInterior )
+      {
+      for( unsigned int k = 0; k < this->m_BufferOffsets.size(); k++ )
+        {
+        neighbors[k] = static_cast<unsigned long>( static_cast<long>( v ) + this->m_BufferOffsets[k] );
+        }
+      return;
+      }
+    for( unsigned int k = 0; k < this->m_BufferOffsets.size(); k++ )
+      {
+      long n = 0;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        const long c = std::min( std::max( index[d] + this->m_Offsets[k * ImageDimension + d], 0L ),
+                                 this->m_Size[d] - 1 );
+        n += c * this->m_Strides[d];
+        }
+      neighbors[k] = static_cast<unsigned long>( n );
+      }
+  }
+
+private:
+  long              m_Size[ImageDimension];
+  long              m_Strides[ImageDimension];
+  long              m_Radius;
+  // offset components, ImageDimension per neighbor
+  std::vector<long> m_Offsets;
+  std::vector<long> m_BufferOffsets;
+};
+
+/**
+ * Label adjacency of an image gathered in one scan, see ComputeLabelAdjacency.
+ * Labels are the truncated positive voxel values.
+ */
+struct LabelAdjacencyTable
+{
+  typedef std::pair<unsigned long, unsigned long> LabelPairType;
+
+  unsigned long                          m_MaximumLabel;
+  // number of voxels of each label
+  std::vector<unsigned long>             m_LabelVoxelCounts;
+  // per voxel in buffer order:  0 if no neighbor carries a different label,
+  // otherwise min(a,b) * ( m_MaximumLabel + 1 ) + max(a,b) for the labels a, b
+  // of the voxel and of the last such neighbor
+  std::vector<unsigned long>             m_InterfaceCodes;
+  // number of (voxel, neighbor) pairs for each ordered pair of labels
+  std::map<LabelPairType, unsigned long> m_PairCounts;
+};
+
+/**
+ * Compare every voxel with a positive label with its 3^D neighbors, or only
+ * its face neighbors, and fill the adjacency table in a single parallel scan.
+ * Neighbors with label 0 count as different only if includeBackground is set.
+ * Each work unit fills its own counts and pair table, merged at the end.
+ */
+template <typename TImage>
+LabelAdjacencyTable
+ComputeLabelAdjacency( const TImage *image, bool faceConnected = false, bool includeBackground = false )
+{
+  typedef typename TImage::PixelType PixelType;
+
+  const PixelType *   buffer = image->GetBufferPointer();
+  const unsigned long numberOfVoxels = image->GetBufferedRegion().GetNumberOfPixels();
+
+  LabelAdjacencyTable table;
+  table.m_MaximumLabel = 0;
+  for( unsigned long v = 0; v < numberOfVoxels; v++ )
+    {
+    if( buffer[v] > 0 )
+      {
+      table.m_MaximumLabel = std::max( table.m_MaximumLabel, static_cast<unsigned long>( buffer[v] ) );
+      }
+    }
+  const unsigned long numberOfLabels = table.m_MaximumLabel + 1;
+
+  // face neighbors are at distance 1, the nearest diagonal ones at sqrt(2)
+  const LabelNeighborhood<TImage> neighborhood( image, 1, faceConnected ? 1.1 : 2.0 * TImage::ImageDimension );
+
+  table.m_LabelVoxelCounts.assign( numberOfLabels, 0 );
+  table.m_InterfaceCodes.assign( numberOfVoxels, 0 );
+
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  const unsigned int              numberOfWorkUnits = threader->GetNumberOfWorkUnits();
+  const unsigned long             blockSize = 4096;
+
+  std::vector<std::vector<unsigned long> >                         counts( numberOfWorkUnits );
+  std::vector<std::unordered_map<unsigned long long, unsigned long> > pairCounts( numberOfWorkUnits );
+
+  threader->ParallelizeArray( 0, numberOfWorkUnits,
+    [&]( itk::SizeValueType workUnit )
+    {
+    std::vector<unsigned long> & localCounts = counts[workUnit];
+    std::unordered_map<unsigned long long, unsigned long> & localPairCounts = pairCounts[workUnit];
+    localCounts.assign( numberOfLabels, 0 );
+
+    std::vector<unsigned long> neighbors;
+    for( unsigned long first = workUnit * blockSize; first < numberOfVoxels; first += numberOfWorkUnits * blockSize )
+      {
+      const unsigned long last = std::min( numberOfVoxels, first + blockSize );
+      for( unsigned long v = first; v < last; v++ )
+        {
+        const PixelType p = buffer[v];
+        if( !( p > 0 ) )
+          {
+          continue;
+          }
+        const unsigned long a = static_cast<unsigned long>( p );
+        localCounts[a]++;
+
+        unsigned long code = 0;
+        neighborhood.GetNeighbors( v, neighbors );
+        for( unsigned int k = 0; k < neighbors.size(); k++ )
+          {
+          const PixelType q = buffer[neighbors[k]];
+          if( ( q > 0 || includeBackground ) && q != p )
+            {
+            const unsigned long b = ( q > 0 ) ? static_cast<unsigned long>( q ) : 0;
+            localPairCounts[static_cast<unsigned long long>( a ) * numberOfLabels + b]++;
+            code = std::min( a, b ) * numberOfLabels + std::max( a, b );
+            }
+          }
+        table.m_InterfaceCodes[v] = code;
+        }
+      }
+    }, nullptr );
+
+  for( unsigned int w = 0; w < numberOfWorkUnits; w++ )
+    {
+    for( unsigned long l = 0; l < counts[w].size(); l++ )
+      {
+      table.m_LabelVoxelCounts[l] += counts[w][l];
+      }
+    for( typename std::unordered_map<unsigned long long, unsigned long>::const_iterator it = pairCounts[w].begin();
+         it != pairCounts[w].end(); ++it )
+      {
+      const LabelAdjacencyTable::LabelPairType labelPair( it->first / numberOfLabels, it->first % numberOfLabels );
+      table.m_PairCounts[labelPair] += it->second;
+      }
+    }
+  return table;
+}
+
+
+/**
+ * Monotone priority queue of fast marching trial points ( arrival time, buffer
+ * index ).  Times are quantized into buckets of a fixed width held in a circular
+ * window (a Dial queue); times beyond the window wait in an overflow list that
+ * is redistributed when the window advances.  Only the current bucket is kept
+ * as a binary heap, so points still leave in exact order of arrival time as long
+ * as no time below the last popped one is pushed, which fast marching ensures.
+ */
+class FastMarchingBucketQueue
+{
+public:
+  typedef std::pair<float, unsigned long> EntryType;
+
+  FastMarchingBucketQueue( double bucketWidth, unsigned int numberOfBuckets ) :
+    m_InverseBucketWidth( 1.0 / bucketWidth ),
+    m_Buckets( numberOfBuckets )
+  {
+    this->Clear();
+  }
+
+  void Clear()
+  {
+    for( unsigned int k = 0; k < this->m_Buckets.size(); k++ )
+      {
+      this->m_Buckets[k].clear();
+      }
+    this->m_Overflow.clear();
+    this->m_Current.clear();
+    this->m_CurrentBucket = 0;
+    this->m_WindowStart = 0;
+    this->m_Size = 0;
+  }
+
+  bool IsEmpty() const
+  {
+    return this->m_Size == 0;
+  }
+
+  void Push( float time, unsigned long index )
+  {
+    const EntryType     entry( time, index );
+    const std::uint64_t bucket = this->GetBucket( time );
+    if( bucket <= this->m_CurrentBucket )
+      {
+      this->m_Current.push_back( entry );
+      std::push_heap( this->m_Current.begin(), this->m_Current.end(), std::greater<EntryType>() );
+      }
+    else if( bucket < this->m_WindowStart + this->m_Buckets.size() )
+      {
+      this->m_Buckets[bucket % this->m_Buckets.size()].push_back( entry );
+      }
+    else
+      {
+      this->m_Overflow.push_back( entry );
+      }
+    this->m_Size++;
+  }
+
+  bool Pop( EntryType & entry )
+  {
+    if( this->m_Size == 0 )
+      {
+      return false;
+      }
+    while( this->m_Current.empty() )
+      {
+      this->m_CurrentBucket++;
+      if( this->m_CurrentBucket >= this->m_WindowStart + this->m_Buckets.size() )
+        {
+        // the window is exhausted:  restart it at the earliest overflow bucket
+        std::uint64_t start = std::numeric_limits<std::uint64_t>::max();
+        for( unsigned long i = 0; i < this->m_Overflow.size(); i++ )
+          {
+          start = std::min( start, this->GetBucket( this->m_Overflow[i].first ) );
+          }
+        this->m_WindowStart = start;
+        this->m_CurrentBucket = start;
+        unsigned long kept = 0;
+        for( unsigned long i = 0; i < this->m_Overflow.size(); i++ )
+          {
+          const std::uint64_t bucket = this->GetBucket( this->m_Overflow[i].first );
+          if( bucket < this->m_WindowStart + this->m_Buckets.size() )
+            {
+            this->m_Buckets[bucket % this->m_Buckets.size()].push_back( this->m_Overflow[i] );
+            }
+          else
+            {
+            this->m_Overflow[kept++] = this->m_Overflow[i];
+            }
+          }
+        this->m_Overflow.resize( kept );
+        }
+      std::swap( this->m_Current, this->m_Buckets[this->m_CurrentBucket % this->m_Buckets.size()] );
+      std::make_heap( this->m_Current.begin(), this->m_Current.end(), std::greater<EntryType>() );
+      }
+    std::pop_heap( this->m_Current.begin(), this->m_Current.end(), std::greater<EntryType>() );
+    entry = this->m_Current.back();
+    this->m_Current.pop_back();
+    this->m_Size--;
+    return true;
+  }
+
+private:
+  // 64 bit on every platform, unsigned long cannot hold the cap where long is 32 bit
+  std::uint64_t GetBucket( float time ) const
+  {
+    const double bucket = static_cast<double>( time ) * this->m_InverseBucketWidth;
+    return bucket < 1.e18 ? static_cast<std::uint64_t>( bucket ) : static_cast<std::uint64_t>( 1.e18 );
+  }
+
+  double                               m_InverseBucketWidth;
+  std::vector<std::vector<EntryType> > m_Buckets;
+  std::vector<EntryType>               m_Overflow;
+  std::vector<EntryType>               m_Current;
+  std::uint64_t                        m_CurrentBucket;
+  std::uint64_t                        m_WindowStart;
+  unsigned long                        m_Size;
+};
+
+/**
+ * Arrival times and labels of all the labels of labelImage marched together in a
+ * single fast marching pass over speedImage.  Voxels carrying one of the labels
+ * found where speed >= speedThreshold are alive at time 0; other voxels below the
+ * speed threshold are not traversed.  A trial voxel takes the label of the front
+ * that reaches it first, its arrival time being solved from the alive face
+ * neighbors of that label only.  Arrival times above stoppingValue are not
+ * accepted and those voxels stay unreached (infinite time, label 0).
+ *
+ * With numberOfBlocks > 1 the image is cut into slabs along its last axis that
+ * are marched in parallel rounds.  Each round a slab reads the arrival times of
+ * the planes bordering its neighbors from the previous round and re-marches if
+ * any of them changed, until no plane changes.  One block is the exact serial
+ * pass.  Since every round re-marches a slab from scratch and labels tied on a
+ * slab border may flip between rounds, the rounds are capped at twice the number
+ * of blocks, after which the serial pass is run instead.
+ */
+template <typename TImage>
+void
+MultiLabelFastMarching( const TImage *speedImage, const TImage *labelImage, double stoppingValue,
+                        double speedThreshold, unsigned int numberOfBlocks,
+                        std::vector<float> & arrivalTimes, std::vector<unsigned long> & labels,
+                        std::vector<unsigned char> & alive )
+{
+  enum { ImageDimension = TImage::ImageDimension };
+  typedef typename TImage::PixelType PixelType;
+
+  const float infinity = std::numeric_limits<float>::infinity();
+
+  const PixelType *   speed = speedImage->GetBufferPointer();
+  const PixelType *   label = labelImage->GetBufferPointer();
+  const unsigned long numberOfVoxels = speedImage->GetBufferedRegion().GetNumberOfPixels();
+
+  long   size[ImageDimension];
+  long   strides[ImageDimension];
+  double weights[ImageDimension];
+  long   stride = 1;
+  double minimumSpacing = std::numeric_limits<double>::max();
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    size[d] = static_cast<long>( speedImage->GetBufferedRegion().GetSize()[d] );
+    strides[d] = stride;
+    stride *= size[d];
+    const double spacing = speedImage->GetSpacing()[d];
+    weights[d] = 1.0 / ( spacing * spacing );
+    minimumSpacing = std::min( minimumSpacing, spacing );
+    }
+  const long sliceSize = strides[ImageDimension - 1];
+  const long numberOfSlices = size[ImageDimension - 1];
+
+  // labels that appear inside the speed mask are the sources
+  unsigned long maximumLabel = 0;
+  double        maximumSpeed = 0;
+  for( unsigned long v = 0; v < numberOfVoxels; v++ )
+    {
+    if( speed[v] >= speedThreshold )
+      {
+      maximumSpeed = std::max( maximumSpeed, static_cast<double>( speed[v] ) );
+      if( label[v] > 0 )
+        {
+        maximumLabel = std::max( maximumLabel, static_cast<unsigned long>( label[v] ) );
+        }
+      }
+    }
+  std::vector<unsigned long> sourceLabels( numberOfVoxels, 0 );
+  for( unsigned long v = 0; v < numberOfVoxels; v++ )
+    {
+    if( label[v] > 0 && static_cast<unsigned long>( label[v] ) <= maximumLabel )
+      {
+      sourceLabels[v] = static_cast<unsigned long>( label[v] );
+      }
+    }
+
+  // about one front layer per bucket at the largest speed
+  double bucketWidth = ( maximumSpeed > 0 ) ? minimumSpacing / maximumSpeed : 1;
+  if( stoppingValue > 0 )
+    {
+    bucketWidth = std::max( bucketWidth, stoppingValue / static_cast<double>( 1 << 20 ) );
+    }
+  const unsigned int numberOfBuckets = 4096;
+
+  numberOfBlocks = static_cast<unsigned int>( std::max( 1L, std::min( static_cast<long>( numberOfBlocks ),
+                                                                        numberOfSlices ) ) );
+  std::vector<long> blockSlices( numberOfBlocks + 1 );
+  for( unsigned int b = 0; b <= numberOfBlocks; b++ )
+    {
+    blockSlices[b] = numberOfSlices * static_cast<long>( b ) / static_cast<long>( numberOfBlocks );
+    }
+
+  arrivalTimes.assign( numberOfVoxels, infinity );
+  labels.assign( numberOfVoxels, 0 );
+  alive.assign( numberOfVoxels, 0 );
+
+  // arrival times and labels of the planes below and above each block as read
+  // at the start of a round:  plane 2 * b below block b, plane 2 * b + 1 above
+  std::vector<std::vector<float> >         ghostTimes( 2 * numberOfBlocks,
+                                                       std::vector<float>( sliceSize, infinity ) );
+  std::vector<std::vector<unsigned long> > ghostLabels( 2 * numberOfBlocks,
+                                                        std::vector<unsigned long>( sliceSize, 0 ) );
+
+  auto marchBlock = [&]( unsigned int b )
+    {
+    const unsigned long first = blockSlices[b] * sliceSize;
+    const unsigned long last = blockSlices[b + 1] * sliceSize;
+
+    const std::vector<float> &         lowerTimes = ghostTimes[2 * b];
+    const std::vector<float> &         upperTimes = ghostTimes[2 * b + 1];
+    const std::vector<unsigned long> & lowerLabels = ghostLabels[2 * b];
+    const std::vector<unsigned long> & upperLabels = ghostLabels[2 * b + 1];
+
+    // time of the face neighbor w of a voxel if it is alive with label l
+    auto aliveTime = [&]( long w, unsigned long l ) -> float
+      {
+      if( w < static_cast<long>( first ) )
+        {
+        const long g = w - ( static_cast<long>( first ) - sliceSize );
+        return lowerLabels[g] == l ? lowerTimes[g] : infinity;
+        }
+      if( w >= static_cast<long>( last ) )
+        {
+        const long g = w - static_cast<long>( last );
+        return upperLabels[g] == l ? upperTimes[g] : infinity;
+        }
+      return ( alive[w] && labels[w] == l ) ? arrivalTimes[w] : infinity;
+      };
+
+    FastMarchingBucketQueue queue( bucketWidth, numberOfBuckets );
+
+    // solve the upwind quadratic at voxel u from its alive neighbors of label l
+    // and lower its trial time if the front of l arrives first
+    auto update = [&]( unsigned long u, unsigned long l )
+      {
+      if( alive[u] || sourceLabels[u] > 0 || speed[u] < speedThreshold )
+        {
+        return;
+        }
+      double values[ImageDimension];
+      double axisWeights[ImageDimension];
+      unsigned int n = 0;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        const long c = ( static_cast<long>( u ) / strides[d] ) % size[d];
+        float      t = infinity;
+        if( c > 0 )
+          {
+          t = std::min( t, aliveTime( static_cast<long>( u ) - strides[d], l ) );
+          }
+        if( c + 1 < size[d] )
+          {
+          t = std::min( t, aliveTime( static_cast<long>( u ) + strides[d], l ) );
+          }
+        if( t < infinity )
+          {
+          unsigned int k = n++;
+          for( ; k > 0 && values[k - 1] > t; k-- )
+            {
+            values[k] = values[k - 1];
+            axisWeights[k] = axisWeights[k - 1];
+            }
+          values[k] = t;
+          axisWeights[k] = weights[d];
+          }
+        }
+      const double f = static_cast<double>( speed[u] );
+      double       aa = 0;
+      double       bb = 0;
+      double       cc = -1.0 / ( f * f );
+      double       solution = std::numeric_limits<double>::max();
+      for( unsigned int k = 0; k < n && solution >= values[k]; k++ )
+        {
+        aa += axisWeights[k];
+        bb += values[k] * axisWeights[k];
+        cc += values[k] * values[k] * axisWeights[k];
+        const double discriminant = bb * bb - aa * cc;
+        if( discriminant < 0 )
+          {
+          break;
+          }
+        solution = ( std::sqrt( discriminant ) + bb ) / aa;
+        }
+      if( solution < arrivalTimes[u] && solution <= stoppingValue )
+        {
+        arrivalTimes[u] = static_cast<float>( solution );
+        labels[u] = l;
+        queue.Push( arrivalTimes[u], u );
+        }
+      };
+
+    auto updateNeighbors = [&]( unsigned long v, unsigned long l )
+      {
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        const long c = ( static_cast<long>( v ) / strides[d] ) % size[d];
+        if( c > 0 && v >= first + strides[d] )
+          {
+          update( v - strides[d], l );
+          }
+        if( c + 1 < size[d] && v + strides[d] < last )
+          {
+          update( v + strides[d], l );
+          }
+        }
+      };
+
+    for( unsigned long v = first; v < last; v++ )
+      {
+      labels[v] = sourceLabels[v];
+      alive[v] = ( sourceLabels[v] > 0 );
+      arrivalTimes[v] = alive[v] ? 0 : infinity;
+      }
+    for( unsigned long v = first; v < last; v++ )
+      {
+      if( alive[v] )
+        {
+        updateNeighbors( v, labels[v] );
+        }
+      }
+    for( long g = 0; g < sliceSize; g++ )
+      {
+      if( lowerTimes[g] < infinity )
+        {
+        update( first + g, lowerLabels[g] );
+        }
+      if( upperTimes[g] < infinity )
+        {
+        update( last - sliceSize + g, upperLabels[g] );
+        }
+      }
+
+    FastMarchingBucketQueue::EntryType entry;
+    while( queue.Pop( entry ) )
+      {
+      const unsigned long v = entry.second;
+      if( alive[v] || entry.first != arrivalTimes[v] )
+        {
+        continue;
+        }
+      alive[v] = 1;
+      updateNeighbors( v, labels[v] );
+      }
+    };
+
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+
+  std::vector<char>  marchBlocks( numberOfBlocks, 1 );
+  bool               isMarching = true;
+  const unsigned int maximumNumberOfRounds = 2 * numberOfBlocks;
+  unsigned int       numberOfRounds = 0;
+  while( isMarching && numberOfRounds < maximumNumberOfRounds )
+    {
+    numberOfRounds++;
+    threader->ParallelizeArray( 0, numberOfBlocks,
+      [&]( itk::SizeValueType b )
+      {
+      if( marchBlocks[b] )
+        {
+        marchBlock( b );
+        }
+      }, nullptr );
+
+    // exchange the bordering planes, a block marches again if they changed
+    isMarching = false;
+    for( unsigned int b = 0; b < numberOfBlocks; b++ )
+      {
+      marchBlocks[b] = 0;
+      for( unsigned int side = 0; side < 2; side++ )
+        {
+        const long slice = ( side == 0 ) ? blockSlices[b] - 1 : blockSlices[b + 1];
+        if( slice < 0 || slice >= numberOfSlices )
+          {
+          continue;
+          }
+        std::vector<float> &         times = ghostTimes[2 * b + side];
+        std::vector<unsigned long> & ghosts = ghostLabels[2 * b + side];
+        for( long g = 0; g < sliceSize; g++ )
+          {
+          const unsigned long w = slice * sliceSize + g;
+          if( times[g] != arrivalTimes[w] || ghosts[g] != labels[w] )
+            {
+            times[g] = arrivalTimes[w];
+            ghosts[g] = labels[w];
+            marchBlocks[b] = 1;
+            }
+          }
+        }
+      isMarching = isMarching || marchBlocks[b];
+      }
+    }
+
+  if( isMarching )
+    {
+    std::cout << " multi-label fast marching did not settle in " << maximumNumberOfRounds
+              << " rounds, marching serially " << std::endl;
+    blockSlices[0] = 0;
+    blockSlices[1] = numberOfSlices;
+    std::fill( ghostTimes[0].begin(), ghostTimes[0].end(), infinity );
+    std::fill( ghostTimes[1].begin(), ghostTimes[1].end(), infinity );
+    std::fill( ghostLabels[0].begin(), ghostLabels[0].end(), 0 );
+    std::fill( ghostLabels[1].begin(), ghostLabels[1].end(), 0 );
+    marchBlock( 0 );
+    }
+}
+
+/**
+ * The samples of a time series image transposed once into a contiguous
+ * voxel-major buffer:  GetTimeSeries( v ) points to the GetNumberOfTimePoints()
+ * samples of voxel v, the voxels being numbered in buffer order of the spatial
+ * grid.  Time is the last image axis, or the first one for the [time x voxel]
+ * matrix images of TimeSeriesToMatrix.
+ */
+template <typename TImage>
+class TimeSeriesVoxelView
+{
+public:
+  typedef typename TImage::PixelType PixelType;
+  enum { ImageDimension = TImage::ImageDimension };
+
+  explicit TimeSeriesVoxelView( const TImage *image, bool isTimeFirstAxis = false ) :
+    m_Threader( itk::MultiThreaderBase::New() ),
+    m_IsTimeFirstAxis( isTimeFirstAxis )
+  {
+    const unsigned long numberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+    this->m_NumberOfTimePoints = image->GetBufferedRegion().GetSize()[isTimeFirstAxis ? 0 : ImageDimension - 1];
+    this->m_NumberOfVoxels = ( this->m_NumberOfTimePoints > 0 ) ? numberOfPixels / this->m_NumberOfTimePoints : 0;
+    this->m_Buffer.resize( numberOfPixels );
+    if( this->m_IsTimeFirstAxis )
+      {
+      std::copy( image->GetBufferPointer(), image->GetBufferPointer() + numberOfPixels, this->m_Buffer.begin() );
+      }
+    else
+      {
+      this->Transpose( image->GetBufferPointer(), this->m_Buffer.data(), this->m_NumberOfTimePoints,
+                       this->m_NumberOfVoxels );
+      }
+  }
+
+  unsigned long GetNumberOfVoxels() const
+  {
+    return this->m_NumberOfVoxels;
+  }
+
+  unsigned int GetNumberOfTimePoints() const
+  {
+    return this->m_NumberOfTimePoints;
+  }
+
+  const PixelType * GetTimeSeries( unsigned long v ) const
+  {
+    return this->m_Buffer.data() + v * this->m_NumberOfTimePoints;
+  }
+
+  PixelType * GetTimeSeries( unsigned long v )
+  {
+    return this->m_Buffer.data() + v * this->m_NumberOfTimePoints;
+  }
+
+  /** Write the time series back into an image of the original layout. */
+  void CopyToImage( TImage *image ) const
+  {
+    if( this->m_IsTimeFirstAxis )
+      {
+      std::copy( this->m_Buffer.begin(), this->m_Buffer.end(), image->GetBufferPointer() );
+      }
+    else
+      {
+      this->Transpose( this->m_Buffer.data(), image->GetBufferPointer(), this->m_NumberOfVoxels,
+                       this->m_NumberOfTimePoints );
+      }
+  }
+
+  unsigned int GetNumberOfWorkUnits() const
+  {
+    return this->m_Threader->GetNumberOfWorkUnits();
+  }
+
+  /**
+   * Call function( workUnit, v ) for every voxel in parallel.  Each work unit
+   * visits interleaved blocks of voxels, so callers may keep per work unit sums.
+   */
+  template <typename TFunction>
+  void ForEachVoxel( TFunction function ) const
+  {
+    const unsigned int  numberOfWorkUnits = this->GetNumberOfWorkUnits();
+    const unsigned long blockSize = 256;
+    this->m_Threader->ParallelizeArray( 0, numberOfWorkUnits,
+      [&]( itk::SizeValueType workUnit )
+      {
+      for( unsigned long first = workUnit * blockSize; first < this->m_NumberOfVoxels;
+           first += numberOfWorkUnits * blockSize )
+        {
+        const unsigned long last = std::min( this->m_NumberOfVoxels, first + blockSize );
+        for( unsigned long v = first; v < last; v++ )
+          {
+          function( static_cast<unsigned int>( workUnit ), v );
+          }
+        }
+      }, nullptr );
+  }
+
+private:
+  // rows x columns into columns x rows, in parallel over tiles of columns
+  void Transpose( const PixelType *source, PixelType *target, unsigned long rows, unsigned long columns ) const
+  {
+    const unsigned long tileSize = 64;
+    const unsigned long numberOfTiles = ( columns + tileSize - 1 ) / tileSize;
+    this->m_Threader->ParallelizeArray( 0, numberOfTiles,
+      [&]( itk::SizeValueType tile )
+      {
+      const unsigned long first = tile * tileSize;
+      const unsigned long last = std::min( columns, first + tileSize );
+      for( unsigned long r = 0; r < rows; r++ )
+        {
+        const PixelType *row = source + r * columns;
+        for( unsigned long c = first; c < last; c++ )
+          {
+          target[c * rows + r] = row[c];
+          }
+        }
+      }, nullptr );
+  }
+
+  itk::MultiThreaderBase::Pointer m_Threader;
+  bool                            m_IsTimeFirstAxis;
+  unsigned int                    m_NumberOfTimePoints;
+  unsigned long                   m_NumberOfVoxels;
+  std::vector<PixelType>          m_Buffer;
+};
+
+/**
+ * Temporal standard deviation of every voxel of the view whose mask value is
+ * positive, 0 elsewhere.  Returns the largest one.
+ */
+template <typename TView, typename TMaskPixel>
+float
+ComputeTimeSeriesStandardDeviations( const TView & view, const TMaskPixel *mask, std::vector<float> & deviations )
+{
+  const unsigned int numberOfTimePoints = view.GetNumberOfTimePoints();
+
+  deviations.assign( view.GetNumberOfVoxels(), 0 );
+  std::vector<float> maxima( view.GetNumberOfWorkUnits(), 0 );
+  view.ForEachVoxel(
+    [&]( unsigned int workUnit, unsigned long v )
+    {
+    if( !( mask[v] > 0 ) )
+      {
+      return;
+      }
+    const typename TView::PixelType *series = view.GetTimeSeries( v );
+    double total = 0;
+    for( unsigned int t = 0; t < numberOfTimePoints; t++ )
+      {
+      total += series[t];
+      }
+    const double mean = total / static_cast<double>( numberOfTimePoints );
+    double       var = 0;
+    for( unsigned int t = 0; t < numberOfTimePoints; t++ )
+      {
+      var += ( series[t] - mean ) * ( series[t] - mean );
+      }
+    deviations[v] = std::sqrt( var / static_cast<double>( numberOfTimePoints ) );
+    maxima[workUnit] = std::max( maxima[workUnit], deviations[v] );
+    } );
+  return *std::max_element( maxima.begin(), maxima.end() );
+}
+
+/**
+ * Copy the time series of the listed voxels into the columns of a
+ * [time x voxel] matrix, in parallel over the voxels.
+ */
+template <typename TView, typename TMatrix>
+void
+GatherTimeSeriesColumns( const TView & view, const std::vector<unsigned long> & voxels, TMatrix & matrix )
+{
+  const unsigned int numberOfTimePoints = view.GetNumberOfTimePoints();
+
+  matrix.set_size( numberOfTimePoints, voxels.size() );
+  itk::MultiThreaderBase::New()->ParallelizeArray( 0, voxels.size(),
+    [&]( itk::SizeValueType i )
+    {
+    const typename TView::PixelType *series = view.GetTimeSeries( voxels[i] );
+    for( unsigned int t = 0; t < numberOfTimePoints; t++ )
+      {
+      matrix( t, i ) = series[t];
+      }
+    }, nullptr );
+}
 
 template <unsigned int ImageDimension>
 int FrobeniusNormOfMatrixDifference(int argc, char *argv[])
@@ -421,66 +1246,27 @@ int GetLargestComponent(int argc, char *argv[])
 
   //  WriteImage<ImageType>(relabel->GetOutput(),outname.c_str());
   //  return 0;
-  typename ImageType::Pointer Clusters = MakeNewImage<ImageType>(relabel->GetOutput(), 0);
-  // typename ImageType::Pointer Clusters=relabel->GetOutput();
-  typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
-  Iterator vfIter( relabel->GetOutput(),  relabel->GetOutput()->GetLargestPossibleRegion() );
-
-  float maximum = relabel->GetNumberOfObjects();
-  float                     maxtstat = 0;
-  std::vector<unsigned int> histogram( (int)maximum + 1);
-  std::vector<float>        clustersum( (int)maximum + 1);
-  for( int i = 0; i <= maximum; i++ )
-    {
-    histogram[i] = 0;
-    clustersum[i] = 0;
-    }
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
-    {
-    if( vfIter.Get() > 0 )
-      {
-      float vox = image1->GetPixel(vfIter.GetIndex() );
-      histogram[(unsigned int)vfIter.Get()] = histogram[(unsigned int)vfIter.Get()] + 1;
-      clustersum[(unsigned int)vfIter.Get()] += vox;
-      if( vox > maxtstat )
-        {
-        maxtstat = vox;
-        }
-      }
-    }
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
-    {
-    if( vfIter.Get() > 0 )
-      {
-      Clusters->SetPixel( vfIter.GetIndex(), histogram[(unsigned int)vfIter.Get()]  );
-      //  if ( Clusters->GetPixel( vfIter.GetIndex() ) > maximgval )
-      //    maximgval=Clusters->GetPixel( vfIter.GetIndex());
-      }
-    else
-      {
-      Clusters->SetPixel(vfIter.GetIndex(), 0);
-      }
-    }
 
-  float maximgval = 0;
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
+  // The relabeler already counted the voxels of every component it kept, so
+  // keep the components of maximal size in a single pass over the buffers.
+  const std::vector<itk::SizeValueType> & componentSizes = relabel->GetSizeOfObjectsInPixels();
+  itk::SizeValueType maximumSize = 0;
+  for( unsigned long i = 0; i < componentSizes.size(); i++ )
     {
-    if( Clusters->GetPixel( vfIter.GetIndex() ) > maximgval )
-      {
-      maximgval = Clusters->GetPixel( vfIter.GetIndex() );
-      }
+    maximumSize = std::max( maximumSize, componentSizes[i] );
     }
 
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
+  const PixelType *   componentBuffer = relabel->GetOutput()->GetBufferPointer();
+  PixelType *         imageBuffer = image1->GetBufferPointer();
+  const unsigned long numberOfVoxels = image1->GetBufferedRegion().GetNumberOfPixels();
+  for( unsigned long v = 0; v < numberOfVoxels; v++ )
     {
-    if( Clusters->GetPixel( vfIter.GetIndex() ) >= maximgval )
-      {
-      image1->SetPixel( vfIter.GetIndex(), 1);
-      }
-    else
+    itk::SizeValueType componentSize = 0;
+    if( componentBuffer[v] > 0 && static_cast<unsigned long>( componentBuffer[v] ) <= componentSizes.size() )
       {
-      image1->SetPixel( vfIter.GetIndex(), 0);
+      componentSize = componentSizes[static_cast<unsigned long>( componentBuffer[v] ) - 1];
       }
+    imageBuffer[v] = ( componentSize >= maximumSize ) ? 1 : 0;
     }
 
   if( outname.length() > 3 )
@@ -2842,25 +3628,23 @@ int TimeSeriesRegionSCCA(int argc, char *argv[])
   calc->ComputeMaximum();
   unsigned int nLabels = calc->GetMaximum();
   unsigned int nVoxels = labels->GetLargestPossibleRegion().GetSize()[0];
-  unsigned int nTimes = time->GetLargestPossibleRegion().GetSize()[0];
 
-  // unsigned int labelCounts[nLabels];
-  unsigned int *labelCounts = new unsigned int[nLabels];
-  for( unsigned int i = 0; i < nLabels; i++ )
+  // voxels of each label
+  const TimeSeriesVoxelView<InputImageType> timeSeries( time, true );
+  const unsigned int *                      labelBuffer = labels->GetBufferPointer();
+  std::vector<std::vector<unsigned long> >  labelVoxels( nLabels );
+  for( unsigned int v = 0; v < nVoxels; v++ )
     {
-    typename LabelImageType::IndexType idx;
-    idx[1] = 0;
-
-    labelCounts[i] = 0;
-    for( unsigned int v = 0; v < nVoxels; v++ )
+    if( labelBuffer[v] > 0 )
       {
-      idx[0] = v;
-      if( labels->GetPixel(idx) == (i + 1) )
-        {
-        ++labelCounts[i];
-        }
+      labelVoxels[labelBuffer[v] - 1].push_back( v );
       }
     }
+  std::vector<unsigned int> labelCounts( nLabels );
+  for( unsigned int i = 0; i < nLabels; i++ )
+    {
+    labelCounts[i] = labelVoxels[i].size();
+    }
 
   typename InputImageType::Pointer connmat = InputImageType::New();
   typename InputImageType::RegionType region;
@@ -2880,68 +3664,27 @@ int TimeSeriesRegionSCCA(int argc, char *argv[])
   unsigned int minClusterSize = 1;
   unsigned int minRegionSize = 1;
 
-  // used to rankify matrices if using robust
+  // the [time x voxel] matrix of each label is gathered once
   typename SCCANType::Pointer cca_rankify = SCCANType::New();
+  std::vector<MatrixType>     labelMatrices( nLabels );
   for( unsigned int i = 0; i < nLabels; i++ )
     {
-    typename LabelImageType::IndexType idx;
-    idx[1] = 0;
-
-    MatrixType P(nTimes, labelCounts[i], 0.0);
-
-    unsigned int iCount = 0;
-    for( unsigned int v = 0; v < nVoxels; v++ )
-      {
-      idx[0] = v;
-      typename InputImageType::IndexType timeIdx;
-      timeIdx[1] = v;
-
-      if( labels->GetPixel(idx) == (i + 1) )
-        {
-        for( unsigned int t = 0; t < nTimes; t++ )
-          {
-          timeIdx[0] = t;
-          P(t, iCount) = time->GetPixel(timeIdx);
-          }
-        ++iCount;
-        }
-      }
-
+    GatherTimeSeriesColumns( timeSeries, labelVoxels[i], labelMatrices[i] );
+    // used to rankify matrices if using robust
     if( robust && ( labelCounts[i] >= minRegionSize)  )
       {
-      P = cca_rankify->RankifyMatrixColumns(P);
+      labelMatrices[i] = cca_rankify->RankifyMatrixColumns(labelMatrices[i]);
       }
+    }
+  for( unsigned int i = 0; i < nLabels; i++ )
+    {
+    const MatrixType & P = labelMatrices[i];
 
     if( labelCounts[i] >= minRegionSize )
       {
       for( unsigned int j = i + 1; j < nLabels; j++ )
         {
-        MatrixType Q(nTimes, labelCounts[j], 0.0);
-        typename LabelImageType::IndexType idx2;
-        idx2[1] = 0;
-
-        unsigned int jCount = 0;
-        for( unsigned int v2 = 0; v2 < nVoxels; v2++ )
-          {
-          idx2[0] = v2;
-          typename InputImageType::IndexType timeIdx2;
-          timeIdx2[1] = v2;
-
-          if( labels->GetPixel(idx2) == (j + 1) )
-            {
-            for( unsigned int t2 = 0; t2 < nTimes; t2++ )
-              {
-              timeIdx2[0] = t2;
-              Q(t2, jCount) = time->GetPixel(timeIdx2);
-              }
-            ++jCount;
-            }
-          }
-
-        if( robust )
-          {
-          Q = cca_rankify->RankifyMatrixColumns(Q);
-          }
+        const MatrixType & Q = labelMatrices[j];
 
         if( labelCounts[j] >= minRegionSize )
           {
@@ -2978,8 +3721,6 @@ int TimeSeriesRegionSCCA(int argc, char *argv[])
 
   WriteImage<InputImageType>(connmat, outname.c_str() );
 
-  delete []labelCounts;
-
   return 0;
 }
 
@@ -3039,57 +3780,69 @@ int TimeSeriesRegionCorr(int argc, char *argv[])
   connmat->Allocate();
   connmat->FillBuffer(-1);
 
+  // voxels of each label, then the mean time series of the labels in parallel
+  const TimeSeriesVoxelView<InputImageType> timeSeries( time, true );
+  const unsigned int *                      labelBuffer = labels->GetBufferPointer();
+  std::vector<std::vector<unsigned long> >  labelVoxels( nLabels );
+  for( unsigned int v = 0; v < nVoxels; v++ )
+    {
+    if( labelBuffer[v] > 0 )
+      {
+      labelVoxels[labelBuffer[v] - 1].push_back( v );
+      }
+    }
+
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+
   MatrixType timeSig( nLabels, nTimes, 0.0 );
-  for( unsigned int i = 0; i < nLabels; i++ )
+  threader->ParallelizeArray( 0, nLabels,
+    [&]( itk::SizeValueType i )
     {
-    typename LabelImageType::IndexType idx;
-    idx[1] = 0;
-    for( unsigned int v = 0; v < nVoxels; v++ )
+    double *signal = timeSig[i];
+    for( unsigned long k = 0; k < labelVoxels[i].size(); k++ )
       {
-      idx[0] = v;
-      if( labels->GetPixel(idx) == (i + 1) )
+      const PixelType *series = timeSeries.GetTimeSeries( labelVoxels[i][k] );
+      for( unsigned int t = 0; t < nTimes; t++ )
         {
-        labelCounts[i]++;
-
-        typename InputImageType::IndexType timeIdx;
-        timeIdx[1] = v;
-        for( unsigned int t = 0; t < nTimes; t++ )
-          {
-          timeIdx[0] = t;
-          timeSig(i, t) += time->GetPixel(timeIdx);
-          }
+        signal[t] += series[t];
         }
       }
-    }
-  for( unsigned int i = 0; i < nLabels; i++ )
-    {
-    for( unsigned int j = 0; j < nTimes; j++ )
+    labelCounts[i] = labelVoxels[i].size();
+    for( unsigned int t = 0; t < nTimes; t++ )
       {
-      timeSig(i, j) /= labelCounts[i];
+      signal[t] /= labelCounts[i];
       }
-    }
-  for( unsigned int i = 0; i < nLabels; i++ )
+    }, nullptr );
+
+  // one row of the connectivity matrix and its transpose per label
+  PixelType *connmatBuffer = connmat->GetBufferPointer();
+  threader->ParallelizeArray( 0, nLabels,
+    [&]( itk::SizeValueType i )
     {
     for( unsigned int j = (i + 1); j < nLabels; j++ )
       {
 
       if( (labelCounts[i] > minRegionSize) && (labelCounts[j] > minRegionSize ) )
         {
-        VectorType p = timeSig.get_row(i);
-        VectorType q = timeSig.get_row(j);
+        const double *p = timeSig[i];
+        const double *q = timeSig[j];
 
         double corr = 0.0;
         double xysum = 0;
-        for( unsigned int z = 0; z < p.size(); z++ )
+        double xsum = 0;
+        double ysum = 0;
+        double xsqr = 0;
+        double ysqr = 0;
+        for( unsigned int z = 0; z < nTimes; z++ )
           {
           xysum += (p[z] * q[z]);
+          xsum += p[z];
+          ysum += q[z];
+          xsqr += p[z] * p[z];
+          ysqr += q[z] * q[z];
           }
 
-        double frac = 1.0 / (double)p.size();
-        double xsum = p.sum();
-        double ysum = q.sum();
-        double xsqr = p.squared_magnitude();
-        double ysqr = q.squared_magnitude();
+        double frac = 1.0 / (double)nTimes;
         double numer = xysum - frac * xsum * ysum;
         double denom = sqrt( ( xsqr - frac * xsum * xsum) * ( ysqr - frac * ysum * ysum) );
         if( denom > 0 )
@@ -3101,18 +3854,14 @@ int TimeSeriesRegionCorr(int argc, char *argv[])
           corr = 0.0;
           }
 
-        typename InputImageType::IndexType connIdx;
-        connIdx[0] = i;
-        connIdx[1] = j;
-        connmat->SetPixel( connIdx, corr );
-        connIdx[0] = j;
-        connIdx[1] = i;
-        connmat->SetPixel( connIdx, corr );
+        // index[0] is the column of the matrix image
+        connmatBuffer[i + j * nLabels] = corr;
+        connmatBuffer[j + i * nLabels] = corr;
 
         }
 
       }
-    }
+    }, nullptr );
 
   WriteImage<InputImageType>(connmat, outname.c_str() );
 
@@ -3297,9 +4046,6 @@ int ComputeTimeSeriesLeverage(int argc, char *argv[])
     }
   typedef float                                        PixelType;
   typedef itk::Image<PixelType, ImageDimension>        ImageType;
-  typedef itk::Image<PixelType, ImageDimension - 1>    OutImageType;
-  typedef typename OutImageType::IndexType             OutIndexType;
-  typedef typename ImageType::IndexType                IndexType;
 
   typedef double                                            Scalar;
   typedef itk::ants::antsMatrixUtilities<ImageType, Scalar> matrixOpType;
@@ -3321,48 +4067,23 @@ int ComputeTimeSeriesLeverage(int argc, char *argv[])
     }
   unsigned int timedims = image1->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
 
-  typedef itk::ExtractImageFilter<ImageType, OutImageType> ExtractFilterType;
-  typedef itk::ImageRegionIteratorWithIndex<OutImageType>  SliceIt;
-
-  typename ImageType::RegionType extractRegion = image1->GetLargestPossibleRegion();
-  extractRegion.SetSize(ImageDimension - 1, 0);
-  unsigned int sub_vol = 0;
-  extractRegion.SetIndex(ImageDimension - 1, sub_vol );
-  typename ExtractFilterType::Pointer extractFilter = ExtractFilterType::New();
-  extractFilter->SetInput( image1 );
-  //    extractFilter->SetDirectionCollapseToIdentity();
-  extractFilter->SetDirectionCollapseToSubmatrix();
-  extractFilter->SetExtractionRegion( extractRegion );
-  extractFilter->Update();
-  typename OutImageType::Pointer outimage = extractFilter->GetOutput();
-  outimage->FillBuffer(0);
-
-  typedef itk::ImageRegionIteratorWithIndex<OutImageType> SliceIt;
-
   // step 1.  compute , for each image in the time series, the effect on the average.
   // step 2.  the effect is defined as the influence of that point on the average or, more simply, the distance of that
   // image from the average ....
   typedef vnl_vector<Scalar> timeVectorType;
-  timeVectorType mSample(timedims, 0);
   timeVectorType mLeverage(timedims, 0);
   timeVectorType kDistance(timedims, 0);
-  SliceIt        vfIter2( outimage, outimage->GetLargestPossibleRegion() );
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+
+  const TimeSeriesVoxelView<ImageType> timeSeries( image1 );
+  std::vector<timeVectorType>          leverages( timeSeries.GetNumberOfWorkUnits(), timeVectorType(timedims, 0) );
+  timeSeries.ForEachVoxel(
+    [&]( unsigned int workUnit, unsigned long v )
     {
-    OutIndexType ind = vfIter2.GetIndex();
-    IndexType    tind;
-    // first collect all samples for that location
-    for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-      {
-      tind[i] = ind[i];
-      }
-    double all_mean = 0;
+    const PixelType *sample = timeSeries.GetTimeSeries( v );
+    double           all_mean = 0;
     for( unsigned int t = 0; t < timedims; t++ )
       {
-      tind[ImageDimension - 1] = t;
-      Scalar pix = image1->GetPixel(tind);
-      mSample(t) = pix;
-      all_mean += pix;
+      all_mean += sample[t];
       }
     // compute mean time series value at this voxel
     all_mean /= (double)timedims;
@@ -3370,10 +4091,15 @@ int ComputeTimeSeriesLeverage(int argc, char *argv[])
     //
     // this is a simple approach --- just the difference from the mean.
     //
+    Scalar *leverage = leverages[workUnit].data_block();
     for( unsigned int t = 0; t < timedims; t++ )
       {
-      mLeverage(t) += fabs(all_mean - mSample(t) ) / (Scalar)timedims;
+      leverage[t] += fabs(all_mean - sample[t] ) / (Scalar)timedims;
       }
+    } );
+  for( unsigned int w = 0; w < leverages.size(); w++ )
+    {
+    mLeverage += leverages[w];
     }
 
   // now use k neighbors to get a distance
@@ -3432,23 +4158,24 @@ int TimeSeriesToMatrix(int argc, char *argv[])
   typedef itk::Image<PixelType, ImageDimension>        ImageType;
   typedef itk::Image<PixelType, 2>                     MatrixImageType;
   typedef itk::Image<PixelType, ImageDimension - 1>    OutImageType;
-  typedef typename OutImageType::IndexType             OutIndexType;
-  typedef typename ImageType::IndexType                IndexType;
-
-  typedef double                                            Scalar;
-  typedef itk::ants::antsMatrixUtilities<ImageType, Scalar> matrixOpType;
-  typename matrixOpType::Pointer matrixOps = matrixOpType::New();
 
   bool tomha = true;
+  bool tobmat = false;
   int               argct = 2;
   const std::string outname = std::string(argv[argct]); argct++;
   std::string       ext = itksys::SystemTools::GetFilenameExtension( outname );
-  if( ( strcmp(ext.c_str(), ".csv") != 0 ) && (  strcmp(ext.c_str(), ".mha") != 0 )  )
+  if( ( strcmp(ext.c_str(), ".csv") != 0 ) && (  strcmp(ext.c_str(), ".mha") != 0 ) &&
+      !ANTSIsBinaryMatrixFileName( outname ) )
     {
-    // std::cout << " must use .csv or .mha as output file extension " << std::endl;
+    // std::cout << " must use .csv, .mha or .bmat as output file extension " << std::endl;
     return EXIT_FAILURE;
     }
   if( ( strcmp(ext.c_str(), ".csv") == 0 )  ) tomha = false;
+  if( ANTSIsBinaryMatrixFileName( outname ) )
+    {
+    tomha = false;
+    tobmat = true;
+    }
   argct++;
   std::string fn1 = std::string(argv[argct]);   argct++;
   std::string maskfn = std::string(argv[argct]);   argct++;
@@ -3472,17 +4199,26 @@ int TimeSeriesToMatrix(int argc, char *argv[])
     return 1;
     }
   unsigned int  timedims = image1->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
-  unsigned long voxct = 0;
-  typedef itk::ExtractImageFilter<ImageType, OutImageType> ExtractFilterType;
-  typedef itk::ImageRegionIteratorWithIndex<OutImageType>  SliceIt;
-  SliceIt mIter( mask, mask->GetLargestPossibleRegion() );
-  for(  mIter.GoToBegin(); !mIter.IsAtEnd(); ++mIter )
+
+  // the in-mask voxels are gathered once as offsets into a single time
+  // point of the 4D buffer; time point t is then a fixed stride away.
+  const itk::SizeValueType numberOfVoxels = mask->GetBufferedRegion().GetNumberOfPixels();
+  if( image1->GetBufferedRegion().GetNumberOfPixels() != numberOfVoxels * timedims )
     {
-    if( mIter.Get() >= 0.5 )
+    std::cerr << "The mask " << maskfn << " does not match the spatial grid of " << fn1 << std::endl;
+    return EXIT_FAILURE;
+    }
+  std::vector<itk::OffsetValueType> maskOffsets;
+  const PixelType *                 maskBuffer = mask->GetBufferPointer();
+  for( itk::SizeValueType n = 0; n < numberOfVoxels; n++ )
+    {
+    if( maskBuffer[n] >= 0.5 )
       {
-      voxct++;
+      maskOffsets.push_back( n );
       }
     }
+  const unsigned long voxct = maskOffsets.size();
+
   // allocate the matrix image
   typename MatrixImageType::SizeType size;
   size[0] = timedims;
@@ -3491,23 +4227,6 @@ int TimeSeriesToMatrix(int argc, char *argv[])
   newregion.SetSize(size);
   if ( tomha ) matriximage = AllocImage<MatrixImageType>(newregion, 0);
 
-  typename ImageType::RegionType extractRegion = image1->GetLargestPossibleRegion();
-  extractRegion.SetSize(ImageDimension - 1, 0);
-  unsigned int sub_vol = 0;
-  extractRegion.SetIndex(ImageDimension - 1, sub_vol );
-  typename ExtractFilterType::Pointer extractFilter = ExtractFilterType::New();
-  extractFilter->SetInput( image1 );
-  //    extractFilter->SetDirectionCollapseToIdentity();
-  extractFilter->SetDirectionCollapseToSubmatrix();
-  extractFilter->SetExtractionRegion( extractRegion );
-  extractFilter->Update();
-  typename OutImageType::Pointer outimage = extractFilter->GetOutput();
-  outimage->FillBuffer(0);
-
-  typedef itk::ImageRegionIteratorWithIndex<OutImageType> SliceIt;
-
-  typedef vnl_vector<Scalar> timeVectorType;
-  timeVectorType mSample(timedims, 0);
   typedef itk::Array2D<double> MatrixType;
   std::vector<std::string> ColumnHeaders;
   MatrixType               matrix;
@@ -3516,46 +4235,44 @@ int TimeSeriesToMatrix(int argc, char *argv[])
     matrix.set_size(timedims, voxct);
     matrix.Fill(0);
     }
-  SliceIt vfIter2( outimage, outimage->GetLargestPossibleRegion() );
-  voxct = 0;
-  PixelType meanval = 0;
-  unsigned long fullct = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+
+  const PixelType * timeSeriesBuffer = image1->GetBufferPointer();
+  PixelType *       matrixImageBuffer = tomha ? matriximage->GetBufferPointer() : nullptr;
+
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, timedims,
+    [&]( itk::SizeValueType t )
     {
-    OutIndexType ind = vfIter2.GetIndex();
-    if( mask->GetPixel(ind) >= 0.5 )
+    const PixelType * timePoint = timeSeriesBuffer + t * numberOfVoxels;
+    if( tomha )
       {
-      IndexType tind;
-      // first collect all samples for that location
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
+      // index[0] is the time point and index[1] the voxel
+      for( unsigned long v = 0; v < voxct; v++ )
         {
-        tind[i] = ind[i];
+        matrixImageBuffer[t + v * timedims] = timePoint[maskOffsets[v]];
         }
-      for( unsigned int t = 0; t < timedims; t++ )
+      }
+    else
+      {
+      double * row = matrix[t];
+      for( unsigned long v = 0; v < voxct; v++ )
         {
-	typename MatrixImageType::IndexType matind;
-	matind.Fill(0);
-	matind[1] = t;
-	matind[2] = voxct;
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        mSample(t) = pix;
-        if ( ! tomha ) matrix[t][voxct] = pix;
-        if ( tomha )
-          {
-	  matriximage->SetPixel( matind, pix );
-	  }
-	meanval += pix;
-	fullct++;
+        row[v] = timePoint[maskOffsets[v]];
         }
-      std::string colname = std::string("V") + ants_to_string<unsigned int>(voxct);
-      ColumnHeaders.push_back( colname );
-      voxct++;
-      } // check mask
+      }
+    }, nullptr );
+
+  if( tobmat )
+    {
+    return WriteBinaryMatrix<double>( matrix, outname ) ? 0 : EXIT_FAILURE;
     }
-  // std::cout << " Mean " << meanval / fullct << std::endl;
   if ( ! tomha )
     {
+    for( unsigned long v = 0; v < voxct; v++ )
+      {
+      std::string colname = std::string("V") + ants_to_string<unsigned int>(v);
+      ColumnHeaders.push_back( colname );
+      }
     // write out the array2D object
     typedef itk::CSVNumericObjectFileWriter<double, 1, 1> WriterType;
     WriterType::Pointer writer = WriterType::New();
@@ -4031,8 +4748,6 @@ int CompCorrAuto(int argc, char *argv[])
   typedef float                                        PixelType;
   typedef itk::Image<PixelType, ImageDimension>        ImageType;
   typedef itk::Image<PixelType, ImageDimension - 1>    OutImageType;
-  typedef typename OutImageType::IndexType             OutIndexType;
-  typedef typename ImageType::IndexType                IndexType;
 
   typedef double                                            Scalar;
   typedef itk::ants::antsMatrixUtilities<ImageType, Scalar> matrixOpType;
@@ -4096,18 +4811,31 @@ int CompCorrAuto(int argc, char *argv[])
   unsigned int timedims = image1->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
   // std::cout << "timedims " << timedims << " size " << image1->GetLargestPossibleRegion().GetSize() << std::endl;
 
+  // the time series are transposed once, voxel v of the view is voxel v of the label image
+  TimeSeriesVoxelView<ImageType> timeSeries( image1 );
+  const unsigned long            numberOfVoxels = timeSeries.GetNumberOfVoxels();
+  if( label_image->GetBufferedRegion().GetNumberOfPixels() != numberOfVoxels )
+    {
+    std::cerr << "The label image " << fn_label << " does not match the spatial grid of " << fn1 << std::endl;
+    return EXIT_FAILURE;
+    }
+  const PixelType *labels = label_image->GetBufferPointer();
+  PixelType *      variances = var_image->GetBufferPointer();
+
   // first, count the label numbers
-  typedef itk::ImageRegionIteratorWithIndex<OutImageType> labIterator;
-  labIterator   vfIter2( label_image,  label_image->GetLargestPossibleRegion() );
-  unsigned long ct_nuis = 0;
-  unsigned long ct_vox = 0;
+  unsigned long              ct_vox = 0;
+  std::vector<unsigned long> brainVoxels;
   // std::cout << " verify input " << std::endl;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+  for( unsigned long v = 0; v < numberOfVoxels; v++ )
     {
-    if( vfIter2.Get() == 1 )      // in brain
+    if( labels[v] == 1 )      // in brain
       {
       ct_vox++;
       }
+    if( labels[v] > 0 )
+      {
+      brainVoxels.push_back( v );
+      }
     }
   // std::cout << " counted " << ct_vox << " voxels " <<  std::endl;
   if( ct_vox == 0 )
@@ -4121,55 +4849,20 @@ int CompCorrAuto(int argc, char *argv[])
   // step 3.  compute the correlation of the reference region with every voxel in the roi.
   typedef vnl_matrix<Scalar> timeMatrixType;
   typedef vnl_vector<Scalar> timeVectorType;
-  timeMatrixType mSample(timedims, ct_vox, 0);
-  unsigned long  nuis_vox = 0;
-  timeVectorType sample(timedims, 0);
   //  FIRST -- get high variance (in time) voxels
-  float maxvar = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-    {
-    OutIndexType ind = vfIter2.GetIndex();
-    if( vfIter2.Get() > 0 )      // in-brain
-      {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      float total = 0;
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        sample(t) = pix;
-        total += pix;
-        }
-      float mean = total / (float)timedims;
-      float var = 0;
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        var += ( (sample(t) - mean) * (sample(t) - mean) );
-        }
-      var /= (float)(timedims);
-      var = sqrt(var);
-      if( var > maxvar )
-        {
-        maxvar = var;
-        }
-      var_image->SetPixel(ind, var);
-      }
-    }
+  std::vector<float> deviations;
+  float              maxvar = ComputeTimeSeriesStandardDeviations( timeSeries, labels, deviations );
+  std::copy( deviations.begin(), deviations.end(), variances );
   // std::cout << " got var " << std::endl;
   // now build the histogram
   unsigned int   histsize = 50;
   float          binsize = maxvar / histsize;
   timeVectorType varhist(histsize, 0);
   float          varhistsum = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+  for( unsigned long v = 0; v < numberOfVoxels; v++ )
     {
-    OutIndexType ind = vfIter2.GetIndex();
-    float        var = var_image->GetPixel(ind);
-    if( vfIter2.Get() > 0 && var > 0 )      // in-brain
+    float var = variances[v];
+    if( labels[v] > 0 && var > 0 )      // in-brain
       {
       int bin = (int)( var / binsize ) - 1;
       if( bin < 0 )
@@ -4187,75 +4880,39 @@ int CompCorrAuto(int argc, char *argv[])
   for( unsigned int j = 0; j < histsize; j++ )
     {
     temp += varhist(j);
-    if( temp >= 0.95 && varval_csf <=  0 )
-      {
-      varval_csf = (float)j * binsize;
-      }
-    }
-
-  // std::cout << " maxvar " << maxvar << " varval_csf " << varval_csf << std::endl;
-  ct_nuis = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-    {
-    OutIndexType ind = vfIter2.GetIndex();
-    if( var_image->GetPixel(ind) > varval_csf  )      // nuisance
-      {
-      ct_nuis++;
-      }
-    }
-  timeMatrixType mNuisance(timedims, ct_nuis, 0);
-  nuis_vox = 0;
-  unsigned long brain_vox = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-    {
-    OutIndexType ind = vfIter2.GetIndex();
-    if( var_image->GetPixel(ind) > varval_csf  )      // nuisance
-      {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        mNuisance(t, nuis_vox) = pix;
-        }
-      nuis_vox++;
+    if( temp >= 0.95 && varval_csf <=  0 )
+      {
+      varval_csf = (float)j * binsize;
       }
-    if( vfIter2.Get() > 0  )      // in brain
+    }
+
+  // std::cout << " maxvar " << maxvar << " varval_csf " << varval_csf << std::endl;
+  std::vector<unsigned long> nuisanceVoxels;
+  for( unsigned long v = 0; v < numberOfVoxels; v++ )
+    {
+    if( variances[v] > varval_csf  )      // nuisance
       {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        mSample(t, brain_vox) = pix;
-        }
-      brain_vox++;
+      nuisanceVoxels.push_back( v );
       }
     }
+  timeMatrixType mNuisance;
+  timeMatrixType mSample;
+  GatherTimeSeriesColumns( timeSeries, nuisanceVoxels, mNuisance );
+  GatherTimeSeriesColumns( timeSeries, brainVoxels, mSample );
   // factor out the nuisance variables by OLS
   timeVectorType vGlobal = matrixOps->AverageColumns(mSample);
   //  typedef itk::Array2D<double> csvMatrixType;
+  // all of the compcorr vectors come from one truncated decomposition
+  timeMatrixType nuisanceVectors = matrixOps->GetTopCovMatEigenvectors(mNuisance, n_comp_corr_vecs);
+  n_comp_corr_vecs = nuisanceVectors.cols();
   timeMatrixType           reducedNuisance(timedims, n_comp_corr_vecs + 1);
   std::vector<std::string> ColumnHeaders;
   std::string              colname = std::string("GlobalSignal");
   ColumnHeaders.push_back( colname );
   reducedNuisance.set_column(0, vGlobal);
-  if( ct_nuis == 0 )
-    {
-    n_comp_corr_vecs = 1;
-    }
   for( unsigned int i = 0; i < n_comp_corr_vecs; i++ )
     {
-    timeVectorType nuisi = matrixOps->GetCovMatEigenvector(mNuisance, i);
-    reducedNuisance.set_column(i + 1, nuisi);
+    reducedNuisance.set_column(i + 1, nuisanceVectors.get_column(i) );
     colname = std::string("CompCorrVec") + ants_to_string<unsigned int>(i + 1);
     ColumnHeaders.push_back( colname );
     }
@@ -4279,30 +4936,19 @@ int CompCorrAuto(int argc, char *argv[])
     return EXIT_FAILURE;
     }
 
-  timeMatrixType RRt = matrixOps->ProjectionMatrix(reducedNuisance);
   mSample = matrixOps->NormalizeMatrix(mSample);
-  mSample = mSample - RRt * mSample;
-  brain_vox = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+  matrixOps->ProjectOutMatrix(mSample, reducedNuisance);
+  // correct the original image
+  itk::MultiThreaderBase::New()->ParallelizeArray( 0, brainVoxels.size(),
+    [&]( itk::SizeValueType i )
     {
-    OutIndexType ind = vfIter2.GetIndex();
-    if( vfIter2.Get() > 0 )
+    PixelType *series = timeSeries.GetTimeSeries( brainVoxels[i] );
+    for( unsigned int t = 0; t < timedims; t++ )
       {
-      timeVectorType samp = mSample.get_column(brain_vox);
-// correct the original image
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        image1->SetPixel(tind, samp[t]);
-        }
-      brain_vox++;
+      series[t] = mSample( t, i );
       }
-    }
+    }, nullptr );
+  timeSeries.CopyToImage( image1 );
   kname = tempname + std::string("_corrected") + extension;
   WriteImage<ImageType>(image1, kname.c_str() );
   kname = tempname + std::string("_variance") + extension;
@@ -4392,28 +5038,42 @@ int ThreeTissueConfounds(int argc, char *argv[])
   unsigned int timedims = image1->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
   // std::cout << "timedims " << timedims << " size " << image1->GetLargestPossibleRegion().GetSize() << std::endl;
 
+  // the time series are transposed once, voxel v of the view is voxel v of the label image
+  TimeSeriesVoxelView<ImageType> timeSeries( image1 );
+  const unsigned long            numberOfVoxels = timeSeries.GetNumberOfVoxels();
+  if( label_image->GetBufferedRegion().GetNumberOfPixels() != numberOfVoxels )
+    {
+    std::cerr << "The label image " << fn_label << " does not match the spatial grid of " << fn1 << std::endl;
+    return EXIT_FAILURE;
+    }
+  const PixelType *labels = label_image->GetBufferPointer();
+  PixelType *      variances = var_image->GetBufferPointer();
+
   // first, count the label numbers
   typedef itk::ImageRegionIteratorWithIndex<OutImageType> labIterator;
   labIterator   vfIter2( label_image,  label_image->GetLargestPossibleRegion() );
-  unsigned long ct_nuis = 0;
-  unsigned long ct_ref = 0;
-  unsigned long ct_gm = 0;
+  std::vector<unsigned long> nuisanceVoxels;
+  std::vector<unsigned long> referenceVoxels;
+  std::vector<unsigned long> gmVoxels;
   // std::cout << " verify input " << std::endl;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+  for( unsigned long v = 0; v < numberOfVoxels; v++ )
     {
-    if( vfIter2.Get() == csflabel )      // nuisance
+    if( labels[v] == csflabel )      // nuisance
       {
-      ct_nuis++;
+      nuisanceVoxels.push_back( v );
       }
-    if( vfIter2.Get() == wmlabel )      // reference
+    if( labels[v] == wmlabel )      // reference
       {
-      ct_ref++;
+      referenceVoxels.push_back( v );
       }
-    if( vfIter2.Get() > 0 )      // gm roi
+    if( labels[v] > 0 )      // gm roi
       {
-      ct_gm++;
+      gmVoxels.push_back( v );
       }
     }
+  unsigned long ct_nuis = nuisanceVoxels.size();
+  unsigned long ct_ref = referenceVoxels.size();
+  unsigned long ct_gm = gmVoxels.size();
   // std::cout << " counted " << ct_gm << " gm voxels " << ct_ref << " reference region voxels " << std::endl;
   if( ct_gm == 0 )
     {
@@ -4431,59 +5091,20 @@ int ThreeTissueConfounds(int argc, char *argv[])
   // step 3.  compute the correlation of the reference region with every voxel in the roi.
   typedef vnl_matrix<Scalar> timeMatrixType;
   typedef vnl_vector<Scalar> timeVectorType;
-  timeMatrixType mReference(timedims, ct_ref, 0);
-  timeMatrixType mSample(timedims, ct_gm, 0);
-  unsigned long  nuis_vox = 0;
-  unsigned long  ref_vox = 0;
-  unsigned long  gm_vox = 0;
-  timeVectorType smoother(timedims, 0);
-  timeVectorType smoother_out(timedims, 0);
   //  FIRST -- get high variance (in time) voxels
-  float maxvar = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-    {
-    OutIndexType ind = vfIter2.GetIndex();
-    if( vfIter2.Get() > 0 )      // in-brain
-      {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      float total = 0;
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        smoother(t) = pix;
-        total += pix;
-        }
-      float mean = total / (float)timedims;
-      float var = 0;
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        var += ( (smoother(t) - mean) * (smoother(t) - mean) );
-        }
-      var /= (float)(timedims);
-      var = sqrt(var);
-      if( var > maxvar )
-        {
-        maxvar = var;
-        }
-      var_image->SetPixel(ind, var);
-      }
-    }
+  std::vector<float> deviations;
+  float              maxvar = ComputeTimeSeriesStandardDeviations( timeSeries, labels, deviations );
+  std::copy( deviations.begin(), deviations.end(), variances );
   // std::cout << " got var " << std::endl;
   // now build the histogram
   unsigned int   histsize = 50;
   float          binsize = maxvar / histsize;
   timeVectorType varhist(histsize, 0);
   float          varhistsum = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+  for( unsigned long v = 0; v < numberOfVoxels; v++ )
     {
-    OutIndexType ind = vfIter2.GetIndex();
-    float        var = var_image->GetPixel(ind);
-    if( vfIter2.Get() > 0 && var > 0 )      // in-brain
+    float var = variances[v];
+    if( labels[v] > 0 && var > 0 )      // in-brain
       {
       int bin = (int)( var / binsize ) - 1;
       if( bin < 0 )
@@ -4510,69 +5131,13 @@ int ThreeTissueConfounds(int argc, char *argv[])
   // std::cout << " maxvar " << maxvar << " varval_csf " << varval_csf << std::endl;
   //  WriteImage<OutImageType>(var_image,"varimage.nii.gz");
   //
-  ct_nuis = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-    {
-    // OutIndexType ind = vfIter2.GetIndex();
-    if( vfIter2.Get() == csflabel )      // reference
-    //    if( var_image->GetPixel(ind) > varval_csf  )      // nuisance
-      {
-      ct_nuis++;
-      }
-    }
-  timeMatrixType mNuisance(timedims, ct_nuis, 0);
-  ref_vox = 0; nuis_vox = 0; gm_vox = 0;
-  for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
-    {
-    OutIndexType ind = vfIter2.GetIndex();
-    //      if ( vfIter2.Get() == 3 ) { // nuisance
-    //    if( var_image->GetPixel(ind) > varval_csf  )      // nuisance
-    if( vfIter2.Get() == csflabel )      // reference
-      {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        mNuisance(t, nuis_vox) = pix;
-        }
-      nuis_vox++;
-      }
-    if( vfIter2.Get() == wmlabel )      // reference
-      {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        mReference(t, ref_vox) = pix;
-        }
-      ref_vox++;
-      }
-    if( vfIter2.Get() > 0  )      // in brain
-      {
-      IndexType tind;
-      for( unsigned int i = 0; i < ImageDimension - 1; i++ )
-        {
-        tind[i] = ind[i];
-        }
-      for( unsigned int t = 0; t < timedims; t++ )
-        {
-        tind[ImageDimension - 1] = t;
-        Scalar pix = image1->GetPixel(tind);
-        mSample(t, gm_vox) = pix;
-        }
-      gm_vox++;
-      }
-    }
+  timeMatrixType mNuisance;
+  timeMatrixType mReference;
+  timeMatrixType mSample;
+  unsigned long  gm_vox = 0;
+  GatherTimeSeriesColumns( timeSeries, nuisanceVoxels, mNuisance );
+  GatherTimeSeriesColumns( timeSeries, referenceVoxels, mReference );
+  GatherTimeSeriesColumns( timeSeries, gmVoxels, mSample );
 
   // factor out the nuisance variables by OLS
   unsigned int nnuis = 3; // global , csf , wm
@@ -4583,10 +5148,13 @@ int ThreeTissueConfounds(int argc, char *argv[])
   timeMatrixType reducedNuisance(timedims, nnuis);
   timeVectorType vGlobal = matrixOps->AverageColumns( mSample );
   reducedNuisance.set_column( 0, vGlobal);
-  vGlobal = matrixOps->AverageColumns( mNuisance ); // csf
-  reducedNuisance.set_column( 1, vGlobal);
-  vGlobal = matrixOps->AverageColumns( mReference ); // wm
-  reducedNuisance.set_column( 2, vGlobal);
+  if( nnuis > 1 )
+    {
+    vGlobal = matrixOps->AverageColumns( mNuisance ); // csf
+    reducedNuisance.set_column( 1, vGlobal);
+    vGlobal = matrixOps->AverageColumns( mReference ); // wm
+    reducedNuisance.set_column( 2, vGlobal);
+    }
 
   std::vector<std::string> ColumnHeaders;
   std::string              colname = std::string("GlobalSignal");
@@ -5005,33 +5573,37 @@ int LabelSurfaceArea(int argc, char *argv[])
   Scalar voxspc2 = voxspc * voxspc;
   Scalar dm1 = static_cast<Scalar>( ImageDimension - 1 );
   Scalar refarea = std::pow( static_cast<Scalar>( rad[1] ) , dm1 );
-  iteratorType GHood(rad, input, input->GetLargestPossibleRegion() );
-  GHood.GoToBegin();
-  while( !GHood.IsAtEnd() )
-    {
-    typename ImageType::IndexType ind = GHood.GetIndex();
-    Scalar area = 0.0;
-    Scalar locrefarea = refarea;
-    if (  GHood.GetCenterPixel() > 0.1 )
+
+  // the neighbors within 2 * voxspc (in voxels) are the same for every voxel
+  const LabelNeighborhood<ImageType> neighborhood( input, rad[0], 2.0 * voxspc );
+
+  const PixelType *   inputBuffer = input->GetBufferPointer();
+  PixelType *         areaBuffer = areaImage->GetBufferPointer();
+  const unsigned long numberOfVoxels = input->GetBufferedRegion().GetNumberOfPixels();
+  const unsigned long blockSize = 4096;
+  const unsigned long numberOfBlocks = ( numberOfVoxels + blockSize - 1 ) / blockSize;
+
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, numberOfBlocks,
+    [&]( itk::SizeValueType block )
     {
-    for( unsigned int i = 0; i < GHood.Size(); i++ )
+    std::vector<unsigned long> neighbors;
+    const unsigned long last = std::min( numberOfVoxels, ( block + 1 ) * blockSize );
+    for( unsigned long v = block * blockSize; v < last; v++ )
       {
-      const typename ImageType::IndexType & ind2 = GHood.GetIndex(i);
-      float dist = 0.0;
-      for( unsigned int j = 0; j < ImageDimension; j++ )
-        {
-        dist += (float)(ind[j] - ind2[j]) * (float)(ind[j] - ind2[j]);
-        }
-      dist = sqrt( dist );
-      if( dist <  (2.0*voxspc) )
+      Scalar area = 0.0;
+      if( inputBuffer[v] > 0.1 )
         {
-        area += ( ( GHood.GetPixel( i ) * voxspc2 ) / locrefarea );
+        neighborhood.GetNeighbors( v, neighbors );
+        for( unsigned int k = 0; k < neighbors.size(); k++ )
+          {
+          area += ( ( inputBuffer[neighbors[k]] * voxspc2 ) / refarea );
+          }
         }
+      areaBuffer[v] = area;
       }
-    }
-    areaImage->SetPixel( ind, area );
-    ++GHood;
-    }
+    }, nullptr );
+
   WriteImage<ImageType>( areaImage, outname.c_str() );
   return 0;
 }
@@ -7831,25 +8403,31 @@ int PropagateLabelsThroughMask(int argc, char *argv[])
   typedef  itk::FMarchingImageFilter<ImageType, ImageType> FastMarchingFilterType;
   typedef  typename FastMarchingFilterType::LabelImageType LabelImageType;
   typename FastMarchingFilterType::Pointer  fastMarching;
-  for( unsigned int lab = 1; lab <= (unsigned int)maxlabel; lab++ )
-    {
 
-    typedef itk::BinaryThresholdImageFilter<ImageType, ImageType> ThresholderType;
-    typename ThresholderType::Pointer thresholder = ThresholderType::New();
-    thresholder->SetInput( labimage );
-    thresholder->SetLowerThreshold( lab );
-    thresholder->SetUpperThreshold( lab );
-    thresholder->SetInsideValue( 1 );
-    thresholder->SetOutsideValue( 0 );
+  // The face-connected contour of every label, which seeds its front, and the
+  // label interiors, which start alive, come from a single adjacency scan.
+  const LabelAdjacencyTable adjacency = ComputeLabelAdjacency<ImageType>( labimage, true, true );
+  std::vector<std::vector<unsigned long> > contourVoxels( (unsigned int)maxlabel + 1 );
+  std::vector<std::vector<unsigned long> > interiorVoxels( (unsigned int)maxlabel + 1 );
+  const PixelType * labelBuffer = labimage->GetBufferPointer();
+  for( unsigned long v = 0; v < adjacency.m_InterfaceCodes.size(); v++ )
+    {
+    const unsigned int labval = (unsigned int) labelBuffer[v];
+    if( labelBuffer[v] > 0 && labval >= 1 && labval <= (unsigned int)maxlabel )
+      {
+      if( adjacency.m_InterfaceCodes[v] != 0 )
+        {
+        contourVoxels[labval].push_back( v );
+        }
+      else
+        {
+        interiorVoxels[labval].push_back( v );
+        }
+      }
+    }
 
-    typedef itk::LabelContourImageFilter<ImageType, ImageType>
-      ContourFilterType;
-    typename ContourFilterType::Pointer contour = ContourFilterType::New();
-    contour->SetInput( thresholder->GetOutput() );
-    contour->FullyConnectedOff();
-    contour->SetBackgroundValue( itk::NumericTraits<typename LabelImageType::PixelType>::ZeroValue() );
-    contour->Update();
-    typename ImageType::Pointer contourimage = contour->GetOutput();
+  for( unsigned int lab = 1; lab <= (unsigned int)maxlabel; lab++ )
+    {
 
     fastMarching = FastMarchingFilterType::New();
     fastMarching->SetInput( speedimage );
@@ -7870,30 +8448,20 @@ int PropagateLabelsThroughMask(int argc, char *argv[])
     seeds->Initialize();
     typename NodeContainer::Pointer alivePoints = NodeContainer::New();
     alivePoints->Initialize();
-    unsigned long aliveCount = 0;
-    unsigned long ct = 0;
-    for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+    const double seedValue = 0.0;
+    for( unsigned long ct = 0; ct < contourVoxels[lab].size(); ct++ )
       {
-      double labval = labimage->GetPixel( vfIter2.GetIndex() );
-      double contourval = contourimage->GetPixel( vfIter2.GetIndex() );
-      if( ( (unsigned int) contourval == 1 ) && ( (unsigned int) labval == lab ) )
-        {
-	NodeType     node;
-	const double seedValue = 0.0;
-	node.SetValue( seedValue );
-	node.SetIndex( vfIter2.GetIndex() );
-	seeds->InsertElement( ct, node );
-	ct++;
-        }
-      if( ( (unsigned int) contourval == 0 ) && ( (unsigned int) labval == lab ) )
-        {
-	NodeType     node;
-	const double seedValue = 0.0;
-	node.SetValue( seedValue );
-	node.SetIndex( vfIter2.GetIndex() );
-	alivePoints->InsertElement( aliveCount, node );
-	aliveCount++;
-        }
+      NodeType node;
+      node.SetValue( seedValue );
+      node.SetIndex( labimage->ComputeIndex( contourVoxels[lab][ct] ) );
+      seeds->InsertElement( ct, node );
+      }
+    for( unsigned long aliveCount = 0; aliveCount < interiorVoxels[lab].size(); aliveCount++ )
+      {
+      NodeType node;
+      node.SetValue( seedValue );
+      node.SetIndex( labimage->ComputeIndex( interiorVoxels[lab][aliveCount] ) );
+      alivePoints->InsertElement( aliveCount, node );
       }
     fastMarching->SetTrialPoints(  seeds  );
     fastMarching->SetAlivePoints( alivePoints );
@@ -8082,6 +8650,12 @@ int itkPropagateLabelsThroughMask(int argc, char *argv[])
     {
     topocheck = std::stoi(argv[argct]);   argct++;
     }
+  // 0 marches each label in turn, N > 0 marches all labels at once in N blocks
+  unsigned int multilabelblocks = 0;
+  if(  argc > argct )
+    {
+    multilabelblocks = std::stoi(argv[argct]);   argct++;
+    }
 
   typename ImageType::Pointer speedimage = nullptr;
   ReadImage<ImageType>(speedimage, fn1.c_str() );
@@ -8092,6 +8666,49 @@ int itkPropagateLabelsThroughMask(int argc, char *argv[])
   typename ImageType::Pointer outlabimage = nullptr;
   ReadImage<ImageType>(outlabimage, fn2.c_str() );
   fastimage->FillBuffer(1.e9);
+
+  std::string::size_type idx;
+  idx = outname.find_first_of('.');
+  std::string tempname = outname.substr(0, idx);
+  std::string extension = outname.substr(idx, outname.length() );
+  std::string kname = tempname + std::string("_speed") + extension;
+  std::string lname = tempname + std::string("_label") + extension;
+
+  // the topology checks need the per-label marching below
+  if( multilabelblocks > 0 && topocheck == 0 )
+    {
+    std::vector<float>         arrivalTimes;
+    std::vector<unsigned long> labels;
+    std::vector<unsigned char> alive;
+    MultiLabelFastMarching<ImageType>( speedimage, labimage, stopval, thresh, multilabelblocks,
+                                       arrivalTimes, labels, alive );
+
+    typename ImageType::Pointer stateimage = AllocImage<ImageType>( speedimage, 0 );
+    const PixelType *           speed = speedimage->GetBufferPointer();
+    const PixelType *           label = labimage->GetBufferPointer();
+    PixelType *                 fast = fastimage->GetBufferPointer();
+    PixelType *                 outlab = outlabimage->GetBufferPointer();
+    PixelType *                 state = stateimage->GetBufferPointer();
+    const unsigned long         numberOfVoxels = speedimage->GetBufferedRegion().GetNumberOfPixels();
+    for( unsigned long v = 0; v < numberOfVoxels; v++ )
+      {
+      if( speed[v] < thresh )
+        {
+        outlab[v] = 0;
+        }
+      else if( label[v] == 0 && labels[v] > 0 )
+        {
+        fast[v] = arrivalTimes[v];
+        outlab[v] = labels[v];
+        }
+      // alive points as in the label image of the fast marching filter
+      state[v] = alive[v] ? 1 : 0;
+      }
+    WriteImage<ImageType>(fastimage, kname.c_str() );
+    WriteImage<ImageType>(outlabimage, outname.c_str() );
+    WriteImage<ImageType>(stateimage, lname.c_str() );
+    return 0;
+    }
   // compute max label
   double   maxlabel = 0;
   Iterator vfIter2( labimage,  labimage->GetLargestPossibleRegion() );
@@ -8118,27 +8735,32 @@ int itkPropagateLabelsThroughMask(int argc, char *argv[])
   CriterionPointer criterion = CriterionType::New();
   criterion->SetThreshold( stopval );
   typedef  itk::FastMarchingImageFilterBase<ImageType, ImageType> FastMarchingFilterType;
-  typedef  typename FastMarchingFilterType::LabelImageType LabelImageType;
   typename FastMarchingFilterType::Pointer  fastMarching;
-  for( unsigned int lab = 1; lab <= (unsigned int)maxlabel; lab++ )
-    {
 
-    typedef itk::BinaryThresholdImageFilter<ImageType, ImageType> ThresholderType;
-    typename ThresholderType::Pointer thresholder = ThresholderType::New();
-    thresholder->SetInput( labimage );
-    thresholder->SetLowerThreshold( lab );
-    thresholder->SetUpperThreshold( lab );
-    thresholder->SetInsideValue( 1 );
-    thresholder->SetOutsideValue( 0 );
+  // The face-connected contour of every label, which seeds its front, and the
+  // label interiors, which start alive, come from a single adjacency scan.
+  const LabelAdjacencyTable adjacency = ComputeLabelAdjacency<ImageType>( labimage, true, true );
+  std::vector<std::vector<unsigned long> > contourVoxels( (unsigned int)maxlabel + 1 );
+  std::vector<std::vector<unsigned long> > interiorVoxels( (unsigned int)maxlabel + 1 );
+  const PixelType * labelBuffer = labimage->GetBufferPointer();
+  for( unsigned long v = 0; v < adjacency.m_InterfaceCodes.size(); v++ )
+    {
+    const unsigned int labval = (unsigned int) labelBuffer[v];
+    if( labelBuffer[v] > 0 && labval >= 1 && labval <= (unsigned int)maxlabel )
+      {
+      if( adjacency.m_InterfaceCodes[v] != 0 )
+        {
+        contourVoxels[labval].push_back( v );
+        }
+      else
+        {
+        interiorVoxels[labval].push_back( v );
+        }
+      }
+    }
 
-    typedef itk::LabelContourImageFilter<ImageType, ImageType>
-      ContourFilterType;
-    typename ContourFilterType::Pointer contour = ContourFilterType::New();
-    contour->SetInput( thresholder->GetOutput() );
-    contour->FullyConnectedOff();
-    contour->SetBackgroundValue( itk::NumericTraits<typename LabelImageType::PixelType>::ZeroValue() );
-    contour->Update();
-    typename ImageType::Pointer contourimage = contour->GetOutput();
+  for( unsigned int lab = 1; lab <= (unsigned int)maxlabel; lab++ )
+    {
 
     fastMarching = FastMarchingFilterType::New();
     fastMarching->SetInput( speedimage );
@@ -8160,18 +8782,13 @@ int itkPropagateLabelsThroughMask(int argc, char *argv[])
     seeds->Initialize();
     typename NodeContainer::Pointer alivePoints = NodeContainer::New();
     alivePoints->Initialize();
-    for(  vfIter2.GoToBegin(); !vfIter2.IsAtEnd(); ++vfIter2 )
+    for( unsigned long ct = 0; ct < contourVoxels[lab].size(); ct++ )
       {
-      double labval = labimage->GetPixel( vfIter2.GetIndex() );
-      double contourval = contourimage->GetPixel( vfIter2.GetIndex() );
-      if( ( (unsigned int) contourval == 1 ) && ( (unsigned int) labval == lab ) )
-        {
-	seeds->push_back( NodePairType(  vfIter2.GetIndex(), 0. ) );
-        }
-      if( ( (unsigned int) contourval == 0 ) && ( (unsigned int) labval == lab ) )
-        {
-	alivePoints->push_back( NodePairType(  vfIter2.GetIndex(), 0. ) );
-        }
+      seeds->push_back( NodePairType( labimage->ComputeIndex( contourVoxels[lab][ct] ), 0. ) );
+      }
+    for( unsigned long ct = 0; ct < interiorVoxels[lab].size(); ct++ )
+      {
+      alivePoints->push_back( NodePairType( labimage->ComputeIndex( interiorVoxels[lab][ct] ), 0. ) );
       }
     fastMarching->SetTrialPoints(  seeds  );
     fastMarching->SetAlivePoints( alivePoints );
@@ -8201,12 +8818,6 @@ int itkPropagateLabelsThroughMask(int argc, char *argv[])
         }
       }
     }
-  std::string::size_type idx;
-  idx = outname.find_first_of('.');
-  std::string tempname = outname.substr(0, idx);
-  std::string extension = outname.substr(idx, outname.length() );
-  std::string kname = tempname + std::string("_speed") + extension;
-  std::string lname = tempname + std::string("_label") + extension;
   WriteImage<ImageType>(fastimage, kname.c_str() );
   WriteImage<ImageType>(outlabimage, outname.c_str() );
 
@@ -8919,37 +9530,41 @@ RemoveLabelInterfaces(int argc, char *argv[])
   typename ImageType::Pointer input = nullptr;
   ReadImage<ImageType>(input, fn1.c_str() );
 
-  typedef itk::NeighborhoodIterator<ImageType> iteratorType;
-  typename iteratorType::RadiusType rad;
-  for( unsigned int j = 0; j < ImageDimension; j++ )
-    {
-    rad[j] = 1;
-    }
-  iteratorType GHood(rad, input, input->GetLargestPossibleRegion() );
-
-  GHood.GoToBegin();
+  // Only voxels on an interface of the input can be removed.  They are removed
+  // in raster order, so a voxel stays if all of its differing neighbors that
+  // precede it have already been removed.
+  const LabelAdjacencyTable       adjacency = ComputeLabelAdjacency<ImageType>( input );
+  const LabelNeighborhood<ImageType> neighborhood( input, 1, 2.0 * ImageDimension );
 
-// std::cout << " foreg " << (int) foreground;
-  while( !GHood.IsAtEnd() )
+  PixelType *                buffer = input->GetBufferPointer();
+  const unsigned long        numberOfVoxels = adjacency.m_InterfaceCodes.size();
+  std::vector<unsigned char> removed( numberOfVoxels, 0 );
+  std::vector<unsigned long> neighbors;
+  for( unsigned long v = 0; v < numberOfVoxels; v++ )
     {
-    typename ImageType::PixelType p = GHood.GetCenterPixel();
-    typename ImageType::IndexType ind = GHood.GetIndex();
-    if( p > 0  )
+    if( adjacency.m_InterfaceCodes[v] == 0 )
       {
-      bool atedge = false;
-      for( unsigned int i = 0; i < GHood.Size(); i++ )
-        {
-        if( GHood.GetPixel(i) > 0 && GHood.GetPixel(i)  != p )
-          {
-          atedge = true;
-          }
-        }
-      if( atedge )
+      continue;
+      }
+    const PixelType p = buffer[v];
+    neighborhood.GetNeighbors( v, neighbors );
+    for( unsigned int k = 0; k < neighbors.size(); k++ )
+      {
+      const unsigned long n = neighbors[k];
+      const PixelType     q = ( n < v && removed[n] ) ? 0 : buffer[n];
+      if( q > 0 && q != p )
         {
-        input->SetPixel(ind, 0);
+        removed[v] = 1;
+        break;
         }
       }
-    ++GHood;
+    }
+  for( unsigned long v = 0; v < numberOfVoxels; v++ )
+    {
+    if( removed[v] )
+      {
+      buffer[v] = 0;
+      }
     }
 
   WriteImage<ImageType>(input, outname.c_str() );
@@ -9038,18 +9653,10 @@ EnumerateLabelInterfaces(int argc, char *argv[])
   ReadImage<ImageType>(colored, fn1.c_str() );
   colored->FillBuffer(0);
 
-  unsigned int max = 0;
+  const LabelAdjacencyTable adjacency = ComputeLabelAdjacency<ImageType>( input );
+
   Iterator     o_iter( input, input->GetLargestPossibleRegion() );
-  o_iter.GoToBegin();
-  while( !o_iter.IsAtEnd() )
-    {
-    unsigned int label = (unsigned int) o_iter.Get();
-    if( label > max )
-      {
-      max = label;
-      }
-    ++o_iter;
-    }
+  unsigned int max = adjacency.m_MaximumLabel;
 
   // std::cout << " Max Label " << max << std::endl;
   typedef itk::Image<float, 2> myInterfaceImageType;
@@ -9073,54 +9680,24 @@ EnumerateLabelInterfaces(int argc, char *argv[])
 
 // we can use this to compute a 4-coloring of the brain
 
-  typedef itk::NeighborhoodIterator<ImageType> iteratorType;
-  typename iteratorType::RadiusType rad;
-  for( unsigned int j = 0; j < ImageDimension; j++ )
+  // every (voxel, neighbor) pair with labels (a,b) counts at (a,b) and (b,a)
+  for( std::map<LabelAdjacencyTable::LabelPairType, unsigned long>::const_iterator it =
+         adjacency.m_PairCounts.begin(); it != adjacency.m_PairCounts.end(); ++it )
     {
-    rad[j] = 1;
+    typename myInterfaceImageType::IndexType inda, indb;
+    inda[0] = it->first.first;  inda[1] = it->first.second;
+    indb[1] = it->first.first;  indb[0] = it->first.second;
+    faceimage->SetPixel(inda, faceimage->GetPixel(inda) + it->second);
+    faceimage->SetPixel(indb, faceimage->GetPixel(indb) + it->second);
     }
-  iteratorType GHood(rad, input, input->GetLargestPossibleRegion() );
-
-  GHood.GoToBegin();
 
-// std::cout << " foreg " << (int) foreground;
-  while( !GHood.IsAtEnd() )
+  PixelType * outputBuffer = output->GetBufferPointer();
+  for( unsigned long v = 0; v < adjacency.m_InterfaceCodes.size(); v++ )
     {
-    const typename ImageType::PixelType & p = GHood.GetCenterPixel();
-    if( p > 0  )
+    if( adjacency.m_InterfaceCodes[v] != 0 )
       {
-      bool atedge = false;
-
-      unsigned long linearinda = 0, linearindb = 0, linearind = 0;
-      for( unsigned int i = 0; i < GHood.Size(); i++ )
-        {
-        if( GHood.GetPixel(i) > 0 && GHood.GetPixel(i)  != p )
-          {
-          atedge = true;
-          typename myInterfaceImageType::IndexType inda, indb;
-          inda[0] = (long int)p;  inda[1] = (long int)GHood.GetPixel(i);
-          indb[1] = (long int)p;  indb[0] = (long int)GHood.GetPixel(i);
-          faceimage->SetPixel(inda, faceimage->GetPixel(inda) + 1);
-          faceimage->SetPixel(indb, faceimage->GetPixel(indb) + 1);
-          linearinda = inda[1] * size[0] + inda[0];
-          linearindb = indb[1] * size[0] + indb[0];
-          if( linearinda < linearindb )
-            {
-            linearind = linearinda;
-            }
-          else
-            {
-            linearind = linearindb;
-            }
-          }
-        }
-      if( atedge )
-        {
-        const typename ImageType::IndexType & ind = GHood.GetIndex();
-        output->SetPixel(ind, linearind);
-        }
+      outputBuffer[v] = adjacency.m_InterfaceCodes[v];
       }
-    ++GHood;
     }
 
 // first normalize the interfaces
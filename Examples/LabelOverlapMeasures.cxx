@@ -2,10 +2,19 @@
 #include "itkCSVArray2DFileReader.h"
 #include "itkCSVNumericObjectFileWriter.h"
 #include "itkImage.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkImageRegionIterator.h"
 #include "itkLabelOverlapMeasuresImageFilter.h"
+#include "itkMultiThreaderBase.h"
+#include "itkPlatformMultiThreader.h"
+#include "itkSignedMaurerDistanceMapImageFilter.h"
 
 #include <algorithm>
+#include <cmath>
 #include <iomanip>
+#include <limits>
+#include <map>
 #include <vector>
 
 #include "antsUtilities.h"
@@ -14,6 +23,448 @@
 namespace ants
 {
 
+// Per-label tallies of the fast mode.  Each work unit of the scan fills its
+// own table, and the tables are merged in work-unit order afterwards.
+template <unsigned int ImageDimension>
+struct FastLabelTally
+{
+  typedef itk::Index<ImageDimension> IndexType;
+
+  FastLabelTally() : m_SourceCount( 0 ), m_TargetCount( 0 ), m_IntersectionCount( 0 )
+  {
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      m_SourceIndexSum[d] = 0.0;
+      m_SourceLower[d] = m_Lower[d] = std::numeric_limits<itk::IndexValueType>::max();
+      m_SourceUpper[d] = m_Upper[d] = std::numeric_limits<itk::IndexValueType>::min();
+      }
+  }
+
+  void AddSource( const IndexType & index )
+  {
+    ++m_SourceCount;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      m_SourceIndexSum[d] += index[d];
+      m_SourceLower[d] = std::min( m_SourceLower[d], index[d] );
+      m_SourceUpper[d] = std::max( m_SourceUpper[d], index[d] );
+      }
+    this->Expand( index );
+  }
+
+  void AddTarget( const IndexType & index )
+  {
+    ++m_TargetCount;
+    this->Expand( index );
+  }
+
+  void Merge( const FastLabelTally & other )
+  {
+    m_SourceCount += other.m_SourceCount;
+    m_TargetCount += other.m_TargetCount;
+    m_IntersectionCount += other.m_IntersectionCount;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      m_SourceIndexSum[d] += other.m_SourceIndexSum[d];
+      m_SourceLower[d] = std::min( m_SourceLower[d], other.m_SourceLower[d] );
+      m_SourceUpper[d] = std::max( m_SourceUpper[d], other.m_SourceUpper[d] );
+      m_Lower[d] = std::min( m_Lower[d], other.m_Lower[d] );
+      m_Upper[d] = std::max( m_Upper[d], other.m_Upper[d] );
+      }
+  }
+
+  void Expand( const IndexType & index )
+  {
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      m_Lower[d] = std::min( m_Lower[d], index[d] );
+      m_Upper[d] = std::max( m_Upper[d], index[d] );
+      }
+  }
+
+  unsigned long m_SourceCount;
+  unsigned long m_TargetCount;
+  unsigned long m_IntersectionCount;
+  double        m_SourceIndexSum[ImageDimension];
+  IndexType     m_SourceLower;   // bounding box of the source label
+  IndexType     m_SourceUpper;
+  IndexType     m_Lower;         // bounding box of the source and target labels together
+  IndexType     m_Upper;
+};
+
+// Tally every nonzero label of both images in one parallel scan over slabs of
+// the last axis.
+template <typename TImage>
+void ScanLabelTallies( const TImage * sourceImage, const TImage * targetImage,
+                       std::map<typename TImage::PixelType, FastLabelTally<TImage::ImageDimension> > & tallies )
+{
+  typedef typename TImage::PixelType                               LabelType;
+  typedef FastLabelTally<TImage::ImageDimension>                   TallyType;
+  typedef std::map<LabelType, TallyType>                           TallyMapType;
+  typedef typename TImage::RegionType                              RegionType;
+
+  const unsigned int splitAxis = TImage::ImageDimension - 1;
+  const RegionType   region = sourceImage->GetLargestPossibleRegion();
+  const itk::SizeValueType numberOfSlices = region.GetSize()[splitAxis];
+  const itk::SizeValueType numberOfWorkUnits = std::max( static_cast<itk::SizeValueType>( 1 ),
+    std::min( numberOfSlices, static_cast<itk::SizeValueType>(
+      itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads() ) ) );
+
+  std::vector<TallyMapType> partialTallies( numberOfWorkUnits );
+
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, numberOfWorkUnits,
+    [&]( itk::SizeValueType w )
+      {
+      const itk::SizeValueType firstSlice = w * numberOfSlices / numberOfWorkUnits;
+      const itk::SizeValueType lastSlice = ( w + 1 ) * numberOfSlices / numberOfWorkUnits;
+      if( lastSlice == firstSlice )
+        {
+        return;
+        }
+      RegionType slab = region;
+      slab.SetIndex( splitAxis, region.GetIndex()[splitAxis] + static_cast<itk::IndexValueType>( firstSlice ) );
+      slab.SetSize( splitAxis, lastSlice - firstSlice );
+
+      TallyMapType & table = partialTallies[w];
+      // labels come in runs, so remember the last table entry of each image
+      LabelType   lastSourceLabel = 0;
+      TallyType * lastSourceTally = nullptr;
+      LabelType   lastTargetLabel = 0;
+      TallyType * lastTargetTally = nullptr;
+
+      itk::ImageRegionConstIteratorWithIndex<TImage> ItS( sourceImage, slab );
+      itk::ImageRegionConstIterator<TImage>          ItT( targetImage, slab );
+      for( ItS.GoToBegin(), ItT.GoToBegin(); !ItS.IsAtEnd(); ++ItS, ++ItT )
+        {
+        const LabelType sourceLabel = ItS.Get();
+        const LabelType targetLabel = ItT.Get();
+        if( sourceLabel != 0 )
+          {
+          if( lastSourceTally == nullptr || sourceLabel != lastSourceLabel )
+            {
+            lastSourceTally = &table[sourceLabel];
+            lastSourceLabel = sourceLabel;
+            }
+          lastSourceTally->AddSource( ItS.GetIndex() );
+          if( targetLabel == sourceLabel )
+            {
+            ++lastSourceTally->m_IntersectionCount;
+            }
+          }
+        if( targetLabel != 0 )
+          {
+          if( lastTargetTally == nullptr || targetLabel != lastTargetLabel )
+            {
+            lastTargetTally = &table[targetLabel];
+            lastTargetLabel = targetLabel;
+            }
+          lastTargetTally->AddTarget( ItS.GetIndex() );
+          }
+        }
+      },
+    nullptr );
+
+  tallies.clear();
+  for( itk::SizeValueType w = 0; w < numberOfWorkUnits; w++ )
+    {
+    for( typename TallyMapType::const_iterator it = partialTallies[w].begin(); it != partialTallies[w].end(); ++it )
+      {
+      tallies[it->first].Merge( it->second );
+      }
+    }
+}
+
+// Surface distances (in physical units) between one label of the source and
+// target images.  Only the bounding box of the label in either image, padded
+// by a voxel, is considered, which contains every surface voxel of both.
+template <typename TImage>
+void ComputeLabelSurfaceDistances( const TImage * sourceImage, const TImage * targetImage,
+                                   typename TImage::PixelType label,
+                                   const FastLabelTally<TImage::ImageDimension> & tally,
+                                   double & meanDistance, double & hausdorffDistance )
+{
+  typedef typename TImage::RegionType                          RegionType;
+  typedef itk::Image<unsigned char, TImage::ImageDimension>    MaskImageType;
+  typedef itk::Image<float, TImage::ImageDimension>            DistanceImageType;
+  typedef itk::SignedMaurerDistanceMapImageFilter<MaskImageType, DistanceImageType> DistanceFilterType;
+
+  meanDistance = std::numeric_limits<double>::quiet_NaN();
+  hausdorffDistance = std::numeric_limits<double>::quiet_NaN();
+  if( tally.m_SourceCount == 0 || tally.m_TargetCount == 0 )
+    {
+    return;
+    }
+
+  const RegionType imageRegion = sourceImage->GetLargestPossibleRegion();
+  RegionType       region;
+  for( unsigned int d = 0; d < TImage::ImageDimension; d++ )
+    {
+    region.SetIndex( d, tally.m_Lower[d] - 1 );
+    region.SetSize( d, tally.m_Upper[d] - tally.m_Lower[d] + 3 );
+    }
+  region.Crop( imageRegion );
+
+  // distance to the surface of each label, measured within the crop
+  typename DistanceImageType::Pointer distanceMaps[2];
+  const TImage *                      labelImages[2] = { sourceImage, targetImage };
+  for( unsigned int n = 0; n < 2; n++ )
+    {
+    typename MaskImageType::Pointer mask = AllocImage<MaskImageType>( region, sourceImage->GetSpacing(),
+      sourceImage->GetOrigin(), sourceImage->GetDirection(), 0 );
+    itk::ImageRegionConstIterator<TImage>  ItL( labelImages[n], region );
+    itk::ImageRegionIterator<MaskImageType> ItM( mask, region );
+    for( ItL.GoToBegin(), ItM.GoToBegin(); !ItL.IsAtEnd(); ++ItL, ++ItM )
+      {
+      if( ItL.Get() == label )
+        {
+        ItM.Set( 1 );
+        }
+      }
+
+    typename DistanceFilterType::Pointer distance = DistanceFilterType::New();
+    distance->SetInput( mask );
+    distance->SetSquaredDistance( false );
+    distance->SetUseImageSpacing( true );
+    distance->SetInsideIsPositive( false );
+    distance->SetNumberOfWorkUnits( 1 );
+    distance->Update();
+    distanceMaps[n] = distance->GetOutput();
+    }
+
+  // each surface voxel of one label looks up its distance to the other surface
+  double        sumDistance = 0.0;
+  unsigned long numberOfSurfaceVoxels = 0;
+  hausdorffDistance = 0.0;
+  for( unsigned int n = 0; n < 2; n++ )
+    {
+    const TImage *                                  labelImage = labelImages[n];
+    const DistanceImageType *                       otherDistance = distanceMaps[1 - n];
+    itk::ImageRegionConstIteratorWithIndex<TImage> ItL( labelImage, region );
+    for( ItL.GoToBegin(); !ItL.IsAtEnd(); ++ItL )
+      {
+      if( ItL.Get() != label )
+        {
+        continue;
+        }
+      const typename TImage::IndexType index = ItL.GetIndex();
+      bool                             isSurface = false;
+      for( unsigned int d = 0; d < TImage::ImageDimension && !isSurface; d++ )
+        {
+        for( int offset = -1; offset <= 1 && !isSurface; offset += 2 )
+          {
+          typename TImage::IndexType neighbor = index;
+          neighbor[d] += offset;
+          isSurface = !imageRegion.IsInside( neighbor ) || labelImage->GetPixel( neighbor ) != label;
+          }
+        }
+      if( isSurface )
+        {
+        const double surfaceDistance = std::fabs( otherDistance->GetPixel( index ) );
+        sumDistance += surfaceDistance;
+        hausdorffDistance = std::max( hausdorffDistance, surfaceDistance );
+        ++numberOfSurfaceVoxels;
+        }
+      }
+    }
+  meanDistance = sumDistance / static_cast<double>( numberOfSurfaceVoxels );
+}
+
+// Fast mode:  every source/target pair is scanned once for all labels and
+// the rows of all pairs go to a single csv file.
+template <unsigned int ImageDimension>
+int LabelOverlapMeasuresFast( int argc, char * argv[] )
+{
+  if( argc < 6 || ( argc - 4 ) % 2 != 0 )
+    {
+    std::cerr << "The fast mode needs an output csv file and pairs of source and target images." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  typedef unsigned int                                   PixelType;
+  typedef itk::Image<PixelType, ImageDimension>          ImageType;
+  typedef FastLabelTally<ImageDimension>                 TallyType;
+  typedef std::map<PixelType, TallyType>                 TallyMapType;
+
+  const char axisNames[] = { 'x', 'y', 'z' };
+
+  std::vector<std::string> columnHeaders;
+  columnHeaders.emplace_back( "Source" );
+  columnHeaders.emplace_back( "Label" );
+  columnHeaders.emplace_back( "SourceVolumeInVoxels" );
+  columnHeaders.emplace_back( "TargetVolumeInVoxels" );
+  columnHeaders.emplace_back( "SourceVolume" );
+  columnHeaders.emplace_back( "Jaccard" );
+  columnHeaders.emplace_back( "Dice" );
+  columnHeaders.emplace_back( "VolumeSimilarity" );
+  columnHeaders.emplace_back( "FalseNegative" );
+  columnHeaders.emplace_back( "FalsePositive" );
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    columnHeaders.push_back( std::string( "Centroid_" ) + axisNames[d] );
+    }
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    columnHeaders.push_back( std::string( "BoundingBoxLower_" ) + axisNames[d] );
+    }
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    columnHeaders.push_back( std::string( "BoundingBoxUpper_" ) + axisNames[d] );
+    }
+  columnHeaders.emplace_back( "MeanSurfaceDistance" );
+  columnHeaders.emplace_back( "HausdorffDistance" );
+  const unsigned int numberOfColumns = columnHeaders.size() - 1;
+
+  std::vector<std::string>          rowHeaders;
+  std::vector<std::vector<double> > rows;
+
+  // the distance filters are ITK filters themselves, so the labels are
+  // spread over dedicated threads rather than the global pool
+  const unsigned int numberOfWorkers = std::max( 1u, static_cast<unsigned int>(
+                                                   itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads() ) );
+  itk::PlatformMultiThreader::Pointer workers = itk::PlatformMultiThreader::New();
+  workers->SetNumberOfWorkUnits( numberOfWorkers );
+
+  for( int n = 4; n < argc; n += 2 )
+    {
+    typename ImageType::Pointer sourceImage = ImageType::New();
+    typename ImageType::Pointer targetImage = ImageType::New();
+    if( !ReadImage<ImageType>( sourceImage, argv[n] ) || !ReadImage<ImageType>( targetImage, argv[n + 1] ) )
+      {
+      std::cerr << "Unable to read " << argv[n] << " or " << argv[n + 1] << "." << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    if( sourceImage->GetLargestPossibleRegion() != targetImage->GetLargestPossibleRegion() )
+      {
+      std::cerr << "The images " << argv[n] << " and " << argv[n + 1]
+                << " do not have the same size." << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    // the same physical space check the filter applies to its inputs
+    const double coordinateTolerance = 1.0e-6 * sourceImage->GetSpacing()[0];
+    const double directionTolerance = 1.0e-6;
+    bool         samePhysicalSpace = true;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      if( std::fabs( sourceImage->GetSpacing()[d] - targetImage->GetSpacing()[d] ) > coordinateTolerance ||
+          std::fabs( sourceImage->GetOrigin()[d] - targetImage->GetOrigin()[d] ) > coordinateTolerance )
+        {
+        samePhysicalSpace = false;
+        }
+      for( unsigned int e = 0; e < ImageDimension; e++ )
+        {
+        if( std::fabs( sourceImage->GetDirection()( d, e ) - targetImage->GetDirection()( d, e ) ) >
+            directionTolerance )
+          {
+          samePhysicalSpace = false;
+          }
+        }
+      }
+    if( !samePhysicalSpace )
+      {
+      std::cerr << "The images " << argv[n] << " and " << argv[n + 1]
+                << " do not occupy the same physical space." << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    TallyMapType tallies;
+    ScanLabelTallies<ImageType>( sourceImage, targetImage, tallies );
+
+    std::vector<PixelType>         labels;
+    std::vector<const TallyType *> labelTallies;
+    for( typename TallyMapType::const_iterator it = tallies.begin(); it != tallies.end(); ++it )
+      {
+      labels.push_back( it->first );
+      labelTallies.push_back( &( it->second ) );
+      }
+
+    std::vector<double> meanDistances( labels.size() );
+    std::vector<double> hausdorffDistances( labels.size() );
+    workers->ParallelizeArray( 0, labels.size(),
+      [&]( itk::SizeValueType l )
+        {
+        ComputeLabelSurfaceDistances<ImageType>( sourceImage, targetImage, labels[l], *labelTallies[l],
+                                                 meanDistances[l], hausdorffDistances[l] );
+        },
+      nullptr );
+
+    double voxelVolume = 1.0;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      voxelVolume *= sourceImage->GetSpacing()[d];
+      }
+
+    for( unsigned int l = 0; l < labels.size(); l++ )
+      {
+      const TallyType & tally = *labelTallies[l];
+      const double      source = tally.m_SourceCount;
+      const double      target = tally.m_TargetCount;
+      const double      intersection = tally.m_IntersectionCount;
+      const double      nan = std::numeric_limits<double>::quiet_NaN();
+
+      std::vector<double> row;
+      row.reserve( numberOfColumns );
+      row.push_back( labels[l] );
+      row.push_back( source );
+      row.push_back( target );
+      row.push_back( source * voxelVolume );
+      row.push_back( intersection / ( source + target - intersection ) );
+      row.push_back( 2.0 * intersection / ( source + target ) );
+      row.push_back( 2.0 * ( source - target ) / ( source + target ) );
+      row.push_back( target > 0 ? ( target - intersection ) / target : nan );
+      row.push_back( source > 0 ? ( source - intersection ) / source : nan );
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        row.push_back( source > 0 ? tally.m_SourceIndexSum[d] / source : nan );
+        }
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        row.push_back( source > 0 ? static_cast<double>( tally.m_SourceLower[d] ) : nan );
+        }
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        row.push_back( source > 0 ? static_cast<double>( tally.m_SourceUpper[d] ) : nan );
+        }
+      row.push_back( meanDistances[l] );
+      row.push_back( hausdorffDistances[l] );
+
+      rowHeaders.emplace_back( argv[n] );
+      rows.push_back( row );
+      }
+    std::cout << argv[n] << " : " << labels.size() << " labels" << std::endl;
+    }
+
+  vnl_matrix<double> measures( rows.size(), numberOfColumns );
+  for( unsigned int i = 0; i < rows.size(); i++ )
+    {
+    for( unsigned int j = 0; j < numberOfColumns; j++ )
+      {
+      measures( i, j ) = rows[i][j];
+      }
+    }
+
+  typedef itk::CSVNumericObjectFileWriter<double, 1, 1> WriterType;
+  WriterType::Pointer writer = WriterType::New();
+  writer->SetFileName( argv[3] );
+  writer->SetColumnHeaders( columnHeaders );
+  writer->SetRowHeaders( rowHeaders );
+  writer->SetInput( &measures );
+  try
+    {
+    writer->Write();
+    }
+  catch( itk::ExceptionObject& exp )
+    {
+    std::cerr << "Exception caught!" << std::endl;
+    std::cerr << exp << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
 template <unsigned int ImageDimension>
 int LabelOverlapMeasures( int argc, char * argv[] )
 {
@@ -223,6 +674,11 @@ private:
     {
     std::cout << "Usage: " << argv[0] << " imageDimension sourceImage "
               << "targetImage [outputCSVFile]" << std::endl;
+    std::cout << "       " << argv[0] << " imageDimension --fast outputCSVFile "
+              << "sourceImage1 targetImage1 [sourceImage2 targetImage2 ...]" << std::endl;
+    std::cout << "  The fast mode scans each image pair once and writes, for every label of every pair, "
+              << "the volumes, overlap measures, source centroid and bounding box (index space) and the "
+              << "mean and Hausdorff surface distances (physical space) to one csv file." << std::endl;
     if( argc >= 2 &&
         ( std::string( argv[1] ) == std::string("--help") || std::string( argv[1] ) == std::string("-h") ) )
       {
@@ -231,16 +687,18 @@ private:
     return EXIT_FAILURE;
     }
 
+  const bool fastMode = ( std::string( argv[2] ) == std::string( "--fast" ) );
+
   switch( std::stoi( argv[1] ) )
     {
     case 2:
       {
-      return LabelOverlapMeasures<2>( argc, argv );
+      return fastMode ? LabelOverlapMeasuresFast<2>( argc, argv ) : LabelOverlapMeasures<2>( argc, argv );
       }
       break;
     case 3:
       {
-      return LabelOverlapMeasures<3>( argc, argv );
+      return fastMode ? LabelOverlapMeasuresFast<3>( argc, argv ) : LabelOverlapMeasures<3>( argc, argv );
       }
       break;
     default:
@@ -1,6 +1,7 @@
 #include "antsUtilities.h"
 #include "antsAllocImage.h"
 #include <algorithm>
+#include <atomic>
 
 #include "itkDanielssonDistanceMapImageFilter.h"
 #include "itkDiscreteGaussianImageFilter.h"
@@ -9,6 +10,7 @@
 #include "itkImageFileWriter.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkLaplacianRecursiveGaussianImageFilter.h"
+#include "itkMultiThreaderBase.h"
 #include "itkRescaleIntensityImageFilter.h"
 #include "itkVectorCurvatureAnisotropicDiffusionImageFilter.h"
 #include "itkVectorIndexSelectionCastImageFilter.h"
@@ -608,6 +610,192 @@ float IntegrateLength( typename TImage::Pointer /* gmsurf */,  typename TImage::
   return totalmag;
 }
 
+/**
+ * Eulerian thickness after Yezzi and Prince: rather than tracing a streamline
+ * from every gray matter voxel, solve the upwind transport equations
+ *   grad(L0) . T = 1  with L0 = 0 on white matter,
+ *  -grad(L1) . T = 1  with L1 = 0 outside the gray matter,
+ * where T is the normalized Laplacian gradient, and report L0 + L1.  The
+ * discretized equations are relaxed with parallel Jacobi sweeps over the gray
+ * matter voxels until the largest update falls below a fraction of a voxel.
+ */
+template <typename TImage, typename TField>
+typename TImage::Pointer
+EulerianThickness( typename TImage::Pointer wm, typename TImage::Pointer gm,
+                   typename TField::Pointer lapgrad, float priorthickval )
+{
+  typedef TImage                                ImageType;
+  typedef typename ImageType::IndexType         IndexType;
+  typedef typename ImageType::OffsetValueType   OffsetValueType;
+  typedef typename TField::PixelType            VectorType;
+  enum { ImageDimension = ImageType::ImageDimension };
+
+  typename ImageType::Pointer thickness = AllocImage<ImageType>(wm, 0);
+
+  const typename ImageType::RegionType region = wm->GetLargestPossibleRegion();
+  const typename ImageType::SizeType   size = region.GetSize();
+  const typename ImageType::SpacingType spacing = wm->GetSpacing();
+  const OffsetValueType * offsetTable = wm->GetOffsetTable();
+  const itk::SizeValueType numberOfVoxels = region.GetNumberOfPixels();
+
+  // 0 = white matter (L0 = 0), 1 = gray matter (solved), 2 = outside (L1 = 0),
+  // with the same thresholds at which LaplacianGrad pins the potential
+  std::vector<unsigned char> label( numberOfVoxels, 2 );
+  for( itk::SizeValueType v = 0; v < numberOfVoxels; v++ )
+    {
+    const IndexType ind = wm->ComputeIndex( v );
+    if( wm->GetPixel( ind ) >= 0.5 )
+      {
+      label[v] = 0;
+      }
+    else if( gm->GetPixel( ind ) >= 0.5 )
+      {
+      label[v] = 1;
+      }
+    }
+
+  // per gray matter voxel, the upwind neighbor of each equation along every
+  // axis (or -1 when that term is dropped) and the weight |T_d| / h_d
+  std::vector<itk::SizeValueType> gmVoxels;
+  std::vector<OffsetValueType>    inner;
+  std::vector<OffsetValueType>    outer;
+  std::vector<float>              weights;
+  itk::SizeValueType              numberOfUnsolvedVoxels = 0;
+  for( itk::SizeValueType v = 0; v < numberOfVoxels; v++ )
+    {
+    if( label[v] != 1 )
+      {
+      continue;
+      }
+    const IndexType ind = wm->ComputeIndex( v );
+    VectorType      tangent = lapgrad->GetPixel( ind );
+    const float     mag = tangent.GetNorm();
+    if( mag > 0 )
+      {
+      tangent = tangent / mag;
+      }
+    else
+      {
+      // no direction to transport along, so the thickness stays 0
+      numberOfUnsolvedVoxels++;
+      }
+    gmVoxels.push_back( v );
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      const OffsetValueType step = ( tangent[d] < 0 ) ? -1 : 1;
+      OffsetValueType       inwards = -1;
+      OffsetValueType       outwards = -1;
+      if( tangent[d] != 0 )
+        {
+        const OffsetValueType back = ind[d] - step;
+        const OffsetValueType front = ind[d] + step;
+        if( back >= region.GetIndex()[d] && back < region.GetIndex()[d] + static_cast<OffsetValueType>( size[d] ) )
+          {
+          inwards = static_cast<OffsetValueType>( v ) - step * offsetTable[d];
+          if( label[inwards] == 2 )
+            {
+            inwards = -1;
+            }
+          }
+        if( front >= region.GetIndex()[d] && front < region.GetIndex()[d] + static_cast<OffsetValueType>( size[d] ) )
+          {
+          outwards = static_cast<OffsetValueType>( v ) + step * offsetTable[d];
+          if( label[outwards] == 0 )
+            {
+            outwards = -1;
+            }
+          }
+        }
+      inner.push_back( inwards );
+      outer.push_back( outwards );
+      weights.push_back( std::fabs( tangent[d] ) / spacing[d] );
+      }
+    }
+
+  if( numberOfUnsolvedVoxels > 0 )
+    {
+    std::cout << " eulerian solver: " << numberOfUnsolvedVoxels << " of " << gmVoxels.size()
+              << " gray matter voxels have a zero Laplacian gradient and get thickness 0 " << std::endl;
+    }
+
+  float minSpacing = spacing[0];
+  unsigned long maxIterations = 0;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    minSpacing = std::min( minSpacing, static_cast<float>( spacing[d] ) );
+    maxIterations += 2 * size[d];
+    }
+  const float convergence = 1.e-3 * minSpacing;
+
+  std::vector<float> L0( numberOfVoxels, 0 );
+  std::vector<float> L1( numberOfVoxels, 0 );
+  std::vector<float> nextL0( L0 );
+  std::vector<float> nextL1( L1 );
+
+  const itk::SizeValueType blockSize = 4096;
+  const itk::SizeValueType numberOfBlocks = ( gmVoxels.size() + blockSize - 1 ) / blockSize;
+  std::vector<float>       blockDelta( numberOfBlocks, 0 );
+
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  float                           delta = convergence + 1;
+  unsigned long                   iterations = 0;
+  while( delta > convergence && iterations < maxIterations )
+    {
+    threader->ParallelizeArray( 0, numberOfBlocks,
+      [&]( itk::SizeValueType block )
+        {
+        const itk::SizeValueType last = std::min( static_cast<itk::SizeValueType>( gmVoxels.size() ),
+                                                  ( block + 1 ) * blockSize );
+        float maxDelta = 0;
+        for( itk::SizeValueType n = block * blockSize; n < last; n++ )
+          {
+          const itk::SizeValueType v = gmVoxels[n];
+          float num0 = 1, den0 = 0, num1 = 1, den1 = 0;
+          for( unsigned int d = 0; d < ImageDimension; d++ )
+            {
+            const float w = weights[n * ImageDimension + d];
+            const OffsetValueType in = inner[n * ImageDimension + d];
+            const OffsetValueType out = outer[n * ImageDimension + d];
+            if( in >= 0 )
+              {
+              num0 += w * L0[in];  den0 += w;
+              }
+            if( out >= 0 )
+              {
+              num1 += w * L1[out];  den1 += w;
+              }
+            }
+          nextL0[v] = ( den0 > 0 ) ? std::min( num0 / den0, priorthickval ) : 0;
+          nextL1[v] = ( den1 > 0 ) ? std::min( num1 / den1, priorthickval ) : 0;
+          maxDelta = std::max( maxDelta, std::fabs( nextL0[v] - L0[v] ) );
+          maxDelta = std::max( maxDelta, std::fabs( nextL1[v] - L1[v] ) );
+          }
+        blockDelta[block] = maxDelta;
+        },
+      nullptr );
+    L0.swap( nextL0 );
+    L1.swap( nextL1 );
+    delta = 0;
+    for( itk::SizeValueType block = 0; block < numberOfBlocks; block++ )
+      {
+      delta = std::max( delta, blockDelta[block] );
+      }
+    iterations++;
+    if( iterations % 10 == 0 )
+      {
+      std::cout << "  eulerian iteration " << iterations << " max-delta " << delta << std::endl;
+      }
+    }
+  std::cout << " eulerian solver finished after " << iterations << " iterations " << std::endl;
+
+  for( itk::SizeValueType n = 0; n < gmVoxels.size(); n++ )
+    {
+    const itk::SizeValueType v = gmVoxels[n];
+    thickness->SetPixel( wm->ComputeIndex( v ), std::min( L0[v] + L1[v], priorthickval ) );
+    }
+  return thickness;
+}
+
 template <unsigned int ImageDimension>
 int LaplacianThickness(int argc, char *argv[])
 {
@@ -648,6 +836,12 @@ int LaplacianThickness(int argc, char *argv[])
     tolerance = atof(argv[argct]);
     }
   argct++;
+  bool eulerian = false;
+  if( argc >  argct )
+    {
+    eulerian = ( atoi(argv[argct]) > 0 );
+    }
+  argct++;
   std::cout << " using tolerance " << tolerance << std::endl;
   typedef float                                      PixelType;
   typedef itk::Vector<float, ImageDimension>         VectorType;
@@ -741,6 +935,20 @@ int LaplacianThickness(int argc, char *argv[])
   lapgrad = LaplacianGrad<ImageType, DisplacementFieldType>(wmb, gmb, smoothparam, 500, tolerance);
   //  lapgrad=FMMGrad<ImageType,DisplacementFieldType>(wmb,gmb);
 
+  if( eulerian )
+    {
+    std::cout << " solving the Eulerian thickness equations " << std::endl;
+    if( lapgrad2 )
+      {
+      std::cout << " the sulcus prior is not used by the Eulerian solver " << std::endl;
+      }
+    typename ImageType::Pointer eulerthick =
+      EulerianThickness<ImageType, DisplacementFieldType>(wm, gm, lapgrad, priorthickval);
+    std::cout << " writing " << outname << std::endl;
+    WriteImage<ImageType>(eulerthick, outname.c_str() );
+    return EXIT_SUCCESS;
+    }
+
   //  LabelSurface(typename TImage::PixelType foreground,
   //       typename TImage::PixelType newval, typename TImage::Pointer input, float distthresh )
   float distthresh = 1.9;
@@ -760,7 +968,6 @@ int LaplacianThickness(int argc, char *argv[])
   float finishtime = timeone; // s[ImageDimension]-1;//timeone;
   // std::cout << " MUCKING WITH START FINISH TIME " <<  finishtime <<  std::endl;
 
-  typename DisplacementFieldType::IndexType velind;
   typename ImageType::Pointer smooththick = nullptr;
   float timesign = 1.0;
   if( starttime  >  finishtime )
@@ -770,7 +977,6 @@ int LaplacianThickness(int argc, char *argv[])
   unsigned int m_NumberOfTimePoints = 2;
   typedef   DisplacementFieldType                                                        TimeVaryingVelocityFieldType;
   typedef itk::VectorLinearInterpolateImageFunction<TimeVaryingVelocityFieldType, float> DefaultInterpolatorType;
-  typename DefaultInterpolatorType::Pointer vinterp =  DefaultInterpolatorType::New();
   typedef itk::LinearInterpolateImageFunction<ImageType, float> ScalarInterpolatorType;
   typename ScalarInterpolatorType::Pointer sinterp =  ScalarInterpolatorType::New();
   sinterp->SetInputImage(gm);
@@ -817,100 +1023,128 @@ int LaplacianThickness(int argc, char *argv[])
     }
 
   bool propagate = false;
+  // each work unit owns its interpolators and only writes the thickness of the
+  // voxels it integrates, so the streamlines can be traced concurrently
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  const unsigned int              numberOfWorkUnits = threader->GetNumberOfWorkUnits();
+  const itk::SizeValueType        numberOfVoxels = thickimage2->GetLargestPossibleRegion().GetNumberOfPixels();
+  const itk::SizeValueType        blockSize = 256;
+  std::vector<typename DefaultInterpolatorType::Pointer> vinterps( numberOfWorkUnits );
+  std::vector<typename DefaultInterpolatorType::Pointer> vinterps2( numberOfWorkUnits );
+  for( unsigned int w = 0; w < numberOfWorkUnits; w++ )
+    {
+    vinterps[w] = DefaultInterpolatorType::New();
+    vinterps[w]->SetInputImage(lapgrad);
+    if( lapgrad2 )
+      {
+      vinterps2[w] = DefaultInterpolatorType::New();
+      vinterps2[w]->SetInputImage(lapgrad2);
+      }
+    }
   for( unsigned int smoothit = 0; smoothit < nsmooth; smoothit++ )
     {
     std::cout << " smoothit " << smoothit << std::endl;
-    Iterator.GoToBegin();
-    unsigned int cter = 0;
-    while(  !Iterator.IsAtEnd()  )
-      {
-      velind = Iterator.GetIndex();
-      //      float thislength=0;
-      for( unsigned int task = 0; task < 1; task++ )
+    std::atomic<unsigned int> cter( 0 );
+    threader->ParallelizeArray( 0, numberOfWorkUnits,
+      [&]( itk::SizeValueType workUnit )
         {
-        float itime = starttime;
-
-        unsigned long ct = 0;
-        bool          timedone = false;
-
-        VectorType disp;
-        disp.Fill(0.0);
-        double deltaTime = dT, vecsign = 1.0;
-        bool   domeasure = false;
-        float  gradsign = 1.0;
-        bool   printprobability = false;
-//    std::cout << " wmb " << wmb->GetPixel(velind) << " gm " << gm->GetPixel(velind) << std::endl;
-//    if (surf->GetPixel(velind) != 0) printprobability=true;
-        if( gm->GetPixel(velind) > 0.25 ) // && wmb->GetPixel(velind) < 1 )
-          {
-          cter++;
-          domeasure = true;
-          }
-        vinterp->SetInputImage(lapgrad);
-        gradsign = -1.0; vecsign = -1.0;
-        float len1 = IntegrateLength<ImageType, DisplacementFieldType, DefaultInterpolatorType, ScalarInterpolatorType>
-            (gmsurf, thickimage, velind, lapgrad,  itime, starttime, finishtime,  timedone,  deltaTime,  vinterp,
-            sinterp, task, propagate, domeasure, m_NumberOfTimePoints, spacing, vecsign, gradsign, timesign, ct, wm, gm,
-            priorthickval, smooththick, printprobability,
-            sulci );
-
-        gradsign = 1.0;  vecsign = 1;
-        float len2 = IntegrateLength<ImageType, DisplacementFieldType, DefaultInterpolatorType, ScalarInterpolatorType>
-            (gmsurf, thickimage, velind, lapgrad,  itime, starttime, finishtime,  timedone,  deltaTime,  vinterp,
-            sinterp, task, propagate, domeasure, m_NumberOfTimePoints, spacing, vecsign, gradsign, timesign, ct, wm, gm,
-            priorthickval - len1, smooththick, printprobability,
-            sulci );
-
-        float len3 = 1.e9, len4 = 1.e9;
-        if( lapgrad2 )
+        typename DefaultInterpolatorType::Pointer vinterp = vinterps[workUnit];
+        typename DefaultInterpolatorType::Pointer vinterp2 = vinterps2[workUnit];
+        for( itk::SizeValueType first = workUnit * blockSize; first < numberOfVoxels;
+             first += numberOfWorkUnits * blockSize )
           {
-          vinterp->SetInputImage(lapgrad2);
-          gradsign = -1.0; vecsign = -1.0;
-          len3 = IntegrateLength<ImageType, DisplacementFieldType, DefaultInterpolatorType, ScalarInterpolatorType>
-              (gmsurf, thickimage, velind, lapgrad2,  itime, starttime, finishtime,  timedone,  deltaTime,  vinterp,
-              sinterp, task, propagate, domeasure, m_NumberOfTimePoints, spacing, vecsign, gradsign, timesign, ct, wm,
-              gm,
-              priorthickval, smooththick, printprobability,
-              sulci );
-
-          gradsign = 1.0;  vecsign = 1;
-          len4 = IntegrateLength<ImageType, DisplacementFieldType, DefaultInterpolatorType, ScalarInterpolatorType>
-              (gmsurf, thickimage, velind, lapgrad2,  itime, starttime, finishtime,  timedone,  deltaTime,  vinterp,
-              sinterp, task, propagate, domeasure, m_NumberOfTimePoints, spacing, vecsign, gradsign, timesign, ct, wm,
-              gm,
-              priorthickval - len3, smooththick, printprobability,
-              sulci );
-          }
-        float totalength = len1 + len2;
-//    if (totalength > 5 && totalength <  8) std::cout<< " t1 " << len3+len4 << " t2 " << len1+len2 << std::endl;
-        if( len3 + len4 < totalength )
-          {
-          totalength = len3 + len4;
-          }
-
-        if( smoothit == 0 )
-          {
-          if( thickimage2->GetPixel(velind) == 0  )
+          const itk::SizeValueType last = std::min( numberOfVoxels, first + blockSize );
+          for( itk::SizeValueType v = first; v < last; v++ )
             {
-            thickimage2->SetPixel(velind, totalength);
+            const typename DisplacementFieldType::IndexType velind = thickimage2->ComputeIndex( v );
+            //      float thislength=0;
+            for( unsigned int task = 0; task < 1; task++ )
+              {
+              float itime = starttime;
+
+              unsigned long ct = 0;
+              bool          timedone = false;
+
+              double deltaTime = dT, vecsign = 1.0;
+              bool   domeasure = false;
+              float  gradsign = 1.0;
+              bool   printprobability = false;
+              unsigned int count = 0;
+              if( gm->GetPixel(velind) > 0.25 ) // && wmb->GetPixel(velind) < 1 )
+                {
+                count = ++cter;
+                domeasure = true;
+                }
+              gradsign = -1.0; vecsign = -1.0;
+              float len1 = IntegrateLength<ImageType, DisplacementFieldType, DefaultInterpolatorType,
+                                           ScalarInterpolatorType>
+                  (gmsurf, thickimage, velind, lapgrad,  itime, starttime, finishtime,  timedone,  deltaTime,  vinterp,
+                  sinterp, task, propagate, domeasure, m_NumberOfTimePoints, spacing, vecsign, gradsign, timesign, ct,
+                  wm, gm,
+                  priorthickval, smooththick, printprobability,
+                  sulci );
+
+              gradsign = 1.0;  vecsign = 1;
+              float len2 = IntegrateLength<ImageType, DisplacementFieldType, DefaultInterpolatorType,
+                                           ScalarInterpolatorType>
+                  (gmsurf, thickimage, velind, lapgrad,  itime, starttime, finishtime,  timedone,  deltaTime,  vinterp,
+                  sinterp, task, propagate, domeasure, m_NumberOfTimePoints, spacing, vecsign, gradsign, timesign, ct,
+                  wm, gm,
+                  priorthickval - len1, smooththick, printprobability,
+                  sulci );
+
+              float len3 = 1.e9, len4 = 1.e9;
+              if( lapgrad2 )
+                {
+                gradsign = -1.0; vecsign = -1.0;
+                len3 = IntegrateLength<ImageType, DisplacementFieldType, DefaultInterpolatorType,
+                                       ScalarInterpolatorType>
+                    (gmsurf, thickimage, velind, lapgrad2,  itime, starttime, finishtime,  timedone,  deltaTime,
+                    vinterp2, sinterp, task, propagate, domeasure, m_NumberOfTimePoints, spacing, vecsign, gradsign,
+                    timesign, ct, wm, gm,
+                    priorthickval, smooththick, printprobability,
+                    sulci );
+
+                gradsign = 1.0;  vecsign = 1;
+                len4 = IntegrateLength<ImageType, DisplacementFieldType, DefaultInterpolatorType,
+                                       ScalarInterpolatorType>
+                    (gmsurf, thickimage, velind, lapgrad2,  itime, starttime, finishtime,  timedone,  deltaTime,
+                    vinterp2, sinterp, task, propagate, domeasure, m_NumberOfTimePoints, spacing, vecsign, gradsign,
+                    timesign, ct, wm, gm,
+                    priorthickval - len3, smooththick, printprobability,
+                    sulci );
+                }
+              float totalength = len1 + len2;
+              if( len3 + len4 < totalength )
+                {
+                totalength = len3 + len4;
+                }
+
+              if( smoothit == 0 )
+                {
+                if( thickimage2->GetPixel(velind) == 0  )
+                  {
+                  thickimage2->SetPixel(velind, totalength);
+                  }
+                else if( (totalength) > 0 &&  thickimage2->GetPixel(velind) < (totalength) )
+                  {
+                  thickimage2->SetPixel(velind, totalength);
+                  }
+                }
+              if( smoothit > 0 && smooththick )
+                {
+                thickimage2->SetPixel(velind, (totalength) * 0.5 + smooththick->GetPixel(velind) * 0.5 );
+                }
+
+              if( domeasure && (totalength) > 0 && count % 10000 == 0 )
+                {
+                std::cout << " len1 " << len1 << " len2 " << len2 << " ind " << velind << std::endl;
+                }
+              }
             }
-          else if( (totalength) > 0 &&  thickimage2->GetPixel(velind) < (totalength) )
-            {
-            thickimage2->SetPixel(velind, totalength);
-            }
-          }
-        if( smoothit > 0 && smooththick )
-          {
-          thickimage2->SetPixel(velind, (totalength) * 0.5 + smooththick->GetPixel(velind) * 0.5 );
-          }
-
-        if( domeasure && (totalength) > 0 && cter % 10000 == 0 )
-          {
-          std::cout << " len1 " << len1 << " len2 " << len2 << " ind " << velind << std::endl;
           }
-        }
-      ++Iterator;
-      }
+        },
+      nullptr );
 
     smooththick = SmoothImage<ImageType>(thickimage2, 1.0);
 
@@ -984,8 +1218,12 @@ private:
     {
     std::cout << "Usage:   " << argv[0]
              <<
-      " WM.nii GM.nii   Out.nii  {smoothparam=1} {priorthickval=500} {dT=0.01} {sulcus-prior=0} {laplacian-tolerance=0.001}"
+      " WM.nii GM.nii   Out.nii  {smoothparam=1} {priorthickval=500} {dT=0.01} {sulcus-prior=0} {laplacian-tolerance=0.001} {eulerian=0}"
              << std::endl;
+    std::cout
+      <<
+      " eulerian=1 replaces the per-voxel streamline integration with an upwind PDE solution of the thickness (Yezzi and Prince) -- much faster, but ignores the sulcus prior "
+      << std::endl;
     std::cout
       <<
       " a good value for sulcus prior (if not 0, which disables its use) is 0.15 -- in a function :  1/(1.+exp(-0.1*(laplacian-img-value-sulcprob)/0.01)) "
@@ -23,8 +23,12 @@
 
 #include "itkTDistribution.h"
 #include "itkMath.h"
+#include "itkMultiThreaderBase.h"
 #include "vnl/vnl_erf.h"
 
+#include <numeric>
+#include <random>
+
 namespace ants
 {
 // for computing F distribution
@@ -421,6 +425,130 @@ double TTest(int numSubjects,   int* groupLabel, double * featureValue )
   return tt;
 }
 
+// Unequal variance t statistic of TTest() from the sum and sum of squares
+// of each group, so that a permuted labelling only has to revisit the
+// subjects it assigns to group A.
+inline double TTestFromSums(double sumA, double sumSqA, double numSubjA,
+                            double sumB, double sumSqB, double numSubjB)
+{
+  const double meanA = sumA / numSubjA;
+  const double meanB = sumB / numSubjB;
+  const double varA = std::max( 0.0, sumSqA / numSubjA - meanA * meanA );
+  const double varB = std::max( 0.0, sumSqB / numSubjB - meanB * meanB );
+  const double denom = varA / numSubjA + varB / numSubjB;
+  if( denom > 0 )
+    {
+    return ( meanA - meanB ) / sqrt( denom );
+    }
+  return 0;
+}
+
+// Permutation p-values of the two-sided t statistic at every voxel.
+//
+// featureMatrix holds the subjects of one voxel contiguously (voxel-major,
+// subject-minor).  The permutations are drawn in batches; each batch is
+// applied to blocks of voxels in parallel, so a block stays in cache for the
+// whole batch, and every voxel keeps a running count of the permutations
+// whose |t| reaches the observed one instead of storing and sorting the
+// permutation distribution.  The p-value is (count + 1) / (numPerms + 1).
+void PermutationTTest(const std::vector<float> & featureMatrix, unsigned long numVoxels,
+                      unsigned int numSubjectsA, unsigned int numSubjectsB, unsigned int numPerms,
+                      unsigned int randomSeed, std::vector<float> & pValues)
+{
+  const unsigned int numSubjects = numSubjectsA + numSubjectsB;
+  const double       nA = numSubjectsA;
+  const double       nB = numSubjectsB;
+
+  // per voxel totals and the observed statistic
+  std::vector<double> sum( numVoxels, 0 );
+  std::vector<double> sumSq( numVoxels, 0 );
+  std::vector<double> observed( numVoxels, 0 );
+  std::vector<unsigned int> exceedances( numVoxels, 0 );
+
+  constexpr itk::SizeValueType voxelsPerBlock = 4096;
+  const itk::SizeValueType     numBlocks = ( numVoxels + voxelsPerBlock - 1 ) / voxelsPerBlock;
+
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, numBlocks,
+    [&]( itk::SizeValueType block )
+    {
+    const unsigned long last = std::min<unsigned long>( numVoxels, ( block + 1 ) * voxelsPerBlock );
+    for( unsigned long v = block * voxelsPerBlock; v < last; v++ )
+      {
+      const float * feature = &featureMatrix[v * numSubjects];
+      double        sA = 0, sqA = 0, sB = 0, sqB = 0;
+      for( unsigned int subj = 0; subj < numSubjectsA; subj++ )
+        {
+        sA += feature[subj];
+        sqA += feature[subj] * static_cast<double>( feature[subj] );
+        }
+      for( unsigned int subj = numSubjectsA; subj < numSubjects; subj++ )
+        {
+        sB += feature[subj];
+        sqB += feature[subj] * static_cast<double>( feature[subj] );
+        }
+      sum[v] = sA + sB;
+      sumSq[v] = sqA + sqB;
+      observed[v] = std::fabs( TTestFromSums( sA, sqA, nA, sB, sqB, nB ) );
+      }
+    }, nullptr );
+
+  // group A members of every permutation in the current batch
+  constexpr unsigned int   permsPerBatch = 256;
+  std::vector<unsigned int> subjects( numSubjects );
+  std::vector<unsigned int> batchGroupA( permsPerBatch * numSubjectsA );
+  std::mt19937              generator( randomSeed );
+
+  unsigned int perm = 0;
+  while( perm < numPerms )
+    {
+    const unsigned int batchSize = std::min( permsPerBatch, numPerms - perm );
+    for( unsigned int b = 0; b < batchSize; b++ )
+      {
+      std::iota( subjects.begin(), subjects.end(), 0u );
+      std::shuffle( subjects.begin(), subjects.end(), generator );
+      std::copy( subjects.begin(), subjects.begin() + numSubjectsA, batchGroupA.begin() + b * numSubjectsA );
+      }
+
+    threader->ParallelizeArray( 0, numBlocks,
+      [&]( itk::SizeValueType block )
+      {
+      const unsigned long last = std::min<unsigned long>( numVoxels, ( block + 1 ) * voxelsPerBlock );
+      for( unsigned long v = block * voxelsPerBlock; v < last; v++ )
+        {
+        const float *        feature = &featureMatrix[v * numSubjects];
+        const unsigned int * groupA = &batchGroupA[0];
+        unsigned int         count = 0;
+        for( unsigned int b = 0; b < batchSize; b++, groupA += numSubjectsA )
+          {
+          double sA = 0, sqA = 0;
+          for( unsigned int subj = 0; subj < numSubjectsA; subj++ )
+            {
+            const double value = feature[groupA[subj]];
+            sA += value;
+            sqA += value * value;
+            }
+          const double t = TTestFromSums( sA, sqA, nA, sum[v] - sA, sumSq[v] - sqA, nB );
+          if( std::fabs( t ) >= observed[v] )
+            {
+            count++;
+            }
+          }
+        exceedances[v] += count;
+        }
+      }, nullptr );
+
+    perm += batchSize;
+    std::cout << " permutations " << perm << " of " << numPerms << std::endl;
+    }
+
+  pValues.resize( numVoxels );
+  for( unsigned long v = 0; v < numVoxels; v++ )
+    {
+    pValues[v] = static_cast<float>( exceedances[v] + 1 ) / static_cast<float>( numPerms + 1 );
+    }
+}
+
 template <unsigned int ImageDimension>
 int StudentsTestOnImages(int argc, char *argv[])
 {
@@ -444,12 +572,6 @@ int StudentsTestOnImages(int argc, char *argv[])
     {
     groupLabel[i] = 1;
     }
-  double* feature = new double[numvals];
-  for( unsigned int i = 0; i < numvals; i++ )
-    {
-    feature[i] = 0;
-    }
-
   std::cout << " Numvals " << numvals << std::endl;
   // Get the image dimension
   std::string               fn = std::string(argv[5]);
@@ -506,46 +628,126 @@ int StudentsTestOnImages(int argc, char *argv[])
 
 //   unsigned int sizeofpixel=sizeof(PixelType);
 
-  std::vector<typename ImageType::Pointer> imagestack;
-  imagestack.resize(numvals);
-  for( unsigned int j = 0; j < numvals; j++ )
+  // optional trailing arguments: number of permutations and random seed
+  unsigned int numPerms = 0;
+  unsigned int randomSeed = 0;
+  if( argc > static_cast<int>( 5 + numvals ) )
     {
-    std::string ifn = std::string(argv[5 + j]);
-    std::cout << "reading " << ifn << std::endl;
-    ReadImage<ImageType>(imagestack[j], ifn.c_str(), false);
+    numPerms = std::stoi( argv[5 + numvals] );
+    }
+  if( argc > static_cast<int>( 6 + numvals ) )
+    {
+    randomSeed = static_cast<unsigned int>( std::stoul( argv[6 + numvals] ) );
+    }
+  else
+    {
+    char* envSeed = getenv( "ANTS_RANDOM_SEED" );
+    if( envSeed != nullptr )
+      {
+      randomSeed = static_cast<unsigned int>( std::stoul( envSeed ) );
+      }
+    }
+  if( randomSeed == 0 )
+    {
+    randomSeed = std::random_device()();
     }
 
-  typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
-  Iterator      vfIter(PImage, PImage->GetLargestPossibleRegion() );
   unsigned long nvox = 1;
   for( unsigned int i = 0; i < ImageDimension; i++ )
     {
-    nvox *= PImage->GetLargestPossibleRegion().GetSize()[i];
+    nvox *= StatImage->GetLargestPossibleRegion().GetSize()[i];
     }
 
-  unsigned long ct = 0;
-  unsigned long prog = nvox / 20;
-  std::cout << " NVals " << numvals << " NSub " << numSubjects <<  std::endl;
-  for(  vfIter.GoToBegin(); !vfIter.IsAtEnd(); ++vfIter )
+  // gather the subjects into a voxel-major matrix, reading the images
+  // concurrently and holding at most one image per thread.  failures are
+  // recorded per image and reported once all the reads are done.
+  enum { ReadSucceeded = 0, ReadFailed, SizeMismatch };
+  std::vector<float>         featureMatrix( nvox * numSubjects );
+  std::vector<unsigned char> readStatus( numvals, ReadSucceeded );
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, numvals,
+    [&]( itk::SizeValueType j )
     {
-    typename ImageType::IndexType index = vfIter.GetIndex();
-    for( unsigned int subj = 0; subj < numSubjects; subj++ )
+    std::string ifn = std::string(argv[5 + j]);
+    typename ImageType::Pointer image = nullptr;
+    try
+      {
+      ReadImage<ImageType>(image, ifn.c_str(), false);
+      }
+    catch( itk::ExceptionObject & )
       {
-      feature[subj] = imagestack[subj]->GetPixel(index);
+      image = nullptr;
       }
-    if( ct % prog == 0 )
+    if( image.IsNull() )
       {
-      std::cout << " % " << (float) ct / (float) nvox << std::endl;
+      readStatus[j] = ReadFailed;
+      return;
       }
+    if( image->GetBufferedRegion().GetNumberOfPixels() != nvox )
+      {
+      readStatus[j] = SizeMismatch;
+      return;
+      }
+    const PixelType * buffer = image->GetBufferPointer();
+    for( unsigned long v = 0; v < nvox; v++ )
+      {
+      featureMatrix[v * numSubjects + j] = buffer[v];
+      }
+    }, nullptr );
 
-    double stat = 0;
-//      if (mask->GetPixel(index) >= 0.5)
-    if( true )
+  bool readFailure = false;
+  for( unsigned int j = 0; j < numvals; j++ )
+    {
+    if( readStatus[j] == ReadFailed )
+      {
+      std::cout << " could not read " << argv[5 + j] << std::endl;
+      readFailure = true;
+      }
+    else if( readStatus[j] == SizeMismatch )
       {
-      stat = TTest(numSubjects, groupLabel, feature);
+      std::cout << argv[5 + j] << " is not the same size as " << fn << std::endl;
+      readFailure = true;
       }
-    ct++;
-    StatImage->SetPixel(  index,   stat);
+    }
+  if( readFailure )
+    {
+    delete [] groupLabel;
+    return EXIT_FAILURE;
+    }
+
+  std::cout << " NVals " << numvals << " NSub " << numSubjects <<  std::endl;
+  PixelType *                  statBuffer = StatImage->GetBufferPointer();
+  constexpr itk::SizeValueType voxelsPerBlock = 4096;
+  threader->ParallelizeArray( 0, ( nvox + voxelsPerBlock - 1 ) / voxelsPerBlock,
+    [&]( itk::SizeValueType block )
+    {
+    std::vector<double> blockFeature( numSubjects );
+    const unsigned long last = std::min<unsigned long>( nvox, ( block + 1 ) * voxelsPerBlock );
+    for( unsigned long v = block * voxelsPerBlock; v < last; v++ )
+      {
+      for( unsigned int subj = 0; subj < numSubjects; subj++ )
+        {
+        blockFeature[subj] = featureMatrix[v * numSubjects + subj];
+        }
+      statBuffer[v] = TTest(numSubjects, groupLabel, &blockFeature[0]);
+      }
+    }, nullptr );
+
+  if( numPerms > 0 )
+    {
+    std::cout << " running " << numPerms << " permutations with random seed " << randomSeed << std::endl;
+    std::vector<float> pValues;
+    PermutationTTest( featureMatrix, nvox, numSubjectsA, numSubjectsB, numPerms, randomSeed, pValues );
+    std::copy( pValues.begin(), pValues.end(), PImage->GetBufferPointer() );
+
+    std::string path = itksys::SystemTools::GetFilenamePath( outname );
+    std::string pname = itksys::SystemTools::GetFilenameWithoutExtension( outname ) + std::string( "_pvalue" )
+      + itksys::SystemTools::GetFilenameExtension( outname );
+    if( !path.empty() )
+      {
+      pname = path + std::string( "/" ) + pname;
+      }
+    WriteImage(PImage, pname.c_str() );
     }
 
   typedef itk::Statistics::TDistribution DistributionType;
@@ -553,7 +755,6 @@ int StudentsTestOnImages(int argc, char *argv[])
 
   WriteImage(StatImage, outname.c_str() );
 
-  delete [] feature;
   delete [] groupLabel;
 
   return 1;
@@ -625,9 +826,12 @@ private:
   if( argc < 6 )
     {
     std::cout << "Usage: " << argv[0] <<  " ImageDimension  OutName NGroup1 NGroup2 ControlV1*   SubjectV1*   "
-             << std::endl;
+             << " [NumberOfPermutations] [RandomSeed] " << std::endl;
     std::cout << " Assume all images the same size " << std::endl;
     std::cout << " Writes out an F-Statistic image " << std::endl;
+    std::cout << " With NumberOfPermutations > 0, also writes the two-sided permutation p-values to OutName_pvalue "
+             << std::endl;
+    std::cout << " (the seed defaults to ANTS_RANDOM_SEED or a random value) " << std::endl;
     std::cout <<  " \n example call \n  \n ";
     std::cout << argv[0] << "  2  TEST.nii.gz 4 8 FawtJandADCcon/*SUB.nii  FawtJandADCsub/*SUB.nii  \n ";
     return 1;
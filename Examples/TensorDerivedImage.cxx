@@ -25,9 +25,262 @@
 #include "TensorFunctions.h"
 #include "ReadWriteData.h"
 #include "itkRGBPixel.h"
+#include "itkMultiThreaderBase.h"
+#include "TensorEigenSystem3x3.h"
+#include <cctype>
+#include <sstream>
 
 namespace ants
 {
+// Writes several derived maps in one pass over the tensor buffer.  Each
+// requested type in outputTypes is written to
+// <output name stem><type><output name extension>, or to the output name
+// itself if appendTypeToOutputName is off (a single type).  Tensors are decomposed
+// once per voxel: scalar-only requests use the batched eigenvalue solver on
+// blocks of voxels; RGB and PEV need the eigenvectors and use the per-tensor
+// solver instead.
+static int TensorDerivedImageMultiOutput( const char * inputName, const std::string & outputName,
+                                          const std::vector<std::string> & outputTypes,
+                                          const bool appendTypeToOutputName = true )
+{
+  typedef float                                    PixelType;
+  typedef itk::Image<PixelType, 3>                 ScalarImageType;
+  typedef itk::SymmetricSecondRankTensor<float, 3> TensorType;
+  typedef itk::Image<TensorType, 3>                TensorImageType;
+  typedef itk::RGBPixel<float>                     ColorPixelType;
+  typedef itk::Image<ColorPixelType, 3>            ColorImageType;
+  typedef itk::Vector<float, 3>                    VectorPixelType;
+  typedef itk::Image<VectorPixelType, 3>           VectorImageType;
+
+  enum { FA = 0, MD, TR, AD, RD, NumberOfScalarTypes };
+  const char * const scalarNames[NumberOfScalarTypes] = { "FA", "MD", "TR", "AD", "RD" };
+
+  std::vector<ScalarImageType::Pointer> scalarImages( NumberOfScalarTypes );
+  std::vector<PixelType *>              scalarBuffers( NumberOfScalarTypes, nullptr );
+  ColorImageType::Pointer               colorImage;
+  VectorImageType::Pointer              vectorImage;
+
+  TensorImageType::Pointer dtimg = TensorImageType::New();
+  ReadTensorImage<TensorImageType>(dtimg, inputName, false);
+
+  std::cout << "tensor_image: " << inputName << std::endl;
+
+  std::vector<std::string> outputNames;
+  for( unsigned int n = 0; n < outputTypes.size(); n++ )
+    {
+    std::string type = outputTypes[n];
+    std::transform( type.begin(), type.end(), type.begin(), ::toupper );
+    if( type == "DEC" )
+      {
+      type = "RGB";
+      }
+    if( type == "RGB" )
+      {
+      colorImage = AllocImage<ColorImageType>( dtimg );
+      }
+    else if( type == "PEV" )
+      {
+      vectorImage = AllocImage<VectorImageType>( dtimg );
+      }
+    else
+      {
+      unsigned int which = 0;
+      while( which < NumberOfScalarTypes && type != scalarNames[which] )
+        {
+        which++;
+        }
+      if( which == NumberOfScalarTypes )
+        {
+        std::cerr << "Unsupported output type in list: " << outputTypes[n] << std::endl;
+        std::cerr << "Supported types are FA, MD, TR, AD, RD, RGB (or DEC) and PEV." << std::endl;
+        return 1;
+        }
+      scalarImages[which] = AllocImage<ScalarImageType>( dtimg, 0 );
+      scalarBuffers[which] = scalarImages[which]->GetBufferPointer();
+      }
+    outputNames.push_back( type );
+    }
+
+  const bool needEigenvectors = colorImage.IsNotNull() || vectorImage.IsNotNull();
+
+  const TensorType *       tensors = dtimg->GetBufferPointer();
+  ColorPixelType *         colorBuffer = colorImage.IsNotNull() ? colorImage->GetBufferPointer() : nullptr;
+  VectorPixelType *        vectorBuffer = vectorImage.IsNotNull() ? vectorImage->GetBufferPointer() : nullptr;
+  const itk::SizeValueType numberOfVoxels = dtimg->GetLargestPossibleRegion().GetNumberOfPixels();
+  const itk::SizeValueType voxelsPerBlock = 4096;
+  const itk::SizeValueType numberOfBlocks = ( numberOfVoxels + voxelsPerBlock - 1 ) / voxelsPerBlock;
+
+  std::cout << "Calculating " << outputNames.size() << " outputs..." << std::flush;
+
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, numberOfBlocks,
+    [&]( itk::SizeValueType block )
+      {
+      const itk::SizeValueType first = block * voxelsPerBlock;
+      const itk::SizeValueType count = std::min( numberOfVoxels, first + voxelsPerBlock ) - first;
+
+      std::vector<PixelType> work( 9 * count );
+      PixelType *            components[6];
+      PixelType *            evals[3];
+      for( unsigned int c = 0; c < 6; c++ )
+        {
+        components[c] = &work[c * count];
+        }
+      for( unsigned int k = 0; k < 3; k++ )
+        {
+        evals[k] = &work[( 6 + k ) * count];
+        }
+
+      for( itk::SizeValueType v = 0; v < count; v++ )
+        {
+        const TensorType & dtv = tensors[first + v];
+        for( unsigned int c = 0; c < 6; c++ )
+          {
+          components[c][v] = std::isfinite( dtv[c] ) ? dtv[c] : 0.0f;
+          }
+        }
+
+      if( !needEigenvectors )
+        {
+        SymmetricEigenValues3x3Batch<PixelType>( count, components, evals );
+        }
+
+      for( itk::SizeValueType v = 0; v < count; v++ )
+        {
+        const itk::SizeValueType voxel = first + v;
+
+        double e[3];
+        double evecs[3][3];
+        if( needEigenvectors )
+          {
+          const double dtv[6] = { components[0][v], components[1][v], components[2][v],
+                                  components[3][v], components[4][v], components[5][v] };
+          SymmetricEigenSystem3x3( dtv, e, evecs );
+          }
+        else
+          {
+          for( unsigned int k = 0; k < 3; k++ )
+            {
+            e[k] = evals[k][v];
+            }
+          }
+
+        double trace = e[0] + e[1] + e[2];
+        if( trace < 0 )
+          {
+          trace = 0;
+          }
+
+        // Same clamping of negative eigenvalues as GetTensorFA, and zero
+        // anisotropy for background (zero diffusion) voxels.
+        double fa = 0.0;
+        if( components[0][v] + components[3][v] + components[5][v] != 0.0f )
+          {
+          const double l1 = ( e[0] < 0 ) ? e[1] : e[0];
+          const double l2 = e[1];
+          const double l3 = ( e[2] < 0 ) ? e[1] : e[2];
+          const double emean = ( l1 + l2 + l3 ) / 3.0;
+          const double numer = std::sqrt( ( l1 - emean ) * ( l1 - emean ) + ( l2 - emean ) * ( l2 - emean )
+                                          + ( l3 - emean ) * ( l3 - emean ) );
+          const double denom = std::sqrt( l1 * l1 + l2 * l2 + l3 * l3 );
+          if( denom > 0 )
+            {
+            fa = std::sqrt( 3.0 / 2.0 ) * numer / denom;
+            }
+          }
+
+        if( scalarBuffers[FA] )
+          {
+          scalarBuffers[FA][voxel] = static_cast<PixelType>( fa );
+          }
+        if( scalarBuffers[MD] )
+          {
+          scalarBuffers[MD][voxel] = static_cast<PixelType>( trace / 3.0 );
+          }
+        if( scalarBuffers[TR] )
+          {
+          scalarBuffers[TR][voxel] = static_cast<PixelType>( trace );
+          }
+        if( scalarBuffers[AD] )
+          {
+          scalarBuffers[AD][voxel] = static_cast<PixelType>( e[2] );
+          }
+        if( scalarBuffers[RD] )
+          {
+          scalarBuffers[RD][voxel] = static_cast<PixelType>( 0.5 * ( e[0] + e[1] ) );
+          }
+        // As in GetTensorRGB and GetTensorPrincipalEigenvector, diagonal,
+        // (near) zero and non-finite tensors have no orientation.
+        bool hasOrientation = false;
+        if( needEigenvectors )
+          {
+          const TensorType & dtv = tensors[voxel];
+          bool   isFinite = true;
+          double magnitude = 0.0;
+          for( unsigned int c = 0; c < 6; c++ )
+            {
+            isFinite = isFinite && std::isfinite( dtv[c] );
+            magnitude += static_cast<double>( dtv[c] ) * static_cast<double>( dtv[c] );
+            }
+          hasOrientation = isFinite && std::sqrt( magnitude ) >= 1.e-9 &&
+            !( dtv[1] == 0 && dtv[2] == 0 && dtv[4] == 0 );
+          }
+
+        if( colorBuffer )
+          {
+          for( unsigned int i = 0; i < 3; i++ )
+            {
+            colorBuffer[voxel][i] = hasOrientation ? static_cast<float>( std::fabs( evecs[i][2] ) * fa * 255.0 ) : 0.0f;
+            }
+          }
+        if( vectorBuffer )
+          {
+          for( unsigned int i = 0; i < 3; i++ )
+            {
+            vectorBuffer[voxel][i] = hasOrientation ? static_cast<float>( evecs[i][2] ) : 0.0f;
+            }
+          }
+        }
+      }, nullptr );
+
+  std::cout << "Done. " << std::endl;
+
+  std::string::size_type slash = outputName.find_last_of( "/\\" );
+  std::string::size_type idx = outputName.find_first_of( '.', ( slash == std::string::npos ) ? 0 : slash + 1 );
+  if( idx == std::string::npos )
+    {
+    idx = outputName.length();
+    }
+  const std::string stem = outputName.substr( 0, idx );
+  const std::string extension = ( idx < outputName.length() ) ? outputName.substr( idx ) : std::string( ".nii.gz" );
+
+  for( unsigned int n = 0; n < outputNames.size(); n++ )
+    {
+    const std::string filename = appendTypeToOutputName ? stem + outputNames[n] + extension : outputName;
+    std::cout << "output_image: " << filename << std::endl;
+    if( outputNames[n] == "RGB" )
+      {
+      WriteImage<ColorImageType>( colorImage, filename.c_str() );
+      }
+    else if( outputNames[n] == "PEV" )
+      {
+      WriteImage<VectorImageType>( vectorImage, filename.c_str() );
+      }
+    else
+      {
+      for( unsigned int which = 0; which < NumberOfScalarTypes; which++ )
+        {
+        if( outputNames[n] == scalarNames[which] )
+          {
+          WriteImage<ScalarImageType>( scalarImages[which], filename.c_str() );
+          }
+        }
+      }
+    }
+
+  return 0;
+}
+
 // entry point for the library; parameter 'args' is equivalent to 'argv' in (argc,argv) of commandline parameters to
 // 'main()'
 int TensorDerivedImage( std::vector<std::string> args, std::ostream* out_stream = nullptr )
@@ -88,9 +341,12 @@ private:
   typedef itk::ImageFileWriter<ColorImageType>     ColorWriterType;
 
   // Check for valid input paramters
-  if( argc < 3 )
+  if( argc < 4 )
     {
     std::cout << "Usage: " << argv[0] << " tensorvolume outputvolume outputtype" << std::endl;
+    std::cout << "  outputtype may be a comma-separated list, e.g. FA,MD,AD,RD,RGB,PEV, in which case all" << std::endl;
+    std::cout << "  maps are computed in a single multithreaded pass and written to" << std::endl;
+    std::cout << "  <outputvolume stem><type><outputvolume extension>, e.g. subj_FA.nii.gz for subj_.nii.gz" << std::endl;
     return 1;
     }
 
@@ -99,6 +355,30 @@ private:
   char *      outputName = argv[2];
   std::string outType = argv[3];
 
+  if( outType.find( ',' ) != std::string::npos )
+    {
+    std::vector<std::string> outputTypes;
+    std::istringstream       typeStream( outType );
+    std::string              type;
+    while( std::getline( typeStream, type, ',' ) )
+      {
+      if( !type.empty() )
+        {
+        outputTypes.push_back( type );
+        }
+      }
+    return TensorDerivedImageMultiOutput( inputName, std::string( outputName ), outputTypes );
+    }
+
+  // The maps only computed by the multi-output pass are written to the output name as given
+  std::string upperOutType = outType;
+  std::transform( upperOutType.begin(), upperOutType.end(), upperOutType.begin(), ::toupper );
+  if( upperOutType == "AD" || upperOutType == "RD" || upperOutType == "RGB" || upperOutType == "PEV" )
+    {
+    return TensorDerivedImageMultiOutput( inputName, std::string( outputName ),
+                                          std::vector<std::string>( 1, outType ), false );
+    }
+
   TensorImageType::Pointer dtimg = TensorImageType::New();
   ReadTensorImage<TensorImageType>(dtimg, inputName, false);
 
@@ -110,7 +390,7 @@ private:
 
   if( outType == "DEC" )
     {
-    colorImage = AllocImage<ColorImageType>(dtimage);
+    colorImage = AllocImage<ColorImageType>(dtimg);
     }
   else
     {
@@ -145,6 +425,15 @@ private:
     outType = "5";
     }
 
+  if( !( (outType == "0") || (outType == "1") || (outType == "2") || (outType == "3") ||
+         (outType == "4") || (outType == "5") || (outType == "TR") || (outType == "MD") ||
+         (outType == "V") || (outType == "FA") || (outType == "DEC") ) )
+    {
+    std::cerr << "Unsupported output type: " << argv[3] << std::endl;
+    std::cerr << "Supported types are XX, XY, XZ, YY, YZ, ZZ, TR, MD, V, FA, DEC, AD, RD, RGB and PEV." << std::endl;
+    return 1;
+    }
+
   std::cout << "Calculating output..." << std::flush;
 
   while( !inputIt.IsAtEnd() )
@@ -158,7 +447,7 @@ private:
     else if( (outType == "TR") || (outType == "MD") )
       {
       ScalarImageType::PixelType tr;
-      tr = inputIt.Value()[0] + inputIt.Value()[2] + inputIt.Value()[5];
+      tr = inputIt.Value()[0] + inputIt.Value()[3] + inputIt.Value()[5];
       if( tr < 0 )
         {
         tr = 0;
@@ -194,8 +483,8 @@ private:
       {
       colorImage->SetPixel(inputIt.GetIndex(),
                            GetTensorRGB<TensorType>(inputIt.Value() ) );
-      ++inputIt;
       }
+    ++inputIt;
     }
 
   std::cout << "Done. " << std::endl;
@@ -7,6 +7,7 @@
 #include "itkImageFileWriter.h"
 #include "itkExtractImageFilter.h"
 #include "itkResampleImageFilter.h"
+#include "itkStreamingResampleImageFilter.h"
 #include "itkVectorImage.h"
 #include "itkVectorIndexSelectionCastImageFilter.h"
 
@@ -28,6 +29,14 @@
 #include "itkLabelImageGaussianInterpolateImageFunction.h"
 #include "itkLabelImageGenericInterpolateImageFunction.h"
 
+#include <itksys/SystemTools.hxx>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+
 namespace ants
 {
 template <typename TensorImageType, typename ImageType>
@@ -138,6 +147,51 @@ bool isDiagonalElement(std::vector<unsigned int> diagElements, unsigned int ind)
   return false;
 }
 
+template <typename TReferenceImage, typename TRealType>
+std::string
+GetCompositeTransformCacheFileName( itk::ants::CommandLineParser::OptionType * transformOption,
+                                    const TReferenceImage * referenceImage,
+                                    const std::string & cacheDirectory,
+                                    bool useStaticCastForR )
+{
+  // The key is built from every transform specification (file names and
+  // flags, with the modification time and size of each file) and the
+  // reference image header.
+  std::ostringstream key;
+  key << TReferenceImage::ImageDimension << "|" << sizeof( TRealType ) << "|" << useStaticCastForR;
+  for( unsigned int n = 0; n < transformOption->GetNumberOfFunctions(); n++ )
+    {
+    std::vector<std::string> tokens;
+    tokens.push_back( transformOption->GetFunction( n )->GetName() );
+    for( unsigned int p = 0; p < transformOption->GetFunction( n )->GetNumberOfParameters(); p++ )
+      {
+      tokens.push_back( transformOption->GetFunction( n )->GetParameter( p ) );
+      }
+    for( unsigned int t = 0; t < tokens.size(); t++ )
+      {
+      key << "|" << tokens[t];
+
+      struct stat stFileInfo;
+      if( !tokens[t].empty() && stat( tokens[t].c_str(), &stFileInfo ) == 0 )
+        {
+        key << "@" << itksys::SystemTools::CollapseFullPath( tokens[t] )
+            << ":" << static_cast<long long>( stFileInfo.st_mtime )
+            << ":" << static_cast<long long>( stFileInfo.st_size );
+        }
+      }
+    key << ";";
+    }
+
+  key << std::setprecision( 17 ) << "|" << referenceImage->GetLargestPossibleRegion()
+      << "|" << referenceImage->GetOrigin() << "|" << referenceImage->GetSpacing()
+      << "|" << referenceImage->GetDirection();
+
+  std::ostringstream cacheFileName;
+  cacheFileName << cacheDirectory << "/antsCompositeTransform_" << std::hex
+                << std::hash<std::string>()( key.str() ) << ".nii";
+  return cacheFileName.str();
+}
+
 template <typename T, unsigned int Dimension>
 int antsApplyTransforms( itk::ants::CommandLineParser::Pointer & parser, unsigned int inputImageType = 0 )
 {
@@ -191,6 +245,56 @@ int antsApplyTransforms( itk::ants::CommandLineParser::Pointer & parser, unsigne
   typename itk::ants::CommandLineParser::OptionType::Pointer inputOption = parser->GetOption( "input" );
   typename itk::ants::CommandLineParser::OptionType::Pointer outputOption = parser->GetOption( "output" );
 
+  /**
+   * Streaming option.  Only scalar images written as warped images are
+   * streamed; everything else is resampled in memory as before.
+   */
+  unsigned int numberOfSlabs = 0;
+  int          streamingPaddingRadius = -1;
+  typename itk::ants::CommandLineParser::OptionType::Pointer streamingOption = parser->GetOption( "streaming" );
+  if( streamingOption && streamingOption->GetNumberOfFunctions() )
+    {
+    if( streamingOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+      {
+      numberOfSlabs = parser->Convert<unsigned int>( streamingOption->GetFunction( 0 )->GetParameter( 0 ) );
+      if( streamingOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+        {
+        streamingPaddingRadius = parser->Convert<int>( streamingOption->GetFunction( 0 )->GetParameter( 1 ) );
+        }
+      }
+    else
+      {
+      numberOfSlabs = parser->Convert<unsigned int>( streamingOption->GetFunction( 0 )->GetName() );
+      }
+    }
+
+  bool isWarpedImageOutput = false;
+  if( outputOption && outputOption->GetNumberOfFunctions() )
+    {
+    std::string outputOptionName = outputOption->GetFunction( 0 )->GetName();
+    ConvertToLowerCase( outputOptionName );
+    isWarpedImageOutput = std::strcmp( outputOptionName.c_str(), "linear" ) &&
+      !( outputOption->GetFunction( 0 )->GetNumberOfParameters() > 1 &&
+         parser->Convert<unsigned int>( outputOption->GetFunction( 0 )->GetParameter( 1 ) ) != 0 );
+    }
+
+  bool useStreaming = false;
+  if( numberOfSlabs > 1 && isWarpedImageOutput )
+    {
+    if( inputImageType == 0 )
+      {
+      useStreaming = true;
+      }
+    else if( verbose )
+      {
+      std::cout << "WARNING: streaming is only supported for scalar images written as warped images.  "
+                << "Resampling in memory." << std::endl;
+      }
+    }
+
+  typedef itk::ImageFileReader<ImageType> StreamingReaderType;
+  typename StreamingReaderType::Pointer streamingReader = nullptr;
+
   if( inputImageType == 4 && inputOption && inputOption->GetNumberOfFunctions() )
     {
     if( verbose )
@@ -223,7 +327,35 @@ int antsApplyTransforms( itk::ants::CommandLineParser::Pointer & parser, unsigne
       std::cout << "Input scalar image: " << inputOption->GetFunction( 0 )->GetName() << std::endl;
       }
     typename ImageType::Pointer image;
-    ReadImage<ImageType>( image, ( inputOption->GetFunction( 0 )->GetName() ).c_str()  );
+    if( useStreaming )
+      {
+      // Only read the header here.  The pixels are read slab by slab when
+      // the output is written.
+      streamingReader = StreamingReaderType::New();
+      streamingReader->SetFileName( ( inputOption->GetFunction( 0 )->GetName() ).c_str() );
+      try
+        {
+        streamingReader->UpdateOutputInformation();
+        }
+      catch( itk::ExceptionObject & err )
+        {
+        if( verbose )
+          {
+          std::cerr << "Unable to read input image information: " << err << std::endl;
+          }
+        return EXIT_FAILURE;
+        }
+      if( verbose && !streamingReader->GetImageIO()->CanStreamRead() )
+        {
+        std::cout << "WARNING: the input image format does not support streamed reading "
+                  << "(e.g. compressed files) so the whole input will be read." << std::endl;
+        }
+      image = streamingReader->GetOutput();
+      }
+    else
+      {
+      ReadImage<ImageType>( image, ( inputOption->GetFunction( 0 )->GetName() ).c_str()  );
+      }
     inputImages.push_back( image );
     }
   else if( inputImageType == 1 && inputOption && inputOption->GetNumberOfFunctions() )
@@ -298,7 +430,31 @@ int antsApplyTransforms( itk::ants::CommandLineParser::Pointer & parser, unsigne
       {
       std::cout << "Reference image: " << referenceOption->GetFunction( 0 )->GetName() << std::endl;
       }
-    ReadImage<ReferenceImageType>( referenceImage,  ( referenceOption->GetFunction( 0 )->GetName() ).c_str() );
+    if( useStreaming )
+      {
+      // The reference image only provides the output geometry.
+      typedef itk::ImageFileReader<ReferenceImageType> ReferenceReaderType;
+      typename ReferenceReaderType::Pointer referenceReader = ReferenceReaderType::New();
+      referenceReader->SetFileName( ( referenceOption->GetFunction( 0 )->GetName() ).c_str() );
+      try
+        {
+        referenceReader->UpdateOutputInformation();
+        }
+      catch( itk::ExceptionObject & err )
+        {
+        if( verbose )
+          {
+          std::cerr << "Unable to read reference image information: " << err << std::endl;
+          }
+        return EXIT_FAILURE;
+        }
+      referenceImage = referenceReader->GetOutput();
+      referenceImage->DisconnectPipeline();
+      }
+    else
+      {
+      ReadImage<ReferenceImageType>( referenceImage,  ( referenceOption->GetFunction( 0 )->GetName() ).c_str() );
+      }
     }
   else if( needReferenceImage == true )
     {
@@ -377,13 +533,120 @@ int antsApplyTransforms( itk::ants::CommandLineParser::Pointer & parser, unsigne
     useStaticCastForR = parser->Convert<bool>(  rOption->GetFunction( 0 )->GetName() );
     }
 
+  /**
+   * Composite transform cache.  The transform chain is collapsed into a single
+   * displacement field on the reference grid which is saved under a key of the
+   * chain and the reference header so that later calls with the same chain
+   * and reference only need a single field lookup per voxel.
+   */
+  std::string compositeCacheFileName;
+  typename itk::ants::CommandLineParser::OptionType::Pointer cacheOption =
+    parser->GetOption( "cache-composite" );
+  if( cacheOption && cacheOption->GetNumberOfFunctions() && isWarpedImageOutput &&
+      referenceImage.IsNotNull() && transformOption && transformOption->GetNumberOfFunctions() )
+    {
+    std::string cacheDirectory = cacheOption->GetFunction( 0 )->GetName();
+    if( cacheOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+      {
+      cacheDirectory = cacheOption->GetFunction( 0 )->GetParameter( 0 );
+      }
+    itksys::SystemTools::MakeDirectory( cacheDirectory );
+    compositeCacheFileName = GetCompositeTransformCacheFileName<ReferenceImageType, RealType>(
+        transformOption, referenceImage, cacheDirectory, useStaticCastForR );
+    }
+
+  typedef itk::DisplacementFieldTransform<RealType, Dimension> DisplacementFieldTransformType;
+
   std::vector<bool> isDerivedTransform;
-  typename CompositeTransformType::Pointer compositeTransform =
-    GetCompositeTransformFromParserOption<RealType, Dimension>( parser, transformOption, isDerivedTransform,
-                                                                useStaticCastForR );
+  typename CompositeTransformType::Pointer compositeTransform = nullptr;
+  if( !compositeCacheFileName.empty() && ANTSFileExists( compositeCacheFileName ) )
+    {
+    typedef itk::ImageFileReader<DisplacementFieldType> CachedFieldReaderType;
+    typename CachedFieldReaderType::Pointer cachedFieldReader = CachedFieldReaderType::New();
+    cachedFieldReader->SetFileName( compositeCacheFileName.c_str() );
+    try
+      {
+      cachedFieldReader->Update();
+
+      typename DisplacementFieldTransformType::Pointer cachedTransform = DisplacementFieldTransformType::New();
+      cachedTransform->SetDisplacementField( cachedFieldReader->GetOutput() );
+
+      compositeTransform = CompositeTransformType::New();
+      compositeTransform->AddTransform( cachedTransform );
+      if( verbose )
+        {
+        std::cout << "Using cached composite transform: " << compositeCacheFileName << std::endl;
+        }
+      }
+    catch( itk::ExceptionObject & )
+      {
+      // Fall back to reading the transform chain, which also refreshes the cache.
+      compositeTransform = nullptr;
+      }
+    }
+
   if( compositeTransform.IsNull() )
     {
-    return EXIT_FAILURE;
+    compositeTransform = GetCompositeTransformFromParserOption<RealType, Dimension>( parser, transformOption,
+                                                                                    isDerivedTransform,
+                                                                                    useStaticCastForR );
+    if( compositeTransform.IsNull() )
+      {
+      return EXIT_FAILURE;
+      }
+
+    // A purely linear chain is already cheap to evaluate so it is not cached.
+    if( !compositeCacheFileName.empty() && !compositeTransform->IsLinear() )
+      {
+      typedef typename itk::TransformToDisplacementFieldFilter<DisplacementFieldType, RealType> ConverterType;
+      typename ConverterType::Pointer converter = ConverterType::New();
+      converter->SetOutputOrigin( referenceImage->GetOrigin() );
+      converter->SetOutputStartIndex( referenceImage->GetLargestPossibleRegion().GetIndex() );
+      converter->SetSize( referenceImage->GetLargestPossibleRegion().GetSize() );
+      converter->SetOutputSpacing( referenceImage->GetSpacing() );
+      converter->SetOutputDirection( referenceImage->GetDirection() );
+      converter->SetTransform( compositeTransform );
+      converter->Update();
+
+      typename DisplacementFieldType::Pointer collapsedField = converter->GetOutput();
+      collapsedField->DisconnectPipeline();
+
+      // Write to a temporary file and rename so that concurrent calls never
+      // read a partially written cache entry.
+      const std::string temporaryFileName = ANTSTemporaryFileName(
+          compositeCacheFileName.substr( 0, compositeCacheFileName.length() - 4 ), ".nii" );
+
+      typedef itk::ImageFileWriter<DisplacementFieldType> CachedFieldWriterType;
+      typename CachedFieldWriterType::Pointer cachedFieldWriter = CachedFieldWriterType::New();
+      cachedFieldWriter->SetInput( collapsedField );
+      cachedFieldWriter->SetFileName( temporaryFileName.c_str() );
+      try
+        {
+        cachedFieldWriter->Update();
+        if( std::rename( temporaryFileName.c_str(), compositeCacheFileName.c_str() ) != 0 )
+          {
+          itksys::SystemTools::RemoveFile( temporaryFileName );
+          }
+        else if( verbose )
+          {
+          std::cout << "Cached composite transform: " << compositeCacheFileName << std::endl;
+          }
+        }
+      catch( itk::ExceptionObject & err )
+        {
+        if( verbose )
+          {
+          std::cout << "WARNING: unable to write the composite transform cache: " << err << std::endl;
+          }
+        itksys::SystemTools::RemoveFile( temporaryFileName );
+        }
+
+      typename DisplacementFieldTransformType::Pointer collapsedTransform = DisplacementFieldTransformType::New();
+      collapsedTransform->SetDisplacementField( collapsedField );
+
+      compositeTransform = CompositeTransformType::New();
+      compositeTransform->AddTransform( collapsedTransform );
+      }
     }
 
   if( !compositeTransform->GetNumberOfParameters() )
@@ -434,6 +697,117 @@ int antsApplyTransforms( itk::ants::CommandLineParser::Pointer & parser, unsigne
     else
       std::cout << "Default pixel value: " << defaultValue << std::endl;
     }
+  if( useStreaming )
+    {
+    std::string outputFileName = outputOption->GetFunction( 0 )->GetName();
+    if( outputOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+      {
+      outputFileName = outputOption->GetFunction( 0 )->GetParameter( 0 );
+      }
+
+    // Pad the input region requested for each slab by the support of the
+    // interpolator.
+    if( streamingPaddingRadius < 0 )
+      {
+      streamingPaddingRadius = 2;
+      if( !std::strcmp( whichInterpolator.c_str(), "bspline" ) )
+        {
+        streamingPaddingRadius = 8;
+        }
+      else if( std::strcmp( whichInterpolator.c_str(), "linear" ) &&
+               std::strcmp( whichInterpolator.c_str(), "nearestneighbor" ) )
+        {
+        streamingPaddingRadius = 5;
+        }
+      }
+
+    // The Gaussian kernels reach alpha * sigma in physical units, which can
+    // be much wider than the default padding.
+    typedef itk::GaussianInterpolateImageFunction<ImageType, RealType> GaussianInterpolatorBaseType;
+    const GaussianInterpolatorBaseType * gaussianInterpolator =
+      dynamic_cast<const GaussianInterpolatorBaseType *>( interpolator.GetPointer() );
+    if( gaussianInterpolator != nullptr )
+      {
+      const typename ImageType::SpacingType inputSpacing = streamingReader->GetOutput()->GetSpacing();
+      int gaussianPaddingRadius = 0;
+      for( unsigned int d = 0; d < Dimension; d++ )
+        {
+        gaussianPaddingRadius = std::max( gaussianPaddingRadius, static_cast<int>( std::ceil(
+          gaussianInterpolator->GetAlpha() * gaussianInterpolator->GetSigma()[d] / inputSpacing[d] ) ) + 1 );
+        }
+      if( streamingPaddingRadius < gaussianPaddingRadius )
+        {
+        if( verbose )
+          {
+          std::cout << "Increasing the slab padding radius to " << gaussianPaddingRadius
+                    << " to cover the Gaussian interpolation kernel." << std::endl;
+          }
+        streamingPaddingRadius = gaussianPaddingRadius;
+        }
+      }
+
+    // A displacement field makes the slab regions depend on how well the
+    // mapped slab boundary bounds the mapped slab, so report the padding used.
+    for( unsigned int i = 0; i < compositeTransform->GetNumberOfTransforms(); i++ )
+      {
+      if( compositeTransform->GetNthTransform( i )->GetTransformCategory() == CompositeTransformType::DisplacementField )
+        {
+        std::cout << "Streaming with a displacement field in the transform chain:  slab padding radius = "
+                  << streamingPaddingRadius << " voxels." << std::endl;
+        break;
+        }
+      }
+
+    typedef itk::StreamingResampleImageFilter<ImageType, ImageType, RealType> StreamingResamplerType;
+    typename StreamingResamplerType::Pointer resampleFilter = StreamingResamplerType::New();
+    resampleFilter->SetInput( streamingReader->GetOutput() );
+    resampleFilter->SetOutputParametersFromImage( referenceImage );
+    resampleFilter->SetTransform( compositeTransform );
+    resampleFilter->SetDefaultPixelValue( defaultValue );
+    resampleFilter->SetInterpolator( interpolator );
+    resampleFilter->SetPaddingRadius( static_cast<unsigned int>( streamingPaddingRadius ) );
+
+    typedef itk::ImageFileWriter<ImageType> StreamingWriterType;
+    typename StreamingWriterType::Pointer writer = StreamingWriterType::New();
+    writer->SetInput( resampleFilter->GetOutput() );
+    writer->SetFileName( outputFileName.c_str() );
+    writer->SetNumberOfStreamDivisions( numberOfSlabs );
+
+    itk::ImageIOBase::Pointer outputIO = itk::ImageIOFactory::CreateImageIO(
+        outputFileName.c_str(), itk::ImageIOFactory::WriteMode );
+    if( outputIO.IsNotNull() )
+      {
+      writer->SetImageIO( outputIO );
+      if( verbose && !outputIO->CanStreamWrite() )
+        {
+        std::cout << "WARNING: the output format does not support streamed writing "
+                  << "(use e.g. .nrrd or .mha) so the whole output will be held in memory." << std::endl;
+        }
+      }
+
+    if( verbose )
+      {
+      std::cout << "Interpolation type: " << interpolator->GetNameOfClass() << std::endl;
+      std::cout << "Output warped image: " << outputFileName << " (streamed in "
+                << numberOfSlabs << " slabs)" << std::endl;
+      }
+
+    try
+      {
+      writer->Update();
+      }
+    catch( itk::ExceptionObject & err )
+      {
+      if( verbose )
+        {
+        std::cerr << "Caught an ITK exception: " << std::endl;
+        std::cerr << err << " " << __FILE__ << " " << __LINE__ << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+    return EXIT_SUCCESS;
+    }
+
   for( unsigned int n = 0; n < inputImages.size(); n++ )
     {
     typedef itk::ResampleImageFilter<ImageType, ImageType, RealType> ResamplerType;
@@ -892,6 +1266,43 @@ static void antsApplyTransformsInitializeCommandLineOptions( itk::ants::CommandL
   parser->AddOption( option );
   }
 
+  {
+  std::string description =
+    std::string( "Resample the output in the specified number of slabs to bound " )
+    + std::string( "memory use when the output is larger than RAM.  Each slab only " )
+    + std::string( "reads the region of the input that it maps to through the " )
+    + std::string( "transform chain (padded by paddingRadius voxels for the " )
+    + std::string( "interpolator) and is written before the next one is computed.  " )
+    + std::string( "Memory is only bounded if the input can be read in pieces and the " )
+    + std::string( "output written in pieces, i.e. uncompressed formats such as .nrrd, " )
+    + std::string( ".mha or .nii.  Only scalar input images are streamed." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "streaming" );
+  option->SetUsageOption( 0, "numberOfSlabs" );
+  option->SetUsageOption( 1, "[numberOfSlabs,<paddingRadius>]" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "Cache the collapsed transform chain in the specified directory.  " )
+    + std::string( "The first call collapses the whole chain (linear transforms " )
+    + std::string( "included) into a single displacement field on the reference " )
+    + std::string( "grid and saves it under a hash of the transform specifications " )
+    + std::string( "(including file modification times) and the reference image " )
+    + std::string( "header.  Later calls with the same chain and reference reuse the " )
+    + std::string( "field without reading the individual transforms.  Purely linear " )
+    + std::string( "chains are not cached.  Only used when writing warped images." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "cache-composite" );
+  option->SetUsageOption( 0, "cacheDirectory" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
   {
   std::string         description = std::string( "forces static cast in ReadTransform (for R)" );
   OptionType::Pointer option = OptionType::New();
@@ -3,15 +3,21 @@
 #include "antsAllocImage.h"
 #include "ReadWriteData.h"
 
+#include "itkMemoryProbe.h"
+#include "itkMemoryUsageObserver.h"
 #include "itkNumericSeriesFileNames.h"
+#include "itkPlatformMultiThreader.h"
 #include "itkTimeProbe.h"
 #include "itkWeightedVotingFusionImageFilter.h"
 
 #include "stdio.h"
 
 #include <algorithm>
+#include <fstream>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "ANTsVersion.h"
@@ -111,6 +117,21 @@ public:
     }
 };
 
+// A view of an image shared by concurrent fusions:  it shares the pixel buffer
+// but has its own regions, so updating one fusion does not touch the others.
+template <typename TImage>
+typename TImage::Pointer
+GraftSharedImage( TImage *image )
+{
+  if( image == nullptr )
+    {
+    return nullptr;
+    }
+  typename TImage::Pointer graft = TImage::New();
+  graft->Graft( image );
+  return graft;
+}
+
 template <unsigned int ImageDimension>
 int antsJointFusion( itk::ants::CommandLineParser *parser )
 {
@@ -162,6 +183,7 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
   fusionFilter->SetBeta( beta );
 
   // Get the search and patch radii
+  typename FusionFilterType::RadiusImageType::Pointer searchRadiusImage = nullptr;
   typename OptionType::Pointer searchRadiusOption = parser->GetOption( "search-radius" );
 
   if( searchRadiusOption && searchRadiusOption->GetNumberOfFunctions() )
@@ -171,7 +193,6 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
     if( itksys::SystemTools::FileExists( searchRadiusString.c_str() ) )
       {
       typedef typename FusionFilterType::RadiusImageType  RadiusImageType;
-      typename RadiusImageType::Pointer searchRadiusImage;
       bool fileReadSuccessfully = ReadImage<RadiusImageType>( searchRadiusImage, searchRadiusString.c_str() );
       if( fileReadSuccessfully )
         {
@@ -248,35 +269,7 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
 
   fusionFilter->SetNeighborhoodPatchRadius( patchNeighborhoodRadius );
 
-  // Check if the user wants to retain atlas voting and/or label posterior images
-
-  bool retainAtlasVotingImages = false;
-  bool retainLabelPosteriorImages = false;
-
   typename OptionType::Pointer outputOption = parser->GetOption( "output" );
-  if( outputOption && outputOption->GetNumberOfFunctions() )
-    {
-    if( outputOption->GetFunction( 0 )->GetNumberOfParameters() > 2 )
-      {
-      retainLabelPosteriorImages = true;
-      }
-    if( outputOption->GetFunction( 0 )->GetNumberOfParameters() > 3 )
-      {
-      retainAtlasVotingImages = true;
-      }
-    }
-
-//   typename OptionType::Pointer retainLabelPosteriorOption = parser->GetOption( "retain-label-posterior-images" );
-//   if( retainLabelPosteriorOption && retainLabelPosteriorOption->GetNumberOfFunctions() > 0 )
-//     {
-//     retainLabelPosteriorImages = parser->Convert<bool>( retainLabelPosteriorOption->GetFunction()->GetName() );
-//     }
-//
-//   typename OptionType::Pointer retainAtlasVotingOption = parser->GetOption( "retain-atlas-voting-images" );
-//   if( retainAtlasVotingOption && retainAtlasVotingOption->GetNumberOfFunctions() > 0 )
-//     {
-//     retainAtlasVotingImages = parser->Convert<bool>( retainAtlasVotingOption->GetFunction()->GetName() );
-//     }
 
   bool constrainSolutionToNonnegativeWeights = false;
 
@@ -286,6 +279,13 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
     constrainSolutionToNonnegativeWeights = parser->Convert<bool>( constrainWeightsOption->GetFunction()->GetName() );
     }
 
+  typename OptionType::Pointer maxLabelsOption = parser->GetOption( "max-labels-per-voxel" );
+  if( maxLabelsOption && maxLabelsOption->GetNumberOfFunctions() > 0 )
+    {
+    fusionFilter->SetMaximumNumberOfLabelsPerVoxel(
+      parser->Convert<unsigned int>( maxLabelsOption->GetFunction()->GetName() ) );
+    }
+
   typename OptionType::Pointer metricOption = parser->GetOption( "patch-metric" );
   if( metricOption && metricOption->GetNumberOfFunctions() > 0 )
     {
@@ -306,54 +306,86 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
       }
     }
 
-  fusionFilter->SetRetainAtlasVotingWeightImages( retainAtlasVotingImages );
-  fusionFilter->SetRetainLabelPosteriorProbabilityImages( retainLabelPosteriorImages );
   fusionFilter->SetConstrainSolutionToNonnegativeWeights( constrainSolutionToNonnegativeWeights );
 
-  // Get the target image
+  // Get the target image(s).  Every target-image option is one target.  With
+  // more than one (batch mode) the atlases are read once and each target is
+  // fused in turn, writing the outputs of the corresponding output option.
 
-  unsigned int numberOfTargetModalities = 0;
+  typename OptionType::Pointer targetImageOption = parser->GetOption( "target-image" );
+  if( !targetImageOption || targetImageOption->GetNumberOfFunctions() == 0 )
+    {
+    if( verbose )
+      {
+      std::cerr << "Target image(s) not specified." << std::endl;
+      }
+    return EXIT_FAILURE;
+    }
 
-  typename FusionFilterType::InputImageList targetImageList;
+  const unsigned int numberOfTargets = targetImageOption->GetNumberOfFunctions();
+  if( numberOfTargets > 1 && ( !outputOption || outputOption->GetNumberOfFunctions() != numberOfTargets ) )
+    {
+    if( verbose )
+      {
+      std::cerr << "Each target image needs its own output option." << std::endl;
+      }
+    return EXIT_FAILURE;
+    }
 
-  typename OptionType::Pointer targetImageOption = parser->GetOption( "target-image" );
-  if( targetImageOption && targetImageOption->GetNumberOfFunctions() )
+  unsigned int numberOfTargetModalities = 0;
+  std::vector<std::string> targetFileNames( numberOfTargets );
+  for( unsigned int t = 0; t < numberOfTargets; t++ )
+    {
+    unsigned int numberOfModalities = 1;
+    if( targetImageOption->GetFunction( t )->GetNumberOfParameters() == 0 )
+      {
+      targetFileNames[t] = targetImageOption->GetFunction( t )->GetName();
+      }
+    else
+      {
+      numberOfModalities = targetImageOption->GetFunction( t )->GetNumberOfParameters();
+      targetFileNames[t] = targetImageOption->GetFunction( t )->GetParameter( 0 );
+      }
+    if( t == 0 )
+      {
+      numberOfTargetModalities = numberOfModalities;
+      }
+    else if( numberOfModalities != numberOfTargetModalities )
+      {
+      if( verbose )
+        {
+        std::cerr << "All targets must have the same number of modalities." << std::endl;
+        }
+      return EXIT_FAILURE;
+      }
+    }
+
+  auto readTargetImages = [&]( unsigned int t ) -> typename FusionFilterType::InputImageList
     {
-    if( targetImageOption->GetFunction( 0 )->GetNumberOfParameters() == 0 )
+    typename FusionFilterType::InputImageList targetImageList;
+    if( targetImageOption->GetFunction( t )->GetNumberOfParameters() == 0 )
       {
       typename ImageType::Pointer targetImage = nullptr;
 
-      std::string targetFile = targetImageOption->GetFunction( 0 )->GetName();
+      std::string targetFile = targetImageOption->GetFunction( t )->GetName();
       ReadImage<ImageType>( targetImage, targetFile.c_str() );
 
       targetImageList.push_back( targetImage );
-
-      numberOfTargetModalities = 1;
       }
     else
       {
-      numberOfTargetModalities = targetImageOption->GetFunction( 0 )->GetNumberOfParameters();
       for( unsigned int n = 0; n < numberOfTargetModalities; n++ )
         {
         typename ImageType::Pointer targetImage = nullptr;
 
-        std::string targetFile = targetImageOption->GetFunction( 0 )->GetParameter( n );
+        std::string targetFile = targetImageOption->GetFunction( t )->GetParameter( n );
         ReadImage<ImageType>( targetImage, targetFile.c_str() );
 
         targetImageList.push_back( targetImage );
         }
       }
-    }
-  else
-    {
-    if( verbose )
-      {
-      std::cerr << "Target image(s) not specified." << std::endl;
-      }
-    return EXIT_FAILURE;
-    }
-
-  fusionFilter->SetTargetImage( targetImageList );
+    return targetImageList;
+    };
 
   // Get the atlas images and segmentations
 
@@ -391,6 +423,10 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
     numberOfAtlasSegmentations = 0;
     }
 
+  std::vector<typename FusionFilterType::InputImageList> atlasImageLists( numberOfAtlases );
+  std::vector<typename LabelImageType::Pointer>          atlasSegmentations( numberOfAtlases );
+  std::vector<std::string>                               atlasFileNames( numberOfAtlases );
+
   for( unsigned int m = 0; m < numberOfAtlases; m++ )
     {
     typename FusionFilterType::InputImageList atlasImageList;
@@ -413,6 +449,7 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
       std::string atlasFile = atlasImageOption->GetFunction( m )->GetName();
       ReadImage<ImageType>( atlasImage, atlasFile.c_str() );
       atlasImageList.push_back( atlasImage );
+      atlasFileNames[m] = atlasFile;
       }
     else
       {
@@ -438,17 +475,36 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
 
         atlasImageList.push_back( atlasImage );
         }
+      atlasFileNames[m] = atlasImageOption->GetFunction( m )->GetParameter( 0 );
       }
     if( numberOfAtlasSegmentations > 0 )
       {
       std::string atlasSegmentationFile = atlasSegmentationOption->GetFunction( m )->GetName();
       ReadImage<LabelImageType>( atlasSegmentation, atlasSegmentationFile.c_str() );
       }
-    fusionFilter->AddAtlas( atlasImageList, atlasSegmentation );
+    atlasImageLists[m] = atlasImageList;
+    atlasSegmentations[m] = atlasSegmentation;
+    }
+
+  // In batch mode the patch statistics of the atlases are computed once and
+  // shared by all targets.
+
+  std::vector<typename FusionFilterType::PatchMomentImagesList> atlasPatchMomentImages( numberOfAtlases );
+  if( numberOfTargets > 1 )
+    {
+    for( unsigned int m = 0; m < numberOfAtlases; m++ )
+      {
+      for( unsigned int n = 0; n < atlasImageLists[m].size(); n++ )
+        {
+        atlasPatchMomentImages[m].push_back( fusionFilter->ComputePatchMomentImages( atlasImageLists[m][n] ) );
+        }
+      }
     }
 
   // Get the exclusion images
 
+  std::vector<std::pair<LabelType, typename LabelImageType::Pointer> > exclusionImages;
+
   typename OptionType::Pointer exclusionImageOption = parser->GetOption( "exclusion-image" );
   if( exclusionImageOption && exclusionImageOption->GetNumberOfFunctions() )
     {
@@ -459,170 +515,367 @@ int antsJointFusion( itk::ants::CommandLineParser *parser )
       typename LabelImageType::Pointer exclusionImage = nullptr;
       std::string exclusionFile = exclusionImageOption->GetFunction( n )->GetParameter( 0 );
       ReadImage<LabelImageType>( exclusionImage, exclusionFile.c_str() );
-      fusionFilter->AddLabelExclusionImage( label, exclusionImage );
+      exclusionImages.push_back( std::make_pair( label, exclusionImage ) );
       }
     }
 
   // Get the mask
 
+  typename MaskImageType::Pointer maskImage = nullptr;
+
   typename itk::ants::CommandLineParser::OptionType::Pointer maskImageOption =
     parser->GetOption( "mask-image" );
   if( maskImageOption && maskImageOption->GetNumberOfFunctions() )
     {
-    typename MaskImageType::Pointer maskImage = nullptr;
-
     std::string inputFile = maskImageOption->GetFunction( 0 )->GetName();
     ReadImage<MaskImageType>( maskImage, inputFile.c_str() );
+    }
 
-    fusionFilter->SetMaskImage( maskImage );
+  unsigned int numberOfConcurrentTargets = 1;
+  typename OptionType::Pointer concurrentTargetsOption = parser->GetOption( "concurrent-targets" );
+  if( numberOfTargets > 1 && concurrentTargetsOption && concurrentTargetsOption->GetNumberOfFunctions() )
+    {
+    numberOfConcurrentTargets = parser->Convert<unsigned int>( concurrentTargetsOption->GetFunction( 0 )->GetName() );
+    numberOfConcurrentTargets = std::max( 1u, std::min( numberOfConcurrentTargets, numberOfTargets ) );
     }
 
-  // Run the fusion program
+  // Run the fusion program for each target
 
-  itk::TimeProbe timer;
-  timer.Start();
+  std::vector<int>          targetStatus( numberOfTargets, EXIT_FAILURE );
+  std::vector<unsigned int> targetNumberOfAtlases( numberOfTargets, 0 );
+  std::vector<double>       targetElapsedTime( numberOfTargets, 0.0 );
+  std::vector<double>       targetMemoryChange( numberOfTargets, 0.0 );
+  std::vector<double>       targetMemoryInUse( numberOfTargets, 0.0 );
+  std::mutex                outputMutex;
 
-  if( verbose )
+  // Atlases are matched to targets by canonical path, so that the same file
+  // given through a different relative path or a link is still left out.
+  std::vector<std::string> targetRealPaths( numberOfTargets );
+  std::vector<std::string> atlasRealPaths( numberOfAtlases );
+  if( numberOfTargets > 1 )
     {
-    typedef CommandProgressUpdate<FusionFilterType> CommandType;
-    typename CommandType::Pointer observer = CommandType::New();
-    fusionFilter->AddObserver( itk::ProgressEvent(), observer );
+    for( unsigned int t = 0; t < numberOfTargets; t++ )
+      {
+      targetRealPaths[t] = itksys::SystemTools::GetRealPath( targetFileNames[t] );
+      }
+    for( unsigned int m = 0; m < numberOfAtlases; m++ )
+      {
+      atlasRealPaths[m] = itksys::SystemTools::GetRealPath( atlasFileNames[m] );
+      }
     }
 
-  try
-    {
-    fusionFilter->Update();
-    }
-  catch( itk::ExceptionObject & e )
+  auto fuseTarget = [&]( unsigned int t )
     {
-    if( verbose )
+    itk::TimeProbe   timer;
+    itk::MemoryProbe memoryProbe;
+    timer.Start();
+    memoryProbe.Start();
+
+    typename FusionFilterType::Pointer filter = fusionFilter;
+    if( numberOfTargets > 1 )
       {
-      std::cerr << "Exception caught: " << e << std::endl;
+      filter = FusionFilterType::New();
+      filter->SetAlpha( fusionFilter->GetAlpha() );
+      filter->SetBeta( fusionFilter->GetBeta() );
+      filter->SetNeighborhoodSearchRadius( fusionFilter->GetNeighborhoodSearchRadius() );
+      if( searchRadiusImage.IsNotNull() )
+        {
+        filter->SetNeighborhoodSearchRadiusImage( GraftSharedImage( searchRadiusImage.GetPointer() ) );
+        }
+      filter->SetNeighborhoodPatchRadius( fusionFilter->GetNeighborhoodPatchRadius() );
+      filter->SetSimilarityMetric( fusionFilter->GetSimilarityMetric() );
+      filter->SetConstrainSolutionToNonnegativeWeights( fusionFilter->GetConstrainSolutionToNonnegativeWeights() );
+      filter->SetMaximumNumberOfLabelsPerVoxel( fusionFilter->GetMaximumNumberOfLabelsPerVoxel() );
+      filter->SetNumberOfWorkUnits( std::max( 1u, fusionFilter->GetNumberOfWorkUnits() / numberOfConcurrentTargets ) );
       }
-    return EXIT_FAILURE;
-    }
 
-  timer.Stop();
+    // Check if the user wants to retain atlas voting and/or label posterior images
 
-  if( verbose )
-    {
-    std::cout << std::endl << std::endl;
-    fusionFilter->Print( std::cout, 3 );
-    }
+    typename OptionType::OptionFunctionType::Pointer outputFunction = nullptr;
+    if( outputOption && outputOption->GetNumberOfFunctions() )
+      {
+      outputFunction = outputOption->GetFunction( t );
+      }
+    filter->SetRetainLabelPosteriorProbabilityImages( outputFunction && outputFunction->GetNumberOfParameters() > 2 );
+    filter->SetRetainAtlasVotingWeightImages( outputFunction && outputFunction->GetNumberOfParameters() > 3 );
 
-  // write the output
+    filter->SetTargetImage( readTargetImages( t ) );
 
-  if( verbose )
-    {
-    std::cout << std::endl << "Writing output:" << std::endl;
-    }
-  if( outputOption && outputOption->GetNumberOfFunctions() )
-    {
-    std::string labelFusionName;
-    std::string intensityFusionName;
-    std::string labelPosteriorName;
-    std::string atlasVotingName;
+    // An atlas which is also the target is left out (e.g., leave-one-out evaluation).
+    // In batch mode the filter of each target gets its own views of the shared
+    // images, since updating a filter sets the requested regions of its inputs.
+    unsigned int numberOfTargetAtlases = 0;
+    for( unsigned int m = 0; m < numberOfAtlases; m++ )
+      {
+      if( numberOfTargets > 1 )
+        {
+        if( atlasRealPaths[m] == targetRealPaths[t] )
+          {
+          continue;
+          }
+        typename FusionFilterType::InputImageList atlasImageList;
+        for( unsigned int n = 0; n < atlasImageLists[m].size(); n++ )
+          {
+          atlasImageList.push_back( GraftSharedImage( atlasImageLists[m][n].GetPointer() ) );
+          }
+        filter->AddAtlas( atlasImageList, GraftSharedImage( atlasSegmentations[m].GetPointer() ) );
+        }
+      else
+        {
+        filter->AddAtlas( atlasImageLists[m], atlasSegmentations[m] );
+        }
+      if( !atlasPatchMomentImages[m].empty() )
+        {
+        filter->SetAtlasPatchMomentImages( numberOfTargetAtlases, atlasPatchMomentImages[m] );
+        }
+      numberOfTargetAtlases++;
+      }
+    targetNumberOfAtlases[t] = numberOfTargetAtlases;
+    if( numberOfTargetAtlases < 2 )
+      {
+      if( verbose )
+        {
+        std::lock_guard<std::mutex> lock( outputMutex );
+        std::cerr << "At least 2 atlases are required (target " << targetFileNames[t] << ")." << std::endl;
+        }
+      return;
+      }
 
-    if( outputOption->GetFunction( 0 )->GetNumberOfParameters() == 0 )
+    for( unsigned int n = 0; n < exclusionImages.size(); n++ )
       {
-      if( numberOfAtlasSegmentations != 0 )
+      if( numberOfTargets > 1 )
         {
-        labelFusionName = outputOption->GetFunction( 0 )->GetName();
+        filter->AddLabelExclusionImage( exclusionImages[n].first,
+          GraftSharedImage( exclusionImages[n].second.GetPointer() ) );
         }
       else
         {
-        intensityFusionName = outputOption->GetFunction( 0 )->GetName();
+        filter->AddLabelExclusionImage( exclusionImages[n].first, exclusionImages[n].second );
         }
       }
-    if( outputOption->GetFunction( 0 )->GetNumberOfParameters() > 0 )
+    if( maskImage.IsNotNull() )
       {
-      if( numberOfAtlasSegmentations != 0 )
+      if( numberOfTargets > 1 )
         {
-        labelFusionName = outputOption->GetFunction( 0 )->GetParameter( 0 );
+        filter->SetMaskImage( GraftSharedImage( maskImage.GetPointer() ) );
+        }
+      else
+        {
+        filter->SetMaskImage( maskImage );
         }
       }
-    if( outputOption->GetFunction( 0 )->GetNumberOfParameters() > 1 )
+
+    if( verbose && numberOfConcurrentTargets == 1 )
       {
-      intensityFusionName = outputOption->GetFunction( 0 )->GetParameter( 1 );
+      if( numberOfTargets > 1 )
+        {
+        std::cout << std::endl << "Target " << targetFileNames[t] << std::endl;
+        }
+      typedef CommandProgressUpdate<FusionFilterType> CommandType;
+      typename CommandType::Pointer observer = CommandType::New();
+      filter->AddObserver( itk::ProgressEvent(), observer );
       }
-    if( outputOption->GetFunction( 0 )->GetNumberOfParameters() > 2 )
+
+    try
       {
-      if( numberOfAtlasSegmentations != 0 )
+      filter->Update();
+      }
+    catch( itk::ExceptionObject & e )
+      {
+      if( verbose )
         {
-        labelPosteriorName = outputOption->GetFunction( 0 )->GetParameter( 2 );
+        std::lock_guard<std::mutex> lock( outputMutex );
+        std::cerr << "Exception caught: " << e << std::endl;
         }
+      return;
       }
-    if( outputOption->GetFunction( 0 )->GetNumberOfParameters() > 3 )
+
+    if( verbose && numberOfTargets == 1 )
       {
-      atlasVotingName = outputOption->GetFunction( 0 )->GetParameter( 3 );
+      std::cout << std::endl << std::endl;
+      filter->Print( std::cout, 3 );
       }
 
-    if( !labelFusionName.empty() )
+    // write the output
+
+    if( verbose && numberOfConcurrentTargets == 1 )
       {
-      WriteImage<LabelImageType>( fusionFilter->GetOutput(), labelFusionName.c_str() );
+      std::cout << std::endl << "Writing output:" << std::endl;
       }
-    if( !intensityFusionName.empty() )
+    if( outputFunction )
       {
-      itk::NumericSeriesFileNames::Pointer fileNamesCreator = itk::NumericSeriesFileNames::New();
-      fileNamesCreator->SetStartIndex( 1 );
-      fileNamesCreator->SetEndIndex( numberOfAtlasModalities );
-      fileNamesCreator->SetSeriesFormat( intensityFusionName.c_str() );
+      std::string labelFusionName;
+      std::string intensityFusionName;
+      std::string labelPosteriorName;
+      std::string atlasVotingName;
 
-      const std::vector<std::string> & imageNames = fileNamesCreator->GetFileNames();
-      for( unsigned int i = 0; i < imageNames.size(); i++ )
+      if( outputFunction->GetNumberOfParameters() == 0 )
         {
-        if( verbose )
+        if( numberOfAtlasSegmentations != 0 )
+          {
+          labelFusionName = outputFunction->GetName();
+          }
+        else
           {
-          std::cout << "  Writing intensity fusion image (modality " << i + 1 << ")" << std::endl;
+          intensityFusionName = outputFunction->GetName();
           }
-        typename ImageType::Pointer jointIntensityFusionImage
-          = fusionFilter->GetJointIntensityFusionImage( i );
-        WriteImage<ImageType>( jointIntensityFusionImage, imageNames[i].c_str() );
         }
-      }
-    if( !labelPosteriorName.empty() && fusionFilter->GetRetainLabelPosteriorProbabilityImages() )
-      {
-      typename FusionFilterType::LabelSetType labelSet = fusionFilter->GetLabelSet();
-
-      typename FusionFilterType::LabelSetType::const_iterator labelIt;
-      for( labelIt = labelSet.begin(); labelIt != labelSet.end(); ++labelIt )
+      if( outputFunction->GetNumberOfParameters() > 0 )
         {
-        if( *labelIt == 0 )
+        if( numberOfAtlasSegmentations != 0 )
           {
-          continue;
+          labelFusionName = outputFunction->GetParameter( 0 );
           }
-        if( verbose )
+        }
+      if( outputFunction->GetNumberOfParameters() > 1 )
+        {
+        intensityFusionName = outputFunction->GetParameter( 1 );
+        }
+      if( outputFunction->GetNumberOfParameters() > 2 )
+        {
+        if( numberOfAtlasSegmentations != 0 )
           {
-          std::cout << "  Writing label probability image (label " << *labelIt << ")" << std::endl;
+          labelPosteriorName = outputFunction->GetParameter( 2 );
           }
+        }
+      if( outputFunction->GetNumberOfParameters() > 3 )
+        {
+        atlasVotingName = outputFunction->GetParameter( 3 );
+        }
 
-        char buffer[256];
-        std::snprintf( buffer, sizeof( buffer ), labelPosteriorName.c_str(), *labelIt );
-        WriteImage<typename FusionFilterType::ProbabilityImageType>( fusionFilter->GetLabelPosteriorProbabilityImage( *labelIt ), buffer );
+      if( !labelFusionName.empty() )
+        {
+        WriteImage<LabelImageType>( filter->GetOutput(), labelFusionName.c_str() );
         }
-      }
-    if( !atlasVotingName.empty() && fusionFilter->GetRetainAtlasVotingWeightImages() )
-      {
-      itk::NumericSeriesFileNames::Pointer fileNamesCreator = itk::NumericSeriesFileNames::New();
-      fileNamesCreator->SetStartIndex( 1 );
-      fileNamesCreator->SetEndIndex( numberOfAtlases );
-      fileNamesCreator->SetSeriesFormat( atlasVotingName.c_str() );
+      if( !intensityFusionName.empty() )
+        {
+        itk::NumericSeriesFileNames::Pointer fileNamesCreator = itk::NumericSeriesFileNames::New();
+        fileNamesCreator->SetStartIndex( 1 );
+        fileNamesCreator->SetEndIndex( numberOfAtlasModalities );
+        fileNamesCreator->SetSeriesFormat( intensityFusionName.c_str() );
 
-      const std::vector<std::string> & imageNames = fileNamesCreator->GetFileNames();
-      for( unsigned int i = 0; i < imageNames.size(); i++ )
+        const std::vector<std::string> & imageNames = fileNamesCreator->GetFileNames();
+        for( unsigned int i = 0; i < imageNames.size(); i++ )
+          {
+          if( verbose && numberOfConcurrentTargets == 1 )
+            {
+            std::cout << "  Writing intensity fusion image (modality " << i + 1 << ")" << std::endl;
+            }
+          typename ImageType::Pointer jointIntensityFusionImage
+            = filter->GetJointIntensityFusionImage( i );
+          WriteImage<ImageType>( jointIntensityFusionImage, imageNames[i].c_str() );
+          }
+        }
+      if( !labelPosteriorName.empty() && filter->GetRetainLabelPosteriorProbabilityImages() )
         {
-        if( verbose )
+        typename FusionFilterType::LabelSetType labelSet = filter->GetLabelSet();
+
+        typename FusionFilterType::LabelSetType::const_iterator labelIt;
+        for( labelIt = labelSet.begin(); labelIt != labelSet.end(); ++labelIt )
           {
-          std::cout << "  Writing atlas voting image (atlas " << i+1 << ")" << std::endl;
+          if( *labelIt == 0 )
+            {
+            continue;
+            }
+          if( verbose && numberOfConcurrentTargets == 1 )
+            {
+            std::cout << "  Writing label probability image (label " << *labelIt << ")" << std::endl;
+            }
+
+          char buffer[256];
+          std::snprintf( buffer, sizeof( buffer ), labelPosteriorName.c_str(), *labelIt );
+          WriteImage<typename FusionFilterType::ProbabilityImageType>( filter->GetLabelPosteriorProbabilityImage( *labelIt ), buffer );
+          }
+        }
+      if( !atlasVotingName.empty() && filter->GetRetainAtlasVotingWeightImages() )
+        {
+        itk::NumericSeriesFileNames::Pointer fileNamesCreator = itk::NumericSeriesFileNames::New();
+        fileNamesCreator->SetStartIndex( 1 );
+        fileNamesCreator->SetEndIndex( numberOfTargetAtlases );
+        fileNamesCreator->SetSeriesFormat( atlasVotingName.c_str() );
+
+        const std::vector<std::string> & imageNames = fileNamesCreator->GetFileNames();
+        for( unsigned int i = 0; i < imageNames.size(); i++ )
+          {
+          if( verbose && numberOfConcurrentTargets == 1 )
+            {
+            std::cout << "  Writing atlas voting image (atlas " << i+1 << ")" << std::endl;
+            }
+          WriteImage<typename FusionFilterType::ProbabilityImageType>( filter->GetAtlasVotingWeightImage( i ), imageNames[i].c_str() );
           }
-        WriteImage<typename FusionFilterType::ProbabilityImageType>( fusionFilter->GetAtlasVotingWeightImage( i ), imageNames[i].c_str() );
         }
       }
+
+    itk::MemoryUsageObserver memoryUsageObserver;
+    targetMemoryInUse[t] = memoryUsageObserver.GetMemoryUsage();
+
+    memoryProbe.Stop();
+    timer.Stop();
+
+    targetElapsedTime[t] = timer.GetMean();
+    targetMemoryChange[t] = memoryProbe.GetMean();
+    targetStatus[t] = EXIT_SUCCESS;
+
+    if( verbose )
+      {
+      std::lock_guard<std::mutex> lock( outputMutex );
+      if( numberOfTargets > 1 )
+        {
+        std::cout << "Target " << targetFileNames[t] << ":  ";
+        }
+      std::cout << "Elapsed time: " << timer.GetMean() << std::endl;
+      }
+    };
+
+  // The parser keeps the functions of an option in reverse order, so count
+  // down to fuse the targets in command line order.
+  if( numberOfConcurrentTargets == 1 )
+    {
+    for( unsigned int k = 0; k < numberOfTargets; k++ )
+      {
+      fuseTarget( numberOfTargets - 1 - k );
+      }
+    }
+  else
+    {
+    // each fusion filter is multithreaded itself, so the targets get their own
+    // threads rather than occupying the global pool
+    itk::PlatformMultiThreader::Pointer targetThreader = itk::PlatformMultiThreader::New();
+    targetThreader->SetNumberOfWorkUnits( numberOfConcurrentTargets );
+    targetThreader->ParallelizeArray( 0, numberOfTargets,
+      [&]( itk::SizeValueType k )
+        {
+        fuseTarget( numberOfTargets - 1 - k );
+        },
+      nullptr );
     }
 
-  if( verbose )
+  typename OptionType::Pointer reportOption = parser->GetOption( "batch-report" );
+  if( reportOption && reportOption->GetNumberOfFunctions() )
     {
-    std::cout << "Elapsed time: " << timer.GetMean() << std::endl;
+    std::ofstream report( reportOption->GetFunction( 0 )->GetName().c_str() );
+    if( !report )
+      {
+      std::cerr << "Unable to write the batch report " << reportOption->GetFunction( 0 )->GetName() << std::endl;
+      return EXIT_FAILURE;
+      }
+    report << "Target,Atlases,ElapsedTime(s),MemoryChange(" << itk::MemoryProbe().GetUnit()
+           << "),MemoryInUse(" << itk::MemoryProbe().GetUnit() << "),Status" << std::endl;
+    for( unsigned int k = 0; k < numberOfTargets; k++ )
+      {
+      const unsigned int t = numberOfTargets - 1 - k;
+      report << targetFileNames[t] << "," << targetNumberOfAtlases[t] << "," << targetElapsedTime[t] << ","
+             << targetMemoryChange[t] << "," << targetMemoryInUse[t] << ","
+             << ( targetStatus[t] == EXIT_SUCCESS ? "success" : "failure" ) << std::endl;
+      }
+    }
+
+  for( unsigned int t = 0; t < numberOfTargets; t++ )
+    {
+    if( targetStatus[t] != EXIT_SUCCESS )
+      {
+      return EXIT_FAILURE;
+      }
     }
 
   return EXIT_SUCCESS;
@@ -648,7 +901,11 @@ void ajfInitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
   {
   std::string description =
     std::string( "The target image (or multimodal target images) assumed to be " )
-    + std::string( "aligned to a common image domain." );
+    + std::string( "aligned to a common image domain.  This option can be repeated " )
+    + std::string( "to fuse several targets with the same atlases (batch mode), each " )
+    + std::string( "with its own output option.  The atlases are then read and their " )
+    + std::string( "patch statistics computed only once, and an atlas whose (first) " )
+    + std::string( "image is also the target image is left out for that target." );
 
   OptionType::Pointer option = OptionType::New();
   option->SetLongName( "target-image" );
@@ -746,6 +1003,49 @@ void ajfInitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
   parser->AddOption( option );
   }
 
+  {
+  std::string description =
+    std::string( "Store the label posteriors sparsely, keeping the specified number " )
+    + std::string( "of label slots per voxel and an overflow list for voxels with more " )
+    + std::string( "labels, so the result matches the dense posteriors.  " )
+    + std::string( "Memory then scales with the local label diversity instead of the " )
+    + std::string( "size of the label set, which matters for parcellations with many " )
+    + std::string( "labels.  Default = 0 (one posterior image per label)." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "max-labels-per-voxel" );
+  option->SetUsageOption( 0, "(0)/8" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "In batch mode (several target images), the number of targets which " )
+    + std::string( "are fused at the same time.  The threads are divided among them.  " )
+    + std::string( "Default = 1." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "concurrent-targets" );
+  option->SetUsageOption( 0, "(1)/2" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
+  {
+  std::string description =
+    std::string( "Write a csv file listing, for each target, the number of atlases used, " )
+    + std::string( "the elapsed time, the change in memory use over its fusion and the " )
+    + std::string( "memory in use at its end.  With concurrent targets the memory figures " )
+    + std::string( "are for the whole process." );
+
+  OptionType::Pointer option = OptionType::New();
+  option->SetLongName( "batch-report" );
+  option->SetUsageOption( 0, "report.csv" );
+  option->SetDescription( description );
+  parser->AddOption( option );
+  }
+
   {
   std::string description =
     std::string( "Patch radius for similarity measures.  Default = 2x2x2" );
@@ -817,7 +1117,8 @@ void ajfInitializeCommandLineOptions( itk::ants::CommandLineParser *parser )
   std::string description =
     std::string( "The output is the intensity and/or label fusion image.  Additional " )
     + std::string( "optional outputs include the label posterior probability images " )
-    + std::string( "and the atlas voting weight images." );
+    + std::string( "and the atlas voting weight images.  In batch mode, the output " )
+    + std::string( "options are matched to the target images in order." );
 
   OptionType::Pointer option = OptionType::New();
   option->SetLongName( "output" );
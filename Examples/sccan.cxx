@@ -28,7 +28,14 @@
 #include "itkCSVArray2DDataObject.h"
 #include "itkCSVArray2DFileReader.h"
 #include "itkExtractImageFilter.h"
+#include "itkMultiThreaderBase.h"
+#include "itkPlatformMultiThreader.h"
 #include "ReadWriteData.h"
+#include <cmath>
+#include <cstdlib>
+#include <mutex>
+#include <numeric>
+#include <random>
 
 namespace ants
 {
@@ -420,6 +427,184 @@ PermuteMatrix( vnl_matrix<TComp> q, bool doperm = true)
   return q_perm;
 }
 
+template <typename TComp, typename TGenerator>
+vnl_matrix<TComp>
+PermuteMatrixRows( const vnl_matrix<TComp> & q, TGenerator & generator )
+{
+  std::vector<unsigned long> permvec( q.rows() );
+  std::iota( permvec.begin(), permvec.end(), 0 );
+  std::shuffle( permvec.begin(), permvec.end(), generator );
+
+  vnl_matrix<TComp> q_perm( q.rows(), q.columns() );
+  for( unsigned long i = 0; i < q.rows(); i++ )
+    {
+    q_perm.set_row( i, q.get_row( permvec[i] ) );
+    }
+  return q_perm;
+}
+
+/** Settings shared by the permutation tests (see the random-seed, warm-start
+ * and permutation-early-stop options). */
+struct SCCANPermutationSettings
+{
+  unsigned int randomSeed;
+  bool         warmStart;
+  double       earlyStopAlpha;
+};
+
+inline SCCANPermutationSettings
+GetSCCANPermutationSettings( itk::ants::CommandLineParser *sccanparser )
+{
+  SCCANPermutationSettings settings;
+  settings.randomSeed = 0;
+  settings.warmStart = false;
+  settings.earlyStopAlpha = 0.0;
+
+  itk::ants::CommandLineParser::OptionType::Pointer seedOption =
+    sccanparser->GetOption( "random-seed" );
+  if( seedOption && seedOption->GetNumberOfFunctions() > 0 )
+    {
+    settings.randomSeed = sccanparser->Convert<unsigned int>( seedOption->GetFunction()->GetName() );
+    }
+  else
+    {
+    char* envSeed = getenv( "ANTS_RANDOM_SEED" );
+    if( envSeed != nullptr )
+      {
+      settings.randomSeed = static_cast<unsigned int>( std::stoul( envSeed ) );
+      }
+    }
+  if( settings.randomSeed == 0 )
+    {
+    settings.randomSeed = std::random_device()();
+    }
+
+  itk::ants::CommandLineParser::OptionType::Pointer warmStartOption =
+    sccanparser->GetOption( "warm-start" );
+  if( warmStartOption && warmStartOption->GetNumberOfFunctions() > 0 )
+    {
+    settings.warmStart = sccanparser->Convert<bool>( warmStartOption->GetFunction()->GetName() );
+    }
+
+  itk::ants::CommandLineParser::OptionType::Pointer earlyStopOption =
+    sccanparser->GetOption( "permutation-early-stop" );
+  if( earlyStopOption && earlyStopOption->GetNumberOfFunctions() > 0 )
+    {
+    settings.earlyStopAlpha = sccanparser->Convert<double>( earlyStopOption->GetFunction()->GetName() );
+    }
+  return settings;
+}
+
+/** Run permutations concurrently.  Each worker solves on its own clone of the
+ * (already solved) solver.  Permutation k draws from a generator seeded with
+ * ( randomSeed, k ), and permutations are run in fixed-size batches, so the
+ * counts (and the early stopping point) do not depend on the number of threads.
+ *
+ * permutationFunction( solver, generator, exceeds ) solves one permutation and
+ * sets exceeds[i] = 1 for every statistic that exceeded its unpermuted value.
+ * The first numberOfTestedStatistics entries are the reported p-values and the
+ * ones used for early stopping; any others (e.g. per-weight counts) are only
+ * accumulated.  Returns the number of permutations that were run. */
+template <typename TSolver, typename TPermutationFunction>
+unsigned long
+RunSCCANPermutations( TSolver * solver, unsigned long numberOfPermutations,
+                      unsigned int numberOfStatistics, unsigned int numberOfTestedStatistics,
+                      const SCCANPermutationSettings & settings, bool verbose,
+                      TPermutationFunction permutationFunction,
+                      vnl_vector<unsigned long> & exceedanceCounts )
+{
+  constexpr unsigned long batchSize = 64;
+  constexpr unsigned long minimumNumberOfPermutationsForEarlyStop = 100;
+  // two-sided 99.9% normal quantile for the p-value confidence interval
+  constexpr double confidenceMultiplier = 3.29;
+
+  exceedanceCounts.set_size( numberOfStatistics );
+  exceedanceCounts.fill( 0 );
+
+  const unsigned int numberOfWorkers = static_cast<unsigned int>( std::max( static_cast<itk::SizeValueType>( 1 ),
+    std::min( static_cast<itk::SizeValueType>( std::min( batchSize, numberOfPermutations ) ),
+              static_cast<itk::SizeValueType>( itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads() ) ) ) );
+
+  std::vector<typename TSolver::Pointer> solvers( numberOfWorkers );
+  for( unsigned int w = 0; w < numberOfWorkers; w++ )
+    {
+    solvers[w] = solver->Clone();
+    }
+
+  // The solvers run ITK filters internally (cluster thresholding), so use
+  // dedicated threads rather than the shared pool.
+  itk::PlatformMultiThreader::Pointer threader = itk::PlatformMultiThreader::New();
+  threader->SetNumberOfWorkUnits( numberOfWorkers );
+
+  std::vector<vnl_vector<unsigned char> > batchExceeds( batchSize );
+
+  unsigned long completed = 0;
+  while( completed < numberOfPermutations )
+    {
+    const unsigned long currentBatchSize = std::min( batchSize, numberOfPermutations - completed );
+
+    threader->ParallelizeArray( 0, numberOfWorkers,
+      [&]( itk::SizeValueType worker )
+        {
+        for( unsigned long b = worker; b < currentBatchSize; b += numberOfWorkers )
+          {
+          std::seed_seq seeds{ settings.randomSeed, static_cast<unsigned int>( completed + b ) };
+          std::mt19937 generator( seeds );
+
+          batchExceeds[b].set_size( numberOfStatistics );
+          batchExceeds[b].fill( 0 );
+          permutationFunction( solvers[worker].GetPointer(), generator, batchExceeds[b] );
+          }
+        }, nullptr );
+
+    for( unsigned long b = 0; b < currentBatchSize; b++ )
+      {
+      for( unsigned int i = 0; i < numberOfStatistics; i++ )
+        {
+        exceedanceCounts[i] += batchExceeds[b][i];
+        }
+      }
+    completed += currentBatchSize;
+
+    if( verbose )
+      {
+      std::cout << " permutations " << completed << " p-values";
+      for( unsigned int i = 0; i < numberOfTestedStatistics; i++ )
+        {
+        std::cout << " " << static_cast<double>( exceedanceCounts[i] ) / static_cast<double>( completed );
+        }
+      std::cout << std::endl;
+      }
+
+    // Stop once every p-value is confidently on one side of alpha.
+    if( settings.earlyStopAlpha > 0 && completed >= minimumNumberOfPermutationsForEarlyStop &&
+        completed < numberOfPermutations )
+      {
+      bool resolved = true;
+      for( unsigned int i = 0; i < numberOfTestedStatistics && resolved; i++ )
+        {
+        const double n = static_cast<double>( completed );
+        const double pvalue = static_cast<double>( exceedanceCounts[i] ) / n;
+        const double variance = std::max( pvalue * ( 1.0 - pvalue ), 1.0 / n );
+        if( std::fabs( pvalue - settings.earlyStopAlpha ) <= confidenceMultiplier * std::sqrt( variance / n ) )
+          {
+          resolved = false;
+          }
+        }
+      if( resolved )
+        {
+        if( verbose )
+          {
+          std::cout << " p-values resolved at alpha = " << settings.earlyStopAlpha << " after "
+                    << completed << " permutations." << std::endl;
+          }
+        break;
+        }
+      }
+    }
+  return completed;
+}
+
 template <unsigned int ImageDimension, typename PixelType>
 int matrixOperation( itk::ants::CommandLineParser::OptionType *option,
                      itk::ants::CommandLineParser::OptionType * /* outputOption */ = nullptr )
@@ -461,13 +646,17 @@ CompareMatrixSizes(  vnl_matrix<RealType> & p,  vnl_matrix<RealType> & q )
 }
 
 template <typename PixelType>
-void
+bool
 ReadMatrixFromCSVorImageSet( std::string matname, vnl_matrix<PixelType> & p )
 {
   typedef PixelType                             Scalar;
   typedef itk::Image<PixelType, 2>              MatrixImageType;
   typedef itk::ImageFileReader<MatrixImageType> matReaderType;
   std::string ext = itksys::SystemTools::GetFilenameExtension( matname );
+  if( ANTSIsBinaryMatrixFileName( matname ) )
+    {
+    return ReadBinaryMatrix<PixelType>( p, matname );
+    }
   if( strcmp(ext.c_str(), ".csv") == 0 )
     {
     typedef itk::CSVArray2DFileReader<double> ReaderType;
@@ -490,7 +679,7 @@ ReadMatrixFromCSVorImageSet( std::string matname, vnl_matrix<PixelType> & p )
     typedef itk::CSVArray2DDataObject<double> DataFrameObjectType;
     DataFrameObjectType::Pointer dfo = reader->GetOutput();
     p = dfo->GetMatrix();
-    return;
+    return true;
     }
   else
     {
@@ -499,7 +688,39 @@ ReadMatrixFromCSVorImageSet( std::string matname, vnl_matrix<PixelType> & p )
     matreader1->Update();
     p = CopyImageToVnlMatrix<MatrixImageType, Scalar>( matreader1->GetOutput() );
     }
-  return;
+  return true;
+}
+
+// Whether an image lies on the same voxel grid as the mask, with the
+// tolerances ITK filters use when checking their inputs.
+template <typename ImageType>
+bool
+ImageMatchesMaskGrid( const ImageType * image, const ImageType * mask )
+{
+  const double coordinateTolerance = 1.0e-6 * mask->GetSpacing()[0];
+  const double directionTolerance = 1.0e-6;
+
+  if( image->GetLargestPossibleRegion() != mask->GetLargestPossibleRegion() ||
+      image->GetBufferedRegion() != mask->GetBufferedRegion() )
+    {
+    return false;
+    }
+  for( unsigned int d = 0; d < ImageType::ImageDimension; d++ )
+    {
+    if( std::fabs( image->GetSpacing()[d] - mask->GetSpacing()[d] ) > coordinateTolerance ||
+        std::fabs( image->GetOrigin()[d] - mask->GetOrigin()[d] ) > coordinateTolerance )
+      {
+      return false;
+      }
+    for( unsigned int e = 0; e < ImageType::ImageDimension; e++ )
+      {
+      if( std::fabs( image->GetDirection()(d, e) - mask->GetDirection()(d, e) ) > directionTolerance )
+        {
+        return false;
+        }
+      }
+    }
+  return true;
 }
 
 template <unsigned int ImageDimension, typename PixelType>
@@ -515,17 +736,25 @@ ConvertImageListToMatrix( std::string imagelist, std::string maskfn, std::string
   typedef itk::Image<PixelType, 2>              MatrixImageType;
   typedef itk::ImageFileReader<ImageType>       ReaderType;
   typename ImageType::Pointer mask;
-  ReadImage<ImageType>( mask, maskfn.c_str() );
-  unsigned long voxct = 0;
-  typedef itk::ImageRegionIteratorWithIndex<ImageType> Iterator;
-  Iterator mIter( mask, mask->GetLargestPossibleRegion() );
-  for(  mIter.GoToBegin(); !mIter.IsAtEnd(); ++mIter )
+  if( !ReadImage<ImageType>( mask, maskfn.c_str() ) )
     {
-    if( mIter.Get() >= 0.5 )
+    return zmat;
+    }
+
+  // the offsets of the in-mask voxels into the pixel buffer are computed once
+  // and shared by all subjects
+  std::vector<itk::OffsetValueType> maskOffsets;
+  const PixelType *                 maskBuffer = mask->GetBufferPointer();
+  const itk::SizeValueType          numberOfVoxels = mask->GetBufferedRegion().GetNumberOfPixels();
+  for( itk::SizeValueType n = 0; n < numberOfVoxels; n++ )
+    {
+    if( maskBuffer[n] >= 0.5 )
       {
-      voxct++;
+      maskOffsets.push_back( n );
       }
     }
+  unsigned long voxct = maskOffsets.size();
+
   std::vector<std::string> image_fn_list;
   // first, count the number of files
   constexpr unsigned int maxChar = 512;
@@ -566,33 +795,67 @@ ConvertImageListToMatrix( std::string imagelist, std::string maskfn, std::string
   //      // std::cout <<" have voxct " << voxct << " and nsub " << filecount << " or " << image_fn_list.size()<<
   // std::endl;
 
+  // read the subjects concurrently, each one straight into its row of the
+  // matrix.  every worker holds a single image at a time.
   MatrixType matrix(xsize, ysize);
   matrix.Fill(0);
-  for( unsigned int j = 0; j < image_fn_list.size(); j++ )
+  std::vector<std::string> failedImages;
+  std::mutex               failedImagesMutex;
+
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, xsize,
+    [&]( itk::SizeValueType j )
     {
     typename ReaderType::Pointer reader2 = ReaderType::New();
     reader2->SetFileName( image_fn_list[j] );
-    reader2->Update();
-    unsigned long xx = 0, yy = 0, tvoxct = 0;
-    xx = j;
-    for(  mIter.GoToBegin(); !mIter.IsAtEnd(); ++mIter )
+    try
       {
-      if( mIter.Get() >= 0.5 )
-        {
-        yy = tvoxct;
-        matrix[xx][yy] = reader2->GetOutput()->GetPixel(mIter.GetIndex() );
-        if( j == 0 )
-          {
-          std::string colname = std::string("V") + sccan_to_string<unsigned long>(tvoxct);
-          ColumnHeaders.push_back( colname );
-          }
-        tvoxct++;
-        }
+      reader2->Update();
       }
+    catch( itk::ExceptionObject & )
+      {
+      std::lock_guard<std::mutex> lock( failedImagesMutex );
+      failedImages.push_back( image_fn_list[j] );
+      return;
+      }
+    const ImageType * image = reader2->GetOutput();
+    if( !ImageMatchesMaskGrid<ImageType>( image, mask.GetPointer() ) )
+      {
+      std::lock_guard<std::mutex> lock( failedImagesMutex );
+      failedImages.push_back( image_fn_list[j] );
+      return;
+      }
+    const PixelType * buffer = image->GetBufferPointer();
+    double *          row = matrix[j];
+    for( unsigned long k = 0; k < voxct; k++ )
+      {
+      row[k] = buffer[maskOffsets[k]];
+      }
+    }, nullptr );
+
+  if( !failedImages.empty() )
+    {
+    for( unsigned int i = 0; i < failedImages.size(); i++ )
+      {
+      std::cerr << "Could not read " << failedImages[i] << " or it does not match the mask " << maskfn
+                << std::endl;
+      }
+    return zmat;
+    }
+
+  if( ANTSIsBinaryMatrixFileName( outname ) )
+    {
+    WriteBinaryMatrix<double>( matrix, outname );
+    return matrix;
     }
 
   if( strcmp(ext.c_str(), ".csv") == 0 )
     {
+    for( unsigned long k = 0; k < voxct; k++ )
+      {
+      std::string colname = std::string("V") + sccan_to_string<unsigned long>(k);
+      ColumnHeaders.push_back( colname );
+      }
     // write out the array2D object
     typedef itk::CSVNumericObjectFileWriter<double, 1, 1> WriterType;
     WriterType::Pointer writer = WriterType::New();
@@ -618,24 +881,13 @@ ConvertImageListToMatrix( std::string imagelist, std::string maskfn, std::string
     region.SetSize( tilesize );
     typename MatrixImageType::Pointer matimage =
       AllocImage<MatrixImageType>(region);
-    for( unsigned int j = 0; j < image_fn_list.size(); j++ )
+    // index[0] is the subject and index[1] the voxel
+    PixelType * matbuffer = matimage->GetBufferPointer();
+    for( unsigned long yy = 0; yy < ysize; yy++ )
       {
-      typename ReaderType::Pointer reader2 = ReaderType::New();
-      reader2->SetFileName( image_fn_list[j] );
-      reader2->Update();
-      unsigned long xx = 0, yy = 0, tvoxct = 0;
-      xx = j;
-      typename MatrixImageType::IndexType mind;
-      for(  mIter.GoToBegin(); !mIter.IsAtEnd(); ++mIter )
+      for( unsigned long xx = 0; xx < xsize; xx++ )
         {
-        if( mIter.Get() >= 0.5 )
-          {
-          yy = tvoxct;
-          mind[0] = xx;
-          mind[1] = yy;
-          matimage->SetPixel(mind, reader2->GetOutput()->GetPixel(mIter.GetIndex() ) );
-          tvoxct++;
-          }
+        matbuffer[xx + yy * xsize] = matrix[xx][yy];
         }
       }
 
@@ -920,7 +1172,10 @@ ConvertCSVVectorToImage( std::string csvfn, std::string maskfn, std::string outn
   /** we refer to the two view matrices as P and Q */
   vMatrix p;
   p.fill(0);
-  ReadMatrixFromCSVorImageSet<Scalar>(csvfn, p);
+  if( !ReadMatrixFromCSVorImageSet<Scalar>(csvfn, p) )
+    {
+    return EXIT_FAILURE;
+    }
   if( mct != p.rows() && mct != p.cols() )
     {
     // std::cout << " csv-vec rows " << p.rows() << " cols " << p.cols() << " mask non zero elements " << mct  <<  std::endl;
@@ -1171,7 +1426,10 @@ int SVD_One_View( itk::ants::CommandLineParser *sccanparser, unsigned int permct
 
   std::string pmatname = std::string(option->GetFunction( 0 )->GetParameter( 0 ) );
   vMatrix     p;
-  ReadMatrixFromCSVorImageSet<Scalar>(pmatname, p);
+  if( !ReadMatrixFromCSVorImageSet<Scalar>(pmatname, p) )
+    {
+    return EXIT_FAILURE;
+    }
   typename ImageType::Pointer mask1 = nullptr;
   bool have_p_mask = false;
   have_p_mask = ReadImage<ImageType>(mask1, option->GetFunction( 0 )->GetParameter( 1 ).c_str() );
@@ -1185,7 +1443,10 @@ int SVD_One_View( itk::ants::CommandLineParser *sccanparser, unsigned int permct
     std::string outname = "prior.mhd";
     ConvertImageListToMatrix<ImageDimension, double>( imagelistPrior, option->GetFunction( 0 )->GetParameter(
                                                         1 ), outname );
-    ReadMatrixFromCSVorImageSet<Scalar>(outname, priorROIMat);
+    if( !ReadMatrixFromCSVorImageSet<Scalar>(outname, priorROIMat) )
+      {
+      return EXIT_FAILURE;
+      }
     // ReadMatrixFromCSVorImageSet<Scalar>(priorScaleFile, priorScaleMat);
     }
   // std::cout << " frac nonzero " << FracNonZero1 << std::endl;
@@ -1211,7 +1472,10 @@ int SVD_One_View( itk::ants::CommandLineParser *sccanparser, unsigned int permct
     if( nuis_img.length() > 3 && svd_option != 7 )
       {
       // std::cout << " nuis_img " << nuis_img << std::endl;
-      ReadMatrixFromCSVorImageSet<Scalar>(nuis_img, r);
+      if( !ReadMatrixFromCSVorImageSet<Scalar>(nuis_img, r) )
+        {
+        return EXIT_FAILURE;
+        }
       if( CompareMatrixSizes<Scalar>( p, r ) == EXIT_FAILURE )
         {
         return EXIT_FAILURE;
@@ -1345,32 +1609,39 @@ int SVD_One_View( itk::ants::CommandLineParser *sccanparser, unsigned int permct
   // permutation test
   if(  ( svd_option == 4 || svd_option == 5 ) && permct > 0 )
     {
-    // std::cout << "Begin" << permct << " permutations " << std::endl;
-    unsigned long perm_exceed_ct = 0;
-    for( unsigned long pct = 0; pct <= permct; pct++ )
+    const SCCANPermutationSettings permutationSettings = GetSCCANPermutationSettings( sccanparser );
+    if( permutationSettings.warmStart )
+      {
+      sccanobj->SetWarmStartVariates( sccanobj->GetVariatesP(), sccanobj->GetVariatesQ() );
+      }
+    const vMatrix originalP = sccanobj->GetOriginalMatrixP();
+    const vMatrix originalR = sccanobj->GetOriginalMatrixR();
+
+    auto permutationFunction = [&]( SCCANType * permobj, std::mt19937 & generator,
+                                    vnl_vector<unsigned char> & exceeds )
       {
       // 0. compute permutation for q ( switch around rows )
-      vMatrix p_perm = PermuteMatrix<Scalar>( sccanobj->GetOriginalMatrixP() );
-      vMatrix r_perm = PermuteMatrix<Scalar>( sccanobj->GetOriginalMatrixR() );
-      sccanobj->SetMatrixP( p_perm );
-      sccanobj->SetMatrixR( r_perm );
+      permobj->SetMatrixP( PermuteMatrixRows<Scalar>( originalP, generator ) );
+      permobj->SetMatrixR( PermuteMatrixRows<Scalar>( originalR, generator ) );
       double permcorr = 1.e9;
-      // if ( pct > 76 && pct < 79 )
       if( svd_option == 4 )
         {
-        permcorr = sccanobj->NetworkDecomposition(n_evec);                      // cgsparse
+        permcorr = permobj->NetworkDecomposition( n_evec );                      // cgsparse
         }
       if( svd_option == 5 )
         {
-        permcorr = sccanobj->LASSO( n_evec );                      // cgsparse
+        permcorr = permobj->LASSO( n_evec );                      // cgsparse
         }
-      if( permcorr < truecorr )
-        {
-        perm_exceed_ct++;
-        }
-      // end solve cca permutation
-      // std::cout << permcorr << " p-value " <<  (double)perm_exceed_ct
-      //  / (pct + 1) << " ct " << pct << " true " << truecorr << " vs " << permcorr << std::endl;
+      exceeds[0] = ( permcorr < truecorr );
+      };
+
+    vnl_vector<unsigned long> perm_exceed_ct;
+    const unsigned long       numberOfPermutations = RunSCCANPermutations( sccanobj.GetPointer(), permct + 1, 1, 1,
+      permutationSettings, verbosity > 0, permutationFunction, perm_exceed_ct );
+    if( verbosity > 0 )
+      {
+      std::cout << " p-value " << static_cast<double>( perm_exceed_ct[0] ) / numberOfPermutations
+                << " ct " << numberOfPermutations << " true " << truecorr << std::endl;
       }
     }
   return EXIT_SUCCESS;
@@ -1467,11 +1738,17 @@ int SCCA_vnl( itk::ants::CommandLineParser *sccanparser, unsigned int permct, un
   std::string pmatname = std::string(option->GetFunction( 0 )->GetParameter( 0 ) );
   vMatrix     p;
   // // std::cout <<" read-p "<< std::endl;
-  ReadMatrixFromCSVorImageSet<Scalar>(pmatname, p);
+  if( !ReadMatrixFromCSVorImageSet<Scalar>(pmatname, p) )
+    {
+    return EXIT_FAILURE;
+    }
   std::string qmatname = std::string(option->GetFunction( 0 )->GetParameter( 1 ) );
   vMatrix     q;
   // // std::cout <<" read-q "<< std::endl;
-  ReadMatrixFromCSVorImageSet<Scalar>(qmatname, q);
+  if( !ReadMatrixFromCSVorImageSet<Scalar>(qmatname, q) )
+    {
+    return EXIT_FAILURE;
+    }
   //  // std::cout << q.get_row(0) << std::endl;
   //  // std::cout << q.mean() << std::endl;
   if( CompareMatrixSizes<Scalar>( p, q ) == EXIT_FAILURE )
@@ -1556,88 +1833,92 @@ int SCCA_vnl( itk::ants::CommandLineParser *sccanparser, unsigned int permct, un
   sermuted ;  2. scca ;  3. test corrs and weights significance */
   if( permct > 0 )
     {
-    vnl_vector<unsigned long> perm_exceed_ct( sccancorrs.size(),  0 );
-    vVector                   w_p_signif_ct(w_p.size(), 0);
-    vVector                   w_q_signif_ct(w_q.size(), 0);
-    for( unsigned long pct = 0; pct <= permct; pct++ )
+    const SCCANPermutationSettings permutationSettings = GetSCCANPermutationSettings( sccanparser );
+    if( permutationSettings.warmStart )
+      {
+      sccanobj->SetWarmStartVariates( sccanobj->GetVariatesP(), sccanobj->GetVariatesQ() );
+      }
+    vMatrix qraw;
+    if( !ReadMatrixFromCSVorImageSet<Scalar>(qmatname, qraw) )
+      {
+      return EXIT_FAILURE;
+      }
+
+    // statistics are packed as [ correlations, P weights, Q weights ]
+    const unsigned int numberOfCorrelations = sccancorrs.size();
+    auto permutationFunction = [&]( SCCANType * permobj, std::mt19937 & generator,
+                                    vnl_vector<unsigned char> & exceeds )
       {
       // 0. compute permutation for q ( switch around rows )
-      sccanobj->SetFractionNonZeroP(FracNonZero1);
-      sccanobj->SetFractionNonZeroQ(FracNonZero2);
-      sccanobj->SetGradStep( gradstep );
-      sccanobj->SetMatrixP( p );
-      ReadMatrixFromCSVorImageSet<Scalar>(qmatname, q);
-      vMatrix q_perm = PermuteMatrix<Scalar>( q );
-      sccanobj->SetMatrixQ( q_perm );
-      sccanobj->SparsePartialArnoldiCCA(n_evec );
-      vVector permcorrs = sccanobj->GetCanonicalCorrelations();
-      // std::cout << " perm-corr " << permcorrs << " ct " << pct << " p-values ";
-      for( unsigned int kk = 0; kk < permcorrs.size(); kk++ )
+      permobj->SetFractionNonZeroP(FracNonZero1);
+      permobj->SetFractionNonZeroQ(FracNonZero2);
+      permobj->SetGradStep( gradstep );
+      permobj->SetMatrixP( p );
+      permobj->SetMatrixQ( PermuteMatrixRows<Scalar>( qraw, generator ) );
+      permobj->SparsePartialArnoldiCCA(n_evec );
+      vVector permcorrs = permobj->GetCanonicalCorrelations();
+      for( unsigned int kk = 0; kk < permcorrs.size() && kk < numberOfCorrelations; kk++ )
         {
-        if( permcorrs[kk] > sccancorrs[kk] )
-          {
-          perm_exceed_ct[kk]++;
-          }
-        // std::cout <<  ( double ) perm_exceed_ct[kk] / (pct + 1) << " ";
+        exceeds[kk] = ( permcorrs[kk] > sccancorrs[kk] );
         }
-      // std::cout << std::endl;
-      vVector w_p_perm = sccanobj->GetVariateP(0);
-      vVector w_q_perm = sccanobj->GetVariateQ(0);
+      vVector w_p_perm = permobj->GetVariateP(0);
+      vVector w_q_perm = permobj->GetVariateQ(0);
       for( unsigned long j = 0; j < w_p.size(); j++ )
         {
-        if( w_p_perm(j) > w_p(j) )
-          {
-          w_p_signif_ct(j) = w_p_signif_ct(j)++;
-          }
+        exceeds[numberOfCorrelations + j] = ( w_p_perm(j) > w_p(j) );
         }
       for( unsigned long j = 0; j < w_q.size(); j++ )
         {
-        if( w_q_perm(j) > w_q(j) )
-          {
-          w_q_signif_ct(j) = w_q_signif_ct(j)++;
-          }
+        exceeds[numberOfCorrelations + w_p.size() + j] = ( w_q_perm(j) > w_q(j) );
         }
       // end solve cca permutation
-      if( pct == permct )
-        {
-        // std::cout << "final_p_values" << ",";
-        for( unsigned int kk = 0; kk < permcorrs.size(); kk++ )
-          {
-          // std::cout << ( double ) perm_exceed_ct[kk] / (pct + 1) << ",";
-          }
-        // std::cout << "x" << std::endl;
+      };
 
-        std::ofstream myfile;
-        std::string   fnmp = filepre + std::string("_summary.csv");
-        myfile.open(fnmp.c_str(), std::ios::out );
-        myfile << "TypeOfMeasure" << ",";
-        for( unsigned int kk = 0; kk < permcorrs.size(); kk++ )
-          {
-          std::string colname = std::string("Variate") + sccan_to_string<unsigned int>(kk);
-          myfile << colname << ",";
-          }
-        myfile << "x" << std::endl;
-        myfile << "final_p_values" << ",";
-        for( unsigned int kk = 0; kk < permcorrs.size(); kk++ )
-          {
-          myfile << ( double ) perm_exceed_ct[kk] / (pct + 1) << ",";
-          }
-        myfile << "x" << std::endl;
-        myfile << "corrs" << ",";
-        for( unsigned int kk = 0; kk < permcorrs.size(); kk++ )
-          {
-          myfile << sccancorrs[kk]  << ",";
-          }
-        myfile << "x" << std::endl;
-        myfile.close();
-        }
+    vnl_vector<unsigned long> exceedanceCounts;
+    const unsigned long       numberOfPermutations = RunSCCANPermutations( sccanobj.GetPointer(), permct + 1,
+      numberOfCorrelations + w_p.size() + w_q.size(), numberOfCorrelations, permutationSettings, verbosity > 0,
+      permutationFunction, exceedanceCounts );
+
+    vVector w_p_signif_ct(w_p.size(), 0);
+    vVector w_q_signif_ct(w_q.size(), 0);
+    for( unsigned long j = 0; j < w_p.size(); j++ )
+      {
+      w_p_signif_ct(j) = exceedanceCounts[numberOfCorrelations + j];
       }
+    for( unsigned long j = 0; j < w_q.size(); j++ )
+      {
+      w_q_signif_ct(j) = exceedanceCounts[numberOfCorrelations + w_p.size() + j];
+      }
+
+    std::ofstream myfile;
+    std::string   fnmp = filepre + std::string("_summary.csv");
+    myfile.open(fnmp.c_str(), std::ios::out );
+    myfile << "TypeOfMeasure" << ",";
+    for( unsigned int kk = 0; kk < numberOfCorrelations; kk++ )
+      {
+      std::string colname = std::string("Variate") + sccan_to_string<unsigned int>(kk);
+      myfile << colname << ",";
+      }
+    myfile << "x" << std::endl;
+    myfile << "final_p_values" << ",";
+    for( unsigned int kk = 0; kk < numberOfCorrelations; kk++ )
+      {
+      myfile << ( double ) exceedanceCounts[kk] / numberOfPermutations << ",";
+      }
+    myfile << "x" << std::endl;
+    myfile << "corrs" << ",";
+    for( unsigned int kk = 0; kk < numberOfCorrelations; kk++ )
+      {
+      myfile << sccancorrs[kk]  << ",";
+      }
+    myfile << "x" << std::endl;
+    myfile.close();
     unsigned long psigct = 0, qsigct = 0;
     for( unsigned long j = 0; j < w_p.size(); j++ )
       {
       if( w_p(j) > pinvtoler )
         {
-        w_p_signif_ct(j) = 1.0 - (double)w_p_signif_ct(j) / (double)(permct);
+        w_p_signif_ct(j) = 1.0 - (double)w_p_signif_ct(j) / (double)(numberOfPermutations);
         if( w_p_signif_ct(j) > 0.949 )
           {
           psigct++;
@@ -1652,7 +1933,7 @@ int SCCA_vnl( itk::ants::CommandLineParser *sccanparser, unsigned int permct, un
       {
       if( w_q(j) > pinvtoler )
         {
-        w_q_signif_ct(j) = 1.0 - (double)w_q_signif_ct(j) / (double)(permct);
+        w_q_signif_ct(j) = 1.0 - (double)w_q_signif_ct(j) / (double)(numberOfPermutations);
         if( w_q_signif_ct(j) > 0.949 )
           {
           qsigct++;
@@ -1714,13 +1995,22 @@ int mSCCA_vnl( itk::ants::CommandLineParser *sccanparser,
   /** read the matrix images */
   std::string pmatname = std::string(option->GetFunction( 0 )->GetParameter( 0 ) );
   vMatrix     pin;
-  ReadMatrixFromCSVorImageSet<Scalar>(pmatname, pin);
+  if( !ReadMatrixFromCSVorImageSet<Scalar>(pmatname, pin) )
+    {
+    return EXIT_FAILURE;
+    }
   std::string qmatname = std::string(option->GetFunction( 0 )->GetParameter( 1 ) );
   vMatrix     qin;
-  ReadMatrixFromCSVorImageSet<Scalar>(qmatname, qin);
+  if( !ReadMatrixFromCSVorImageSet<Scalar>(qmatname, qin) )
+    {
+    return EXIT_FAILURE;
+    }
   std::string rmatname = std::string(option->GetFunction( 0 )->GetParameter( 2 ) );
   vMatrix     rin;
-  ReadMatrixFromCSVorImageSet<Scalar>(rmatname, rin);
+  if( !ReadMatrixFromCSVorImageSet<Scalar>(rmatname, rin) )
+    {
+    return EXIT_FAILURE;
+    }
   if( CompareMatrixSizes<Scalar>( pin, qin ) == EXIT_FAILURE )
     {
     return EXIT_FAILURE;
@@ -2561,6 +2851,43 @@ private:
     sccanparser->AddOption( option );
     }
 
+    {
+    std::string description =
+      std::string( "Seed for the permutation tests.  Permutation k always uses the " )
+      + std::string( "random stream derived from (seed, k), so results are reproducible " )
+      + std::string( "independent of the number of threads.  If not specified (or zero), " )
+      + std::string( "the ANTS_RANDOM_SEED environment variable is used, otherwise a " )
+      + std::string( "random seed." );
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "random-seed" );
+    option->SetUsageOption( 0, "seedValue" );
+    option->SetDescription( description );
+    sccanparser->AddOption( option );
+    }
+
+    {
+    std::string description =
+      std::string( "Start each permutation from the unpermuted solution rather than " )
+      + std::string( "the default initialization (sparse two-view scca and lasso)." );
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "warm-start" );
+    option->SetUsageOption( 0, "0/1" );
+    option->SetDescription( description );
+    sccanparser->AddOption( option );
+    }
+
+    {
+    std::string description =
+      std::string( "Stop the permutation test early once every p-value is resolved, i.e. " )
+      + std::string( "its 99.9% confidence interval excludes alpha (checked every 64 " )
+      + std::string( "permutations after the first 100).  Zero (default) runs all permutations." );
+    OptionType::Pointer option = OptionType::New();
+    option->SetLongName( "permutation-early-stop" );
+    option->SetUsageOption( 0, "alpha" );
+    option->SetDescription( description );
+    sccanparser->AddOption( option );
+    }
+
     {
     std::string description =
       std::string( "Smoothing function for variates" );
@@ -2767,7 +3094,9 @@ private:
     std::string description =
       std::string( "takes a list of image files names (one per line) " )
       + std::string(
-        "and converts it to a 2D matrix / image in binary or csv format depending on the filetype used to define the output." );
+        "and converts it to a 2D matrix / image in binary or csv format depending on the filetype used to define the output. " )
+      + std::string(
+        "A .bmat output is a raw, memory-mappable matrix which sccan reads wherever it accepts a .csv matrix." );
     OptionType::Pointer option = OptionType::New();
     option->SetLongName( "imageset-to-matrix" );
     option->SetUsageOption( 0, "[list.txt,mask.nii.gz]" );
@@ -25,6 +25,9 @@
 #include "itkMath.h"
 #include "itkDiscreteGaussianImageFilter.h"
 #include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkMultiThreaderBase.h"
+#include <cstdint>
+#include <vector>
 
 namespace itk
 {
@@ -81,6 +84,11 @@ AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplace
       interp.GetPointer() );
 
   this->m_RobustnessParameter = -1.e19;
+
+  this->m_SamplingStrategy = NONE;
+  this->m_SamplingPercentage = 1.0;
+  this->m_SamplingStride = 1;
+  this->m_SamplingIteration = 0;
 }
 
 /**
@@ -115,6 +123,10 @@ AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplace
   os << m_MovingImageBinSize << std::endl;
   os << indent << "InterpolatorIsBSpline: ";
   os << m_InterpolatorIsBSpline << std::endl;
+  os << indent << "SamplingStrategy: ";
+  os << m_SamplingStrategy << std::endl;
+  os << indent << "SamplingPercentage: ";
+  os << m_SamplingPercentage << std::endl;
 }
 
 /**
@@ -194,53 +206,43 @@ AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplace
 
    */
 
-  double movingImageMin = NumericTraits<double>::max();
-  double movingImageMax = NumericTraits<double>::NonpositiveMin();
-  double fixedImageMin = NumericTraits<double>::max();
-  double fixedImageMax = NumericTraits<double>::NonpositiveMin();
+  // intensity ranges are gathered per work unit and then reduced
+  const unsigned int  numberOfWorkUnits = this->GetNumberOfWorkUnits();
+  std::vector<double> movingImageMins( numberOfWorkUnits, NumericTraits<double>::max() );
+  std::vector<double> movingImageMaxs( numberOfWorkUnits, NumericTraits<double>::NonpositiveMin() );
+  std::vector<double> fixedImageMins( numberOfWorkUnits, NumericTraits<double>::max() );
+  std::vector<double> fixedImageMaxs( numberOfWorkUnits, NumericTraits<double>::NonpositiveMin() );
 
-  typedef ImageRegionConstIterator<MovingImageType> MovingIteratorType;
-  MovingIteratorType movingImageIterator(
-    this->m_MovingImage, this->m_MovingImage->GetBufferedRegion() );
-  for( movingImageIterator.GoToBegin();
-       !movingImageIterator.IsAtEnd(); ++movingImageIterator )
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, numberOfWorkUnits,
+    [&]( SizeValueType workUnit )
     {
-    bool takesample = true;
-
-    if( this->m_FixedImageMask )
+    typedef ImageRegionConstIteratorWithIndex<MovingImageType> MovingIteratorType;
+    MovingIteratorType movingImageIterator( this->m_MovingImage,
+                                            this->GetWorkUnitRegion( workUnit, numberOfWorkUnits ) );
+    for( movingImageIterator.GoToBegin();
+         !movingImageIterator.IsAtEnd(); ++movingImageIterator )
       {
-      if( this->m_FixedImageMask->GetPixel( movingImageIterator.GetIndex() ) < 1.e-6 )
+      if( this->m_FixedImageMask &&
+          this->m_FixedImageMask->GetPixel( movingImageIterator.GetIndex() ) < 1.e-6 )
         {
-        takesample = false;
+        continue;
         }
-      }
 
-    if( takesample )
-      {
       double sample = static_cast<double>( movingImageIterator.Get() );
       double fsample = static_cast<double>( this->m_FixedImage->GetPixel( movingImageIterator.GetIndex() ) );
 
-      if( sample < movingImageMin )
-        {
-        movingImageMin = sample;
-        }
-
-      if( sample > movingImageMax )
-        {
-        movingImageMax = sample;
-        }
-
-      if( fsample < fixedImageMin )
-        {
-        fixedImageMin = fsample;
-        }
-
-      if( fsample > fixedImageMax )
-        {
-        fixedImageMax = fsample;
-        }
+      movingImageMins[workUnit] = std::min( movingImageMins[workUnit], sample );
+      movingImageMaxs[workUnit] = std::max( movingImageMaxs[workUnit], sample );
+      fixedImageMins[workUnit] = std::min( fixedImageMins[workUnit], fsample );
+      fixedImageMaxs[workUnit] = std::max( fixedImageMaxs[workUnit], fsample );
       }
-    }
+    }, nullptr );
+
+  const double movingImageMin = *std::min_element( movingImageMins.begin(), movingImageMins.end() );
+  const double movingImageMax = *std::max_element( movingImageMaxs.begin(), movingImageMaxs.end() );
+  const double fixedImageMin = *std::min_element( fixedImageMins.begin(), fixedImageMins.end() );
+  const double fixedImageMax = *std::max_element( fixedImageMaxs.begin(), fixedImageMaxs.end() );
   this->m_MovingImageTrueMax = movingImageMax;
   this->m_FixedImageTrueMax = fixedImageMax;
   this->m_MovingImageTrueMin = movingImageMin;
@@ -330,50 +332,65 @@ void
 AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
 ::GetProbabilities()
 {
-  typedef ImageRegionConstIteratorWithIndex<FixedImageType> RandomIterator;
-  RandomIterator randIter( this->m_FixedImage, this->m_FixedImage->GetLargestPossibleRegion() );
   this->m_FixedImageMarginalPDF->FillBuffer(0);
   this->m_MovingImageMarginalPDF->FillBuffer(0);
 
   // Reset the joint pdfs to zero
   m_JointPDF->FillBuffer( 0.0 );
 
-  unsigned long  nSamples = 0;
-  RandomIterator iter( this->m_FixedImage, this->m_FixedImage->GetLargestPossibleRegion() );
-  for( iter.GoToBegin(); !iter.IsAtEnd(); ++iter )
+  this->m_SamplingStride = std::max( static_cast<OffsetValueType>( 1 ),
+                                     static_cast<OffsetValueType>( 1.0 / this->m_SamplingPercentage + 0.5 ) );
+  this->m_SamplingIteration++;
+
+  // Each work unit fills its own partial joint histogram over a slab of
+  // the fixed image; the partial histograms are summed afterwards, so the
+  // result does not depend on the number of threads.
+  const unsigned int numberOfWorkUnits = this->GetNumberOfWorkUnits();
+  const SizeValueType numberOfJointPDFBins = m_NumberOfHistogramBins * m_NumberOfHistogramBins;
+  std::vector<std::vector<double> > partialJointPDFs( numberOfWorkUnits );
+
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, numberOfWorkUnits,
+    [&]( SizeValueType workUnit )
     {
-    bool takesample = true;
-    if( this->m_FixedImageMask )
-      {
-      if( this->m_FixedImageMask->GetPixel( iter.GetIndex() ) < 1.e-6 )
-        {
-        takesample = false;
-        }
-      }
+    std::vector<double> & partialJointPDF = partialJointPDFs[workUnit];
+    partialJointPDF.assign( numberOfJointPDFBins, 0.0 );
 
-    if( takesample )
+    typedef ImageRegionConstIteratorWithIndex<FixedImageType> RandomIterator;
+    RandomIterator iter( this->m_FixedImage, this->GetWorkUnitRegion( workUnit, numberOfWorkUnits ) );
+    for( iter.GoToBegin(); !iter.IsAtEnd(); ++iter )
       {
       // Get sampled index
       FixedImageIndexType index = iter.GetIndex();
-/*    bool inimage=true;
-    for (unsigned int dd=0; dd<ImageDimension; dd++)
-      {
-        if ( index[dd] < 1 ||    index[dd] >= static_cast<typename IndexType::IndexValueType>(imagesize[dd]-1) )
-          inimage=false;
-      }
-*/
+      if( this->m_FixedImageMask && this->m_FixedImageMask->GetPixel( index ) < 1.e-6 )
+        {
+        continue;
+        }
+      if( !this->IsVoxelSampled( this->m_FixedImage->ComputeOffset( index ) ) )
+        {
+        continue;
+        }
+
       double movingImageValue = this->GetMovingParzenTerm(  this->m_MovingImage->GetPixel( index )  );
-      double fixedImageValue = this->GetFixedParzenTerm(  this->m_FixedImage->GetPixel( index )  );
+      double fixedImageValue = this->GetFixedParzenTerm(  iter.Get()  );
 
       /** add the paired intensity points to the joint histogram */
       JointPDFPointType jointPDFpoint;
       this->ComputeJointPDFPoint(fixedImageValue, movingImageValue, jointPDFpoint);
       JointPDFIndexType jointPDFIndex;
-      jointPDFIndex.Fill(0);
-      this->m_JointPDF->TransformPhysicalPointToIndex(jointPDFpoint, jointPDFIndex);
-      this->m_JointPDF->SetPixel(jointPDFIndex, this->m_JointPDF->GetPixel(jointPDFIndex) + 1);
+      if( this->m_JointPDF->TransformPhysicalPointToIndex(jointPDFpoint, jointPDFIndex) )
+        {
+        partialJointPDF[jointPDFIndex[0] + jointPDFIndex[1] * m_NumberOfHistogramBins] += 1;
+        }
+      }
+    }, nullptr );
 
-      ++nSamples;
+  JointPDFValueType * jointPDFBuffer = m_JointPDF->GetBufferPointer();
+  for( unsigned int workUnit = 0; workUnit < numberOfWorkUnits; workUnit++ )
+    {
+    for( SizeValueType bin = 0; bin < numberOfJointPDFBins; bin++ )
+      {
+      jointPDFBuffer[bin] += static_cast<JointPDFValueType>( partialJointPDFs[workUnit][bin] );
       }
     }
 
@@ -464,6 +481,63 @@ AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplace
     }
 }
 
+template <typename TFixedImage, typename TMovingImage, typename TDisplacementField>
+unsigned int
+AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::GetNumberOfWorkUnits() const
+{
+  const SizeValueType numberOfSlices =
+    this->m_FixedImage->GetLargestPossibleRegion().GetSize()[ImageDimension - 1];
+  return static_cast<unsigned int>( std::max( static_cast<SizeValueType>( 1 ), std::min( numberOfSlices,
+    static_cast<SizeValueType>( MultiThreaderBase::GetGlobalDefaultNumberOfThreads() ) ) ) );
+}
+
+template <typename TFixedImage, typename TMovingImage, typename TDisplacementField>
+typename TFixedImage::RegionType
+AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::GetWorkUnitRegion( unsigned int workUnit, unsigned int numberOfWorkUnits ) const
+{
+  typename FixedImageType::RegionType region = this->m_FixedImage->GetLargestPossibleRegion();
+  const SizeValueType numberOfSlices = region.GetSize()[ImageDimension - 1];
+  const SizeValueType first = numberOfSlices * workUnit / numberOfWorkUnits;
+  const SizeValueType last = numberOfSlices * ( workUnit + 1 ) / numberOfWorkUnits;
+
+  region.SetIndex( ImageDimension - 1, region.GetIndex()[ImageDimension - 1] + first );
+  region.SetSize( ImageDimension - 1, last - first );
+  return region;
+}
+
+template <typename TFixedImage, typename TMovingImage, typename TDisplacementField>
+bool
+AvantsMutualInformationRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>
+::IsVoxelSampled( OffsetValueType offset ) const
+{
+  switch( this->m_SamplingStrategy )
+    {
+    case REGULAR:
+      {
+      // shift the grid every iteration so all voxels are eventually visited
+      return ( offset + this->m_SamplingIteration ) % this->m_SamplingStride == 0;
+      }
+    case RANDOM:
+      {
+      // hash of (voxel, iteration), so the selection does not depend on
+      // which thread visits the voxel
+      uint64_t z = static_cast<uint64_t>( offset )
+        + 0x9E3779B97F4A7C15ULL * static_cast<uint64_t>( this->m_SamplingIteration );
+      z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+      z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBULL;
+      z = z ^ ( z >> 31 );
+      return static_cast<double>( z >> 11 ) * ( 1.0 / 9007199254740992.0 ) < this->m_SamplingPercentage;
+      }
+    case NONE:
+    default:
+      {
+      return true;
+      }
+    }
+}
+
 /**
  * Get the both Value and Derivative Measure
  */
@@ -14,6 +14,7 @@
 #ifndef __itkAvantsMutualInformationRegistrationFunction_h
 #define __itkAvantsMutualInformationRegistrationFunction_h
 #include <vcl_compiler.h>
+#include <algorithm>
 #include <iostream>
 #include "cmath"
 #include "itkImageFileWriter.h"
@@ -653,6 +654,32 @@ public:
     m_FixedImageMask = img;
   }
 
+  /** Voxel sampling used to build the joint histogram, following the
+   * NONE/REGULAR/RANDOM strategies of the v4 metrics.  REGULAR takes every
+   * n-th voxel and RANDOM a fresh random subset at every iteration, both
+   * keeping roughly SamplingPercentage (0, 1] of the voxels. */
+  typedef enum { NONE, REGULAR, RANDOM } SamplingStrategyType;
+
+  void SetSamplingStrategy( SamplingStrategyType strategy )
+  {
+    m_SamplingStrategy = strategy;
+  }
+
+  SamplingStrategyType GetSamplingStrategy() const
+  {
+    return m_SamplingStrategy;
+  }
+
+  void SetSamplingPercentage( double percentage )
+  {
+    m_SamplingPercentage = std::min( 1.0, std::max( percentage, NumericTraits<double>::epsilon() ) );
+  }
+
+  double GetSamplingPercentage() const
+  {
+    return m_SamplingPercentage;
+  }
+
   /** FixedImage image neighborhood iterator type. */
   typedef ConstNeighborhoodIterator<FixedImageType> FixedImageNeighborhoodIteratorType;
 
@@ -786,6 +813,18 @@ private:
 
   unsigned int        m_Padding;
   JointPDFSpacingType m_JointPDFSpacing;
+
+  /** Slab of the fixed image handled by one histogram work unit. */
+  typename FixedImageType::RegionType GetWorkUnitRegion( unsigned int workUnit, unsigned int numberOfWorkUnits ) const;
+
+  unsigned int GetNumberOfWorkUnits() const;
+
+  bool IsVoxelSampled( OffsetValueType offset ) const;
+
+  SamplingStrategyType m_SamplingStrategy;
+  double               m_SamplingPercentage;
+  OffsetValueType      m_SamplingStride;
+  unsigned long        m_SamplingIteration;
 };
 } // end namespace itk
 
@@ -43,6 +43,8 @@
 // #include "itkJensenTsallisBSplineRegistrationFunction.h"
 
 #include "itkMath.h"
+#include <algorithm>
+#include <cctype>
 
 #include "ANTS_affine_registration2.h"
 
@@ -818,6 +820,32 @@ PICSLAdvancedNormalizationToolKit<TDimension, TReal>
           metric->SetNumberOfHistogramBins(histbins);
           radius.Fill(0);
           metric->SetRadius( radius );
+          if( option->GetFunction( i )->GetNumberOfParameters() > parameterCount )
+            {
+            std::string samplingStrategy = option->GetFunction( i )->GetParameter( parameterCount );
+            std::transform( samplingStrategy.begin(), samplingStrategy.end(), samplingStrategy.begin(), ::tolower );
+            if( samplingStrategy == "regular" )
+              {
+              metric->SetSamplingStrategy( MetricType::REGULAR );
+              }
+            else if( samplingStrategy == "random" )
+              {
+              metric->SetSamplingStrategy( MetricType::RANDOM );
+              }
+            else
+              {
+              metric->SetSamplingStrategy( MetricType::NONE );
+              }
+            parameterCount++;
+            }
+          if( option->GetFunction( i )->GetNumberOfParameters() > parameterCount )
+            {
+            metric->SetSamplingPercentage( this->m_Parser->template Convert<double>(
+                                             option->GetFunction( i )->GetParameter( parameterCount ) ) );
+            parameterCount++;
+            }
+          std::cout << "  Sampling strategy: " << metric->GetSamplingStrategy()
+                    << " percentage: " << metric->GetSamplingPercentage() << std::endl;
           similarityMetric->SetMetric(  metric );
           similarityMetric->SetMaximizeMetric( true );
           this->m_SimilarityMetrics.push_back( similarityMetric );
@@ -982,6 +1010,8 @@ PICSLAdvancedNormalizationToolKit<TDimension, TReal>
     std::string intensityBasedOptions( "[fixedImage,movingImage,weight,radius/OrForMI-#histogramBins]" );
     std::string ccDescription( "CC/cross-correlation/CrossCorrelation" );
     std::string miDescription( "MI/mutual-information/MutualInformation" );
+    std::string miOptions(
+      "[fixedImage,movingImage,weight,#histogramBins,extraParam,<samplingStrategy={None,Regular,Random}>,<samplingPercentage=[0,1]>]" );
     std::string smiDescription( "SMI/spatial-mutual-information/SpatialMutualInformation" );
     std::string prDescription( "PR/probabilistic/Probabilistic" );
     std::string msqDescription(
@@ -989,7 +1019,7 @@ PICSLAdvancedNormalizationToolKit<TDimension, TReal>
     std::string ssdDescription( "SSD --- standard intensity difference." );
     intensityBasedDescription += (
         newLineTabs + ccDescription + intensityBasedOptions
-        + newLineTabs + miDescription + intensityBasedOptions
+        + newLineTabs + miDescription + miOptions
         + newLineTabs + smiDescription + intensityBasedOptions
         + newLineTabs + prDescription + intensityBasedOptions
         + newLineTabs + ssdDescription + intensityBasedOptions
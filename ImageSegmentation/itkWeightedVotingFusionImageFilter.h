@@ -27,6 +27,7 @@
 
 #include <vector>
 #include <map>
+#include <mutex>
 #include <set>
 
 namespace itk
@@ -107,6 +108,9 @@ public:
   typedef vnl_vector<RealType>                       VectorType;
 
   typedef std::map<LabelType, ProbabilityImagePointer>  LabelPosteriorProbabilityMap;
+  typedef unsigned short                                SparseLabelIndexType;
+  typedef std::vector<std::pair<SparseLabelIndexType, float> > SparseLabelSpillList;
+  typedef std::map<OffsetValueType, SparseLabelSpillList>      SparseLabelSpillMap;
   typedef std::map<LabelType, LabelImagePointer>        LabelExclusionMap;
   typedef std::vector<ProbabilityImagePointer>          VotingWeightImageList;
 
@@ -114,6 +118,7 @@ public:
   typedef typename Superclass::NeighborhoodRadiusType             NeighborhoodRadiusType;
   typedef typename Superclass::NeighborhoodOffsetType             NeighborhoodOffsetType;
   typedef typename Superclass::NeighborhoodOffsetListType         NeighborhoodOffsetListType;
+  typedef typename Superclass::PatchMomentImagesList              PatchMomentImagesList;
 
   typedef typename SizeType::SizeValueType                        RadiusValueType;
   typedef Image<RadiusValueType, ImageDimension>                  RadiusImageType;
@@ -133,10 +138,7 @@ public:
    */
   void AddAtlas( InputImageList imageList, LabelImageType *segmentation = nullptr )
     {
-    for( unsigned int i = 0; i < imageList.size(); i++ )
-      {
-      this->m_AtlasImages.push_back( imageList );
-      }
+    this->m_AtlasImages.push_back( imageList );
     if( this->m_NumberOfAtlasModalities == 0 )
       {
       itkDebugMacro( "Setting the number of modalities to " << this->m_NumberOfAtlasModalities );
@@ -157,6 +159,23 @@ public:
     this->UpdateInputs();
     }
 
+  /**
+   * Set the patch moment images (see ComputePatchMomentImages()) of each
+   * modality of the nth atlas.  They are optional and only speed up the patch
+   * search, so precomputing them pays off when the same atlases are used to
+   * label several targets.  They are ignored if their region differs from the
+   * target's.
+   */
+  void SetAtlasPatchMomentImages( SizeValueType n, const PatchMomentImagesList & moments )
+    {
+    if( this->m_AtlasPatchMomentImages.size() <= n )
+      {
+      this->m_AtlasPatchMomentImages.resize( n + 1 );
+      }
+    this->m_AtlasPatchMomentImages[n] = moments;
+    this->Modified();
+    }
+
   /**
    * Set mask image function.  If a binary mask image is specified, only
    * those input image voxels corresponding with mask image values equal
@@ -223,6 +242,18 @@ public:
   itkGetConstMacro( RetainLabelPosteriorProbabilityImages, bool );
   itkBooleanMacro( RetainLabelPosteriorProbabilityImages );
 
+  /**
+   * Set/Get the number of label slots stored inline per voxel.  If nonzero, the
+   * label posteriors are kept sparsely:  each voxel holds only the labels which
+   * received votes together with their accumulated weights, instead of one
+   * full-size image per label.  Once a voxel's slots are full, further labels
+   * go to an overflow list kept for that voxel only, so no vote is dropped and
+   * the result matches the dense posteriors.  The posterior probability images
+   * are then generated on request.  Default = 0 (one image per label).
+   */
+  itkSetMacro( MaximumNumberOfLabelsPerVoxel, unsigned int );
+  itkGetConstMacro( MaximumNumberOfLabelsPerVoxel, unsigned int );
+
   /**
    * Boolean for retaining the voting weights images.  This can have a negative effect
    * on memory use, so it should only be done if one wishes to save the voting weight
@@ -256,6 +287,10 @@ public:
       {
       if( std::find( this->m_LabelSet.begin(), this->m_LabelSet.end(), label ) != this->m_LabelSet.end() )
         {
+        if( this->m_UseSparseLabelPosteriors )
+          {
+          return this->GenerateSparseLabelPosteriorProbabilityImage( label );
+          }
         return this->m_LabelPosteriorProbabilityImages[label];
         }
       else
@@ -336,6 +371,16 @@ private:
 
   void UpdateInputs();
 
+  /** Accumulate a vote (and the weight sum) in the sparse label posteriors of
+   * a voxel.  Safe to call concurrently for overlapping neighborhoods. */
+  void AddSparseLabelVote( OffsetValueType, SparseLabelIndexType, RealType );
+
+  /** The overflow votes of a voxel whose slots are full, or nullptr.  Only
+   * called once the voting is done. */
+  SparseLabelSpillList * GetSparseLabelSpill( OffsetValueType );
+
+  ProbabilityImagePointer GenerateSparseLabelPosteriorProbabilityImage( LabelType );
+
   typedef std::pair<unsigned int, RealType>           DistanceIndexType;
   typedef std::vector<DistanceIndexType>              DistanceIndexVectorType;
 
@@ -353,6 +398,7 @@ private:
   InputImageList                                       m_TargetImage;
   InputImageSetList                                    m_AtlasImages;
   LabelImageList                                       m_AtlasSegmentations;
+  std::vector<PatchMomentImagesList>                   m_AtlasPatchMomentImages;
   LabelExclusionMap                                    m_LabelExclusionImages;
   MaskImagePointer                                     m_MaskImage;
 
@@ -373,12 +419,28 @@ private:
   bool                                                 m_RetainAtlasVotingWeightImages;
   bool                                                 m_ConstrainSolutionToNonnegativeWeights;
 
+  unsigned int                                         m_MaximumNumberOfLabelsPerVoxel;
+  bool                                                 m_UseSparseLabelPosteriors;
+
   ProbabilityImagePointer                              m_WeightSumImage;
 
   RadiusImagePointer                                   m_NeighborhoodSearchRadiusImage;
 
   /** Output variables     */
   LabelPosteriorProbabilityMap                         m_LabelPosteriorProbabilityImages;
+
+  /** Sparse label posteriors:  m_MaximumNumberOfLabelsPerVoxel slots per voxel
+   * (in the buffer order of the weight sum image), each holding one plus the
+   * index of the label in m_LabelList (zero marks an empty slot) and its weight.
+   * Labels beyond the slots of a voxel are kept in the overflow map of the
+   * voxel's lock stripe. */
+  static constexpr unsigned int NumberOfSparseLabelVoteLocks = 1024;
+
+  std::vector<LabelType>                               m_LabelList;
+  std::vector<SparseLabelIndexType>                    m_SparseLabelIndices;
+  std::vector<float>                                   m_SparseLabelWeights;
+  std::vector<SparseLabelSpillMap>                     m_SparseLabelSpills;
+  std::mutex                                           m_SparseLabelVoteLocks[NumberOfSparseLabelVoteLocks];
   VotingWeightImageList                                m_AtlasVotingWeightImages;
 
   InputImageList                                       m_JointIntensityFusionImage;
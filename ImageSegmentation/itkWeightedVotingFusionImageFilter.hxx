@@ -43,7 +43,9 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
   m_Beta( 2.0 ),
   m_RetainLabelPosteriorProbabilityImages( false ),
   m_RetainAtlasVotingWeightImages( false ),
-  m_ConstrainSolutionToNonnegativeWeights( false )
+  m_ConstrainSolutionToNonnegativeWeights( false ),
+  m_MaximumNumberOfLabelsPerVoxel( 0 ),
+  m_UseSparseLabelPosteriors( false )
 {
   this->m_MaskImage = nullptr;
 
@@ -239,6 +241,22 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
     itkExceptionMacro( "The number of target images must be 1 or must be the number of atlas modalities." );
     }
 
+  // Only keep the atlas patch moment images which match the target domain
+  this->m_AtlasPatchMomentImages.resize( this->m_NumberOfAtlases );
+  for( SizeValueType i = 0; i < this->m_NumberOfAtlases; i++ )
+    {
+    for( SizeValueType j = 0; j < this->m_AtlasPatchMomentImages[i].size(); j++ )
+      {
+      if( this->m_AtlasPatchMomentImages[i][j].m_Sum.IsNull() ||
+          this->m_AtlasPatchMomentImages[i][j].m_Sum->GetBufferedRegion() != this->m_TargetImageRegion )
+        {
+        itkWarningMacro( "The patch moment images of atlas " << i << " do not match the target image.  Ignoring them." );
+        this->m_AtlasPatchMomentImages[i].clear();
+        break;
+        }
+      }
+    }
+
   // Find all the unique labels in the atlas segmentations
   this->m_LabelSet.clear();
   for( unsigned int i = 0; i < this->m_NumberOfAtlasSegmentations; i++ )
@@ -257,10 +275,35 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
 
   // Initialize the posterior maps
   this->m_LabelPosteriorProbabilityImages.clear();
+  this->m_LabelList.assign( this->m_LabelSet.begin(), this->m_LabelSet.end() );
+  this->m_SparseLabelIndices.clear();
+  this->m_SparseLabelWeights.clear();
+  this->m_SparseLabelSpills.clear();
+
+  this->m_UseSparseLabelPosteriors = ( this->m_MaximumNumberOfLabelsPerVoxel > 0 );
+  if( this->m_UseSparseLabelPosteriors &&
+      this->m_LabelList.size() >= NumericTraits<SparseLabelIndexType>::max() )
+    {
+    itkWarningMacro( "Too many labels for the sparse label posteriors.  Using one image per label." );
+    this->m_UseSparseLabelPosteriors = false;
+    }
+
+  if( this->m_UseSparseLabelPosteriors )
+    {
+    const SizeValueType numberOfSlots = this->m_TargetImage[0]->GetRequestedRegion().GetNumberOfPixels() *
+      this->m_MaximumNumberOfLabelsPerVoxel;
+    this->m_SparseLabelIndices.resize( numberOfSlots, 0 );
+    this->m_SparseLabelWeights.resize( numberOfSlots, 0.0f );
+    this->m_SparseLabelSpills.resize( NumberOfSparseLabelVoteLocks );
+    }
 
   typename LabelSetType::const_iterator labelIt;
   for( labelIt = this->m_LabelSet.begin(); labelIt != this->m_LabelSet.end(); ++labelIt )
     {
+    if( this->m_UseSparseLabelPosteriors )
+      {
+      break;
+      }
     typename ProbabilityImageType::Pointer labelProbabilityImage = ProbabilityImageType::New();
     labelProbabilityImage->CopyInformation( this->m_TargetImage[0] );
     labelProbabilityImage->SetRegions( this->m_TargetImage[0]->GetRequestedRegion() );
@@ -494,6 +537,13 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
     InputImagePixelVectorType normalizedTargetPatch =
       this->VectorizeImageListPatch( this->m_TargetImage, currentCenterIndex, true );
 
+    // NaN if the target patch is not entirely inside the image
+    double targetPatchSumOfSquares = 0.0;
+    for( SizeValueType k = 0; k < normalizedTargetPatch.size(); k++ )
+      {
+      targetPatchSumOfSquares += itk::Math::sqr( static_cast<double>( normalizedTargetPatch[k] ) );
+      }
+
     absoluteAtlasPatchDifferences.fill( 0.0 );
     originalAtlasPatchIntensities.fill( 0.0 );
 
@@ -514,7 +564,8 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
           }
 
         RealType patchSimilarity = this->ComputeNeighborhoodPatchSimilarity(
-          this->m_AtlasImages[i], searchIndex, normalizedTargetPatch, useOnlyFirstAtlasImage );
+          this->m_AtlasImages[i], searchIndex, normalizedTargetPatch, useOnlyFirstAtlasImage,
+          this->m_AtlasPatchMomentImages[i], targetPatchSumOfSquares );
 
         if( patchSimilarity < minimumPatchSimilarity )
           {
@@ -702,16 +753,30 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
 
           LabelType label = this->m_AtlasSegmentations[i]->GetPixel( minimumIndex );
 
-          if( this->m_LabelSet.find( label ) == this->m_LabelSet.end() )
+          if( this->m_UseSparseLabelPosteriors )
             {
-            continue;
+            typename std::vector<LabelType>::const_iterator labelIt = std::lower_bound(
+              this->m_LabelList.begin(), this->m_LabelList.end(), label );
+            if( labelIt == this->m_LabelList.end() || *labelIt != label )
+              {
+              continue;
+              }
+            this->AddSparseLabelVote( this->m_WeightSumImage->ComputeOffset( neighborhoodIndex ),
+              static_cast<SparseLabelIndexType>( labelIt - this->m_LabelList.begin() ), W[i] );
+            }
+          else
+            {
+            if( this->m_LabelSet.find( label ) == this->m_LabelSet.end() )
+              {
+              continue;
+              }
+
+            // Add that weight the posterior map for voxel at idx
+            this->m_LabelPosteriorProbabilityImages[label]->SetPixel( neighborhoodIndex,
+              this->m_LabelPosteriorProbabilityImages[label]->GetPixel( neighborhoodIndex ) + W[i] );
+            this->m_WeightSumImage->SetPixel( neighborhoodIndex,
+              this->m_WeightSumImage->GetPixel( neighborhoodIndex ) + W[i] );
             }
-
-          // Add that weight the posterior map for voxel at idx
-          this->m_LabelPosteriorProbabilityImages[label]->SetPixel( neighborhoodIndex,
-            this->m_LabelPosteriorProbabilityImages[label]->GetPixel( neighborhoodIndex ) + W[i] );
-          this->m_WeightSumImage->SetPixel( neighborhoodIndex,
-            this->m_WeightSumImage->GetPixel( neighborhoodIndex ) + W[i] );
 
           if( this->m_RetainAtlasVotingWeightImages )
             {
@@ -751,6 +816,45 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
     RealType maxPosteriorProbability = 0.0;
     LabelType winningLabel = NumericTraits<LabelType>::ZeroValue();
 
+    if( this->m_UseSparseLabelPosteriors )
+      {
+      // Only the labels which received votes at this voxel compete.  Ties go to
+      // the smaller label as in the dense case.
+      const OffsetValueType offset = this->m_WeightSumImage->ComputeOffset( index );
+      const SizeValueType   firstSlot = offset * this->m_MaximumNumberOfLabelsPerVoxel;
+      const SparseLabelSpillList *spill = this->GetSparseLabelSpill( offset );
+      const SizeValueType numberOfVotes = this->m_MaximumNumberOfLabelsPerVoxel + ( spill ? spill->size() : 0 );
+      for( SizeValueType k = 0; k < numberOfVotes; k++ )
+        {
+        const bool inSlot = ( k < this->m_MaximumNumberOfLabelsPerVoxel );
+        const SparseLabelIndexType slotLabel = inSlot ? this->m_SparseLabelIndices[firstSlot + k] :
+          ( *spill )[k - this->m_MaximumNumberOfLabelsPerVoxel].first;
+        if( slotLabel == 0 )
+          {
+          break;
+          }
+        const LabelType label = this->m_LabelList[slotLabel - 1];
+
+        typename LabelExclusionMap::const_iterator xIt = this->m_LabelExclusionImages.find( label );
+        if( xIt != m_LabelExclusionImages.end() && xIt->second->GetPixel( index ) != 0 )
+          {
+          continue;
+          }
+
+        const RealType posteriorProbability = inSlot ? this->m_SparseLabelWeights[firstSlot + k] :
+          ( *spill )[k - this->m_MaximumNumberOfLabelsPerVoxel].second;
+        if( maxPosteriorProbability < posteriorProbability ||
+            ( posteriorProbability > 0.0 && maxPosteriorProbability == posteriorProbability &&
+              label < winningLabel ) )
+          {
+          maxPosteriorProbability = posteriorProbability;
+          winningLabel = label;
+          }
+        }
+      It.Set( winningLabel );
+      continue;
+      }
+
     typename LabelSetType::const_iterator labelIt;
     for( labelIt = this->m_LabelSet.begin(); labelIt != this->m_LabelSet.end(); ++labelIt )
       {
@@ -790,7 +894,24 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
       continue;
       }
 
-    if( this->m_RetainLabelPosteriorProbabilityImages )
+    if( this->m_RetainLabelPosteriorProbabilityImages && this->m_UseSparseLabelPosteriors )
+      {
+      const OffsetValueType offset = this->m_WeightSumImage->ComputeOffset( index );
+      const SizeValueType   firstSlot = offset * this->m_MaximumNumberOfLabelsPerVoxel;
+      for( unsigned int k = 0; k < this->m_MaximumNumberOfLabelsPerVoxel; k++ )
+        {
+        this->m_SparseLabelWeights[firstSlot + k] /= weightSum;
+        }
+      SparseLabelSpillList *spill = this->GetSparseLabelSpill( offset );
+      if( spill )
+        {
+        for( SizeValueType k = 0; k < spill->size(); k++ )
+          {
+          ( *spill )[k].second /= weightSum;
+          }
+        }
+      }
+    else if( this->m_RetainLabelPosteriorProbabilityImages )
       {
       typename LabelSetType::const_iterator labelIt;
       for( labelIt = this->m_LabelSet.begin(); labelIt != this->m_LabelSet.end(); ++labelIt )
@@ -822,6 +943,9 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
   if( !this->m_RetainLabelPosteriorProbabilityImages )
     {
     this->m_LabelPosteriorProbabilityImages.clear();
+    std::vector<SparseLabelIndexType>().swap( this->m_SparseLabelIndices );
+    std::vector<float>().swap( this->m_SparseLabelWeights );
+    std::vector<SparseLabelSpillMap>().swap( this->m_SparseLabelSpills );
     }
 
   // Normalize the joint intensity fusion images.
@@ -997,6 +1121,117 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
   return x;
 }
 
+template <typename TInputImage, typename TOutputImage>
+void
+WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
+::AddSparseLabelVote( OffsetValueType offset, SparseLabelIndexType labelIndex, RealType weight )
+{
+  const SizeValueType  firstSlot = offset * this->m_MaximumNumberOfLabelsPerVoxel;
+  SparseLabelIndexType *slotLabels = &( this->m_SparseLabelIndices[firstSlot] );
+  float                *slotWeights = &( this->m_SparseLabelWeights[firstSlot] );
+
+  const SparseLabelIndexType slotLabel = labelIndex + 1;
+
+  // Neighborhoods of voxels in different threads overlap, so the slots of a
+  // voxel are only updated under the lock of its stripe.
+  const unsigned int lockIndex = static_cast<unsigned int>( offset % NumberOfSparseLabelVoteLocks );
+  std::lock_guard<std::mutex> lock( this->m_SparseLabelVoteLocks[lockIndex] );
+
+  this->m_WeightSumImage->GetBufferPointer()[offset] += weight;
+
+  for( unsigned int k = 0; k < this->m_MaximumNumberOfLabelsPerVoxel; k++ )
+    {
+    if( slotLabels[k] == slotLabel )
+      {
+      slotWeights[k] += weight;
+      return;
+      }
+    if( slotLabels[k] == 0 )
+      {
+      slotLabels[k] = slotLabel;
+      slotWeights[k] = weight;
+      return;
+      }
+    }
+
+  // All slots are taken, so the vote goes to the overflow list of the voxel.
+  SparseLabelSpillList & spill = this->m_SparseLabelSpills[lockIndex][offset];
+  for( SizeValueType k = 0; k < spill.size(); k++ )
+    {
+    if( spill[k].first == slotLabel )
+      {
+      spill[k].second += weight;
+      return;
+      }
+    }
+  spill.push_back( std::make_pair( slotLabel, static_cast<float>( weight ) ) );
+}
+
+template <typename TInputImage, typename TOutputImage>
+typename WeightedVotingFusionImageFilter<TInputImage, TOutputImage>::SparseLabelSpillList *
+WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
+::GetSparseLabelSpill( OffsetValueType offset )
+{
+  if( this->m_SparseLabelSpills.empty() )
+    {
+    return nullptr;
+    }
+  SparseLabelSpillMap & spills = this->m_SparseLabelSpills[offset % NumberOfSparseLabelVoteLocks];
+  typename SparseLabelSpillMap::iterator it = spills.find( offset );
+  return ( it != spills.end() ) ? &( it->second ) : nullptr;
+}
+
+template <typename TInputImage, typename TOutputImage>
+typename WeightedVotingFusionImageFilter<TInputImage, TOutputImage>::ProbabilityImagePointer
+WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
+::GenerateSparseLabelPosteriorProbabilityImage( LabelType label )
+{
+  typename std::vector<LabelType>::const_iterator labelIt = std::lower_bound(
+    this->m_LabelList.begin(), this->m_LabelList.end(), label );
+  if( labelIt == this->m_LabelList.end() || *labelIt != label ||
+      this->m_SparseLabelIndices.empty() )
+    {
+    return nullptr;
+    }
+  const SparseLabelIndexType slotLabel =
+    static_cast<SparseLabelIndexType>( labelIt - this->m_LabelList.begin() ) + 1;
+
+  ProbabilityImagePointer labelProbabilityImage = ProbabilityImageType::New();
+  labelProbabilityImage->CopyInformation( this->m_WeightSumImage );
+  labelProbabilityImage->SetRegions( this->m_WeightSumImage->GetBufferedRegion() );
+  labelProbabilityImage->SetLargestPossibleRegion( this->m_WeightSumImage->GetLargestPossibleRegion() );
+  labelProbabilityImage->Allocate( true );
+
+  typename ProbabilityImageType::PixelType *buffer = labelProbabilityImage->GetBufferPointer();
+  const SizeValueType numberOfPixels = labelProbabilityImage->GetBufferedRegion().GetNumberOfPixels();
+  for( SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    const SizeValueType firstSlot = n * this->m_MaximumNumberOfLabelsPerVoxel;
+    for( unsigned int k = 0; k < this->m_MaximumNumberOfLabelsPerVoxel; k++ )
+      {
+      if( this->m_SparseLabelIndices[firstSlot + k] == slotLabel )
+        {
+        buffer[n] = this->m_SparseLabelWeights[firstSlot + k];
+        break;
+        }
+      }
+    if( this->m_SparseLabelIndices[firstSlot + this->m_MaximumNumberOfLabelsPerVoxel - 1] == 0 )
+      {
+      continue;
+      }
+    const SparseLabelSpillList *spill = this->GetSparseLabelSpill( n );
+    for( SizeValueType k = 0; spill && k < spill->size(); k++ )
+      {
+      if( ( *spill )[k].first == slotLabel )
+        {
+        buffer[n] = ( *spill )[k].second;
+        break;
+        }
+      }
+    }
+  return labelProbabilityImage;
+}
+
 template <typename TInputImage, typename TOutputImage>
 void
 WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
@@ -1013,6 +1248,10 @@ WeightedVotingFusionImageFilter<TInputImage, TOutputImage>
     {
     os << "Constrain solution to positive weights using NNLS." << std::endl;
     }
+  if( this->m_MaximumNumberOfLabelsPerVoxel > 0 )
+    {
+    os << "Maximum number of labels per voxel = " << this->m_MaximumNumberOfLabelsPerVoxel << std::endl;
+    }
 
   os << "Label set: ";
   typename LabelSetType::const_iterator labelIt;
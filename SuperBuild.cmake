@@ -102,6 +102,7 @@ option(USE_SYSTEM_ITK "Build using an externally defined version of ITK" OFF)
 option(USE_SYSTEM_SlicerExecutionModel "Build using an externally defined version of SlicerExecutionModel"  OFF)
 
 option(USE_VTK "Build tools that depend on VTK" OFF)
+option(USE_SCCAN_BLAS "Use a (multithreaded) BLAS for the matrix products in sccan" OFF)
 CMAKE_DEPENDENT_OPTION(
      USE_SYSTEM_VTK "Build using an externally defined version of VTK" OFF
      "USE_VTK" OFF
@@ -231,6 +232,7 @@ list(APPEND ${CMAKE_PROJECT_NAME}_SUPERBUILD_EP_VARS
   ITK_VERSION_MAJOR:STRING
   ITK_DIR:PATH
   BUILD_ALL_ANTS_APPS:BOOL
+  USE_SCCAN_BLAS:BOOL
   RUN_SHORT_TESTS:BOOL
   RUN_LONG_TESTS:BOOL
   OLD_BASELINE_TESTS:BOOL
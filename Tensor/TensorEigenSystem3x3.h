@@ -0,0 +1,380 @@
+#ifndef _TensorEigenSystem3x3_h_
+#define _TensorEigenSystem3x3_h_
+
+/* Closed-form eigen-decomposition of 3x3 symmetric matrices, following
+ *
+ * D. Eberly, "A Robust Eigensolver for 3x3 Symmetric Matrices",
+ * Geometric Tools, 2014.
+ *
+ * The eigenvalues come from the trigonometric solution of the characteristic
+ * cubic of the shifted and scaled matrix, and the eigenvectors from cross
+ * products of the rows of (A - lambda I) and a 2x2 problem in the orthogonal
+ * complement of the first eigenvector.  Nothing is allocated, which makes it
+ * much cheaper than vnl_symmetric_eigensystem for per-voxel tensor work.
+ *
+ * Tensors are given in the usual upper triangular order
+ * (xx, xy, xz, yy, yz, zz).  As with vnl_symmetric_eigensystem the
+ * eigenvalues are sorted in increasing order and column k of the eigenvector
+ * matrix, evecs[.][k], belongs to eigenvalue k.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+namespace tensorEigenHelper
+{
+template <typename TReal>
+inline void Cross( const TReal u[3], const TReal v[3], TReal w[3] )
+{
+  w[0] = u[1] * v[2] - u[2] * v[1];
+  w[1] = u[2] * v[0] - u[0] * v[2];
+  w[2] = u[0] * v[1] - u[1] * v[0];
+}
+
+template <typename TReal>
+inline TReal Dot( const TReal u[3], const TReal v[3] )
+{
+  return u[0] * v[0] + u[1] * v[1] + u[2] * v[2];
+}
+
+// Unit eigenvector of a (scaled) matrix for the eigenvalue which is well
+// separated from the other two:  the largest cross product of two rows of
+// (A - lambda I).
+template <typename TReal>
+inline void ComputeEigenvector0( const TReal a[6], TReal eval, TReal evec[3] )
+{
+  const TReal row0[3] = { a[0] - eval, a[1], a[2] };
+  const TReal row1[3] = { a[1], a[3] - eval, a[4] };
+  const TReal row2[3] = { a[2], a[4], a[5] - eval };
+
+  TReal r0xr1[3], r0xr2[3], r1xr2[3];
+  Cross( row0, row1, r0xr1 );
+  Cross( row0, row2, r0xr2 );
+  Cross( row1, row2, r1xr2 );
+
+  const TReal d0 = Dot( r0xr1, r0xr1 );
+  const TReal d1 = Dot( r0xr2, r0xr2 );
+  const TReal d2 = Dot( r1xr2, r1xr2 );
+
+  const TReal *largest = r0xr1;
+  TReal        dmax = d0;
+  if( d1 > dmax )
+    {
+    dmax = d1;
+    largest = r0xr2;
+    }
+  if( d2 > dmax )
+    {
+    dmax = d2;
+    largest = r1xr2;
+    }
+
+  const TReal invLength = static_cast<TReal>( 1 ) / std::sqrt( dmax );
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    evec[i] = largest[i] * invLength;
+    }
+}
+
+// Two unit vectors u, v such that (w, u, v) is orthonormal.
+template <typename TReal>
+inline void ComputeOrthogonalComplement( const TReal w[3], TReal u[3], TReal v[3] )
+{
+  if( std::fabs( w[0] ) > std::fabs( w[1] ) )
+    {
+    const TReal invLength = static_cast<TReal>( 1 ) / std::sqrt( w[0] * w[0] + w[2] * w[2] );
+    u[0] = -w[2] * invLength;
+    u[1] = 0;
+    u[2] = w[0] * invLength;
+    }
+  else
+    {
+    const TReal invLength = static_cast<TReal>( 1 ) / std::sqrt( w[1] * w[1] + w[2] * w[2] );
+    u[0] = 0;
+    u[1] = w[2] * invLength;
+    u[2] = -w[1] * invLength;
+    }
+  Cross( w, u, v );
+}
+
+// Unit eigenvector for the middle eigenvalue, found in the plane orthogonal
+// to the eigenvector evec0 already computed.
+template <typename TReal>
+inline void ComputeEigenvector1( const TReal a[6], const TReal evec0[3], TReal eval1, TReal evec1[3] )
+{
+  TReal u[3], v[3];
+  ComputeOrthogonalComplement( evec0, u, v );
+
+  const TReal au[3] = { a[0] * u[0] + a[1] * u[1] + a[2] * u[2],
+                        a[1] * u[0] + a[3] * u[1] + a[4] * u[2],
+                        a[2] * u[0] + a[4] * u[1] + a[5] * u[2] };
+  const TReal av[3] = { a[0] * v[0] + a[1] * v[1] + a[2] * v[2],
+                        a[1] * v[0] + a[3] * v[1] + a[4] * v[2],
+                        a[2] * v[0] + a[4] * v[1] + a[5] * v[2] };
+
+  TReal m00 = Dot( u, au ) - eval1;
+  TReal m01 = Dot( u, av );
+  TReal m11 = Dot( v, av ) - eval1;
+
+  const TReal absM00 = std::fabs( m00 );
+  const TReal absM01 = std::fabs( m01 );
+  const TReal absM11 = std::fabs( m11 );
+
+  TReal cu = 1;
+  TReal cv = 0;
+  if( absM00 >= absM11 )
+    {
+    if( std::max( absM00, absM01 ) > 0 )
+      {
+      if( absM00 >= absM01 )
+        {
+        m01 /= m00;
+        m00 = static_cast<TReal>( 1 ) / std::sqrt( static_cast<TReal>( 1 ) + m01 * m01 );
+        m01 *= m00;
+        }
+      else
+        {
+        m00 /= m01;
+        m01 = static_cast<TReal>( 1 ) / std::sqrt( static_cast<TReal>( 1 ) + m00 * m00 );
+        m00 *= m01;
+        }
+      cu = m01;
+      cv = -m00;
+      }
+    }
+  else
+    {
+    if( std::max( absM11, absM01 ) > 0 )
+      {
+      if( absM11 >= absM01 )
+        {
+        m01 /= m11;
+        m11 = static_cast<TReal>( 1 ) / std::sqrt( static_cast<TReal>( 1 ) + m01 * m01 );
+        m01 *= m11;
+        }
+      else
+        {
+        m11 /= m01;
+        m01 = static_cast<TReal>( 1 ) / std::sqrt( static_cast<TReal>( 1 ) + m11 * m11 );
+        m11 *= m01;
+        }
+      cu = m11;
+      cv = -m01;
+      }
+    }
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    evec1[i] = cu * u[i] + cv * v[i];
+    }
+}
+
+// Scale factor, shift and the (sorted) roots beta0 <= beta1 <= beta2 of the
+// normalized characteristic cubic, so that eval_k = scale * ( q + p * beta_k ).
+// Returns false if the matrix is diagonal (after scaling), in which case the
+// diagonal holds the eigenvalues.
+template <typename TReal>
+inline bool ComputeScaledEigenvalues( const TReal tensor[6], TReal a[6], TReal & scale, TReal evals[3],
+                                      TReal & halfDeterminant )
+{
+  scale = 0;
+  for( unsigned int i = 0; i < 6; i++ )
+    {
+    scale = std::max( scale, static_cast<TReal>( std::fabs( tensor[i] ) ) );
+    }
+  const TReal invScale = ( scale > 0 ) ? static_cast<TReal>( 1 ) / scale : static_cast<TReal>( 0 );
+  for( unsigned int i = 0; i < 6; i++ )
+    {
+    a[i] = tensor[i] * invScale;
+    }
+
+  const TReal norm = a[1] * a[1] + a[2] * a[2] + a[4] * a[4];
+  if( !( norm > 0 ) )
+    {
+    evals[0] = a[0];
+    evals[1] = a[3];
+    evals[2] = a[5];
+    halfDeterminant = 0;
+    return false;
+    }
+
+  const TReal q = ( a[0] + a[3] + a[5] ) / static_cast<TReal>( 3 );
+  const TReal b00 = a[0] - q;
+  const TReal b11 = a[3] - q;
+  const TReal b22 = a[5] - q;
+  const TReal p = std::sqrt( ( b00 * b00 + b11 * b11 + b22 * b22 + static_cast<TReal>( 2 ) * norm ) /
+                             static_cast<TReal>( 6 ) );
+  const TReal c00 = b11 * b22 - a[4] * a[4];
+  const TReal c01 = a[1] * b22 - a[4] * a[2];
+  const TReal c02 = a[1] * a[4] - b11 * a[2];
+  const TReal determinant = ( b00 * c00 - a[1] * c01 + a[2] * c02 ) / ( p * p * p );
+
+  halfDeterminant = std::min( std::max( static_cast<TReal>( 0.5 ) * determinant, static_cast<TReal>( -1 ) ),
+                              static_cast<TReal>( 1 ) );
+
+  // The roots are 2 cos( theta + 2 pi k / 3 ) with theta = acos( det / 2 ) / 3.
+  const TReal angle = std::acos( halfDeterminant ) / static_cast<TReal>( 3 );
+  const TReal twoThirdsPi = static_cast<TReal>( 2.09439510239319549 );
+  const TReal beta2 = std::cos( angle ) * static_cast<TReal>( 2 );
+  const TReal beta0 = std::cos( angle + twoThirdsPi ) * static_cast<TReal>( 2 );
+  const TReal beta1 = -( beta0 + beta2 );
+
+  evals[0] = q + p * beta0;
+  evals[1] = q + p * beta1;
+  evals[2] = q + p * beta2;
+  return true;
+}
+} // namespace tensorEigenHelper
+
+/** Eigenvalues (increasing) of a symmetric 3x3 tensor (xx, xy, xz, yy, yz, zz). */
+template <typename TTensor, typename TReal>
+inline void SymmetricEigenValues3x3( const TTensor & tensor, TReal evals[3] )
+{
+  TReal t[6];
+  for( unsigned int i = 0; i < 6; i++ )
+    {
+    t[i] = static_cast<TReal>( tensor[i] );
+    }
+  TReal a[6];
+  TReal scale;
+  TReal halfDeterminant;
+  tensorEigenHelper::ComputeScaledEigenvalues( t, a, scale, evals, halfDeterminant );
+  for( unsigned int k = 0; k < 3; k++ )
+    {
+    evals[k] *= scale;
+    }
+  if( evals[0] > evals[1] )
+    {
+    std::swap( evals[0], evals[1] );
+    }
+  if( evals[1] > evals[2] )
+    {
+    std::swap( evals[1], evals[2] );
+    }
+  if( evals[0] > evals[1] )
+    {
+    std::swap( evals[0], evals[1] );
+    }
+}
+
+/** Eigenvalues (increasing) and unit eigenvectors (columns of evecs) of a
+ * symmetric 3x3 tensor (xx, xy, xz, yy, yz, zz). */
+template <typename TTensor, typename TReal>
+inline void SymmetricEigenSystem3x3( const TTensor & tensor, TReal evals[3], TReal evecs[3][3] )
+{
+  TReal t[6];
+  for( unsigned int i = 0; i < 6; i++ )
+    {
+    t[i] = static_cast<TReal>( tensor[i] );
+    }
+  TReal a[6];
+  TReal scale;
+  TReal halfDeterminant;
+  TReal v[3][3]; // v[k] is the kth eigenvector
+
+  if( tensorEigenHelper::ComputeScaledEigenvalues( t, a, scale, evals, halfDeterminant ) )
+    {
+    // Start from the eigenvalue farthest from the other two.
+    if( halfDeterminant >= 0 )
+      {
+      tensorEigenHelper::ComputeEigenvector0( a, evals[2], v[2] );
+      tensorEigenHelper::ComputeEigenvector1( a, v[2], evals[1], v[1] );
+      tensorEigenHelper::Cross( v[1], v[2], v[0] );
+      }
+    else
+      {
+      tensorEigenHelper::ComputeEigenvector0( a, evals[0], v[0] );
+      tensorEigenHelper::ComputeEigenvector1( a, v[0], evals[1], v[1] );
+      tensorEigenHelper::Cross( v[0], v[1], v[2] );
+      }
+    }
+  else
+    {
+    for( unsigned int k = 0; k < 3; k++ )
+      {
+      for( unsigned int i = 0; i < 3; i++ )
+        {
+        v[k][i] = ( i == k ) ? static_cast<TReal>( 1 ) : static_cast<TReal>( 0 );
+        }
+      }
+    }
+
+  // Sort (only the diagonal case can be out of order).
+  unsigned int order[3] = { 0, 1, 2 };
+  if( evals[order[0]] > evals[order[1]] )
+    {
+    std::swap( order[0], order[1] );
+    }
+  if( evals[order[1]] > evals[order[2]] )
+    {
+    std::swap( order[1], order[2] );
+    }
+  if( evals[order[0]] > evals[order[1]] )
+    {
+    std::swap( order[0], order[1] );
+    }
+
+  const TReal sortedEvals[3] = { evals[order[0]], evals[order[1]], evals[order[2]] };
+  for( unsigned int k = 0; k < 3; k++ )
+    {
+    evals[k] = sortedEvals[k] * scale;
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      evecs[i][k] = v[order[k]][i];
+      }
+    }
+}
+
+/** Eigenvalues of a run of n tensors stored as separate component arrays
+ * (structure of arrays).  The loop body has no data-dependent branches other
+ * than selects, so the compiler can vectorize it over consecutive tensors;
+ * this is the entry point for whole-image scalar maps (FA, MD, AD, RD).
+ * Each evals[k] receives n eigenvalues, sorted increasingly per tensor. */
+template <typename TReal>
+void SymmetricEigenValues3x3Batch( std::size_t n, const TReal * const components[6], TReal * const evals[3] )
+{
+  const TReal * const xx = components[0];
+  const TReal * const xy = components[1];
+  const TReal * const xz = components[2];
+  const TReal * const yy = components[3];
+  const TReal * const yz = components[4];
+  const TReal * const zz = components[5];
+  TReal * const       e0 = evals[0];
+  TReal * const       e1 = evals[1];
+  TReal * const       e2 = evals[2];
+
+  const TReal third = static_cast<TReal>( 1 ) / static_cast<TReal>( 3 );
+  const TReal sixth = static_cast<TReal>( 1 ) / static_cast<TReal>( 6 );
+  const TReal twoThirdsPi = static_cast<TReal>( 2.09439510239319549 );
+
+  for( std::size_t j = 0; j < n; j++ )
+    {
+    const TReal q = ( xx[j] + yy[j] + zz[j] ) * third;
+    const TReal b00 = xx[j] - q;
+    const TReal b11 = yy[j] - q;
+    const TReal b22 = zz[j] - q;
+    const TReal norm = xy[j] * xy[j] + xz[j] * xz[j] + yz[j] * yz[j];
+    const TReal p2 = ( b00 * b00 + b11 * b11 + b22 * b22 + static_cast<TReal>( 2 ) * norm ) * sixth;
+    const TReal p = std::sqrt( p2 );
+
+    // For p == 0 the tensor is isotropic and every root is q.
+    const TReal invP = ( p > 0 ) ? static_cast<TReal>( 1 ) / p : static_cast<TReal>( 0 );
+    const TReal c00 = b11 * b22 - yz[j] * yz[j];
+    const TReal c01 = xy[j] * b22 - yz[j] * xz[j];
+    const TReal c02 = xy[j] * yz[j] - b11 * xz[j];
+    TReal       halfDeterminant = static_cast<TReal>( 0.5 ) * ( b00 * c00 - xy[j] * c01 + xz[j] * c02 ) *
+      invP * invP * invP;
+    halfDeterminant = std::min( std::max( halfDeterminant, static_cast<TReal>( -1 ) ), static_cast<TReal>( 1 ) );
+
+    const TReal angle = std::acos( halfDeterminant ) * third;
+    const TReal beta2 = std::cos( angle ) * static_cast<TReal>( 2 );
+    const TReal beta0 = std::cos( angle + twoThirdsPi ) * static_cast<TReal>( 2 );
+    const TReal beta1 = -( beta0 + beta2 );
+
+    e0[j] = q + p * beta0;
+    e1[j] = q + p * beta1;
+    e2[j] = q + p * beta2;
+    }
+}
+
+#endif
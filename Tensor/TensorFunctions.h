@@ -10,6 +10,7 @@
 #include "itkVersor.h"
 #include "itkVariableSizeMatrix.h"
 #include "itkDecomposeTensorFunction2.h"
+#include "TensorEigenSystem3x3.h"
 #include "itkRotationMatrixFromVectors.h"
 #include "vnl/algo/vnl_matrix_inverse.h"
 #include "vnl/algo/vnl_symmetric_eigensystem.h"
@@ -108,14 +109,29 @@ TensorType Matrix2Vector( MatrixType dtm )
   return dtv;
 }
 
+// Eigenvalues are returned on the diagonal of evals in increasing order and
+// evecs(:, k) is the eigenvector of the k-th eigenvalue, as with
+// itk::DecomposeTensorFunction2.  The closed-form 3x3 solver is used in place
+// of the iterative vnl decomposition.
 template <typename TensorType, typename MatrixType>
 void EigenAnalysis(TensorType dtv,  MatrixType & evals, MatrixType & evecs)
 {
-  MatrixType dtm = Vector2Matrix<TensorType, MatrixType>(dtv);
+  double values[3];
+  double vectors[3][3];
 
-  itk::DecomposeTensorFunction2<MatrixType, typename MatrixType::ValueType, MatrixType> decomposer;
+  SymmetricEigenSystem3x3( dtv, values, vectors );
 
-  decomposer.EvaluateSymmetricEigenDecomposition( dtm, evals, evecs );
+  evals.SetSize( 3, 3 );
+  evecs.SetSize( 3, 3 );
+  evals.Fill( 0.0 );
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    evals(i, i) = values[i];
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      evecs(i, j) = vectors[i][j];
+      }
+    }
 }
 
 template <typename TensorType, typename VectorType>
@@ -207,16 +223,12 @@ TensorType TensorLogAndExp( TensorType dtv, bool takelog, bool & success)
     success = false;
     return dtv;
     }
-  // typedef vnl_matrix<double>        MatrixType;
-  typedef itk::VariableSizeMatrix<typename TensorType::ValueType> MatrixType;
-
-  // MatrixType DT = Vector2Matrix<TensorType,MatrixType>(dtv);
-  MatrixType D;
-  MatrixType V;
-  EigenAnalysis<TensorType, MatrixType>(dtv, D, V);
-  double e1 = D(0, 0);
-  double e2 = D(1, 1);
-  double e3 = D(2, 2);
+  double D[3];
+  double V[3][3];
+  SymmetricEigenSystem3x3( dtv, D, V );
+  double e1 = D[0];
+  double e2 = D[1];
+  double e3 = D[2];
   // float peigeps=1.e-12;
 
   if( fabs(e3) < eps )
@@ -226,8 +238,7 @@ TensorType TensorLogAndExp( TensorType dtv, bool takelog, bool & success)
     // return dtv;
     }
 
-  MatrixType eigmat(3, 3);
-  eigmat.Fill(0);
+  double eigmat[3];
   if( takelog )
     {
     if( e1 < 0 )
@@ -238,29 +249,39 @@ TensorType TensorLogAndExp( TensorType dtv, bool takelog, bool & success)
       {
       e3 = e2;
       }
-    eigmat(0, 0) = log(fabs(e1) );
-    eigmat(1, 1) = log(fabs(e2) );
-    eigmat(2, 2) = log(fabs(e3) );
+    eigmat[0] = log(fabs(e1) );
+    eigmat[1] = log(fabs(e2) );
+    eigmat[2] = log(fabs(e3) );
     }
   else // take exp
     {
-    eigmat(0, 0) = exp(e1);
-    eigmat(1, 1) = exp(e2);
-    eigmat(2, 2) = exp(e3);
+    eigmat[0] = exp(e1);
+    eigmat[1] = exp(e2);
+    eigmat[2] = exp(e3);
     }
 
-  if( std::isnan(eigmat(0, 0) ) ||
-      std::isnan(eigmat(1, 1) ) ||
-      std::isnan(eigmat(2, 2) ) )
+  if( std::isnan(eigmat[0] ) ||
+      std::isnan(eigmat[1] ) ||
+      std::isnan(eigmat[2] ) )
     {
     dtv.Fill(0);
     success = false;
     return dtv;
     }
 
-  typedef typename MatrixType::InternalMatrixType VnlMatrixType;
-  VnlMatrixType DTrec = V.GetVnlMatrix() * eigmat.GetVnlMatrix() * V.GetTranspose();
-  TensorType    dtv2 = Matrix2Vector<TensorType, VnlMatrixType>(DTrec);
+  // V * diag(eigmat) * V^T, written straight into the upper triangle in the
+  // same component order as Matrix2Vector.
+  TensorType   dtv2;
+  unsigned int tensorIndex = 0;
+  for( unsigned int i = 0; i < 3; ++i )
+    {
+    for( unsigned int j = i; j < 3; ++j, ++tensorIndex )
+      {
+      dtv2[tensorIndex] = V[i][0] * eigmat[0] * V[j][0]
+        + V[i][1] * eigmat[1] * V[j][1]
+        + V[i][2] * eigmat[2] * V[j][2];
+      }
+    }
 
   return dtv2;
 }
@@ -303,19 +324,11 @@ float  GetTensorFA( TensorType dtv )
       return 0.0f;
     }
 
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e1 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e3 = (eig.D(2, 2) );
+  double evals[3];
+  SymmetricEigenValues3x3( dtv, evals );
+  double e1 = evals[0];
+  double e2 = evals[1];
+  double e3 = evals[2];
   if( e1 < 0 )
     {
     e1 = e2;
@@ -335,19 +348,11 @@ float  GetTensorFA( TensorType dtv )
 template <typename TensorType>
 float  GetTensorFANumerator( TensorType dtv )
 {
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e1 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e3 = (eig.D(2, 2) );
+  double evals[3];
+  SymmetricEigenValues3x3( dtv, evals );
+  double e1 = evals[0];
+  double e2 = evals[1];
+  double e3 = evals[2];
   if( e1 < 0 )
     {
     e1 = e2;
@@ -365,19 +370,11 @@ float  GetTensorFANumerator( TensorType dtv )
 template <typename TensorType>
 float  GetTensorFADenominator( TensorType dtv )
 {
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e1 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e3 = (eig.D(2, 2) );
+  double evals[3];
+  SymmetricEigenValues3x3( dtv, evals );
+  double e1 = evals[0];
+  double e2 = evals[1];
+  double e3 = evals[2];
   if( e1 < 0 )
     {
     e1 = e2;
@@ -404,11 +401,12 @@ float  GetMetricTensorCost(  TVectorType dpath,  TTensorType dtv, unsigned int m
   DT(2, 0) = DT(0, 2) = dtv[2];
   DT(2, 1) = DT(1, 2) = dtv[4];
 
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e1 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e3 = (eig.D(2, 2) );
-  double                            etot = e1 + e2 + e3;
+  double evals[3];
+  SymmetricEigenValues3x3( dtv, evals );
+  double e1 = evals[0];
+  double e2 = evals[1];
+  double e3 = evals[2];
+  double etot = e1 + e2 + e3;
   if( etot == 0 )
     {
     etot = 1;
@@ -434,19 +432,13 @@ template <typename TVectorType, typename TTensorType>
 TVectorType ChangeTensorByVector(  TVectorType dpath,  TTensorType dtv, float epsilon)
 {
   typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e3 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e1 = (eig.D(2, 2) );
-  double                            etot = e1 + e2 + e3;
+  double evals[3];
+  double evecs[3][3];
+  SymmetricEigenSystem3x3( dtv, evals, evecs );
+  double e3 = evals[0];
+  double e2 = evals[1];
+  double e1 = evals[2];
+  double etot = e1 + e2 + e3;
   if( etot == 0 )
     {
     etot = 1;
@@ -458,17 +450,17 @@ TVectorType ChangeTensorByVector(  TVectorType dpath,  TTensorType dtv, float ep
   vec(2, 0) = dpath[2];
 
   MatrixType evec1(3, 1); // biggest
-  evec1(0, 0) = eig.V(0, 2);
-  evec1(1, 0) = eig.V(1, 2);
-  evec1(2, 0) = eig.V(2, 2);
+  evec1(0, 0) = evecs[0][2];
+  evec1(1, 0) = evecs[1][2];
+  evec1(2, 0) = evecs[2][2];
   MatrixType evec2(3, 1); // middle
-  evec2(0, 0) = eig.V(0, 1);
-  evec2(1, 0) = eig.V(1, 1);
-  evec2(2, 0) = eig.V(2, 1);
+  evec2(0, 0) = evecs[0][1];
+  evec2(1, 0) = evecs[1][1];
+  evec2(2, 0) = evecs[2][1];
   MatrixType evec3(3, 1); // smallest
-  evec3(0, 0) = eig.V(0, 0);
-  evec3(1, 0) = eig.V(1, 0);
-  evec3(2, 0) = eig.V(2, 0);
+  evec3(0, 0) = evecs[0][0];
+  evec3(1, 0) = evecs[1][0];
+  evec3(2, 0) = evecs[2][0];
 
   float temp;
   temp = (vec.transpose() * evec1)(0, 0);
@@ -495,7 +487,7 @@ TVectorType ChangeTensorByVector(  TVectorType dpath,  TTensorType dtv, float ep
     e3 = 1.e-11;
     }
 
-  DT =  (evec3 * evec3.transpose() ) * e3 +   (evec2 * evec2.transpose() ) * e2  +  (evec1 * evec1.transpose() ) * e1;
+  MatrixType DT =  (evec3 * evec3.transpose() ) * e3 +   (evec2 * evec2.transpose() ) * e2  +  (evec1 * evec1.transpose() ) * e1;
 
   itk::Vector<float, 6> newtens;
   newtens[0] = DT(0, 0);
@@ -536,21 +528,13 @@ float  GetTensorADC( TTensorType dtv,  unsigned int opt = 0)
     return 0;
     }
 
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
   //  if (takelog )std::cout << " TAKING LOG " << std::endl;  elsestd::cout << "TAKING EXP " << std::endl;
   // std::cout << " dtv " << dtv << std::endl;
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e1 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e3 = (eig.D(2, 2) );
+  double evals[3];
+  SymmetricEigenValues3x3( dtv, evals );
+  double e1 = evals[0];
+  double e2 = evals[1];
+  double e3 = evals[2];
 
   /*
   opt  return
@@ -658,18 +642,11 @@ itk::RGBPixel<float>   GetTensorPrincipalEigenvector( TTensorType dtv )
     return zero;
     }
 
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
   //  if (takelog )std::cout << " TAKING LOG " << std::endl;  elsestd::cout << "TAKING EXP " << std::endl;
   // std::cout << " dtv " << dtv << std::endl;
-  vnl_symmetric_eigensystem<double> eig(DT);
+  double evals[3];
+  double evecs[3][3];
+  SymmetricEigenSystem3x3( dtv, evals, evecs );
 
   itk::RGBPixel<float> rgb;
 
@@ -696,9 +673,9 @@ itk::RGBPixel<float>   GetTensorPrincipalEigenvector( TTensorType dtv )
   //  rgb[2]=eig.V(2,2)*fa*255;//+eig.V(1,2)*e2;
 
   // biggest evec
-  rgb[0] = eig.V(0, 2); // +eig.V(1,0)*e2;
-  rgb[1] = eig.V(1, 2); // +eig.V(1,1)*e2;
-  rgb[2] = eig.V(2, 2); // +eig.V(1,2)*e2;
+  rgb[0] = evecs[0][2]; // +eig.V(1,0)*e2;
+  rgb[1] = evecs[1][2]; // +eig.V(1,1)*e2;
+  rgb[2] = evecs[2][2]; // +eig.V(1,2)*e2;
 
   return rgb;
   mag = rgb[0] * rgb[0] + rgb[1] * rgb[1] + rgb[2] * rgb[2];
@@ -738,18 +715,11 @@ itk::Vector<float>   GetTensorPrincipalEigenvector( TTensorType dtv, unsigned in
     return zero;
     }
 
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType DT(3, 3);
-  DT.fill(0);
-  DT(0, 0) = dtv[0];
-  DT(1, 1) = dtv[3];
-  DT(2, 2) = dtv[5];
-  DT(1, 0) = DT(0, 1) = dtv[1];
-  DT(2, 0) = DT(0, 2) = dtv[2];
-  DT(2, 1) = DT(1, 2) = dtv[4];
   //  if (takelog )std::cout << " TAKING LOG " << std::endl;  else std::cout << "TAKING EXP " << std::endl;
   // std::cout << " dtv " << dtv << std::endl;
-  vnl_symmetric_eigensystem<double> eig(DT);
+  double evals[3];
+  double evecs[3][3];
+  SymmetricEigenSystem3x3( dtv, evals, evecs );
 
   itk::Vector<float, 3> rgb;
 
@@ -768,9 +738,9 @@ itk::Vector<float>   GetTensorPrincipalEigenvector( TTensorType dtv, unsigned in
     trace += dtv[5];
     }
 
-  rgb[0] = eig.V(0, whichvec); // +eig.V(1,0)*e2;
-  rgb[1] = eig.V(1, whichvec); // +eig.V(1,1)*e2;
-  rgb[2] = eig.V(2, whichvec); // +eig.V(1,2)*e2;
+  rgb[0] = evecs[0][whichvec]; // +eig.V(1,0)*e2;
+  rgb[1] = evecs[1][whichvec]; // +eig.V(1,1)*e2;
+  rgb[2] = evecs[2][whichvec]; // +eig.V(1,2)*e2;
 
   return rgb;
 }
@@ -787,11 +757,12 @@ static float GetMetricTensorCost(  itk::Vector<float, 3> dpath,  TTensorType dtv
   DT(1, 0) = DT(0, 1) = dtv[1];
   DT(2, 0) = DT(0, 2) = dtv[2];
   DT(2, 1) = DT(1, 2) = dtv[4];
-  vnl_symmetric_eigensystem<double> eig(DT);
-  double                            e1 = (eig.D(0, 0) );
-  double                            e2 = (eig.D(1, 1) );
-  double                            e3 = (eig.D(2, 2) );
-  double                            etot = e1 + e2 + e3;
+  double evals[3];
+  SymmetricEigenValues3x3( dtv, evals );
+  double e1 = evals[0];
+  double e2 = evals[1];
+  double e3 = evals[2];
+  double etot = e1 + e2 + e3;
   if( etot == 0 )
     {
     etot = 1;
@@ -95,17 +95,11 @@ protected:
 
   void PrintSelf(std::ostream& os, Indent indent) const override;
 
-  /** ExpTensorImageFilter can be implemented as a multithreaded filter.
-   * Therefore, this implementation provides a ThreadedGenerateData()
-   * routine which is called for each processing thread. The output
-   * image data is allocated automatically by the superclass prior to
-   * calling ThreadedGenerateData().  ThreadedGenerateData can only
-   * write to the portion of the output image specified by the
-   * parameter "outputRegionForThread"
+  /** Each voxel is transformed independently, so the output region is
+   * split across threads.
    *
-   * \sa ImageToImageFilter::ThreadedGenerateData(),
-   *     ImageToImageFilter::GenerateData() */
-  void GenerateData() override;
+   * \sa ImageToImageFilter::DynamicThreadedGenerateData() */
+  void DynamicThreadedGenerateData( const OutputImageRegionType & outputRegionForThread ) override;
 
 private:
   ExpTensorImageFilter(const Self &) = delete;
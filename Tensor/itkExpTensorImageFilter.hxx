@@ -36,22 +36,17 @@ ExpTensorImageFilter<TInputImage, TOutputImage>
 template <typename TInputImage, typename TOutputImage>
 void
 ExpTensorImageFilter<TInputImage, TOutputImage>
-::GenerateData()
+::DynamicThreadedGenerateData( const OutputImageRegionType & outputRegionForThread )
 {
-  InputImagePointer  input = this->GetInput();
-  OutputImagePointer output = this->GetOutput();
+  const InputImageType * input = this->GetInput();
+  OutputImageType *      output = this->GetOutput();
 
-  ImageRegionConstIterator<InputImageType> inputIt( input, input->GetLargestPossibleRegion() );
-
-  output->SetRegions( input->GetLargestPossibleRegion() );
-  output->Allocate();
-
-  ImageRegionIterator<OutputImageType> outputIt( output, output->GetLargestPossibleRegion() );
-  for( inputIt.GoToBegin(), outputIt.GoToBegin();
-       !inputIt.IsAtEnd() && !outputIt.IsAtEnd(); ++inputIt, ++outputIt )
+  ImageRegionConstIterator<InputImageType> inputIt( input, outputRegionForThread );
+  ImageRegionIterator<OutputImageType>     outputIt( output, outputRegionForThread );
+  for( inputIt.GoToBegin(), outputIt.GoToBegin(); !inputIt.IsAtEnd(); ++inputIt, ++outputIt )
     {
     bool           success; // TODO -- actually check the result?
-    InputPixelType result = TensorLogAndExp<InputPixelType>(inputIt.Value(), false, success);
+    InputPixelType result = TensorLogAndExp<InputPixelType>( inputIt.Value(), false, success );
     outputIt.Set( result );
     }
 }
@@ -16,7 +16,7 @@
 
 #include "itkConstNeighborhoodIterator.h"
 #include "itkNeighborhoodInnerProduct.h"
-#include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageRegionIterator.h"
 #include "itkImageRegionConstIterator.h"
 #include "itkOffset.h"
 #include "itkProgressReporter.h"
@@ -36,22 +36,16 @@ LogTensorImageFilter<TInputImage, TOutputImage>
 template <typename TInputImage, typename TOutputImage>
 void
 LogTensorImageFilter<TInputImage, TOutputImage>
-::GenerateData()
+::DynamicThreadedGenerateData( const OutputImageRegionType & outputRegionForThread )
 {
-  InputImagePointer  input = this->GetInput();
-  OutputImagePointer output = this->GetOutput();
+  const InputImageType * input = this->GetInput();
+  OutputImageType *      output = this->GetOutput();
 
-  ImageRegionConstIterator<InputImageType> inputIt( input, input->GetLargestPossibleRegion() );
-
-  output->SetRegions( input->GetLargestPossibleRegion() );
-  output->Allocate();
-
-  ImageRegionIteratorWithIndex<OutputImageType> outputIt( output, output->GetLargestPossibleRegion() );
-  for( inputIt.GoToBegin(), outputIt.GoToBegin();
-       !inputIt.IsAtEnd() && !outputIt.IsAtEnd();
-       ++inputIt, ++outputIt )
+  ImageRegionConstIterator<InputImageType> inputIt( input, outputRegionForThread );
+  ImageRegionIterator<OutputImageType>     outputIt( output, outputRegionForThread );
+  for( inputIt.GoToBegin(), outputIt.GoToBegin(); !inputIt.IsAtEnd(); ++inputIt, ++outputIt )
     {
-    InputPixelType result = TensorLog<InputPixelType>(inputIt.Value() );
+    InputPixelType result = TensorLog<InputPixelType>( inputIt.Value() );
     outputIt.Set( result );
     }
 }
@@ -17,6 +17,7 @@
 #include "itkConstNeighborhoodIterator.h"
 #include "itkNeighborhoodInnerProduct.h"
 #include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageRegionIterator.h"
 #include "itkImageRegionConstIterator.h"
 #include "itkNeighborhoodAlgorithm.h"
 #include "itkOffset.h"
@@ -31,6 +32,7 @@
 #include "itkVariableSizeMatrix.h"
 #include "itkDecomposeTensorFunction.h"
 #include "itkSymmetricSecondRankTensor.h"
+#include "TensorEigenSystem3x3.h"
 
 #include <vnl/vnl_cross.h>
 #include <vnl/vnl_inverse.h>
@@ -47,7 +49,7 @@ PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVe
   m_DisplacementField = nullptr;
   m_DirectionTransform = nullptr;
   m_AffineTransform = nullptr;
-  m_InverseAffineTransform = nullptr;
+  m_InverseAffineMatrix.SetIdentity();
   m_UseAffine = false;
   m_UseImageDirection = true;
 }
@@ -71,65 +73,66 @@ PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVe
 template <typename TTensorImage, typename TVectorImage>
 typename PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVectorImage>::TensorType
 PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVectorImage>
-::ApplyReorientation(InverseTransformPointer deformation, TensorType tensor )
+::ApplyReorientation( const MatrixType & deformation, const TensorType & tensor ) const
 {
-  VnlMatrixType DT(3, 3);
-
-  DT.fill(0);
-  DT(0, 0) = tensor[0];
-  DT(1, 1) = tensor[3];
-  DT(2, 2) = tensor[5];
-  DT(1, 0) = DT(0, 1) = tensor[1];
-  DT(2, 0) = DT(0, 2) = tensor[2];
-  DT(2, 1) = DT(1, 2) = tensor[4];
-
-  vnl_symmetric_eigensystem<RealType> eig(DT);
-  TensorType                          outTensor;
-
-  TransformInputVectorType ev1;
-  TransformInputVectorType ev2;
-  TransformInputVectorType ev3;
+  RealType evals[3];
+  RealType evecs[3][3];
+
+  SymmetricEigenSystem3x3( tensor, evals, evecs );
+
+  RealType ev1r[3];
+  RealType ev2r[3];
   for( unsigned int i = 0; i < 3; i++ )
     {
-    ev1[i] = eig.get_eigenvector(2)[i];
-    ev2[i] = eig.get_eigenvector(1)[i];
-    ev3[i] = eig.get_eigenvector(0)[i];
+    ev1r[i] = 0.0;
+    ev2r[i] = 0.0;
+    for( unsigned int j = 0; j < 3; j++ )
+      {
+      ev1r[i] += deformation(i, j) * evecs[j][2];
+      ev2r[i] += deformation(i, j) * evecs[j][1];
+      }
     }
 
-  TransformOutputVectorType ev1r = deformation->TransformVector( ev1 );
-  ev1r.Normalize();
+  RealType norm = std::sqrt( ev1r[0] * ev1r[0] + ev1r[1] * ev1r[1] + ev1r[2] * ev1r[2] );
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    ev1r[i] /= norm;
+    }
 
   // Get aspect of rotated e2 that is perpendicular to rotated e1
-  TransformOutputVectorType ev2a = deformation->TransformVector( ev2 );
-  if( (ev2a * ev1r) < 0 )
+  RealType dp = ev2r[0] * ev1r[0] + ev2r[1] * ev1r[1] + ev2r[2] * ev1r[2];
+  if( dp < 0 )
     {
-    ev2a = ev2a * (-1.0);
+    for( unsigned int i = 0; i < 3; i++ )
+      {
+      ev2r[i] = -ev2r[i];
+      }
+    dp = -dp;
     }
-  TransformOutputVectorType ev2r = ev2a - (ev2a * ev1r) * ev1r;
-  ev2r.Normalize();
-
-  TransformOutputVectorType ev3r = CrossProduct( ev1r, ev2r );
-  ev3r.Normalize();
-
-  VnlVectorType e1(3);
-  VnlVectorType e2(3);
-  VnlVectorType e3(3);
   for( unsigned int i = 0; i < 3; i++ )
     {
-    e1[i] = ev1r[i];
-    e2[i] = ev2r[i];
-    e3[i] = ev3r[i];
+    ev2r[i] -= dp * ev1r[i];
+    }
+  norm = std::sqrt( ev2r[0] * ev2r[0] + ev2r[1] * ev2r[1] + ev2r[2] * ev2r[2] );
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    ev2r[i] /= norm;
     }
 
-  VnlMatrixType DTrotated = eig.get_eigenvalue(2) * outer_product(e1, e1)
-    + eig.get_eigenvalue(1) * outer_product(e2, e2) + eig.get_eigenvalue(0) * outer_product(e3, e3);
+  const RealType ev3r[3] = { ev1r[1] * ev2r[2] - ev1r[2] * ev2r[1],
+                             ev1r[2] * ev2r[0] - ev1r[0] * ev2r[2],
+                             ev1r[0] * ev2r[1] - ev1r[1] * ev2r[0] };
 
-  outTensor[0] = DTrotated(0, 0);
-  outTensor[1] = DTrotated(0, 1);
-  outTensor[2] = DTrotated(0, 2);
-  outTensor[3] = DTrotated(1, 1);
-  outTensor[4] = DTrotated(1, 2);
-  outTensor[5] = DTrotated(2, 2);
+  TensorType   outTensor;
+  unsigned int tensorIndex = 0;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    for( unsigned int j = i; j < 3; j++, tensorIndex++ )
+      {
+      outTensor[tensorIndex] = evals[2] * ev1r[i] * ev1r[j] + evals[1] * ev2r[i] * ev2r[j]
+        + evals[0] * ev3r[i] * ev3r[j];
+      }
+    }
 
   return outTensor;
 }
@@ -262,17 +265,12 @@ PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVe
 template <typename TTensorImage, typename TVectorImage>
 void
 PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVectorImage>
-::GenerateData()
+::BeforeThreadedGenerateData()
 {
-  // get input and output images
-  // FIXME - use buffered region, etc
-  InputImagePointer  input = this->GetInput();
-  OutputImagePointer output = this->GetOutput();
+  const InputImageType * input = this->GetInput();
 
   this->m_DirectionTransform = AffineTransformType::New();
   this->m_DirectionTransform->SetIdentity();
-  AffineTransformPointer directionTranspose = AffineTransformType::New();
-  directionTranspose->SetIdentity();
 
   if( this->m_UseAffine )
     {
@@ -281,54 +279,38 @@ PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVe
       {
       this->DirectionCorrectTransform( this->m_AffineTransform, this->m_DirectionTransform );
       }
-    this->m_InverseAffineTransform = this->m_AffineTransform->GetInverseTransform();
-
-    output->SetRegions( input->GetLargestPossibleRegion() );
-    output->SetSpacing( input->GetSpacing() );
-    output->SetOrigin( input->GetOrigin() );
-    output->SetDirection( input->GetDirection() );
-    output->Allocate();
+    // Eigenvectors are carried by the inverse of the linear part, as in
+    // MatrixOffsetTransformBase::TransformDiffusionTensor3D.
+    this->m_InverseAffineMatrix = this->m_AffineTransform->GetInverseMatrix();
     }
   else
     {
     // Retain input image space as that should be handled in antsApplyTransforms
-
     this->m_DirectionTransform->SetMatrix( m_DisplacementField->GetDirection() );
 
-    output->SetRegions( input->GetLargestPossibleRegion() );
-    output->SetSpacing( input->GetSpacing() );
-    output->SetOrigin( input->GetOrigin() );
-    output->SetDirection( input->GetDirection() );
-    output->Allocate();
-
     this->m_DisplacementTransform = DisplacementFieldTransformType::New();
     this->m_DisplacementTransform->SetDisplacementField( m_DisplacementField );
     }
+}
 
-  ImageRegionIteratorWithIndex<OutputImageType> outputIt( output, output->GetLargestPossibleRegion() );
-
-  VariableMatrixType jMatrixAvg;
-  jMatrixAvg.SetSize(ImageDimension, ImageDimension);
-  jMatrixAvg.Fill(0.0);
+template <typename TTensorImage, typename TVectorImage>
+void
+PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVectorImage>
+::DynamicThreadedGenerateData( const OutputImageRegionType & outputRegionForThread )
+{
+  const InputImageType * input = this->GetInput();
+  OutputImageType *      output = this->GetOutput();
 
-  std::cout << "Iterating over image" << std::endl;
-  // for all voxels
-  for( outputIt.GoToBegin(); !outputIt.IsAtEnd(); ++outputIt )
-    {
-    InverseTransformPointer localDeformation;
+  ImageRegionConstIterator<InputImageType>      inputIt( input, outputRegionForThread );
+  ImageRegionIteratorWithIndex<OutputImageType> outputIt( output, outputRegionForThread );
 
-    // FIXME - eventually this will be callable via a generic transform base class
-    if( this->m_UseAffine )
-      {
-      localDeformation = this->m_InverseAffineTransform;
-      }
-    else
-      {
-      AffineTransformPointer deformation = this->GetLocalDeformation( this->m_DisplacementField, outputIt.GetIndex() );
-      localDeformation = deformation->GetInverseTransform();
-      }
+  typedef typename DisplacementFieldTransformType::InverseJacobianPositionType InverseJacobianType;
+  InverseJacobianType invJacobian;
+  MatrixType          localDeformation;
 
-    TensorType inTensor = input->GetPixel(outputIt.GetIndex() );
+  for( inputIt.GoToBegin(), outputIt.GoToBegin(); !outputIt.IsAtEnd(); ++inputIt, ++outputIt )
+    {
+    TensorType inTensor = inputIt.Get();
     TensorType outTensor;
 
     // valid values?
@@ -352,31 +334,25 @@ PreservationOfPrincipalDirectionTensorReorientationImageFilter<TTensorImage, TVe
       {
       outTensor = inTensor;
       }
+    else if( this->m_UseAffine )
+      {
+      outTensor = this->ApplyReorientation( this->m_InverseAffineMatrix, inTensor );
+      }
     else
       {
-      // outTensor = inTensor;
-      // InverseTransformPointer localDeformation;
-      if( this->m_UseAffine )
+      typename DisplacementFieldType::PointType pt;
+      this->m_DisplacementField->TransformIndexToPhysicalPoint( outputIt.GetIndex(), pt );
+      this->m_DisplacementTransform->ComputeInverseJacobianWithRespectToPosition( pt, invJacobian );
+      for( unsigned int i = 0; i < 3; i++ )
         {
-        outTensor = this->m_AffineTransform->TransformDiffusionTensor3D( inTensor );
-        // localDeformation = this->m_InverseAffineTransform;
-        }
-      else
-        {
-        typename DisplacementFieldType::PointType pt;
-        this->m_DisplacementField->TransformIndexToPhysicalPoint( outputIt.GetIndex(), pt );
-        outTensor = this->m_DisplacementTransform->TransformDiffusionTensor3D( inTensor, pt );
-        // AffineTransformPointer deformation = this->GetLocalDeformation( this->m_DeformationField, outputIt.GetIndex()
-        // );
-        // localDeformation = deformation->GetInverseTransform();
+        for( unsigned int j = 0; j < 3; j++ )
+          {
+          localDeformation(i, j) = invJacobian(i, j);
+          }
         }
-
-      /*
-     std::cout << "apply";
       outTensor = this->ApplyReorientation( localDeformation, inTensor );
-     std::cout << " ok" << std::endl;
-      */
       }
+
     // valid values?
     for( unsigned int jj = 0; jj < 6; jj++ )
       {
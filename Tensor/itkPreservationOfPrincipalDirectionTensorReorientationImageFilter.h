@@ -135,17 +135,16 @@ protected:
 
   void PrintSelf(std::ostream& os, Indent indent) const override;
 
-  /** PreservationOfPrincipalDirectionTensorReorientationImageFilter can be implemented as a multithreaded filter.
-   * Therefore, this implementation provides a ThreadedGenerateData()
-   * routine which is called for each processing thread. The output
-   * image data is allocated automatically by the superclass prior to
-   * calling ThreadedGenerateData().  ThreadedGenerateData can only
-   * write to the portion of the output image specified by the
-   * parameter "outputRegionForThread"
+  /** Sets up the affine or displacement field transform shared by all
+   * threads.  For an affine transform the matrix that maps the eigenvectors
+   * is constant, so it is computed once here rather than per voxel. */
+  void BeforeThreadedGenerateData() override;
+
+  /** Each voxel is reoriented independently, so the output region is split
+   * across threads.
    *
-   * \sa ImageToImageFilter::ThreadedGenerateData(),
-   *     ImageToImageFilter::GenerateData() */
-  void GenerateData() override;
+   * \sa ImageToImageFilter::DynamicThreadedGenerateData() */
+  void DynamicThreadedGenerateData( const OutputImageRegionType & outputRegionForThread ) override;
 
   typename DisplacementFieldType::PixelType TransformVectorByDirection( typename DisplacementFieldType::PixelType cpix )
   {
@@ -172,7 +171,10 @@ private:
 
   AffineTransformPointer GetLocalDeformation(DisplacementFieldPointer, typename DisplacementFieldType::IndexType );
 
-  TensorType ApplyReorientation(InverseTransformPointer, TensorType );
+  /** Preservation of principal direction: the principal eigenvector is
+   * mapped by the given matrix, the second one is made perpendicular to it,
+   * and the tensor is rebuilt with the original eigenvalues. */
+  TensorType ApplyReorientation( const MatrixType &, const TensorType & ) const;
 
   void DirectionCorrectTransform( AffineTransformPointer, AffineTransformPointer );
 
@@ -184,7 +186,7 @@ private:
 
   AffineTransformPointer m_AffineTransform;
 
-  InverseTransformPointer m_InverseAffineTransform;
+  MatrixType m_InverseAffineMatrix;
 
   bool m_UseAffine;
 
@@ -1,4 +1,21 @@
 #include "ReadWriteData.h"
+#include "itkMultiThreaderBase.h"
+#include "itk_zlib.h"
+
+#if defined( _WIN32 )
+#include <process.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <vector>
 
 bool ANTSFileExists(const std::string & strFilename)
 {
@@ -25,3 +42,504 @@ bool ANTSFileExists(const std::string & strFilename)
     }
   return blnReturn;
 }
+
+std::string ANTSImageCacheKey( const std::string & file, const std::string & imageTypeName,
+                               unsigned int numberOfComponents )
+{
+#if defined( _WIN32 )
+  return std::string( "" );
+#else
+  const char* cacheDirectory = getenv( "ANTS_IMAGE_CACHE_DIRECTORY" );
+  if( cacheDirectory == nullptr || std::strlen( cacheDirectory ) == 0 )
+    {
+    return std::string( "" );
+    }
+
+  struct stat stFileInfo;
+  if( stat( file.c_str(), &stFileInfo ) != 0 || !S_ISREG( stFileInfo.st_mode ) )
+    {
+    return std::string( "" );
+    }
+
+  // The cache key combines the canonical path with the modification time and
+  // size so that a rewritten input never maps a stale sidecar, and with the
+  // image type and number of components so that scalar, vector and tensor
+  // reads of the same file never share a buffer.
+  std::string canonicalPath = file;
+  char* resolvedPath = realpath( file.c_str(), nullptr );
+  if( resolvedPath != nullptr )
+    {
+    canonicalPath = std::string( resolvedPath );
+    free( resolvedPath );
+    }
+
+  std::ostringstream key;
+  key << canonicalPath << "|" << static_cast<long long>( stFileInfo.st_mtime )
+      << "|" << static_cast<long long>( stFileInfo.st_size )
+      << "|" << imageTypeName << "|" << numberOfComponents;
+  if( key.str().size() >= static_cast<size_t>( ANTSImageCacheHeader::MaximumKeyLength ) )
+    {
+    return std::string( "" );
+    }
+  return key.str();
+#endif
+}
+
+std::string ANTSImageCacheFileName( const std::string & key )
+{
+  const char* cacheDirectory = getenv( "ANTS_IMAGE_CACHE_DIRECTORY" );
+  if( key.empty() || cacheDirectory == nullptr )
+    {
+    return std::string( "" );
+    }
+
+  std::ostringstream cacheFile;
+  cacheFile << cacheDirectory << "/ants_" << std::hex
+            << std::hash<std::string>()( key ) << ".imgcache";
+  return cacheFile.str();
+}
+
+void * ANTSMapImageCacheFile( const std::string & key, ANTSImageCacheHeader & header,
+                              size_t & mappedLength )
+{
+  mappedLength = 0;
+#if defined( _WIN32 )
+  return nullptr;
+#else
+  const std::string cacheFile = ANTSImageCacheFileName( key );
+  if( cacheFile.empty() )
+    {
+    return nullptr;
+    }
+
+  const int fd = open( cacheFile.c_str(), O_RDONLY );
+  if( fd < 0 )
+    {
+    return nullptr;
+    }
+
+  struct stat stFileInfo;
+  if( fstat( fd, &stFileInfo ) != 0 ||
+      static_cast<size_t>( stFileInfo.st_size ) < sizeof( ANTSImageCacheHeader ) )
+    {
+    close( fd );
+    return nullptr;
+    }
+
+  // Reject sidecars from another key (hash collisions) and any whose buffer
+  // does not fit in the file.
+  if( read( fd, &header, sizeof( ANTSImageCacheHeader ) ) != static_cast<ssize_t>( sizeof( ANTSImageCacheHeader ) ) ||
+      std::strncmp( header.m_Magic, "ANTSIMC", 8 ) != 0 ||
+      header.m_Version != ANTSImageCacheHeader::Version ||
+      header.m_Key[ANTSImageCacheHeader::MaximumKeyLength - 1] != '\0' ||
+      key != std::string( header.m_Key ) ||
+      header.m_DataOffset < sizeof( ANTSImageCacheHeader ) ||
+      header.m_DataOffset > static_cast<unsigned long long>( stFileInfo.st_size ) ||
+      header.m_ElementSize == 0 ||
+      header.m_NumberOfElements > ( static_cast<unsigned long long>( stFileInfo.st_size ) - header.m_DataOffset ) /
+      header.m_ElementSize ||
+      header.m_DataOffset + header.m_NumberOfElements * header.m_ElementSize !=
+      static_cast<unsigned long long>( stFileInfo.st_size ) )
+    {
+    close( fd );
+    return nullptr;
+    }
+
+  // Map privately so that tools which modify their inputs in place get
+  // copy-on-write pages and never touch the shared sidecar.
+  mappedLength = static_cast<size_t>( stFileInfo.st_size );
+  void* mapping = mmap( nullptr, mappedLength, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+  close( fd );
+
+  if( mapping == MAP_FAILED )
+    {
+    mappedLength = 0;
+    return nullptr;
+    }
+  return mapping;
+#endif
+}
+
+void ANTSUnmapImageCacheFile( void * mapping, size_t mappedLength )
+{
+#if !defined( _WIN32 )
+  if( mapping != nullptr && mappedLength > 0 )
+    {
+    munmap( mapping, mappedLength );
+    }
+#endif
+}
+
+bool ANTSWriteImageCacheFile( const std::string & key, const ANTSImageCacheHeader & header,
+                              const void * buffer )
+{
+#if defined( _WIN32 )
+  return false;
+#else
+  const std::string cacheFile = ANTSImageCacheFileName( key );
+  if( cacheFile.empty() )
+    {
+    return false;
+    }
+
+  // Write to a temporary file and rename so that concurrent readers on the
+  // same node only ever see complete sidecars.
+  const std::string temporaryFile = ANTSTemporaryFileName( cacheFile, "" );
+
+  std::ofstream str( temporaryFile.c_str(), std::ios::out | std::ios::binary );
+  if( !str.is_open() )
+    {
+    return false;
+    }
+
+  std::vector<char> headerBlock( header.m_DataOffset, 0 );
+  std::memcpy( &headerBlock[0], &header, sizeof( ANTSImageCacheHeader ) );
+  str.write( &headerBlock[0], headerBlock.size() );
+  str.write( static_cast<const char *>( buffer ), header.m_NumberOfElements * header.m_ElementSize );
+  str.close();
+
+  if( !str || std::rename( temporaryFile.c_str(), cacheFile.c_str() ) != 0 )
+    {
+    std::remove( temporaryFile.c_str() );
+    return false;
+    }
+  return true;
+#endif
+}
+
+unsigned long long ANTSImageCacheDataOffset()
+{
+#if defined( _WIN32 )
+  return 4096;
+#else
+  const unsigned long long pageSize = static_cast<unsigned long long>( sysconf( _SC_PAGESIZE ) );
+  return ( ( sizeof( ANTSImageCacheHeader ) + pageSize - 1 ) / pageSize ) * pageSize;
+#endif
+}
+
+bool ANTSIsBinaryMatrixFileName( const std::string & file )
+{
+  return itksys::SystemTools::GetFilenameLastExtension( file ) == ".bmat";
+}
+
+void * ANTSMapBinaryMatrixFile( const std::string & file, ANTSBinaryMatrixHeader & header,
+                                size_t & mappedLength )
+{
+  mappedLength = 0;
+
+  std::ifstream str( file.c_str(), std::ios::in | std::ios::binary );
+  if( !str.is_open() ||
+      !str.read( reinterpret_cast<char *>( &header ), sizeof( ANTSBinaryMatrixHeader ) ) )
+    {
+    return nullptr;
+    }
+  if( std::strncmp( header.m_Magic, "ANTSMAT", 8 ) != 0 ||
+      header.m_Version != ANTSBinaryMatrixHeader::Version ||
+      ( header.m_ElementSize != sizeof( float ) && header.m_ElementSize != sizeof( double ) ) ||
+      header.m_DataOffset < sizeof( ANTSBinaryMatrixHeader ) )
+    {
+    return nullptr;
+    }
+  const unsigned long long dataLength = header.m_Rows * header.m_Columns * header.m_ElementSize;
+  const unsigned long long fileLength = header.m_DataOffset + dataLength;
+
+  str.seekg( 0, std::ios::end );
+  if( static_cast<unsigned long long>( str.tellg() ) < fileLength )
+    {
+    return nullptr;
+    }
+
+#if defined( _WIN32 )
+  // No mmap; read the whole file into a heap block released by
+  // ANTSUnmapBinaryMatrixFile.
+  char * mapping = new char[fileLength];
+  str.seekg( 0, std::ios::beg );
+  if( !str.read( mapping, fileLength ) )
+    {
+    delete[] mapping;
+    return nullptr;
+    }
+  mappedLength = fileLength;
+  return mapping;
+#else
+  str.close();
+  const int fd = open( file.c_str(), O_RDONLY );
+  if( fd < 0 )
+    {
+    return nullptr;
+    }
+  void * mapping = mmap( nullptr, fileLength, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( mapping == MAP_FAILED )
+    {
+    return nullptr;
+    }
+  madvise( mapping, fileLength, MADV_SEQUENTIAL );
+  mappedLength = fileLength;
+  return mapping;
+#endif
+}
+
+void ANTSUnmapBinaryMatrixFile( void * mapping, size_t mappedLength )
+{
+  if( mapping == nullptr )
+    {
+    return;
+    }
+#if defined( _WIN32 )
+  (void) mappedLength;
+  delete[] static_cast<char *>( mapping );
+#else
+  munmap( mapping, mappedLength );
+#endif
+}
+
+bool ANTSWriteBinaryMatrixFile( const std::string & file, unsigned int elementSize,
+                                unsigned long long rows, unsigned long long columns,
+                                const void * buffer )
+{
+  ANTSBinaryMatrixHeader header;
+  std::memset( &header, 0, sizeof( ANTSBinaryMatrixHeader ) );
+  std::strncpy( header.m_Magic, "ANTSMAT", 8 );
+  header.m_Version = ANTSBinaryMatrixHeader::Version;
+  header.m_ElementSize = elementSize;
+  header.m_Rows = rows;
+  header.m_Columns = columns;
+  header.m_DataOffset = ANTSBinaryMatrixHeader::DataOffset;
+
+  const std::string temporaryFile = ANTSTemporaryFileName( file, "" );
+
+  std::ofstream str( temporaryFile.c_str(), std::ios::out | std::ios::binary );
+  if( !str.is_open() )
+    {
+    return false;
+    }
+
+  std::vector<char> headerBlock( header.m_DataOffset, 0 );
+  std::memcpy( &headerBlock[0], &header, sizeof( ANTSBinaryMatrixHeader ) );
+  str.write( &headerBlock[0], headerBlock.size() );
+  str.write( static_cast<const char *>( buffer ), rows * columns * elementSize );
+  str.close();
+
+  if( !str || std::rename( temporaryFile.c_str(), file.c_str() ) != 0 )
+    {
+    std::remove( temporaryFile.c_str() );
+    return false;
+    }
+  return true;
+}
+
+int ANTSOutputCompressionLevel()
+{
+  const char* compressionLevel = getenv( "ANTS_OUTPUT_COMPRESSION_LEVEL" );
+  if( compressionLevel == nullptr || std::strlen( compressionLevel ) == 0 )
+    {
+    return ANTS_LEGACY_COMPRESSION;
+    }
+
+  char*      end = nullptr;
+  const long level = std::strtol( compressionLevel, &end, 10 );
+  if( end == compressionLevel || *end != '\0' || level > Z_BEST_COMPRESSION )
+    {
+    static std::atomic<bool> warned( false );
+    if( !warned.exchange( true ) )
+      {
+      std::cerr << "Invalid ANTS_OUTPUT_COMPRESSION_LEVEL \"" << compressionLevel
+                << "\" (expected 0-9, or negative for the default level).  Using the default level." << std::endl;
+      }
+    return Z_DEFAULT_COMPRESSION;
+    }
+  if( level < 0 )
+    {
+    return Z_DEFAULT_COMPRESSION;
+    }
+  return static_cast<int>( level );
+}
+
+std::string ANTSTemporaryFileName( const std::string & prefix, const std::string & extension )
+{
+  static std::atomic<unsigned int> counter( 0 );
+
+  std::ostringstream temporaryFile;
+#if defined( _WIN32 )
+  temporaryFile << prefix << ".tmp" << _getpid();
+#else
+  temporaryFile << prefix << ".tmp" << getpid();
+#endif
+  temporaryFile << "_" << counter++ << extension;
+  return temporaryFile.str();
+}
+
+bool ANTSReadNiftiHeaderForParallelCompression( const std::string & headerFile,
+                                                const std::vector<unsigned long long> & size,
+                                                unsigned int numberOfComponents,
+                                                std::vector<char> & header )
+{
+  // NIfTI-1 field offsets: sizeof_hdr, dim[8], intent_code and vox_offset.
+  const size_t dimOffset = 40;
+  const size_t intentCodeOffset = 68;
+  const size_t voxOffsetOffset = 108;
+  const int    headerSize = 348;
+  const short  vectorIntent = 1007;
+
+  std::ifstream str( headerFile.c_str(), std::ios::in | std::ios::binary );
+  header.assign( headerSize, 0 );
+  if( !str.is_open() || !str.read( &header[0], headerSize ) )
+    {
+    return false;
+    }
+
+  int   sizeofHeader = 0;
+  short intentCode = 0;
+  float voxOffset = 0.0f;
+  short dim[8];
+  std::memcpy( &sizeofHeader, &header[0], sizeof( int ) );
+  std::memcpy( dim, &header[dimOffset], sizeof( dim ) );
+  std::memcpy( &intentCode, &header[intentCodeOffset], sizeof( short ) );
+  std::memcpy( &voxOffset, &header[voxOffsetOffset], sizeof( float ) );
+
+  // Only native NIfTI-1 single files whose data are either scalar or vectors
+  // stored as the fifth dimension are handled; the caller falls back to the
+  // ITK writer for anything else (tensors, RGB, NIfTI-2, ...).
+  if( sizeofHeader != headerSize || voxOffset < headerSize || dim[0] < static_cast<short>( size.size() ) ||
+      dim[0] > 7 || ( numberOfComponents > 1 && ( intentCode != vectorIntent || dim[0] != 5 ||
+                                                  dim[5] != static_cast<short>( numberOfComponents ) ) ) )
+    {
+    return false;
+    }
+
+  header.resize( static_cast<size_t>( voxOffset ) );
+  if( header.size() > static_cast<size_t>( headerSize ) &&
+      !str.read( &header[headerSize], header.size() - headerSize ) )
+    {
+    return false;
+    }
+
+  // The header was written for a small stand-in image of the same geometry,
+  // so only the extents need to be patched.
+  for( size_t d = 0; d < size.size(); d++ )
+    {
+    if( size[d] > 32767 || dim[d + 1] != static_cast<short>( std::min<unsigned long long>( size[d], 2 ) ) )
+      {
+      return false;
+      }
+    dim[d + 1] = static_cast<short>( size[d] );
+    }
+  std::memcpy( &header[dimOffset], dim, sizeof( dim ) );
+  return true;
+}
+
+bool ANTSParallelGzipBuffer( const std::vector<char> & header, const void * buffer,
+                             unsigned long long numberOfPixels, unsigned int numberOfComponents,
+                             unsigned int componentSize, const std::string & outputFile,
+                             int compressionLevel )
+{
+  // Each block of the serialized file (header followed by the pixel data,
+  // with the components of vector images stored one volume after another as
+  // NIfTI expects) is filled and deflated independently into its own gzip
+  // member.  The concatenation of gzip members is itself a valid gzip stream,
+  // so the result can be opened by gunzip, zlib's gzread (and hence the NIfTI
+  // IO) and other standard readers.
+  const unsigned long long blockSize = 4 * 1024 * 1024;
+  const unsigned long long headerLength = header.size();
+  const unsigned long long totalLength =
+    headerLength + numberOfPixels * numberOfComponents * componentSize;
+  const unsigned long long numberOfBlocks = ( totalLength + blockSize - 1 ) / blockSize;
+  const unsigned char *    data = static_cast<const unsigned char *>( buffer );
+
+  // Write next to the output and rename on success so that a failure never
+  // leaves a truncated file at the final path.
+  const std::string temporaryFile = ANTSTemporaryFileName( outputFile, "" );
+  std::ofstream     output( temporaryFile.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+  if( !output.is_open() )
+    {
+    return false;
+    }
+
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  const unsigned int numberOfBlocksPerBatch =
+    4 * std::max( 1u, static_cast<unsigned int>( itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads() ) );
+
+  std::vector<std::vector<unsigned char> > inputBlocks( numberOfBlocksPerBatch );
+  std::vector<std::vector<unsigned char> > outputBlocks( numberOfBlocksPerBatch );
+  std::vector<int>                         status( numberOfBlocksPerBatch, Z_OK );
+
+  bool success = true;
+  for( unsigned long long firstBlock = 0; success && firstBlock < numberOfBlocks; firstBlock += numberOfBlocksPerBatch )
+    {
+    const unsigned int numberOfBatchBlocks = static_cast<unsigned int>(
+        std::min<unsigned long long>( numberOfBlocksPerBatch, numberOfBlocks - firstBlock ) );
+
+    threader->ParallelizeArray( 0, numberOfBatchBlocks,
+      [&]( itk::SizeValueType b )
+      {
+      const unsigned long long begin = ( firstBlock + b ) * blockSize;
+      const unsigned long long end = std::min( begin + blockSize, totalLength );
+
+      std::vector<unsigned char> & source = inputBlocks[b];
+      std::vector<unsigned char> & destination = outputBlocks[b];
+      source.resize( static_cast<size_t>( end - begin ) );
+
+      unsigned long long position = begin;
+      for( ; position < end && position < headerLength; position++ )
+        {
+        source[position - begin] = static_cast<unsigned char>( header[position] );
+        }
+      if( numberOfComponents == 1 && position < end )
+        {
+        std::memcpy( &source[position - begin], data + ( position - headerLength ), end - position );
+        }
+      else
+        {
+        while( position < end )
+          {
+          const unsigned long long offset = position - headerLength;
+          const unsigned long long element = offset / componentSize;
+          const unsigned long long within = offset % componentSize;
+          const unsigned long long count = std::min<unsigned long long>( componentSize - within, end - position );
+          const unsigned long long component = element / numberOfPixels;
+          const unsigned long long pixel = element % numberOfPixels;
+          std::memcpy( &source[position - begin],
+                       data + ( pixel * numberOfComponents + component ) * componentSize + within, count );
+          position += count;
+          }
+        }
+
+      z_stream stream;
+      std::memset( &stream, 0, sizeof( z_stream ) );
+      status[b] = deflateInit2( &stream, compressionLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY );
+      if( status[b] != Z_OK )
+        {
+        return;
+        }
+      destination.resize( deflateBound( &stream, static_cast<uLong>( source.size() ) ) + 64 );
+
+      stream.next_in = &source[0];
+      stream.avail_in = static_cast<uInt>( source.size() );
+      stream.next_out = &destination[0];
+      stream.avail_out = static_cast<uInt>( destination.size() );
+
+      status[b] = deflate( &stream, Z_FINISH );
+      destination.resize( stream.total_out );
+      deflateEnd( &stream );
+      }, nullptr );
+
+    for( unsigned int b = 0; b < numberOfBatchBlocks; b++ )
+      {
+      if( status[b] != Z_STREAM_END )
+        {
+        success = false;
+        break;
+        }
+      output.write( reinterpret_cast<const char *>( &outputBlocks[b][0] ), outputBlocks[b].size() );
+      }
+    }
+
+  output.close();
+  if( !success || !output || std::rename( temporaryFile.c_str(), outputFile.c_str() ) != 0 )
+    {
+    std::remove( temporaryFile.c_str() );
+    return false;
+    }
+  return true;
+}
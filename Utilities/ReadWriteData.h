@@ -25,10 +25,140 @@
 #include "itkLogTensorImageFilter.h"
 #include "itkExpTensorImageFilter.h"
 #include "itkCastImageFilter.h"
+#include "itkImportImageContainer.h"
+#include "vnl/vnl_matrix.h"
+#include <itksys/SystemTools.hxx>
 #include <sys/stat.h>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <vector>
 
 extern bool ANTSFileExists(const std::string & strFilename);
 
+// Opt-in cache of decoded images.  When ANTS_IMAGE_CACHE_DIRECTORY is set,
+// ReadImage stores the uncompressed pixel buffer of every image it reads in a
+// page-aligned sidecar file in that directory (keyed by path, modification
+// time, size, image type and number of components).  Later reads of the same
+// file mmap the sidecar as the pixel buffer, so repeated tool invocations on
+// one node share pages through the OS page cache instead of re-inflating
+// compressed inputs.  The full key is stored in the sidecar header and checked,
+// along with the buffer length, before a sidecar is mapped.
+// Note that only the image geometry and pixels are cached, not the meta data
+// dictionary.
+struct ANTSImageCacheHeader
+{
+  enum { Version = 2, MaximumDimension = 8, MaximumKeyLength = 2048 };
+
+  char               m_Magic[8];
+  char               m_Key[MaximumKeyLength];
+  unsigned int       m_Version;
+  unsigned int       m_Dimension;
+  unsigned int       m_ElementSize;
+  unsigned int       m_NumberOfComponents;
+  unsigned long long m_NumberOfElements;
+  unsigned long long m_DataOffset;
+  long long          m_Index[MaximumDimension];
+  unsigned long long m_Size[MaximumDimension];
+  double             m_Spacing[MaximumDimension];
+  double             m_Origin[MaximumDimension];
+  double             m_Direction[MaximumDimension * MaximumDimension];
+};
+
+extern std::string ANTSImageCacheKey( const std::string & file, const std::string & imageTypeName,
+                                      unsigned int numberOfComponents );
+extern std::string ANTSImageCacheFileName( const std::string & key );
+extern void * ANTSMapImageCacheFile( const std::string & key, ANTSImageCacheHeader & header,
+                                     size_t & mappedLength );
+extern void ANTSUnmapImageCacheFile( void * mapping, size_t mappedLength );
+extern bool ANTSWriteImageCacheFile( const std::string & key, const ANTSImageCacheHeader & header,
+                                     const void * buffer );
+extern unsigned long long ANTSImageCacheDataOffset();
+
+// Parallel compression of .nii.gz outputs.  When ANTS_OUTPUT_COMPRESSION_LEVEL
+// is set (0-9, negative for the zlib default), WriteImage writes .nii.gz files
+// by compressing independent blocks of the image buffer concurrently into a
+// multi-member gzip stream that standard gzip readers open as usual.  A level
+// of 0 stores the blocks without compression, which is useful for
+// intermediate files.  Invalid levels are reported and replaced by the default.
+#define ANTS_LEGACY_COMPRESSION -2
+
+extern int ANTSOutputCompressionLevel();
+extern std::string ANTSTemporaryFileName( const std::string & prefix, const std::string & extension );
+extern bool ANTSReadNiftiHeaderForParallelCompression( const std::string & headerFile,
+                                                       const std::vector<unsigned long long> & size,
+                                                       unsigned int numberOfComponents,
+                                                       std::vector<char> & header );
+extern bool ANTSParallelGzipBuffer( const std::vector<char> & header, const void * buffer,
+                                    unsigned long long numberOfPixels, unsigned int numberOfComponents,
+                                    unsigned int componentSize, const std::string & outputFile,
+                                    int compressionLevel );
+
+// Binary matrix files (.bmat).  A fixed-size header padded to 4096 bytes is
+// followed by the row-major matrix elements stored as float or double in the
+// native byte order, so the file can be memory mapped and copied into a
+// vnl_matrix without any parsing.  sccan reads and writes this format wherever
+// it accepts .csv matrices.
+struct ANTSBinaryMatrixHeader
+{
+  enum { Version = 1, DataOffset = 4096 };
+
+  char               m_Magic[8];
+  unsigned int       m_Version;
+  unsigned int       m_ElementSize;
+  unsigned long long m_Rows;
+  unsigned long long m_Columns;
+  unsigned long long m_DataOffset;
+};
+
+extern bool ANTSIsBinaryMatrixFileName( const std::string & file );
+extern void * ANTSMapBinaryMatrixFile( const std::string & file, ANTSBinaryMatrixHeader & header,
+                                       size_t & mappedLength );
+extern void ANTSUnmapBinaryMatrixFile( void * mapping, size_t mappedLength );
+extern bool ANTSWriteBinaryMatrixFile( const std::string & file, unsigned int elementSize,
+                                       unsigned long long rows, unsigned long long columns,
+                                       const void * buffer );
+
+/** \class ANTSMappedImageContainer
+ * Pixel container which references a memory-mapped image cache sidecar and
+ * releases the mapping when the image is destroyed.
+ */
+template <typename TElementIdentifier, typename TElement>
+class ANTSMappedImageContainer
+  : public itk::ImportImageContainer<TElementIdentifier, TElement>
+{
+public:
+  typedef ANTSMappedImageContainer                                Self;
+  typedef itk::ImportImageContainer<TElementIdentifier, TElement> Superclass;
+  typedef itk::SmartPointer<Self>                                 Pointer;
+  typedef itk::SmartPointer<const Self>                           ConstPointer;
+
+  itkNewMacro( Self );
+  itkTypeMacro( ANTSMappedImageContainer, ImportImageContainer );
+
+  void SetMapping( void * mapping, size_t mappedLength )
+  {
+    this->m_Mapping = mapping;
+    this->m_MappedLength = mappedLength;
+  }
+
+protected:
+  ANTSMappedImageContainer() : m_Mapping( nullptr ), m_MappedLength( 0 )
+  {
+  }
+
+  ~ANTSMappedImageContainer() override
+  {
+    ANTSUnmapImageCacheFile( this->m_Mapping, this->m_MappedLength );
+  }
+
+private:
+  void * m_Mapping;
+  size_t m_MappedLength;
+};
+
 // Nifti stores DTI values in lower tri format but itk uses upper tri
 // currently, nifti io does nothing to deal with this. if this changes
 // the function below should be modified/eliminated.
@@ -208,6 +338,136 @@ void ReadTensorImage(itk::SmartPointer<TImageType> & target, const char *file, b
 
 }
 
+// Number of components per pixel that is fixed by the image type, or 0 for
+// images such as itk::VectorImage whose vector length comes from the file.
+template <typename TImageType>
+unsigned int ANTSImageCacheComponentsForType()
+{
+  typename TImageType::Pointer image = TImageType::New();
+  return image->GetNumberOfComponentsPerPixel();
+}
+
+template <typename TImageType>
+std::string ANTSImageCacheKeyForType( const char *file )
+{
+  typedef typename TImageType::PixelContainer::Element ElementType;
+
+  // Only plain-old-data buffers can be cached byte for byte.
+  if( !std::is_trivially_copyable<ElementType>::value ||
+      static_cast<unsigned int>( TImageType::ImageDimension ) >
+      static_cast<unsigned int>( ANTSImageCacheHeader::MaximumDimension ) )
+    {
+    return std::string( "" );
+    }
+  return ANTSImageCacheKey( std::string( file ), typeid( TImageType ).name(),
+                            ANTSImageCacheComponentsForType<TImageType>() );
+}
+
+template <typename TImageType>
+bool ReadCachedImage( itk::SmartPointer<TImageType> & target, const std::string & key )
+{
+  typedef typename TImageType::PixelContainer                 PixelContainerType;
+  typedef typename PixelContainerType::Element                ElementType;
+  typedef typename PixelContainerType::ElementIdentifier      ElementIdentifierType;
+  typedef ANTSMappedImageContainer<ElementIdentifierType, ElementType> MappedContainerType;
+
+  if( key.empty() )
+    {
+    return false;
+    }
+
+  ANTSImageCacheHeader header;
+  size_t               mappedLength = 0;
+  void*                mapping = ANTSMapImageCacheFile( key, header, mappedLength );
+  if( mapping == nullptr )
+    {
+    return false;
+    }
+
+  // The buffer must hold exactly one element per pixel, or one element per
+  // component when the vector length is only known from the file.
+  const unsigned int staticComponents = ANTSImageCacheComponentsForType<TImageType>();
+  unsigned long long expectedElements = ( staticComponents == 0 ) ? header.m_NumberOfComponents : 1;
+  for( unsigned int d = 0; d < TImageType::ImageDimension; d++ )
+    {
+    expectedElements *= header.m_Size[d];
+    }
+  if( header.m_Dimension != TImageType::ImageDimension || header.m_ElementSize != sizeof( ElementType ) ||
+      ( staticComponents != 0 && header.m_NumberOfComponents != staticComponents ) ||
+      header.m_NumberOfComponents == 0 || header.m_NumberOfElements != expectedElements )
+    {
+    ANTSUnmapImageCacheFile( mapping, mappedLength );
+    return false;
+    }
+
+  typename TImageType::RegionType region;
+  typename TImageType::SpacingType spacing;
+  typename TImageType::PointType origin;
+  typename TImageType::DirectionType direction;
+  for( unsigned int d = 0; d < TImageType::ImageDimension; d++ )
+    {
+    region.SetIndex( d, header.m_Index[d] );
+    region.SetSize( d, header.m_Size[d] );
+    spacing[d] = header.m_Spacing[d];
+    origin[d] = header.m_Origin[d];
+    for( unsigned int e = 0; e < TImageType::ImageDimension; e++ )
+      {
+      direction(d, e) = header.m_Direction[d * ANTSImageCacheHeader::MaximumDimension + e];
+      }
+    }
+
+  typename MappedContainerType::Pointer container = MappedContainerType::New();
+  container->SetImportPointer( reinterpret_cast<ElementType *>( static_cast<char *>( mapping ) + header.m_DataOffset ),
+                               static_cast<ElementIdentifierType>( header.m_NumberOfElements ), false );
+  container->SetMapping( mapping, mappedLength );
+
+  target = TImageType::New();
+  target->SetRegions( region );
+  target->SetSpacing( spacing );
+  target->SetOrigin( origin );
+  target->SetDirection( direction );
+  target->SetNumberOfComponentsPerPixel( header.m_NumberOfComponents );
+  target->SetPixelContainer( container );
+  return true;
+}
+
+template <typename TImageType>
+bool WriteCachedImage( const itk::SmartPointer<TImageType> & image, const std::string & key )
+{
+  typedef typename TImageType::PixelContainer::Element ElementType;
+
+  if( key.empty() || image.IsNull() || image->GetPixelContainer() == nullptr )
+    {
+    return false;
+    }
+
+  ANTSImageCacheHeader header;
+  std::memset( &header, 0, sizeof( ANTSImageCacheHeader ) );
+  std::strncpy( header.m_Magic, "ANTSIMC", 8 );
+  std::strncpy( header.m_Key, key.c_str(), ANTSImageCacheHeader::MaximumKeyLength - 1 );
+  header.m_Version = ANTSImageCacheHeader::Version;
+  header.m_Dimension = TImageType::ImageDimension;
+  header.m_ElementSize = sizeof( ElementType );
+  header.m_NumberOfComponents = image->GetNumberOfComponentsPerPixel();
+  header.m_NumberOfElements = image->GetPixelContainer()->Size();
+  header.m_DataOffset = ANTSImageCacheDataOffset();
+
+  const typename TImageType::RegionType & region = image->GetBufferedRegion();
+  for( unsigned int d = 0; d < TImageType::ImageDimension; d++ )
+    {
+    header.m_Index[d] = region.GetIndex()[d];
+    header.m_Size[d] = region.GetSize()[d];
+    header.m_Spacing[d] = image->GetSpacing()[d];
+    header.m_Origin[d] = image->GetOrigin()[d];
+    for( unsigned int e = 0; e < TImageType::ImageDimension; e++ )
+      {
+      header.m_Direction[d * ANTSImageCacheHeader::MaximumDimension + e] = image->GetDirection()(d, e);
+      }
+    }
+
+  return ANTSWriteImageCacheFile( key, header, image->GetPixelContainer()->GetBufferPointer() );
+}
+
 template <typename TImageType>
 // void ReadImage(typename TImageType::Pointer target, const char *file)
 bool ReadImage(itk::SmartPointer<TImageType> & target, const char *file)
@@ -243,6 +503,14 @@ bool ReadImage(itk::SmartPointer<TImageType> & target, const char *file)
       std::cerr << " file " << std::string(file) << " does not exist . " << std::endl; target = nullptr;
       return false;
       }
+    // The key is taken before reading so that a file rewritten during the
+    // read is never cached under its new modification time.
+    const std::string cacheKey = ANTSImageCacheKeyForType<TImageType>( file );
+    if( ReadCachedImage<TImageType>( target, cacheKey ) )
+      {
+      return true;
+      }
+
     typedef TImageType                      ImageType;
     typedef itk::ImageFileReader<ImageType> FileSourceType;
 
@@ -267,6 +535,7 @@ bool ReadImage(itk::SmartPointer<TImageType> & target, const char *file)
 
     // std::cout << " setting pointer " << std::endl;
     target = reffilter->GetOutput();
+    WriteCachedImage<TImageType>( target, cacheKey );
     }
   return true;
 }
@@ -274,6 +543,13 @@ bool ReadImage(itk::SmartPointer<TImageType> & target, const char *file)
 template <typename ImageType>
 typename ImageType::Pointer ReadImage(char* fn )
 {
+  const std::string cacheKey = ANTSImageCacheKeyForType<ImageType>( fn );
+  typename ImageType::Pointer cachedTarget = nullptr;
+  if( ReadCachedImage<ImageType>( cachedTarget, cacheKey ) )
+    {
+    return cachedTarget;
+    }
+
   // Read the image files begin
   typedef itk::ImageFileReader<ImageType> FileSourceType;
 
@@ -298,6 +574,8 @@ typename ImageType::Pointer ReadImage(char* fn )
   // if (reffilter->GetImageIO->GetNumberOfComponents() == 6)
   // NiftiDTICheck<ImageType>(target,fn);
 
+  WriteCachedImage<ImageType>( target, cacheKey );
+
   return target;
 }
 
@@ -488,6 +766,95 @@ bool WritePointSet( itk::SmartPointer<TPointSet> pointSet, const char *file )
   return true;
 }
 
+template <typename TImageType>
+bool WriteImageWithParallelCompression(const itk::SmartPointer<TImageType> image, const char *file,
+                                       int compressionLevel)
+{
+  typedef typename TImageType::PixelContainer::Element ElementType;
+
+  // Removes the stand-in header file however the write below ends.
+  struct TemporaryFileRemover
+  {
+    std::string m_FileName;
+    ~TemporaryFileRemover()
+    {
+      itksys::SystemTools::RemoveFile( this->m_FileName );
+    }
+  };
+
+  // The NIfTI header is taken from a stand-in image of at most two voxels per
+  // axis with the same geometry, pixel type and meta data, written by the
+  // regular NIfTI IO.  The pixel data are then compressed in blocks straight
+  // from the image buffer instead of going through the single-threaded gzip
+  // stream of the NIfTI IO.
+  const std::string outputFile( file );
+  const typename TImageType::RegionType & region = image->GetLargestPossibleRegion();
+  const unsigned int numberOfComponents = image->GetNumberOfComponentsPerPixel();
+  const unsigned long long numberOfPixels = region.GetNumberOfPixels();
+  const unsigned long long numberOfBytes =
+    static_cast<unsigned long long>( image->GetPixelContainer()->Size() ) * sizeof( ElementType );
+
+  std::vector<char> header;
+  bool              isSupported = std::is_trivially_copyable<ElementType>::value &&
+    image->GetBufferedRegion() == region && numberOfComponents > 0 && numberOfPixels > 0 &&
+    numberOfBytes % ( numberOfPixels * numberOfComponents ) == 0;
+  if( isSupported )
+    {
+    TemporaryFileRemover headerFile;
+    headerFile.m_FileName =
+      ANTSTemporaryFileName( outputFile.substr( 0, outputFile.length() - 7 ), ".nii" );
+
+    typename TImageType::RegionType    headerRegion( region.GetIndex(), region.GetSize() );
+    std::vector<unsigned long long>    size( TImageType::ImageDimension );
+    for( unsigned int d = 0; d < TImageType::ImageDimension; d++ )
+      {
+      size[d] = region.GetSize()[d];
+      headerRegion.SetSize( d, std::min<itk::SizeValueType>( region.GetSize()[d], 2 ) );
+      }
+
+    typename TImageType::Pointer headerImage = TImageType::New();
+    headerImage->CopyInformation( image );
+    headerImage->SetRegions( headerRegion );
+    headerImage->SetMetaDataDictionary( image->GetMetaDataDictionary() );
+    headerImage->Allocate();
+    std::memset( static_cast<void *>( headerImage->GetPixelContainer()->GetBufferPointer() ), 0,
+                 headerImage->GetPixelContainer()->Size() * sizeof( ElementType ) );
+
+    typename itk::ImageFileWriter<TImageType>::Pointer headerWriter =
+      itk::ImageFileWriter<TImageType>::New();
+    headerWriter->SetFileName( headerFile.m_FileName.c_str() );
+    headerWriter->SetInput( headerImage );
+    headerWriter->SetUseCompression( false );
+    headerWriter->Update();
+
+    isSupported = ANTSReadNiftiHeaderForParallelCompression( headerFile.m_FileName, size,
+                                                            numberOfComponents, header );
+    }
+
+  if( !isSupported )
+    {
+    // Tensors, RGB and other layouts the NIfTI IO reorders itself.
+    typename itk::ImageFileWriter<TImageType>::Pointer writer =
+      itk::ImageFileWriter<TImageType>::New();
+    writer->SetFileName( file );
+    writer->SetInput( image );
+    writer->SetUseCompression( true );
+    writer->Update();
+    return true;
+    }
+
+  const bool success = ANTSParallelGzipBuffer( header, image->GetPixelContainer()->GetBufferPointer(),
+                                               numberOfPixels, numberOfComponents,
+                                               static_cast<unsigned int>( numberOfBytes /
+                                                                          ( numberOfPixels * numberOfComponents ) ),
+                                               outputFile, compressionLevel );
+  if( !success )
+    {
+    std::cerr << "Parallel compression of " << outputFile << " failed." << std::endl;
+    }
+  return success;
+}
+
 template <typename TImageType>
 bool WriteImage(const itk::SmartPointer<TImageType> image, const char *file)
 {
@@ -520,6 +887,13 @@ bool WriteImage(const itk::SmartPointer<TImageType> image, const char *file)
       std::cerr << "Image is nullptr." << std::endl;
       std::exception();
       }
+    const int         compressionLevel = ANTSOutputCompressionLevel();
+    const std::string fileName( file );
+    if( compressionLevel != ANTS_LEGACY_COMPRESSION && fileName.length() > 7 &&
+        fileName.compare( fileName.length() - 7, 7, ".nii.gz" ) == 0 )
+      {
+      return WriteImageWithParallelCompression<TImageType>( image, file, compressionLevel );
+      }
     writer->SetInput(image);
     writer->SetUseCompression( true );
     writer->Update();
@@ -846,6 +1220,53 @@ ConvertMultiChannelImageToTimeSeriesImage( MultiChannelImageType *multiChannelIm
 }
 
 
+template <typename TValue>
+bool ReadBinaryMatrix( vnl_matrix<TValue> & matrix, const std::string & file )
+{
+  ANTSBinaryMatrixHeader header;
+  size_t                 mappedLength = 0;
+  void *                 mapping = ANTSMapBinaryMatrixFile( file, header, mappedLength );
+  if( mapping == nullptr )
+    {
+    std::cerr << "Could not read binary matrix file " << file << std::endl;
+    return false;
+    }
+
+  matrix.set_size( header.m_Rows, header.m_Columns );
+  const char *             data = static_cast<const char *>( mapping ) + header.m_DataOffset;
+  const unsigned long long numberOfElements = header.m_Rows * header.m_Columns;
+  if( header.m_ElementSize == sizeof( TValue ) )
+    {
+    std::memcpy( matrix.data_block(), data, numberOfElements * sizeof( TValue ) );
+    }
+  else if( header.m_ElementSize == sizeof( float ) )
+    {
+    std::copy( reinterpret_cast<const float *>( data ), reinterpret_cast<const float *>( data ) + numberOfElements,
+               matrix.data_block() );
+    }
+  else
+    {
+    std::copy( reinterpret_cast<const double *>( data ), reinterpret_cast<const double *>( data ) + numberOfElements,
+               matrix.data_block() );
+    }
+  ANTSUnmapBinaryMatrixFile( mapping, mappedLength );
+  return true;
+}
+
+template <typename TValue>
+bool WriteBinaryMatrix( const vnl_matrix<TValue> & matrix, const std::string & file )
+{
+  static_assert( std::is_same<TValue, float>::value || std::is_same<TValue, double>::value,
+                 "Binary matrix files store float or double elements." );
+  if( !ANTSWriteBinaryMatrixFile( file, sizeof( TValue ), matrix.rows(), matrix.cols(), matrix.data_block() ) )
+    {
+    std::cerr << "Could not write binary matrix file " << file << std::endl;
+    return false;
+    }
+  return true;
+}
+
+
 class nullBuf
 : public std::streambuf
 {
@@ -210,6 +210,18 @@ public:
 
   MatrixType GetCovMatEigenvectors( MatrixType p );
 
+  /** Leading eigenvectors of p * p^T, largest first, one per column.  Uses a
+   * randomized range finder with a few power iterations so that a
+   * time x voxel matrix is only multiplied through a handful of times
+   * instead of decomposing the full covariance once per eigenvector.  May
+   * return fewer columns than requested if p has lower rank. */
+  MatrixType GetTopCovMatEigenvectors( const MatrixType & p, unsigned int numberOfEigenvectors,
+                                       unsigned int numberOfPowerIterations = 2 );
+
+  /** Same result as p = p - ProjectionMatrix(b) * p, but done in place
+   * without forming the rows x rows projection matrix. */
+  void ProjectOutMatrix( MatrixType & p, const MatrixType & b );
+
   VectorType AverageColumns( MatrixType p )
   {
     unsigned int ncol = p.columns();
@@ -311,6 +323,8 @@ public:
   }
 
 private:
+  void OrthonormalizeColumns( MatrixType & p );
+
   bool       m_Debug;
   MatrixType m_OriginalMatrixP;
   MatrixType m_OriginalMatrixQ;
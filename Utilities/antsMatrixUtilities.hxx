@@ -13,10 +13,12 @@
   PURPOSE.  See the above copyright notices for more information.
 
 =========================================================================*/
+#include <algorithm>
 #include <vnl/vnl_random.h>
 #include <vnl/vnl_trace.h>
 #include <vnl/algo/vnl_matrix_inverse.h>
 #include <vnl/algo/vnl_generalized_eigensystem.h>
+#include <vnl/algo/vnl_symmetric_eigensystem.h>
 #include "antsMatrixUtilities.h"
 
 namespace itk
@@ -159,5 +161,103 @@ antsMatrixUtilities<TInputImage, TRealType>
     return eig.U();
     }
 }
+template <typename TInputImage, typename TRealType>
+typename antsMatrixUtilities<TInputImage, TRealType>::MatrixType
+antsMatrixUtilities<TInputImage, TRealType>
+::GetTopCovMatEigenvectors( const MatrixType & p, unsigned int numberOfEigenvectors,
+                            unsigned int numberOfPowerIterations )
+{
+  // oversample the requested subspace so the leading vectors converge
+  const unsigned int rank = std::min<unsigned int>( numberOfEigenvectors + 10,
+                                                    std::min<unsigned int>( p.rows(), p.cols() ) );
+  if( rank == 0 )
+    {
+    return MatrixType( p.rows(), 0 );
+    }
+
+  // fixed seed so that repeated runs give the same components
+  vnl_random randgen( 1234567 );
+  MatrixType omega( p.cols(), rank );
+  for( unsigned int i = 0; i < omega.rows(); i++ )
+    {
+    for( unsigned int j = 0; j < rank; j++ )
+      {
+      omega( i, j ) = randgen.normal();
+      }
+    }
+
+  // range of p, sharpened by power iterations; p^T is never formed
+  MatrixType range = p * omega;
+  this->OrthonormalizeColumns( range );
+  for( unsigned int iteration = 0; iteration < numberOfPowerIterations; iteration++ )
+    {
+    const MatrixType rangeTp = range.transpose() * p;
+    range = p * rangeTp.transpose();
+    this->OrthonormalizeColumns( range );
+    }
+
+  // eigenvectors of the small projected covariance, mapped back
+  const MatrixType                    rangeTp = range.transpose() * p;
+  const MatrixType                    smallCovariance = rangeTp * rangeTp.transpose();
+  vnl_symmetric_eigensystem<RealType> eig( smallCovariance );
+
+  const unsigned int numberOfColumns = std::min( numberOfEigenvectors, rank );
+  MatrixType         eigenvectors( p.rows(), numberOfColumns );
+  for( unsigned int k = 0; k < numberOfColumns; k++ )
+    {
+    // eigenvalues are sorted in increasing order
+    eigenvectors.set_column( k, range * eig.get_eigenvector( rank - 1 - k ) );
+    }
+  return eigenvectors;
+}
+
+template <typename TInputImage, typename TRealType>
+void
+antsMatrixUtilities<TInputImage, TRealType>
+::ProjectOutMatrix( MatrixType & p, const MatrixType & b )
+{
+  // ProjectionMatrix(b) is w * w^T for the whitened, normalized nuisance w
+  const MatrixType whitened = this->WhitenMatrix( this->NormalizeMatrix( b ) );
+  const MatrixType coefficients = whitened.transpose() * p;
+  for( unsigned int i = 0; i < p.rows(); i++ )
+    {
+    RealType * row = p[i];
+    for( unsigned int c = 0; c < whitened.cols(); c++ )
+      {
+      const RealType   weight = whitened( i, c );
+      const RealType * coefficientRow = coefficients[c];
+      for( unsigned int j = 0; j < p.cols(); j++ )
+        {
+        row[j] -= weight * coefficientRow[j];
+        }
+      }
+    }
+}
+
+template <typename TInputImage, typename TRealType>
+void
+antsMatrixUtilities<TInputImage, TRealType>
+::OrthonormalizeColumns( MatrixType & p )
+{
+  // modified Gram-Schmidt, applied twice for numerical orthogonality
+  for( unsigned int pass = 0; pass < 2; pass++ )
+    {
+    for( unsigned int j = 0; j < p.cols(); j++ )
+      {
+      VectorType column = p.get_column( j );
+      for( unsigned int k = 0; k < j; k++ )
+        {
+        const VectorType previous = p.get_column( k );
+        column -= previous * inner_product( previous, column );
+        }
+      const RealType norm = column.two_norm();
+      if( norm > 0 )
+        {
+        column /= norm;
+        }
+      p.set_column( j, column );
+      }
+    }
+}
 } // namespace ants
 } // namespace itk
@@ -45,6 +45,11 @@ public:
   /** Run-time type information (and related methods). */
   itkTypeMacro( antsSCCANObject, ImageToImageFilter );
 
+  /** Copy the solver settings, data matrices and current solution.  Mask
+   * images are shared, so clones can solve (e.g. permutations) concurrently
+   * as long as the masks are not modified. */
+  itkCloneMacro( Self );
+
   /** Dimension of the images. */
   itkStaticConstMacro( ImageDimension, unsigned int,
                        TInputImage::ImageDimension );
@@ -118,12 +123,29 @@ public:
     this->m_PercentVarianceForPseudoInverse = p;
   }
 
-  MatrixType PseudoInverse( MatrixType p_in,  bool take_sqrt = false )
+  MatrixType PseudoInverse( const MatrixType & p_in,  bool take_sqrt = false )
   {
     return this->VNLPseudoInverse(  p_in,  take_sqrt );
   }
 
-  MatrixType VNLPseudoInverse( MatrixType,  bool take_sqrt = false );
+  MatrixType VNLPseudoInverse( const MatrixType &,  bool take_sqrt = false );
+
+  /** Products with the (large) data matrices.  These never form A^T and write
+   * into caller-owned storage.  When built with ANTS_SCCAN_USE_BLAS they call
+   * the BLAS gemv/gemm routines directly on the vnl (row-major) storage so a
+   * multithreaded BLAS is used for the inner loops of the solvers. */
+  void MultiplyMatrixVector( const MatrixType & A, const VectorType & x, VectorType & y ) const;          // y = A x
+
+  void MultiplyTransposeMatrixVector( const MatrixType & A, const VectorType & x, VectorType & y ) const; // y = A^T x
+
+  void MultiplyNormalMatrixVector( const MatrixType & A, const VectorType & x, VectorType & y,
+                                   VectorType & workspace ) const;                                       // y = A^T A x
+
+  void MultiplyMatrixMatrix( const MatrixType & A, const MatrixType & B, MatrixType & C ) const;         // C = A B
+
+  void MultiplyMatrixMatrixTranspose( const MatrixType & A, MatrixType & C ) const;                      // C = A A^T
+
+  void MultiplyTransposeMatrixMatrix( const MatrixType & A, MatrixType & C ) const;                      // C = A^T A
 
   void ZeroProduct( VectorType& v1, VectorType& v2 )
   {
@@ -153,10 +175,10 @@ public:
       }
   }
 
-  RealType ReconstructionError( MatrixType, MatrixType );
+  RealType ReconstructionError( const MatrixType &, const MatrixType & );
 
-  VectorType Orthogonalize(VectorType Mvec, VectorType V, MatrixType* projecterM = nullptr,  MatrixType* projecterV =
-                             nullptr )
+  VectorType Orthogonalize(const VectorType & Mvec, const VectorType & V, MatrixType* projecterM = nullptr,
+                           MatrixType* projecterV = nullptr )
   {
     if( ( !projecterM ) &&  ( !projecterV ) )
       {
@@ -197,18 +219,30 @@ public:
       }
   }
 
-  MatrixType OrthogonalizeMatrix(MatrixType M, VectorType V )
+  MatrixType OrthogonalizeMatrix(const MatrixType & M, const VectorType & V )
   {
-    for( unsigned int j = 0; j < M.cols(); j++ )
+    MatrixType ortho( M );
+    this->OrthogonalizeMatrixInPlace( ortho, V );
+    return ortho;
+  }
+
+  /** Remove the component along V from every column of M. */
+  void OrthogonalizeMatrixInPlace(MatrixType & M, const VectorType & V )
+  {
+    double vnorm = inner_product(V, V);
+    if ( vnorm < this->m_Epsilon ) vnorm = 1;
+    VectorType ratios;
+    this->MultiplyTransposeMatrixVector( M, V, ratios );
+    ratios /= vnorm;
+    for( unsigned int i = 0; i < M.rows(); i++ )
       {
-      VectorType Mvec = M.get_column(j);
-      double     vnorm = inner_product(V, V);
-      if ( vnorm < this->m_Epsilon ) vnorm = 1;
-      double     ratio = inner_product(Mvec, V) / vnorm;
-      VectorType ortho = Mvec - V * ratio;
-      M.set_column(j, ortho);
+      RealType * row = M[i];
+      const RealType vi = V(i);
+      for( unsigned int j = 0; j < M.cols(); j++ )
+        {
+        row[j] -= vi * ratios(j);
+        }
       }
-    return M;
   }
 
   MatrixType RankifyMatrixColumns(MatrixType M )
@@ -248,7 +282,7 @@ public:
     this->m_MaskImageP = mask;
   }
 
-  void SetMatrixP(  MatrixType matrix )
+  void SetMatrixP( const MatrixType & matrix )
   {
     this->m_OriginalMatrixP.set_size(matrix.rows(), matrix.cols() );  this->m_MatrixP.set_size(
       matrix.rows(), matrix.cols() ); this->m_OriginalMatrixP.update(matrix); this->m_MatrixP.update(matrix);
@@ -263,7 +297,7 @@ public:
     this->m_MaskImageQ = mask;
   }
 
-  void SetMatrixQ(  MatrixType  matrix )
+  void SetMatrixQ( const MatrixType & matrix )
   {
     this->m_OriginalMatrixQ.set_size(matrix.rows(), matrix.cols() );  this->m_MatrixQ.set_size(
       matrix.rows(), matrix.cols() ); this->m_OriginalMatrixQ.update(matrix); this->m_MatrixQ.update(matrix);
@@ -275,6 +309,22 @@ public:
   itkSetMacro( MaxBasedThresholding, bool );
   itkGetMacro( MaxBasedThresholding, bool );
   itkSetMacro( GradStep, RealType );
+
+  /** Optional starting point for SparsePartialArnoldiCCA and LASSO, e.g. the
+   * unpermuted solution when solving permuted data.  Ignored if the sizes do
+   * not match the current problem. */
+  void SetWarmStartVariates( const VariateType & variatesP, const VariateType & variatesQ )
+  {
+    this->m_WarmStartVariatesP = variatesP;
+    this->m_WarmStartVariatesQ = variatesQ;
+  }
+
+  void ClearWarmStartVariates()
+  {
+    this->m_WarmStartVariatesP.clear();
+    this->m_WarmStartVariatesQ.clear();
+  }
+
   itkSetMacro( FractionNonZeroR, RealType );
   itkSetMacro( KeepPositiveR, bool );
   void SetMaskImageR( ImagePointer mask )
@@ -282,33 +332,33 @@ public:
     this->m_MaskImageR = mask;
   }
 
-  void SetMatrixR(  MatrixType matrix )
+  void SetMatrixR( const MatrixType & matrix )
   {
     this->m_OriginalMatrixR.set_size(matrix.rows(), matrix.cols() );  this->m_MatrixR.set_size(
       matrix.rows(), matrix.cols() ); this->m_OriginalMatrixR.update(matrix); this->m_MatrixR.update(matrix);
   }
 
-  MatrixType GetMatrixP()
+  const MatrixType & GetMatrixP() const
   {
     return this->m_MatrixP;
   }
 
-  MatrixType GetMatrixQ()
+  const MatrixType & GetMatrixQ() const
   {
     return this->m_MatrixQ;
   }
 
-  MatrixType GetMatrixR()
+  const MatrixType & GetMatrixR() const
   {
     return this->m_MatrixR;
   }
 
-  MatrixType GetMatrixU()
+  const MatrixType & GetMatrixU() const
   {
     return this->m_MatrixU;
   }
 
-  MatrixType GetOriginalMatrixP()
+  const MatrixType & GetOriginalMatrixP() const
   {
     return this->m_OriginalMatrixP;
   }
@@ -323,12 +373,12 @@ public:
     return this->m_lambda = lambda;
   }
 
-  MatrixType GetOriginalMatrixQ()
+  const MatrixType & GetOriginalMatrixQ() const
   {
     return this->m_OriginalMatrixQ;
   }
 
-  MatrixType GetOriginalMatrixR()
+  const MatrixType & GetOriginalMatrixR() const
   {
     return this->m_OriginalMatrixR;
   }
@@ -370,7 +420,7 @@ public:
                            RealType );
 
   RealType SparseConjGrad( VectorType &, VectorType, RealType, unsigned int );
-  RealType ConjGrad( MatrixType& A, VectorType& x_k, VectorType  b_in, RealType convcrit, unsigned int  );
+  RealType ConjGrad( const MatrixType& A, VectorType& x_k, VectorType  b_in, RealType convcrit, unsigned int  );
 
   RealType SparseConjGradRidgeRegression( MatrixType& A, VectorType& x_k, VectorType  b_in, RealType convcrit,
                                           unsigned int, bool );
@@ -402,7 +452,7 @@ public:
 
   void ConstantProbabilityThreshold( VectorType& v_in, RealType probability_goal, bool allow_negative_weights );
 
-  VectorType InitializeV( MatrixType p, unsigned long seed = 0 );
+  VectorType InitializeV( const MatrixType & p, unsigned long seed = 0 );
 
   TRealType InitializeSCCA_simple( unsigned int n_vecs );
 
@@ -424,28 +474,28 @@ public:
     return this->loc_Array;
   }
 
-  MatrixType NormalizeMatrix(MatrixType p, bool makepositive = true );
+  MatrixType NormalizeMatrix(const MatrixType & p, bool makepositive = true );
 
   /** needed for partial scca */
-  MatrixType CovarianceMatrix(MatrixType p, RealType regularization = 1.e-2 )
+  MatrixType CovarianceMatrix(const MatrixType & p, RealType regularization = 1.e-2 )
   {
+    MatrixType invcov;
     if( p.rows() < p.columns() )
       {
-      MatrixType invcov = p * p.transpose();
-      invcov.set_identity();
-      invcov = invcov * regularization + p * p.transpose();
-      return invcov;
+      this->MultiplyMatrixMatrixTranspose( p, invcov );
       }
     else
       {
-      MatrixType invcov = p.transpose() * p;
-      invcov.set_identity();
-      invcov = invcov * regularization + p.transpose() * p;
-      return invcov;
+      this->MultiplyTransposeMatrixMatrix( p, invcov );
       }
+    for( unsigned int i = 0; i < invcov.rows(); i++ )
+      {
+      invcov( i, i ) += regularization;
+      }
+    return invcov;
   }
 
-  MatrixType WhitenMatrix(MatrixType p, RealType regularization = 1.e-2 )
+  MatrixType WhitenMatrix(const MatrixType & p, RealType regularization = 1.e-2 )
   {
     double reg = 1.e-9;
 
@@ -462,42 +512,48 @@ public:
       std::cout << " invcov " << std::endl;   std::cout << invcov << std::endl;
       std::cout << " id? " << std::endl;   std::cout << cov * invcov << std::endl;
       }
+    MatrixType whitened;
     if( p.rows() < p.columns() )
       {
-      return invcov * p;
+      this->MultiplyMatrixMatrix( invcov, p, whitened );
       }
     else
       {
-      return p * invcov;
+      this->MultiplyMatrixMatrix( p, invcov, whitened );
       }
+    return whitened;
   }
 
-  MatrixType WhitenMatrixByAnotherMatrix(MatrixType p, MatrixType op, RealType regularization = 1.e-2)
+  MatrixType WhitenMatrixByAnotherMatrix(const MatrixType & p, const MatrixType & op,
+                                         RealType regularization = 1.e-2)
   {
     MatrixType invcov = this->CovarianceMatrix(op, regularization);
 
     invcov = this->PseudoInverse( invcov, true );
+    MatrixType whitened;
     if( p.rows() < p.columns() )
       {
-      return invcov * p;
+      this->MultiplyMatrixMatrix( invcov, p, whitened );
       }
     else
       {
-      return p * invcov;
+      this->MultiplyMatrixMatrix( p, invcov, whitened );
       }
+    return whitened;
   }
 
-  MatrixType ProjectionMatrix(MatrixType b, double regularization = 0.001)
+  MatrixType ProjectionMatrix(const MatrixType & b, double regularization = 0.001)
   {
     bool armadillo = false;
 
-    b = this->NormalizeMatrix( b );
-    MatrixType mat = b * b.transpose();
+    MatrixType mat;
+    this->MultiplyMatrixMatrixTranspose( this->NormalizeMatrix( b ), mat );
     if( !armadillo )
       {
-      MatrixType cov( mat.rows(), mat.cols(), 0);
-      cov.set_identity();
-      mat = cov * regularization + mat;
+      for( unsigned int i = 0; i < mat.rows(); i++ )
+        {
+        mat( i, i ) += regularization;
+        }
       return vnl_svd<double>( mat ).inverse();
       //      return vnl_svd<double>( mat ).pinverse( mc );
       }
@@ -591,12 +647,12 @@ public:
     return this->m_VariatesQ.get_column(i);
   }
 
-  MatrixType GetVariatesP()
+  const MatrixType & GetVariatesP() const
   {
     return this->m_VariatesP;
   }
 
-  MatrixType GetVariatesQ()
+  const MatrixType & GetVariatesQ() const
   {
     return this->m_VariatesQ;
   }
@@ -723,18 +779,18 @@ public:
     return 0;
   }
 
-  inline RealType ComputeIntercept(  MatrixType A, VectorType x, VectorType b  )
+  inline RealType ComputeIntercept(  const MatrixType & A, const VectorType & x, const VectorType & b  )
   {
     RealType intercept = b.mean();
 
-    for( unsigned int Acol = 0; Acol < A.cols(); Acol++ )
-      {
-      intercept -= A.get_column( Acol ).mean() * x( Acol );
-      }
+    VectorType rowweights( A.rows(), 1.0 / static_cast<RealType>( A.rows() ) );
+    VectorType colmeans;
+    this->MultiplyTransposeMatrixVector( A, rowweights, colmeans );
+    intercept -= inner_product( colmeans, x );
     return intercept;
   }
 
-  inline RealType SimpleRegression(  VectorType y, VectorType ypred  )
+  inline RealType SimpleRegression(  const VectorType & y, const VectorType & ypred  )
   {
     RealType corr = this->PearsonCorr( y, ypred );
     double   sdy = sqrt(  ( y - y.mean() ).squared_magnitude() /  ( y.size() - 1) );
@@ -747,7 +803,7 @@ public:
     return corr * sdy / sdyp;
   }
 
-  MatrixType GetCovMatEigenvectors( MatrixType p );
+  MatrixType GetCovMatEigenvectors( const MatrixType & p );
 
   void MRFFilterVariateMatrix();
 
@@ -1014,7 +1070,7 @@ protected:
       }
   }
 
-  MatrixType  DeleteCol( MatrixType p_in, unsigned int col)
+  MatrixType  DeleteCol( const MatrixType & p_in, unsigned int col)
   {
     unsigned int ncols = p_in.cols() - 1;
 
@@ -1035,7 +1091,7 @@ protected:
     return p;
   }
 
-  RealType CountNonZero( VectorType v )
+  RealType CountNonZero( const VectorType & v )
   {
     unsigned long ct = 0;
 
@@ -1057,7 +1113,7 @@ protected:
     return false;
   }
 
-  RealType PearsonCorr(VectorType v1, VectorType v2 )
+  RealType PearsonCorr(const VectorType & v1, const VectorType & v2 )
   {
     double xysum = 0;
     for( unsigned int i = 0; i < v1.size(); i++ )
@@ -1180,6 +1236,8 @@ protected:
   antsSCCANObject();
   ~antsSCCANObject() override = default;
 
+  typename LightObject::Pointer InternalClone() const override;
+
   void PrintSelf( std::ostream &, /* os */ Indent /* indent */) const override
   {
     if( this->m_MaskImageP && this->m_MaskImageQ && this->m_MaskImageR )
@@ -1282,6 +1340,8 @@ private:
   VariateType m_SparseVariatesP;
   VariateType m_VariatesP;
   VariateType m_VariatesQ;
+  VariateType m_WarmStartVariatesP;
+  VariateType m_WarmStartVariatesQ;
   /** solution to   X - U V */
   MatrixType m_MatrixU;
 
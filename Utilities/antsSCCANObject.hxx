@@ -19,6 +19,7 @@
 #include "itkExtractImageFilter.h"
 #include <vnl/vnl_random.h>
 #include <vnl/vnl_trace.h>
+#include <vnl/vnl_c_vector.h>
 #include <vnl/algo/vnl_ldl_cholesky.h>
 #include <vnl/algo/vnl_qr.h>
 #include <vnl/algo/vnl_matrix_inverse.h>
@@ -36,10 +37,79 @@
 #include "itkGradientAnisotropicDiffusionImageFilter.h"
 #include "ReadWriteData.h"
 
+#ifdef ANTS_SCCAN_USE_BLAS
+extern "C" {
+void sgemv_( const char *, const int *, const int *, const float *, const float *, const int *,
+             const float *, const int *, const float *, float *, const int * );
+void dgemv_( const char *, const int *, const int *, const double *, const double *, const int *,
+             const double *, const int *, const double *, double *, const int * );
+void sgemm_( const char *, const char *, const int *, const int *, const int *, const float *, const float *,
+             const int *, const float *, const int *, const float *, float *, const int * );
+void dgemm_( const char *, const char *, const int *, const int *, const int *, const double *, const double *,
+             const int *, const double *, const int *, const double *, double *, const int * );
+}
+#endif
+
 namespace itk
 {
 namespace ants
 {
+namespace SCCANBLAS
+{
+/** Thin wrappers over the (column-major) Fortran BLAS interface.  They return
+ * false when no BLAS routine is available for the element type, in which case
+ * the caller falls back to vnl. */
+template <typename T>
+inline bool gemv( char, int, int, const T *, const T *, T * )
+{
+  return false;
+}
+
+template <typename T>
+inline bool gemm( char, char, int, int, int, const T *, int, const T *, int, T *, int )
+{
+  return false;
+}
+
+#ifdef ANTS_SCCAN_USE_BLAS
+inline bool gemv( char trans, int m, int n, const double *A, const double *x, double *y )
+{
+  const double alpha = 1;
+  const double beta = 0;
+  const int    inc = 1;
+  dgemv_( &trans, &m, &n, &alpha, A, &m, x, &inc, &beta, y, &inc );
+  return true;
+}
+
+inline bool gemv( char trans, int m, int n, const float *A, const float *x, float *y )
+{
+  const float alpha = 1;
+  const float beta = 0;
+  const int   inc = 1;
+  sgemv_( &trans, &m, &n, &alpha, A, &m, x, &inc, &beta, y, &inc );
+  return true;
+}
+
+inline bool gemm( char transa, char transb, int m, int n, int k, const double *A, int lda,
+                  const double *B, int ldb, double *C, int ldc )
+{
+  const double alpha = 1;
+  const double beta = 0;
+  dgemm_( &transa, &transb, &m, &n, &k, &alpha, A, &lda, B, &ldb, &beta, C, &ldc );
+  return true;
+}
+
+inline bool gemm( char transa, char transb, int m, int n, int k, const float *A, int lda,
+                  const float *B, int ldb, float *C, int ldc )
+{
+  const float alpha = 1;
+  const float beta = 0;
+  sgemm_( &transa, &transb, &m, &n, &k, &alpha, A, &lda, B, &ldb, &beta, C, &ldc );
+  return true;
+}
+#endif
+} // namespace SCCANBLAS
+
 template <typename TInputImage, typename TRealType>
 antsSCCANObject<TInputImage, TRealType>::antsSCCANObject()
 {
@@ -77,6 +147,251 @@ antsSCCANObject<TInputImage, TRealType>::antsSCCANObject()
   this->m_PriorWeight = 0;
 }
 
+template <typename TInputImage, typename TRealType>
+typename LightObject::Pointer
+antsSCCANObject<TInputImage, TRealType>
+::InternalClone() const
+{
+  typename LightObject::Pointer loPtr = Superclass::InternalClone();
+
+  typename Self::Pointer rval = dynamic_cast<Self *>( loPtr.GetPointer() );
+  if( rval.IsNull() )
+    {
+    itkExceptionMacro( << "downcast to type " << this->GetNameOfClass() << " failed." );
+    }
+
+  rval->m_OriginalMatrixPriorROI = this->m_OriginalMatrixPriorROI;
+  rval->m_Debug = this->m_Debug;
+  rval->m_Silent = this->m_Silent;
+  rval->m_MaxBasedThresholding = this->m_MaxBasedThresholding;
+  rval->m_OriginalMatrixP = this->m_OriginalMatrixP;
+  rval->m_OriginalMatrixQ = this->m_OriginalMatrixQ;
+  rval->m_OriginalMatrixR = this->m_OriginalMatrixR;
+  rval->m_RowSparseness = this->m_RowSparseness;
+  rval->m_ElapsedIterations = this->m_ElapsedIterations;
+  rval->m_MaximumNumberOfIterations = this->m_MaximumNumberOfIterations;
+  rval->m_CurrentConvergenceMeasurement = this->m_CurrentConvergenceMeasurement;
+  rval->m_ConvergenceThreshold = this->m_ConvergenceThreshold;
+  rval->m_SCCANFormulation = this->m_SCCANFormulation;
+  rval->m_PinvTolerance = this->m_PinvTolerance;
+  rval->m_PercentVarianceForPseudoInverse = this->m_PercentVarianceForPseudoInverse;
+  rval->m_Epsilon = this->m_Epsilon;
+  rval->m_MatrixPriorROI = this->m_MatrixPriorROI;
+  rval->m_MatrixPriorROI2 = this->m_MatrixPriorROI2;
+  rval->m_SortedIndicesAll = this->m_SortedIndicesAll;
+  rval->sortedIndicesLoop = this->sortedIndicesLoop;
+  rval->m_Ip = this->m_Ip;
+  rval->m_Ik = this->m_Ik;
+  rval->m_priorScaleMat = this->m_priorScaleMat;
+  rval->loc_Array = this->loc_Array;
+  rval->flagForSort = this->flagForSort;
+  rval->m_WeightsP = this->m_WeightsP;
+  rval->m_MatrixP = this->m_MatrixP;
+  rval->m_MaskImageP = this->m_MaskImageP;
+  rval->m_FractionNonZeroP = this->m_FractionNonZeroP;
+  rval->m_KeepPositiveP = this->m_KeepPositiveP;
+  rval->m_UseLongitudinalFormulation = this->m_UseLongitudinalFormulation;
+  rval->m_Smoother = this->m_Smoother;
+  rval->m_WeightsQ = this->m_WeightsQ;
+  rval->m_MatrixQ = this->m_MatrixQ;
+  rval->m_MaskImageQ = this->m_MaskImageQ;
+  rval->m_FractionNonZeroQ = this->m_FractionNonZeroQ;
+  rval->m_KeepPositiveQ = this->m_KeepPositiveQ;
+  rval->m_Eigenvectors = this->m_Eigenvectors;
+  rval->m_Eigenvalues = this->m_Eigenvalues;
+  rval->m_CanonicalCorrelations = this->m_CanonicalCorrelations;
+  rval->m_SparseVariatesP = this->m_SparseVariatesP;
+  rval->m_VariatesP = this->m_VariatesP;
+  rval->m_VariatesQ = this->m_VariatesQ;
+  rval->m_WarmStartVariatesP = this->m_WarmStartVariatesP;
+  rval->m_WarmStartVariatesQ = this->m_WarmStartVariatesQ;
+  rval->m_MatrixU = this->m_MatrixU;
+  rval->m_WeightsR = this->m_WeightsR;
+  rval->m_MatrixR = this->m_MatrixR;
+  rval->m_MaskImageR = this->m_MaskImageR;
+  rval->m_FractionNonZeroR = this->m_FractionNonZeroR;
+  rval->m_KeepPositiveR = this->m_KeepPositiveR;
+  rval->m_MatrixRRt = this->m_MatrixRRt;
+  rval->m_MatrixRp = this->m_MatrixRp;
+  rval->m_MatrixRq = this->m_MatrixRq;
+  rval->m_Covering = this->m_Covering;
+  rval->m_VecToMaskSize = this->m_VecToMaskSize;
+  rval->m_GetSmall = this->m_GetSmall;
+  rval->m_UseL1 = this->m_UseL1;
+  rval->m_AlreadyWhitened = this->m_AlreadyWhitened;
+  rval->m_SpecializationForHBM2011 = this->m_SpecializationForHBM2011;
+  rval->m_CorrelationForSignificanceTest = this->m_CorrelationForSignificanceTest;
+  rval->m_lambda = this->m_lambda;
+  rval->m_Intercept = this->m_Intercept;
+  rval->m_NTimeDimensions = this->m_NTimeDimensions;
+  rval->m_MinClusterSizeP = this->m_MinClusterSizeP;
+  rval->m_MinClusterSizeQ = this->m_MinClusterSizeQ;
+  rval->m_KeptClusterSize = this->m_KeptClusterSize;
+  rval->m_GoldenSectionCounter = this->m_GoldenSectionCounter;
+  rval->m_ClusterSizes = this->m_ClusterSizes;
+  rval->m_OriginalB = this->m_OriginalB;
+  rval->m_SparsenessP = this->m_SparsenessP;
+  rval->m_SparsenessQ = this->m_SparsenessQ;
+  rval->m_Indicator = this->m_Indicator;
+  rval->m_PreC = this->m_PreC;
+  rval->m_GSBestSol = this->m_GSBestSol;
+  rval->m_GradStep = this->m_GradStep;
+  rval->m_GradStepP = this->m_GradStepP;
+  rval->m_GradStepQ = this->m_GradStepQ;
+  rval->m_PriorWeight = this->m_PriorWeight;
+
+  return loPtr;
+}
+
+/** vnl matrices are row-major, i.e. the column-major BLAS sees A^T with a
+ * leading dimension of A.cols().  Outputs must not alias the inputs. */
+template <typename TInputImage, typename TRealType>
+void
+antsSCCANObject<TInputImage, TRealType>
+::MultiplyMatrixVector( const MatrixType & A, const VectorType & x, VectorType & y ) const
+{
+  y.set_size( A.rows() );
+  if( A.rows() == 0 || A.cols() == 0 )
+    {
+    y.fill( 0 );
+    return;
+    }
+  if( SCCANBLAS::gemv( 'T', A.cols(), A.rows(), A.data_block(), x.data_block(), y.data_block() ) )
+    {
+    return;
+    }
+  for( unsigned int i = 0; i < A.rows(); i++ )
+    {
+    y( i ) = vnl_c_vector<RealType>::dot_product( A[i], x.data_block(), A.cols() );
+    }
+}
+
+template <typename TInputImage, typename TRealType>
+void
+antsSCCANObject<TInputImage, TRealType>
+::MultiplyTransposeMatrixVector( const MatrixType & A, const VectorType & x, VectorType & y ) const
+{
+  y.set_size( A.cols() );
+  if( A.rows() == 0 || A.cols() == 0 )
+    {
+    y.fill( 0 );
+    return;
+    }
+  if( SCCANBLAS::gemv( 'N', A.cols(), A.rows(), A.data_block(), x.data_block(), y.data_block() ) )
+    {
+    return;
+    }
+  y.fill( 0 );
+  RealType * yp = y.data_block();
+  for( unsigned int i = 0; i < A.rows(); i++ )
+    {
+    const RealType   xi = x( i );
+    const RealType * row = A[i];
+    for( unsigned int j = 0; j < A.cols(); j++ )
+      {
+      yp[j] += row[j] * xi;
+      }
+    }
+}
+
+template <typename TInputImage, typename TRealType>
+void
+antsSCCANObject<TInputImage, TRealType>
+::MultiplyNormalMatrixVector( const MatrixType & A, const VectorType & x, VectorType & y,
+                              VectorType & workspace ) const
+{
+  this->MultiplyMatrixVector( A, x, workspace );
+  this->MultiplyTransposeMatrixVector( A, workspace, y );
+}
+
+template <typename TInputImage, typename TRealType>
+void
+antsSCCANObject<TInputImage, TRealType>
+::MultiplyMatrixMatrix( const MatrixType & A, const MatrixType & B, MatrixType & C ) const
+{
+  C.set_size( A.rows(), B.cols() );
+  if( A.rows() == 0 || B.cols() == 0 || A.cols() == 0 )
+    {
+    C.fill( 0 );
+    return;
+    }
+  if( SCCANBLAS::gemm( 'N', 'N', B.cols(), A.rows(), A.cols(), B.data_block(), B.cols(),
+                       A.data_block(), A.cols(), C.data_block(), B.cols() ) )
+    {
+    return;
+    }
+  C = A * B;
+}
+
+template <typename TInputImage, typename TRealType>
+void
+antsSCCANObject<TInputImage, TRealType>
+::MultiplyMatrixMatrixTranspose( const MatrixType & A, MatrixType & C ) const
+{
+  C.set_size( A.rows(), A.rows() );
+  if( A.rows() == 0 || A.cols() == 0 )
+    {
+    C.fill( 0 );
+    return;
+    }
+  if( SCCANBLAS::gemm( 'T', 'N', A.rows(), A.rows(), A.cols(), A.data_block(), A.cols(),
+                       A.data_block(), A.cols(), C.data_block(), A.rows() ) )
+    {
+    return;
+    }
+  for( unsigned int i = 0; i < A.rows(); i++ )
+    {
+    for( unsigned int j = i; j < A.rows(); j++ )
+      {
+      C( i, j ) = C( j, i ) = vnl_c_vector<RealType>::dot_product( A[i], A[j], A.cols() );
+      }
+    }
+}
+
+template <typename TInputImage, typename TRealType>
+void
+antsSCCANObject<TInputImage, TRealType>
+::MultiplyTransposeMatrixMatrix( const MatrixType & A, MatrixType & C ) const
+{
+  C.set_size( A.cols(), A.cols() );
+  C.fill( 0 );
+  if( A.rows() == 0 || A.cols() == 0 )
+    {
+    return;
+    }
+  // the row-major storage of A is A^T in column-major order, and C is symmetric
+  if( SCCANBLAS::gemm( 'N', 'T', A.cols(), A.cols(), A.rows(), A.data_block(), A.cols(),
+                       A.data_block(), A.cols(), C.data_block(), A.cols() ) )
+    {
+    return;
+    }
+  // accumulate the outer products of the rows of A, reading A row by row
+  for( unsigned int k = 0; k < A.rows(); k++ )
+    {
+    const RealType * row = A[k];
+    for( unsigned int i = 0; i < A.cols(); i++ )
+      {
+      const RealType a = row[i];
+      if( a == 0 )
+        {
+        continue;
+        }
+      RealType * crow = C[i];
+      for( unsigned int j = i; j < A.cols(); j++ )
+        {
+        crow[j] += a * row[j];
+        }
+      }
+    }
+  for( unsigned int i = 0; i < A.cols(); i++ )
+    {
+    for( unsigned int j = 0; j < i; j++ )
+      {
+      C( i, j ) = C( j, i );
+      }
+    }
+}
+
 template <typename TInputImage, typename TRealType>
 typename TInputImage::Pointer
 antsSCCANObject<TInputImage, TRealType>
@@ -641,7 +956,7 @@ antsSCCANObject<TInputImage, TRealType>
 template <typename TInputImage, typename TRealType>
 typename antsSCCANObject<TInputImage, TRealType>::VectorType
 antsSCCANObject<TInputImage, TRealType>
-::InitializeV( typename antsSCCANObject<TInputImage, TRealType>::MatrixType p, unsigned long seed )
+::InitializeV( const typename antsSCCANObject<TInputImage, TRealType>::MatrixType & p, unsigned long seed )
 {
   VectorType w_p( p.columns() );
 
@@ -798,7 +1113,7 @@ antsSCCANObject<TInputImage, TRealType>
 template <typename TInputImage, typename TRealType>
 typename antsSCCANObject<TInputImage, TRealType>::MatrixType
 antsSCCANObject<TInputImage, TRealType>
-::NormalizeMatrix( typename antsSCCANObject<TInputImage, TRealType>::MatrixType p, bool makepositive )
+::NormalizeMatrix( const typename antsSCCANObject<TInputImage, TRealType>::MatrixType & p, bool makepositive )
 {
   return(p);
   MatrixType np( p.rows(), p.columns() );
@@ -837,10 +1152,9 @@ antsSCCANObject<TInputImage, TRealType>
 template <typename TInputImage, typename TRealType>
 typename antsSCCANObject<TInputImage, TRealType>::MatrixType
 antsSCCANObject<TInputImage, TRealType>
-::VNLPseudoInverse( typename antsSCCANObject<TInputImage, TRealType>::MatrixType rin, bool take_sqrt )
+::VNLPseudoInverse( const typename antsSCCANObject<TInputImage, TRealType>::MatrixType & dd, bool take_sqrt )
 {
   double       pinvTolerance = this->m_PinvTolerance;
-  MatrixType   dd = rin;
   unsigned int ss = dd.rows();
 
   if( dd.rows() > dd.columns() )
@@ -1808,8 +2122,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
 template <typename TInputImage, typename TRealType>
 TRealType
 antsSCCANObject<TInputImage, TRealType>
-::ReconstructionError( typename antsSCCANObject<TInputImage, TRealType>::MatrixType mymat,
-                       typename antsSCCANObject<TInputImage, TRealType>::MatrixType myvariate )
+::ReconstructionError( const typename antsSCCANObject<TInputImage, TRealType>::MatrixType & mymat,
+                       const typename antsSCCANObject<TInputImage, TRealType>::MatrixType & myvariate )
 {
   this->m_CanonicalCorrelations.set_size( myvariate.cols() );
   this->m_CanonicalCorrelations.fill( 0 );
@@ -2923,8 +3237,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
 
 template <typename TInputImage, typename TRealType>
 TRealType antsSCCANObject<TInputImage, TRealType>
-::ConjGrad( typename antsSCCANObject<TInputImage,
-                                     TRealType>::MatrixType& A,
+::ConjGrad( const typename antsSCCANObject<TInputImage,
+                                           TRealType>::MatrixType& A,
             typename antsSCCANObject<TInputImage, TRealType>::VectorType& x_k,
             typename antsSCCANObject<TInputImage, TRealType>::VectorType  b_in, TRealType convcrit,
             unsigned int maxits)
@@ -2935,11 +3249,12 @@ TRealType antsSCCANObject<TInputImage, TRealType>
    */
   bool debug = false;
   // minimize the following error :    \| A^T*A * vec_i -    b \|  +  sparseness_penalty
-  MatrixType At = A.transpose();
-  VectorType b = b_in - b_in.mean();
-  b = b * A;
-  VectorType r_k = At * ( A * x_k );
-  r_k = b - r_k;
+  VectorType b;
+  this->MultiplyTransposeMatrixVector( A, b_in - b_in.mean(), b );
+  VectorType workspace;
+  VectorType AtAx;
+  this->MultiplyNormalMatrixVector( A, x_k, AtAx, workspace );
+  VectorType r_k = b - AtAx;
   VectorType   p_k = r_k;
   double       approxerr = 1.e9;
   unsigned int ct = 0;
@@ -2948,7 +3263,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   RealType     minerr = starterr, deltaminerr = 1, lasterr = starterr * 2;
   while(  deltaminerr > 0 && approxerr > convcrit && ct < maxits )
     {
-    RealType alpha_denom = inner_product( p_k, At * ( A * p_k ) );
+    this->MultiplyNormalMatrixVector( A, p_k, AtAx, workspace );
+    RealType alpha_denom = inner_product( p_k, AtAx );
     RealType iprk = inner_product( r_k, r_k );
     if( debug )
       {
@@ -2965,7 +3281,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       }
     VectorType x_k1  = x_k + alpha_k * p_k; // this adds the scaled residual to the current solution
     //    this->SparsifyOther( x_k1 ); // this can be used to approximate NMF
-    VectorType r_k1 =  b - At * (A * x_k1 );
+    this->MultiplyNormalMatrixVector( A, x_k1, AtAx, workspace );
+    VectorType r_k1 =  b - AtAx;
     approxerr = r_k1.two_norm();
     if( approxerr < minerr )
       {
@@ -3132,7 +3449,10 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   bool     debug = false;
   RealType intercept = 0;
 
-  VectorType   r_k = ( b -  A.transpose() * ( A * x_k ) );
+  VectorType   workspace;
+  VectorType   AtAx;
+  this->MultiplyNormalMatrixVector( A, x_k, AtAx, workspace );
+  VectorType   r_k = ( b -  AtAx );
   VectorType   p_k = r_k;
   double       approxerr = 1.e22;
   unsigned int ct = 0;
@@ -3141,7 +3461,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   RealType     minerr = starterr, deltaminerr = 1;
   while(  deltaminerr > 1.e-4 && minerr > convcrit && ct < maxits )
     {
-    RealType alpha_denom = inner_product( p_k,  A.transpose() * ( A * p_k ) );
+    this->MultiplyNormalMatrixVector( A, p_k, AtAx, workspace );
+    RealType alpha_denom = inner_product( p_k,  AtAx );
     RealType iprk = inner_product( r_k, r_k );
     RealType alpha_k = iprk / alpha_denom;
     if( debug )
@@ -3174,8 +3495,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       if ( ! this->m_Silent )  std::cout << " xk12n " << x_k1.two_norm() << " alpha_k " << alpha_k << " pk2n " << p_k.two_norm()
                        << std::endl;
       }
-    VectorType proj = A.transpose() * (A * x_k1 );
-    VectorType r_k1 = ( b -  proj );
+    this->MultiplyNormalMatrixVector( A, x_k1, AtAx, workspace );
+    VectorType r_k1 = ( b -  AtAx );
     if( makeprojsparse  )
       {
       this->SparsifyP( r_k1  );
@@ -3366,14 +3687,15 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       d.dx ( x^t A^t A x  ) =   A^t A x  ,   x \leftarrow  x / \| x \|
       we use a conjugate gradient version of this optimization.
   */
-  A = A - A.min_value();
+  A -= A.min_value();
   VectorType evec = evecin;
   unsigned int maxcoltoorth = ( unsigned int ) ( 1.0 / itk::Math::abs ( this->m_FractionNonZeroP ) ) - 1;
   if( evecin.two_norm() ==  0 )
     {
     evec = this->InitializeV( this->m_MatrixP, false );
     }
-  VectorType proj = ( A * evecin  );
+  VectorType proj;
+  this->MultiplyMatrixVector( A, evecin, proj );
   VectorType lastgrad = evecin;
   RealType   rayquo = 0;
   RealType   denom = inner_product( evecin, evecin );
@@ -3382,16 +3704,16 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     rayquo = inner_product( proj, proj  ) / denom;
     } else if ( ! this->m_Silent )  std::cout << "Denom < 0: probable trouble." << std::endl;
   RealType     bestrayquo = 0;
-  MatrixType   At = A.transpose();
   unsigned int powerits = 0;
   bool         conjgrad = true;
   VectorType   bestevec = evecin;
   RealType     relfac = 1.0;
   VectorType di;
+  VectorType nvec;
   while(  ( ( rayquo > bestrayquo ) && ( powerits < maxits ) )  || powerits < 2 )
   // while ( ( relfac > 1.e-4  )  && ( powerits < maxits ) )
     {
-    VectorType nvec = At * proj;
+    this->MultiplyTransposeMatrixVector( A, proj, nvec );
     RealType gamma = 0.1;
     //    nvec = this->SpatiallySmoothVector( nvec, this->m_MaskImageP );
     if ( powerits == 0 ) di = nvec;
@@ -3420,7 +3742,7 @@ TRealType antsSCCANObject<TInputImage, TRealType>
       {
       evec = evec / evec.two_norm();
       }
-    proj = ( A * evec  );
+    this->MultiplyMatrixVector( A, evec, proj );
     denom = inner_product( evec, evec );
     if( denom > 0 )
       {
@@ -3691,7 +4013,9 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   if( this->m_OriginalMatrixR.size() > 0 )
     {
     this->m_MatrixRRt = this->ProjectionMatrix( this->m_OriginalMatrixR );
-    this->m_MatrixP = this->m_MatrixP - ( this->m_MatrixRRt * this->m_MatrixP );
+    MatrixType projectedP;
+    this->MultiplyMatrixMatrix( this->m_MatrixRRt, this->m_MatrixP, projectedP );
+    this->m_MatrixP -= projectedP;
     }
   MatrixType nspaceevecs = this->GetCovMatEigenvectors( this->m_MatrixP );
   VectorType nspaceevals = this->m_Eigenvalues;
@@ -3996,6 +4320,10 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   VectorType y = this->m_MatrixR.get_column( 0 );
   RealType   n = 1.0 / static_cast<RealType>( y.size() );
   VectorType beta_lasso( this->m_MatrixP.cols(), 0 );
+  if( this->m_WarmStartVariatesP.rows() == beta_lasso.size() && this->m_WarmStartVariatesP.cols() > 0 )
+    {
+    beta_lasso = this->m_WarmStartVariatesP.get_column( 0 );
+    }
   for( unsigned int i = 0; i < 1; i++ )
     {
     if ( ! this->m_Silent )  std::cout << i << std::endl;
@@ -4796,15 +5124,14 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   if( this->m_OriginalMatrixR.size() > 0 )
     {
     this->m_MatrixRRt = this->ProjectionMatrix(this->m_OriginalMatrixR);
-    this->m_MatrixP = this->m_MatrixP - (this->m_MatrixRRt * this->m_MatrixP);
+    MatrixType projectedP;
+    this->MultiplyMatrixMatrix( this->m_MatrixRRt, this->m_MatrixP, projectedP );
+    this->m_MatrixP -= projectedP;
     }
   this->m_ClusterSizes.set_size(n_vecs);
   this->m_ClusterSizes.fill(0);
-  double trace = 0;
-  for( unsigned int i = 0; i < this->m_MatrixP.cols(); i++ )
-    {
-    trace += inner_product(this->m_MatrixP.get_column(i), this->m_MatrixP.get_column(i) );
-    }
+  double trace = this->m_MatrixP.frobenius_norm();
+  trace *= trace;
   this->m_VariatesP.set_size(this->m_MatrixP.cols(), n_vecs);
   VariateType myGradients;
   this->m_SparseVariatesP.set_size(this->m_MatrixP.cols(), n_vecs);
@@ -4817,7 +5144,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
     this->m_VariatesP.set_column(kk, this->InitializeV(this->m_MatrixP) );
     if( kk < init.columns() )
       {
-      VectorType initv = init.get_column(kk) * this->m_MatrixP;
+      VectorType initv;
+      this->MultiplyTransposeMatrixVector( this->m_MatrixP, init.get_column(kk), initv );
       this->m_VariatesP.set_column(kk, initv);
       this->m_SparseVariatesP.set_column(kk, initv);
       }
@@ -4828,6 +5156,8 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   bool         debug = false;
   double       convcrit = 1;
   RealType     fnp = 1;
+  VectorType   resid;
+  VectorType   gradient;
   while( loop<maxloop && convcrit> 1.e-8 )
     {
     fnp = this->m_FractionNonZeroP;
@@ -4848,8 +5178,10 @@ TRealType antsSCCANObject<TInputImage, TRealType>
         }
       //      for ( unsigned int i=0; i<k; i++) pveck = this->Orthogonalize(pveck, this->m_VariatesP.get_column(i) );
       RealType   alpha = 0.1;
-      VectorType resid = init.get_column(k) - this->m_MatrixP * pveck;
-      VectorType newsol = this->m_SparseVariatesP.get_column(k) +  this->m_MatrixP.transpose() * resid * alpha;
+      this->MultiplyMatrixVector( this->m_MatrixP, pveck, resid );
+      resid = init.get_column(k) - resid;
+      this->MultiplyTransposeMatrixVector( this->m_MatrixP, resid, gradient );
+      VectorType newsol = this->m_SparseVariatesP.get_column(k) +  gradient * alpha;
       this->m_SparseVariatesP.set_column(k, newsol);
       if( fnp < 1 )
         {
@@ -4992,15 +5324,11 @@ TRealType antsSCCANObject<TInputImage, TRealType>
 template <typename TInputImage, typename TRealType>
 typename antsSCCANObject<TInputImage, TRealType>::MatrixType
 antsSCCANObject<TInputImage, TRealType>
-::GetCovMatEigenvectors( typename antsSCCANObject<TInputImage, TRealType>::MatrixType rin  )
+::GetCovMatEigenvectors( const typename antsSCCANObject<TInputImage, TRealType>::MatrixType & rin  )
 {
   double     pinvTolerance = this->m_PinvTolerance;
-  MatrixType dd = this->NormalizeMatrix(rin);
-  MatrixType cov = dd * dd.transpose();
-
-  cov.set_identity();
-  TRealType regularization = 0;
-  cov = cov * regularization + rin * rin.transpose();
+  MatrixType cov;
+  this->MultiplyMatrixMatrixTranspose( rin, cov );
   vnl_svd<RealType> eig(cov, pinvTolerance);
   VectorType        vec1 = eig.U().get_column(0);
   VectorType        vec2 = eig.V().get_column(0);
@@ -5437,6 +5765,14 @@ TRealType antsSCCANObject<TInputImage, TRealType>
   this->m_VariatesP.set_size(this->m_MatrixP.cols(), n_vecs);
   this->m_VariatesQ.set_size(this->m_MatrixQ.cols(), n_vecs);
   RealType initReturn = this->InitializeSCCA_simple( n_vecs );
+  if( this->m_WarmStartVariatesP.rows() == this->m_VariatesP.rows() &&
+      this->m_WarmStartVariatesP.cols() == this->m_VariatesP.cols() &&
+      this->m_WarmStartVariatesQ.rows() == this->m_VariatesQ.rows() &&
+      this->m_WarmStartVariatesQ.cols() == this->m_VariatesQ.cols() )
+    {
+    this->m_VariatesP = this->m_WarmStartVariatesP;
+    this->m_VariatesQ = this->m_WarmStartVariatesQ;
+    }
   if ( !m_Silent )
     {
     if ( ! this->m_Silent )  std::cout << "Initialization: " << initReturn << std::endl;
@@ -85,6 +85,7 @@ public:
   typedef typename Superclass::NeighborhoodRadiusType          NeighborhoodRadiusType;
   typedef typename Superclass::NeighborhoodOffsetType          NeighborhoodOffsetType;
   typedef typename Superclass::NeighborhoodOffsetListType      NeighborhoodOffsetListType;
+  typedef typename Superclass::PatchMomentImages               PatchMomentImages;
 
   typedef GaussianOperator<RealType>                     ModifiedBesselCalculatorType;
 
@@ -198,6 +199,11 @@ private:
   RealImagePointer                  m_ThreadContributionCountImage;
   RealImagePointer                  m_IntensitySquaredDistanceImage;
 
+  // Input minus local mean, on which both the minimum distance search and the
+  // patch filtering measure their patch distances, and its patch moments.
+  RealImagePointer                  m_ResidualImage;
+  PatchMomentImages                 m_ResidualPatchMomentImages;
+
   NeighborhoodRadiusType            m_NeighborhoodRadiusForLocalMeanAndVariance;
 };
 
@@ -88,6 +88,22 @@ AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
   this->m_VarianceImage->Update();
   this->m_VarianceImage->DisconnectPipeline();
 
+  this->m_ResidualImage = RealImageType::New();
+  this->m_ResidualImage->CopyInformation( this->m_MeanImage );
+  this->m_ResidualImage->SetRegions( this->m_MeanImage->GetBufferedRegion() );
+  this->m_ResidualImage->Allocate();
+
+  ImageRegionConstIterator<RealImageType> ItMean( this->m_MeanImage, this->m_MeanImage->GetBufferedRegion() );
+  ImageRegionIteratorWithIndex<RealImageType> ItResidual( this->m_ResidualImage,
+    this->m_ResidualImage->GetBufferedRegion() );
+  for( ItMean.GoToBegin(), ItResidual.GoToBegin(); !ItResidual.IsAtEnd(); ++ItMean, ++ItResidual )
+    {
+    ItResidual.Set( static_cast<RealType>( inputImage->GetPixel( ItResidual.GetIndex() ) ) - ItMean.Get() );
+    }
+
+  this->m_ResidualPatchMomentImages = this->ComputePatchMomentImages( this->m_ResidualImage.GetPointer() );
+  this->InitializeNeighborhoodPatchBufferOffsets( this->m_ResidualImage->GetBufferedRegion() );
+
   typedef StatisticsImageFilter<InputImageType> StatsFilterType;
   typename StatsFilterType::Pointer statsFilter = StatsFilterType::New();
   statsFilter->SetInput( inputImage );
@@ -139,6 +155,19 @@ AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
 
   Array<RealType> weightedAverageIntensities( neighborhoodPatchSize );
 
+  std::vector<unsigned int> searchCandidates;
+  searchCandidates.reserve( neighborhoodSearchSize );
+
+  // Patches entirely inside the target region are measured on the residual
+  // image buffer directly.
+
+  const RealType *residualBuffer = this->m_ResidualImage->GetBufferPointer();
+  const typename Superclass::BufferOffsetType *patchBufferOffsets = this->m_NeighborhoodPatchBufferOffsetList.data();
+  const bool useResidualBuffer =
+    ( this->m_NeighborhoodPatchBufferRegion == this->m_ResidualImage->GetBufferedRegion() &&
+      this->m_NeighborhoodPatchBufferOffsetList.size() == neighborhoodPatchSize &&
+      this->m_ResidualImage->GetBufferedRegion().IsInside( targetImageRegion ) );
+
   ItM.GoToBegin();
   ItV.GoToBegin();
 
@@ -161,7 +190,10 @@ AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
     if( inputCenterPixel > 0 && meanCenterPixel > this->m_Epsilon && varianceCenterPixel > this->m_Epsilon &&
         ( !maskImage || maskImage->GetPixel( centerIndex ) != NumericTraits<MaskPixelType>::ZeroValue() ) )
       {
-      // Calculate the minimum distance
+      // Calculate the minimum distance.  The search candidates passing the
+      // mean and variance tests are cached for the patch filtering below.
+
+      searchCandidates.clear();
 
       RealType minimumDistance = NumericTraits<RealType>::max();
       for( unsigned int m = 0; m < neighborhoodSearchSize; m++ )
@@ -196,25 +228,31 @@ AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
             ( meanRatioInverse > this->m_MeanThreshold && meanRatioInverse < 1.0 / this->m_MeanThreshold ) ) &&
             varianceRatio > this->m_VarianceThreshold && varianceRatio < 1.0 / this->m_VarianceThreshold )
           {
+          searchCandidates.push_back( m );
 
           RealType averageDistance = 0.0;
-          RealType count = 0.0;
-
-          for( unsigned int n = 0; n < neighborhoodPatchSize; n++ )
+          if( useResidualBuffer && this->IsPatchInsideRegion( neighborhoodIndex, targetImageRegion ) )
             {
-            IndexType neighborhoodPatchIndex = neighborhoodIndex + neighborhoodPatchOffsetList[n];
-
-            if( ! targetImageRegion.IsInside( neighborhoodPatchIndex ) )
+            averageDistance = this->m_ResidualPatchMomentImages.m_SumOfSquares->GetPixel( neighborhoodIndex ) /
+              static_cast<RealType>( neighborhoodPatchSize );
+            }
+          else
+            {
+            RealType count = 0.0;
+            for( unsigned int n = 0; n < neighborhoodPatchSize; n++ )
               {
-              continue;
-              }
-            RealType neighborhoodInputImagePixel = static_cast<RealType>( inputImage->GetPixel( neighborhoodPatchIndex ) );
-            RealType neighborhoodMeanImagePixel = this->m_MeanImage->GetPixel( neighborhoodPatchIndex );
-            averageDistance += itk::Math::sqr ( neighborhoodInputImagePixel - neighborhoodMeanImagePixel );
+              IndexType neighborhoodPatchIndex = neighborhoodIndex + neighborhoodPatchOffsetList[n];
 
-            count += 1.0;
+              if( ! targetImageRegion.IsInside( neighborhoodPatchIndex ) )
+                {
+                continue;
+                }
+              averageDistance += itk::Math::sqr ( this->m_ResidualImage->GetPixel( neighborhoodPatchIndex ) );
+
+              count += 1.0;
+              }
+            averageDistance /= count;
             }
-          averageDistance /= count;
           minimumDistance = std::min( averageDistance, minimumDistance );
           }
         }
@@ -249,40 +287,23 @@ AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
 
       // Patch filtering
 
-      for( unsigned int m = 0; m < neighborhoodSearchSize; m++ )
-        {
-        if( ! ItM.IndexInBounds( m ) || m == static_cast<unsigned int>( 0.5 * neighborhoodSearchSize ) )
-          {
-          continue;
-          }
-
-        IndexType neighborhoodIndex = ItM.GetIndex( m );
+      const bool isCenterPatchInside = useResidualBuffer &&
+        this->IsPatchInsideRegion( centerIndex, targetImageRegion );
+      const RealType *centerResidual = residualBuffer + this->m_ResidualImage->ComputeOffset( centerIndex );
 
-        if( inputImage->GetPixel( neighborhoodIndex ) <= 0 )
-          {
-          continue;
-          }
-
-        meanNeighborhoodPixel = this->m_MeanImage->GetPixel( neighborhoodIndex );
-        varianceNeighborhoodPixel = this->m_VarianceImage->GetPixel( neighborhoodIndex );
+      for( SizeValueType c = 0; c < searchCandidates.size(); c++ )
+        {
+        IndexType neighborhoodIndex = ItM.GetIndex( searchCandidates[c] );
 
-        if( meanNeighborhoodPixel <= this->m_Epsilon || varianceNeighborhoodPixel <= this->m_Epsilon )
+        RealType averageDistance = 0.0;
+        if( isCenterPatchInside && this->IsPatchInsideRegion( neighborhoodIndex, targetImageRegion ) )
           {
-          continue;
+          averageDistance = this->ComputePatchSumOfSquaredDifferences(
+            residualBuffer + this->m_ResidualImage->ComputeOffset( neighborhoodIndex ), centerResidual,
+            patchBufferOffsets, neighborhoodPatchSize ) / static_cast<RealType>( neighborhoodPatchSize );
           }
-
-        const RealType meanRatio = meanCenterPixel / meanNeighborhoodPixel;
-        const RealType meanRatioInverse = ( this->m_MaximumInputPixelIntensity - meanCenterPixel ) /
-          ( this->m_MaximumInputPixelIntensity - meanNeighborhoodPixel );
-
-        const RealType varianceRatio = varianceCenterPixel / varianceNeighborhoodPixel;
-
-        if( ( ( meanRatio > this->m_MeanThreshold && meanRatio < 1.0 / this->m_MeanThreshold ) ||
-            ( meanRatioInverse > this->m_MeanThreshold && meanRatioInverse < 1.0 / this->m_MeanThreshold ) ) &&
-            varianceRatio > this->m_VarianceThreshold && varianceRatio < 1.0 / this->m_VarianceThreshold )
+        else
           {
-
-          RealType averageDistance = 0.0;
           RealType count = 0.0;
           for( unsigned int n = 0; n < neighborhoodPatchSize; n++ )
             {
@@ -292,45 +313,43 @@ AdaptiveNonLocalMeansDenoisingImageFilter<TInputImage, TOutputImage, TMaskImage>
               {
               continue;
               }
-            RealType distance1 = inputImage->GetPixel( searchNeighborhoodPatchIndex ) -
-                                 this->m_MeanImage->GetPixel( searchNeighborhoodPatchIndex );
-            RealType distance2 = inputImage->GetPixel( centerNeighborhoodPatchIndex ) -
-                                 this->m_MeanImage->GetPixel( centerNeighborhoodPatchIndex );
+            RealType distance1 = this->m_ResidualImage->GetPixel( searchNeighborhoodPatchIndex );
+            RealType distance2 = this->m_ResidualImage->GetPixel( centerNeighborhoodPatchIndex );
             averageDistance += itk::Math::sqr ( distance1 - distance2 );
             count += 1.0;
             }
           averageDistance /= count;
+          }
 
-          RealType weight = 0.0;
-          if( averageDistance <= 3.0 * minimumDistance )
-            {
-            weight = std::exp( -averageDistance / minimumDistance );
-            }
-          if( weight > maxWeight )
-            {
-            maxWeight = weight;
-            }
+        RealType weight = 0.0;
+        if( averageDistance <= 3.0 * minimumDistance )
+          {
+          weight = std::exp( -averageDistance / minimumDistance );
+          }
+        if( weight > maxWeight )
+          {
+          maxWeight = weight;
+          }
 
-          if( weight > 0.0 )
+        if( weight > 0.0 )
+          {
+          for( unsigned int n = 0; n < neighborhoodPatchSize; n++ )
             {
-            for( unsigned int n = 0; n < neighborhoodPatchSize; n++ )
+            IndexType neighborhoodPatchIndex = neighborhoodIndex + neighborhoodPatchOffsetList[n];
+            if( ! targetImageRegion.IsInside( neighborhoodPatchIndex ) )
               {
-              IndexType neighborhoodPatchIndex = neighborhoodIndex + neighborhoodPatchOffsetList[n];
-              if( ! targetImageRegion.IsInside( neighborhoodPatchIndex ) )
-                {
-                continue;
-                }
-              if( this->m_UseRicianNoiseModel )
-                {
-                weightedAverageIntensities[n] += weight * itk::Math::sqr ( inputImage->GetPixel( neighborhoodPatchIndex ) );
-                }
-              else
-                {
-                weightedAverageIntensities[n] += weight * inputImage->GetPixel( neighborhoodPatchIndex );
-                }
+              continue;
+              }
+            if( this->m_UseRicianNoiseModel )
+              {
+              weightedAverageIntensities[n] += weight * itk::Math::sqr ( inputImage->GetPixel( neighborhoodPatchIndex ) );
+              }
+            else
+              {
+              weightedAverageIntensities[n] += weight * inputImage->GetPixel( neighborhoodPatchIndex );
               }
-            sumOfWeights += weight;
             }
+          sumOfWeights += weight;
           }
         }
 
@@ -160,6 +160,14 @@ public:
   itkSetMacro( NumberOfBlobs, size_t );
   itkGetMacro( NumberOfBlobs, size_t );
 
+  /** Set/Get whether the larger scales are computed on a downsampled
+   * pyramid of the input.  A scale sigma is computed on the coarsest level
+   * whose voxels are at most sigma / 2, on by default.
+   */
+  itkSetMacro( UseImagePyramid, bool );
+  itkGetConstMacro( UseImagePyramid, bool );
+  itkBooleanMacro( UseImagePyramid );
+
   /** Set/Get the label image
    */
   itkSetMacro( BlobRadiusImage, BlobRadiusImagePointer );
@@ -192,8 +200,6 @@ protected:
 
   void GenerateData() override;
 
-  void ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread, ThreadIdType threadId ) override;
-
 private:
   MultiScaleLaplacianBlobDetectorImageFilter( const Self &) = delete;
   void operator=( const Self &) = delete;
@@ -242,13 +248,31 @@ public:
 
   typedef std::vector<Blob> BlobHeapType;
 
+  /** The normalized laplacian of one scale on a level of the pyramid and
+   * the maximum over the 3^D neighborhood of each of its pixels */
+  struct ScaleSpaceSlice
+  {
+    double                     m_Sigma;
+    unsigned int               m_Level;
+    RealImagePointer           m_Laplacian;
+    std::vector<RealPixelType> m_NeighborhoodMaximum;
+  };
+
+  unsigned int GetPyramidLevel( double sigma ) const;
+
+  void ComputeScaleSpaceSlice( ScaleSpaceSlice & slice, double sigma, unsigned int level );
+
+  void ComputeNeighborhoodMaximum( const RealImageType *image, std::vector<RealPixelType> & maximum ) const;
+
+  void FindScaleSpaceMaxima( const ScaleSpaceSlice *slices );
+
   // private member variable go here
-  RealImageConstPointer     m_LaplacianImage[3];
-  std::vector<BlobHeapType> m_BlobHeapPerThread;
-  RealPixelType             m_GlobalMinimalBestBlobValue;
+  std::vector<RealImagePointer> m_Pyramid;
+  std::vector<double>           m_PyramidSigmas;
+  std::vector<BlobHeapType>     m_BlobHeapPerThread;
+  RealPixelType                 m_GlobalMinimalBestBlobValue;
 
   double m_CurrentSigma;
-  float  m_CurrentProgress;
 
   // private IVAR
   size_t m_NumberOfBlobs;
@@ -258,6 +282,7 @@ public:
   unsigned int m_StepsPerOctave;
   double       m_StartT;
   double       m_EndT;
+  bool         m_UseImagePyramid;
 
   BlobRadiusImagePointer m_BlobRadiusImage;
 };
@@ -30,9 +30,11 @@
 #include "itkEllipseSpatialObject.h"
 #include "itkCastImageFilter.h"
 #include "itkLaplacianRecursiveGaussianImageFilter.h"
-#include "itkNeighborhoodAlgorithm.h"
-#include "itkProgressAccumulator.h"
+#include "itkMultiThreaderBase.h"
+#include "itkShrinkImageFilter.h"
+#include "itkSmoothingRecursiveGaussianImageFilter.h"
 
+#include <algorithm>
 #include <iterator>
 
 namespace itk
@@ -45,6 +47,7 @@ MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
   m_StepsPerOctave = 15;
   m_StartT = 8;
   m_EndT = 128;
+  m_UseImagePyramid = true;
 }
 
 template <typename TInputImage>
@@ -72,15 +75,8 @@ void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
   caster->Update();
   this->GraftOutput( caster->GetOutput() );
 
-  // Create a process accumulator for tracking the progress of minipipeline
-  ProgressAccumulator::Pointer progress = ProgressAccumulator::New();
-  progress->SetMiniPipelineFilter(this);
-
   // prepare one time threaded data
-//  this->m_BlobHeapPerThread.resize( this->GetNumberOfThreads() );
-// FIXME - setting to 2 threads
-  this->m_BlobHeapPerThread.resize(
-    this->GetMultiThreader()->GetGlobalDefaultNumberOfThreads() );
+  this->m_BlobHeapPerThread.resize( std::max( 1u, this->GetNumberOfWorkUnits() ) );
 
   // we wish to add an additional laplacian before and after the user
   // defined range to check for maximums
@@ -89,17 +85,45 @@ void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
 
   const unsigned int numberOfScales = std::ceil( std::log( std::sqrt( m_EndT ) / initial_sigma ) / std::log( k ) ) + 1.0;
 
-  typedef itk::LaplacianRecursiveGaussianImageFilter<InputImageType, RealImageType> LaplacianFilterType;
-  typename LaplacianFilterType::Pointer laplacianFilter[3];
-  for(auto & i : laplacianFilter)
+  // Level 0 of the pyramid is the input.  Level L is smoothed by 2^L voxels
+  // of the largest spacing and subsampled by 2^L, computed from level L-1.
+  typedef itk::CastImageFilter<InputImageType, RealImageType> RealCasterFilterType;
+  typename RealCasterFilterType::Pointer realCaster = RealCasterFilterType::New();
+  realCaster->SetInput( inputImage );
+  realCaster->Update();
+  this->m_Pyramid.assign( 1, realCaster->GetOutput() );
+  this->m_PyramidSigmas.assign( 1, 0.0 );
+
+  const unsigned int numberOfLevels =
+    this->GetPyramidLevel( initial_sigma * std::pow( k, double( numberOfScales - 1 ) ) ) + 1;
+  double maximumSpacing = 0;
+  for( unsigned int d = 0; d < InputImageType::ImageDimension; ++d )
+    {
+    maximumSpacing = std::max( maximumSpacing, static_cast<double>( inputImage->GetSpacing()[d] ) );
+    }
+  for( unsigned int level = 1; level < numberOfLevels; ++level )
     {
-    i = LaplacianFilterType::New();
-//    laplacianFilter[i]->SetNumberOfThreads( this->GetNumberOfThreads() );
-    i->SetInput( inputImage );
-    i->SetNormalizeAcrossScale( true );
-    progress->RegisterInternalFilter( i,   1.0 / numberOfScales );
+    const double levelSigma = std::pow( 2.0, double( level ) ) * maximumSpacing;
+
+    typedef itk::SmoothingRecursiveGaussianImageFilter<RealImageType, RealImageType> SmootherType;
+    typename SmootherType::Pointer smoother = SmootherType::New();
+    smoother->SetInput( this->m_Pyramid.back() );
+    smoother->SetSigma( std::sqrt( itk::Math::sqr( levelSigma ) - itk::Math::sqr( this->m_PyramidSigmas.back() ) ) );
+
+    typedef itk::ShrinkImageFilter<RealImageType, RealImageType> ShrinkerType;
+    typename ShrinkerType::Pointer shrinker = ShrinkerType::New();
+    shrinker->SetInput( smoother->GetOutput() );
+    shrinker->SetShrinkFactors( 2 );
+    shrinker->Update();
+
+    this->m_Pyramid.push_back( shrinker->GetOutput() );
+    this->m_PyramidSigmas.push_back( levelSigma );
     }
 
+  // the scales in decreasing order:  slice 2 is the newest, the maxima are
+  // searched around slice 1
+  ScaleSpaceSlice slices[3];
+
   BlobHeapType blobs;
   m_GlobalMinimalBestBlobValue = itk::NumericTraits<RealPixelType>::NonpositiveMin();
   for( unsigned int i = 0; i < numberOfScales; ++i )
@@ -111,29 +135,25 @@ void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
 
     itkDebugMacro( << "i: " << i << " sigma: " << sigma << " k: " << k );
 
-    // update largest index with new largest sigma
-    laplacianFilter[2]->SetSigma( sigma );
+    // the three scales of a search share the level of the center one
+    const unsigned int level = this->GetPyramidLevel( i > 0 ? slices[1].m_Sigma : sigma );
 
-    laplacianFilter[2]->Update();
+    // update largest index with new largest sigma
+    this->ComputeScaleSpaceSlice( slices[2], sigma, level );
 
-    // wait until all three laplacian filters have run
+    // wait until all three laplacian images are computed
     if( i > 1 )
       {
-      // prepare for threaded execution
-      this->m_LaplacianImage[0] = laplacianFilter[0]->GetOutput();
-      this->m_LaplacianImage[1] = laplacianFilter[1]->GetOutput();
-      this->m_LaplacianImage[2] = laplacianFilter[2]->GetOutput();
-      this->m_CurrentProgress = this->GetProgress();
-
-      // Set up the multithreaded processing of the outputs
-      typename Superclass::ThreadStruct str;
-      str.Filter = this;
+      for( unsigned int j = 0; j < 2; ++j )
+        {
+        if( slices[j].m_Level != level )
+          {
+          this->ComputeScaleSpaceSlice( slices[j], slices[j].m_Sigma, level );
+          }
+        }
 
-//      this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
-      this->GetMultiThreader()->SetSingleMethod( Self::ThreaderCallback, &str );
+      this->FindScaleSpaceMaxima( slices );
 
-      // multithread the execution
-      this->GetMultiThreader()->SingleMethodExecute();
       // combine all the maximally sorted lists into a maximally
       // sorted one
       for( unsigned int tt = 0; tt < m_BlobHeapPerThread.size(); ++tt )
@@ -169,18 +189,19 @@ void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
         }
       }
 
-    // circularly rotate laplacian filters down in scale
-    std::swap( laplacianFilter[2], laplacianFilter[1] );
-    std::swap( laplacianFilter[2], laplacianFilter[0] );
-    // Current Sigma refers to the center filter, hence next it'll be
+    // circularly rotate the slices down in scale
+    std::swap( slices[2], slices[1] );
+    std::swap( slices[2], slices[0] );
+    // Current Sigma refers to the center slice, hence next it'll be
     // the center
     m_CurrentSigma = sigma;
+
+    this->UpdateProgress( static_cast<float>( i + 1 ) / static_cast<float>( numberOfScales ) );
     }
 
   // clean up member variables
-  this->m_LaplacianImage[0] = nullptr;
-  this->m_LaplacianImage[1] = nullptr;
-  this->m_LaplacianImage[2] = nullptr;
+  this->m_Pyramid.clear();
+  this->m_PyramidSigmas.clear();
   this->m_BlobHeapPerThread.clear();
 
   m_BlobList.clear();
@@ -213,112 +234,205 @@ void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
 }
 
 template <typename TInputImage>
-void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
-::ThreadedGenerateData(const OutputImageRegionType & outputRegionForThread, ThreadIdType threadId )
+unsigned int MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
+::GetPyramidLevel( double sigma ) const
 {
-  // unsigned int m_Number = 20;
-  //  const unsigned int numberOfScales = m_Number+2;
-//     const unsigned int numberOfFilters = numberOfScales + m_Number;
-
-//     ProgressReporter progress( this, threadId, outputRegionForThread.GetNumberOfPixels(), 100, m_CurrentProgress,
-//  1.0/numberOfFilters);
-
-  BlobHeapType & blobHeap = this->m_BlobHeapPerThread[threadId];
-
-  blobHeap.reserve( m_NumberOfBlobs );
-
-  RealPixelType localMinimalBestBlobValue = m_GlobalMinimalBestBlobValue;
-
-  // center laplacian image
-  typename RealImageType::ConstPointer laplacianImage =  this->m_LaplacianImage[1];
-  InputImagePointer outputImage( this->GetOutput() );
-
-  typedef itk::ConstNeighborhoodIterator<RealImageType> NeighborhoodIteratorType;
-  typename NeighborhoodIteratorType::RadiusType radius;
-  radius.Fill(1);
-
-  typedef itk::NeighborhoodAlgorithm::ImageBoundaryFacesCalculator<RealImageType> FaceCalculatorType;
-  FaceCalculatorType faceCalculator;
-  typename FaceCalculatorType::FaceListType faceList;
-  typename FaceCalculatorType::FaceListType::iterator fit;
-
-  faceList = faceCalculator( laplacianImage, outputRegionForThread, radius );
-
-  Point<double, RealImageType::ImageDimension> zeroPoint;
-  zeroPoint.Fill(0);
-  for( fit = faceList.begin(); fit != faceList.end(); ++fit )
+  if( !this->m_UseImagePyramid )
     {
-    NeighborhoodIteratorType n0( radius, this->m_LaplacianImage[0], *fit );
-    NeighborhoodIteratorType n1( radius, this->m_LaplacianImage[1], *fit );
-    NeighborhoodIteratorType n2( radius, this->m_LaplacianImage[2], *fit );
+    return 0;
+    }
+  const InputImageType *                  inputImage = this->GetInput();
+  const typename InputImageType::SizeType size = inputImage->GetRequestedRegion().GetSize();
+  double                                  maximumSpacing = 0;
+  for( unsigned int d = 0; d < InputImageType::ImageDimension; ++d )
+    {
+    maximumSpacing = std::max( maximumSpacing, static_cast<double>( inputImage->GetSpacing()[d] ) );
+    }
 
-    const size_t neighborhoodSize = n0.Size();
+  // coarser levels keep sigma >= 2 voxels and at least 8 voxels per axis
+  unsigned int level = 0;
+  while( true )
+    {
+    const double factor = std::pow( 2.0, double( level + 1 ) );
+    bool         isCoarsenable = ( 2.0 * factor * maximumSpacing <= sigma );
+    for( unsigned int d = 0; d < InputImageType::ImageDimension; ++d )
+      {
+      isCoarsenable = isCoarsenable && ( size[d] >= 8 * factor );
+      }
+    if( !isCoarsenable )
+      {
+      return level;
+      }
+    ++level;
+    }
+}
 
-    while( !n0.IsAtEnd() && !n1.IsAtEnd() && !n2.IsAtEnd() )
+template <typename TInputImage>
+void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
+::ComputeScaleSpaceSlice( ScaleSpaceSlice & slice, double sigma, unsigned int level )
+{
+  // the level is already smoothed by its pyramid sigma, the normalization
+  // by the remaining sigma is rescaled to the full one
+  const double levelSigma = this->m_PyramidSigmas[level];
+  const double sigmaOnLevel = std::sqrt( itk::Math::sqr( sigma ) - itk::Math::sqr( levelSigma ) );
+
+  typedef itk::LaplacianRecursiveGaussianImageFilter<RealImageType, RealImageType> LaplacianFilterType;
+  typename LaplacianFilterType::Pointer laplacianFilter = LaplacianFilterType::New();
+  laplacianFilter->SetInput( this->m_Pyramid[level] );
+  laplacianFilter->SetNormalizeAcrossScale( true );
+  laplacianFilter->SetSigma( sigmaOnLevel );
+  laplacianFilter->Update();
+
+  slice.m_Sigma = sigma;
+  slice.m_Level = level;
+  slice.m_Laplacian = laplacianFilter->GetOutput();
+  slice.m_Laplacian->DisconnectPipeline();
+
+  if( levelSigma > 0 )
+    {
+    const RealPixelType scale = static_cast<RealPixelType>( itk::Math::sqr( sigma / sigmaOnLevel ) );
+    RealPixelType *     buffer = slice.m_Laplacian->GetBufferPointer();
+    const SizeValueType numberOfPixels = slice.m_Laplacian->GetBufferedRegion().GetNumberOfPixels();
+    for( SizeValueType n = 0; n < numberOfPixels; ++n )
       {
-      const RealPixelType center = n1.GetCenterPixel();
-      bool                isUsable = true;
+      buffer[n] *= scale;
+      }
+    }
 
-      if( center <  localMinimalBestBlobValue )
-        {
-        isUsable = false;
-        }
-      else
+  this->ComputeNeighborhoodMaximum( slice.m_Laplacian, slice.m_NeighborhoodMaximum );
+}
+
+template <typename TInputImage>
+void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
+::ComputeNeighborhoodMaximum( const RealImageType *image, std::vector<RealPixelType> & maximum ) const
+{
+  // separable maximum filter over the 3^D neighborhood with the boundary
+  // pixels replicated, as the zero flux Neumann boundary condition does.
+  // Each pass runs along contiguous rows of the buffer.
+  const typename RealImageType::SizeType size = image->GetBufferedRegion().GetSize();
+  const SizeValueType                    numberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+  const SizeValueType                    rowLength = size[0];
+  const SizeValueType                    numberOfRows = numberOfPixels / rowLength;
+
+  std::vector<RealPixelType> temp( image->GetBufferPointer(), image->GetBufferPointer() + numberOfPixels );
+  maximum.resize( numberOfPixels );
+
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+  SizeValueType              stride = 1;
+  for( unsigned int d = 0; d < RealImageType::ImageDimension; ++d )
+    {
+    const RealPixelType *in = temp.data();
+    RealPixelType *      out = maximum.data();
+    threader->ParallelizeArray( 0, numberOfRows,
+      [&]( SizeValueType r )
         {
-        for( size_t h = 0; h < neighborhoodSize && isUsable; ++h )
+        const SizeValueType  first = r * rowLength;
+        const RealPixelType *row = in + first;
+        RealPixelType *      outRow = out + first;
+        if( d == 0 )
           {
-          if( center <  n0.GetPixel( h ) )
+          if( rowLength == 1 )
             {
-            isUsable = false;
+            outRow[0] = row[0];
+            return;
             }
-          }
-        for( size_t h = 0; h < neighborhoodSize && isUsable; ++h )
-          {
-          if( center <  n1.GetPixel( h ) )
+          outRow[0] = std::max( row[0], row[1] );
+          for( SizeValueType x = 1; x + 1 < rowLength; ++x )
             {
-            isUsable = false;
+            outRow[x] = std::max( std::max( row[x - 1], row[x] ), row[x + 1] );
             }
+          outRow[rowLength - 1] = std::max( row[rowLength - 2], row[rowLength - 1] );
           }
-        for( size_t h = 0; h < neighborhoodSize && isUsable; ++h )
+        else
           {
-          if( center <  n2.GetPixel( h ) )
+          const SizeValueType  c = ( first / stride ) % size[d];
+          const RealPixelType *lower = ( c > 0 ) ? row - stride : row;
+          const RealPixelType *upper = ( c + 1 < size[d] ) ? row + stride : row;
+          for( SizeValueType x = 0; x < rowLength; ++x )
             {
-            isUsable = false;
+            outRow[x] = std::max( std::max( lower[x], row[x] ), upper[x] );
             }
           }
-        }
+        }, nullptr );
+    std::swap( temp, maximum );
+    stride *= size[d];
+    }
+  std::swap( temp, maximum );
+}
 
-      if( isUsable )
-        {
-        // add blob to thread list
+template <typename TInputImage>
+void MultiScaleLaplacianBlobDetectorImageFilter<TInputImage>
+::FindScaleSpaceMaxima( const ScaleSpaceSlice *slices )
+{
+  // center laplacian image
+  const RealImageType * laplacianImage = slices[1].m_Laplacian;
+  const RealPixelType * center = laplacianImage->GetBufferPointer();
+  const RealPixelType * maximum0 = slices[0].m_NeighborhoodMaximum.data();
+  const RealPixelType * maximum1 = slices[1].m_NeighborhoodMaximum.data();
+  const RealPixelType * maximum2 = slices[2].m_NeighborhoodMaximum.data();
+  const SizeValueType   numberOfPixels = laplacianImage->GetBufferedRegion().GetNumberOfPixels();
+  const InputImageType *inputImage = this->GetInput();
+
+  // Each work unit scans interleaved blocks of pixels into its own heap of
+  // at most m_NumberOfBlobs blobs.
+  const unsigned int  numberOfWorkUnits = this->m_BlobHeapPerThread.size();
+  const SizeValueType blockSize = 4096;
+
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, numberOfWorkUnits,
+    [&]( SizeValueType workUnit )
+      {
+      BlobHeapType & blobHeap = this->m_BlobHeapPerThread[workUnit];
 
-        Blob blob(  n1.GetIndex(), m_CurrentSigma, center );
+      blobHeap.reserve( m_NumberOfBlobs );
 
-        // maintain a minimum heap ( first element is less than all
-        // others) no greater then the target number of blobs
-        if( blobHeap.size() < m_NumberOfBlobs )
-          {
-          blobHeap.push_back( blob );
-          std::push_heap( blobHeap.begin(), blobHeap.end(), BlobValueGreaterCompare );
-          }
-        else if( blob.m_Value > localMinimalBestBlobValue )
+      RealPixelType localMinimalBestBlobValue = m_GlobalMinimalBestBlobValue;
+
+      for( SizeValueType first = workUnit * blockSize; first < numberOfPixels;
+           first += numberOfWorkUnits * blockSize )
+        {
+        const SizeValueType last = std::min( numberOfPixels, first + blockSize );
+        for( SizeValueType n = first; n < last; ++n )
           {
-          std::pop_heap( blobHeap.begin(), blobHeap.end(), BlobValueGreaterCompare );
-          blobHeap.back() = blob;
-          std::push_heap( blobHeap.begin(), blobHeap.end(), BlobValueGreaterCompare );
+          const RealPixelType value = center[n];
+          if( value < localMinimalBestBlobValue || value < maximum0[n] || value < maximum1[n] ||
+              value < maximum2[n] )
+            {
+            continue;
+            }
 
-          localMinimalBestBlobValue = blobHeap.front().m_Value;
-          }
-        }
+          // add blob to thread list, located on the input grid
+          typename RealImageType::IndexType index = laplacianImage->ComputeIndex( n );
+          if( slices[1].m_Level > 0 )
+            {
+            typename RealImageType::PointType point;
+            laplacianImage->TransformIndexToPhysicalPoint( index, point );
+            inputImage->TransformPhysicalPointToIndex( point, index );
+            }
 
-      ++n0, ++n1, ++n2;
+          Blob blob( index, m_CurrentSigma, value );
 
-      // progress.CompletedPixel();
-      }
-    } // end face list
+          // maintain a minimum heap ( first element is less than all
+          // others) no greater then the target number of blobs
+          if( blobHeap.size() < m_NumberOfBlobs )
+            {
+            blobHeap.push_back( blob );
+            std::push_heap( blobHeap.begin(), blobHeap.end(), BlobValueGreaterCompare );
+            }
+          else if( blob.m_Value > localMinimalBestBlobValue )
+            {
+            std::pop_heap( blobHeap.begin(), blobHeap.end(), BlobValueGreaterCompare );
+            blobHeap.back() = blob;
+            std::push_heap( blobHeap.begin(), blobHeap.end(), BlobValueGreaterCompare );
+
+            localMinimalBestBlobValue = blobHeap.front().m_Value;
+            }
+          }
+        }
 
-  //  sort the heap, the first element will now be maximal
-  std::sort_heap( blobHeap.begin(), blobHeap.end(), BlobValueGreaterCompare );
+      //  sort the heap, the first element will now be maximal
+      std::sort_heap( blobHeap.begin(), blobHeap.end(), BlobValueGreaterCompare );
+      }, nullptr );
 }
 }
 
@@ -78,6 +78,51 @@ public:
   typedef typename ConstNeighborhoodIteratorType::OffsetType   NeighborhoodOffsetType;
 
   typedef std::vector<NeighborhoodOffsetType>                  NeighborhoodOffsetListType;
+
+  typedef OffsetValueType                                      BufferOffsetType;
+  typedef std::vector<BufferOffsetType>                        BufferOffsetListType;
+
+  /**
+   * Sum and sum of squares of the patch centered at each voxel of an image.
+   * Voxels whose patch is not entirely inside the image are NaN.
+   */
+  struct PatchMomentImages
+    {
+    RealImagePointer m_Sum;
+    RealImagePointer m_SumOfSquares;
+    };
+  typedef std::vector<PatchMomentImages>                       PatchMomentImagesList;
+
+  /**
+   * Search candidates which survived pruning for every voxel of a region,
+   * stored in the raster order of the region:  the candidates of the n-th voxel
+   * are m_SearchOffsetIndices[k] (indices into the search offset list) and their
+   * patch similarities m_PatchSimilarities[k] for m_VoxelOffsets[n] <= k <
+   * m_VoxelOffsets[n+1].  Iterative filters keep one per work unit so that later
+   * iterations revisit only the surviving candidates instead of searching again.
+   */
+  struct SearchCandidateCache
+    {
+    RegionType                  m_Region;
+    std::vector<SizeValueType>  m_VoxelOffsets;
+    std::vector<unsigned int>   m_SearchOffsetIndices;
+    std::vector<RealType>       m_PatchSimilarities;
+
+    void Clear()
+      {
+      this->m_Region = RegionType();
+      this->m_VoxelOffsets.clear();
+      this->m_SearchOffsetIndices.clear();
+      this->m_PatchSimilarities.clear();
+      }
+    bool IsValid( const RegionType & region ) const
+      {
+      return ( this->m_Region == region &&
+               this->m_VoxelOffsets.size() == region.GetNumberOfPixels() + 1 );
+      }
+    };
+  typedef std::vector<SearchCandidateCache>                    SearchCandidateCacheList;
+
   /**
    * Neighborhood patch similarity metric enumerated type
    */
@@ -138,6 +183,14 @@ public:
   itkSetMacro( SimilarityMetric, SimilarityMetricType );
   itkGetConstMacro( SimilarityMetric, SimilarityMetricType );
 
+  /**
+   * Compute the patch moment images of an image for the current patch radius.
+   * They depend only on the image, so they can be computed once and shared by
+   * every filter searching that image.
+   */
+  template<typename TImage>
+  PatchMomentImages ComputePatchMomentImages( const TImage * ) const;
+
 protected:
 
   NonLocalPatchBasedImageFilter();
@@ -149,6 +202,43 @@ protected:
 
   RealType ComputeNeighborhoodPatchSimilarity( const InputImageList &, const IndexType, const InputImagePixelVectorType &, const bool );
 
+  /**
+   * Same as above but the sums over the searched patch are read from its patch
+   * moment images.  The last argument is the sum of squares of the patch vector,
+   * NaN if the patch vector is incomplete, in which case (or if the searched patch
+   * is not entirely inside the image) the patch is visited voxel by voxel.  The
+   * sums are expanded in double precision since the mean squares expansion
+   * subtracts sums which are large compared to their difference.
+   */
+  RealType ComputeNeighborhoodPatchSimilarity( const InputImageList &, const IndexType, const InputImagePixelVectorType &,
+    const bool, const PatchMomentImagesList &, const double );
+
+  /**
+   * Precompute the buffer offsets of the patch neighborhood for images buffered
+   * over the given region.  Patches entirely inside that region can then be
+   * visited through a pointer and this offset list, see the patch kernels below.
+   */
+  void InitializeNeighborhoodPatchBufferOffsets( const RegionType & );
+
+  /**
+   * Whether the patch centered at the index lies entirely inside the region.
+   */
+  bool IsPatchInsideRegion( const IndexType &, const RegionType & ) const;
+
+  /**
+   * Patch kernels over buffer offsets.  Both accumulate in independent partial
+   * sums over a flat offset list so that the compiler can unroll and vectorize
+   * the loop; the first takes a contiguous patch vector y, the second gathers
+   * both patches from a buffer.
+   */
+  template<typename TPixelX, typename TPixelY>
+  static double ComputePatchInnerProduct( const TPixelX *, const TPixelY *,
+    const BufferOffsetType *, const SizeValueType );
+
+  template<typename TPixel>
+  static RealType ComputePatchSumOfSquaredDifferences( const TPixel *, const TPixel *,
+    const BufferOffsetType *, const SizeValueType );
+
   InputImagePixelVectorType VectorizeImageListPatch( const InputImageList &, const IndexType, const bool );
 
   InputImagePixelVectorType VectorizeImagePatch( const InputImagePointer, const IndexType, const bool );
@@ -170,6 +260,9 @@ protected:
 
   RegionType                                           m_TargetImageRegion;
 
+  BufferOffsetListType                                 m_NeighborhoodPatchBufferOffsetList;
+  RegionType                                           m_NeighborhoodPatchBufferRegion;
+
 
 private:
 
@@ -22,6 +22,10 @@
 
 #include "itkNeighborhood.h"
 
+#include <algorithm>
+#include <limits>
+#include <vector>
+
 namespace itk {
 
 template <typename TInputImage, typename TOutputImage>
@@ -69,6 +73,105 @@ NonLocalPatchBasedImageFilter<TInputImage, TOutputImage>
     }
 
   this->m_TargetImageRegion = this->GetInput()->GetRequestedRegion();
+
+  this->InitializeNeighborhoodPatchBufferOffsets( this->GetInput()->GetBufferedRegion() );
+}
+
+template<typename TInputImage, typename TOutputImage>
+void
+NonLocalPatchBasedImageFilter<TInputImage, TOutputImage>
+::InitializeNeighborhoodPatchBufferOffsets( const RegionType &bufferedRegion )
+{
+  BufferOffsetType strides[ImageDimension];
+  BufferOffsetType stride = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    strides[d] = stride;
+    stride *= static_cast<BufferOffsetType>( bufferedRegion.GetSize()[d] );
+    }
+
+  this->m_NeighborhoodPatchBufferOffsetList.resize( this->m_NeighborhoodPatchOffsetList.size() );
+  for( SizeValueType j = 0; j < this->m_NeighborhoodPatchOffsetList.size(); j++ )
+    {
+    BufferOffsetType offset = 0;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      offset += this->m_NeighborhoodPatchOffsetList[j][d] * strides[d];
+      }
+    this->m_NeighborhoodPatchBufferOffsetList[j] = offset;
+    }
+  this->m_NeighborhoodPatchBufferRegion = bufferedRegion;
+}
+
+template<typename TInputImage, typename TOutputImage>
+bool
+NonLocalPatchBasedImageFilter<TInputImage, TOutputImage>
+::IsPatchInsideRegion( const IndexType &index, const RegionType &region ) const
+{
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    const IndexValueType radius = static_cast<IndexValueType>( this->m_NeighborhoodPatchRadius[d] );
+    if( index[d] - radius < region.GetIndex()[d] ||
+        index[d] + radius >= region.GetIndex()[d] + static_cast<IndexValueType>( region.GetSize()[d] ) )
+      {
+      return false;
+      }
+    }
+  return true;
+}
+
+template<typename TInputImage, typename TOutputImage>
+template<typename TPixelX, typename TPixelY>
+double
+NonLocalPatchBasedImageFilter<TInputImage, TOutputImage>
+::ComputePatchInnerProduct( const TPixelX *x, const TPixelY *y, const BufferOffsetType *offsets,
+  const SizeValueType size )
+{
+  double sum0 = 0.0;
+  double sum1 = 0.0;
+  double sum2 = 0.0;
+  double sum3 = 0.0;
+
+  SizeValueType j = 0;
+  for( ; j + 4 <= size; j += 4 )
+    {
+    sum0 += static_cast<double>( x[offsets[j]] ) * static_cast<double>( y[j] );
+    sum1 += static_cast<double>( x[offsets[j + 1]] ) * static_cast<double>( y[j + 1] );
+    sum2 += static_cast<double>( x[offsets[j + 2]] ) * static_cast<double>( y[j + 2] );
+    sum3 += static_cast<double>( x[offsets[j + 3]] ) * static_cast<double>( y[j + 3] );
+    }
+  for( ; j < size; j++ )
+    {
+    sum0 += static_cast<double>( x[offsets[j]] ) * static_cast<double>( y[j] );
+    }
+  return ( sum0 + sum1 ) + ( sum2 + sum3 );
+}
+
+template<typename TInputImage, typename TOutputImage>
+template<typename TPixel>
+typename NonLocalPatchBasedImageFilter<TInputImage, TOutputImage>::RealType
+NonLocalPatchBasedImageFilter<TInputImage, TOutputImage>
+::ComputePatchSumOfSquaredDifferences( const TPixel *x, const TPixel *y, const BufferOffsetType *offsets,
+  const SizeValueType size )
+{
+  RealType sum0 = 0.0;
+  RealType sum1 = 0.0;
+  RealType sum2 = 0.0;
+  RealType sum3 = 0.0;
+
+  SizeValueType j = 0;
+  for( ; j + 4 <= size; j += 4 )
+    {
+    sum0 += itk::Math::sqr( static_cast<RealType>( x[offsets[j]] ) - static_cast<RealType>( y[offsets[j]] ) );
+    sum1 += itk::Math::sqr( static_cast<RealType>( x[offsets[j + 1]] ) - static_cast<RealType>( y[offsets[j + 1]] ) );
+    sum2 += itk::Math::sqr( static_cast<RealType>( x[offsets[j + 2]] ) - static_cast<RealType>( y[offsets[j + 2]] ) );
+    sum3 += itk::Math::sqr( static_cast<RealType>( x[offsets[j + 3]] ) - static_cast<RealType>( y[offsets[j + 3]] ) );
+    }
+  for( ; j < size; j++ )
+    {
+    sum0 += itk::Math::sqr( static_cast<RealType>( x[offsets[j]] ) - static_cast<RealType>( y[offsets[j]] ) );
+    }
+  return ( sum0 + sum1 ) + ( sum2 + sum3 );
 }
 
 template <typename TInputImage, typename TOutputImage>
@@ -226,6 +329,181 @@ NonLocalPatchBasedImageFilter<TInputImage, TOutputImage>
     }
 }
 
+template <typename TInputImage, typename TOutputImage>
+typename NonLocalPatchBasedImageFilter<TInputImage, TOutputImage>::RealType
+NonLocalPatchBasedImageFilter<TInputImage, TOutputImage>
+::ComputeNeighborhoodPatchSimilarity( const InputImageList &imageList, const IndexType index,
+  const InputImagePixelVectorType &patchVectorY, const bool useOnlyFirstImage,
+  const PatchMomentImagesList &patchMoments, const double sumOfSquaresY )
+{
+  unsigned int numberOfImagesToUse = imageList.size();
+  if( useOnlyFirstImage )
+    {
+    numberOfImagesToUse = 1;
+    }
+
+  if( patchMoments.size() < numberOfImagesToUse || !std::isfinite( sumOfSquaresY ) ||
+      !std::isfinite( patchMoments[0].m_Sum->GetPixel( index ) ) )
+    {
+    return this->ComputeNeighborhoodPatchSimilarity( imageList, index, patchVectorY, useOnlyFirstImage );
+    }
+
+  double sumX = 0.0;
+  double sumOfSquaresX = 0.0;
+  double sumXY = 0.0;
+
+  SizeValueType count = 0;
+  for( SizeValueType i = 0; i < numberOfImagesToUse; i++ )
+    {
+    sumX += patchMoments[i].m_Sum->GetPixel( index );
+    sumOfSquaresX += patchMoments[i].m_SumOfSquares->GetPixel( index );
+    if( imageList[i]->GetBufferedRegion() == this->m_NeighborhoodPatchBufferRegion &&
+        this->m_NeighborhoodPatchBufferOffsetList.size() == this->m_NeighborhoodPatchSize )
+      {
+      sumXY += this->ComputePatchInnerProduct( imageList[i]->GetBufferPointer() + imageList[i]->ComputeOffset( index ),
+        &patchVectorY[count], this->m_NeighborhoodPatchBufferOffsetList.data(), this->m_NeighborhoodPatchSize );
+      count += this->m_NeighborhoodPatchSize;
+      }
+    else
+      {
+      for( SizeValueType j = 0; j < this->m_NeighborhoodPatchSize; j++ )
+        {
+        sumXY += static_cast<double>( imageList[i]->GetPixel( index + this->m_NeighborhoodPatchOffsetList[j] ) ) *
+          static_cast<double>( patchVectorY[count++] );
+        }
+      }
+    }
+  const double N = static_cast<double>( count );
+
+  if( this->m_SimilarityMetric == PEARSON_CORRELATION )
+    {
+    double varianceX = sumOfSquaresX - itk::Math::sqr ( sumX ) / N;
+    varianceX = std::max( varianceX, 1.0e-6 );
+
+    RealType measure = static_cast<RealType>( itk::Math::sqr ( sumXY ) / varianceX );
+    if( sumXY > 0 )
+      {
+      return -measure;
+      }
+    else
+      {
+      return measure;
+      }
+    }
+  else if( this->m_SimilarityMetric == MEAN_SQUARES )
+    {
+    return static_cast<RealType>( ( sumOfSquaresY - 2.0 * sumXY + sumOfSquaresX ) / N );
+    }
+  else
+    {
+    itkExceptionMacro( "Unrecognized similarity metric." );
+    }
+}
+
+template <typename TInputImage, typename TOutputImage>
+template <typename TImage>
+typename NonLocalPatchBasedImageFilter<TInputImage, TOutputImage>::PatchMomentImages
+NonLocalPatchBasedImageFilter<TInputImage, TOutputImage>
+::ComputePatchMomentImages( const TImage *image ) const
+{
+  const RegionType    region = image->GetBufferedRegion();
+  const SizeValueType numberOfPixels = region.GetNumberOfPixels();
+
+  std::vector<double> sums( numberOfPixels );
+  std::vector<double> sumsOfSquares( numberOfPixels );
+
+  const typename TImage::PixelType *buffer = image->GetBufferPointer();
+  for( SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    sums[n] = static_cast<double>( buffer[n] );
+    sumsOfSquares[n] = itk::Math::sqr( sums[n] );
+    }
+
+  // The patch is a box, so its sums are separable:  run a box sum along
+  // each axis in turn using prefix sums over every line of voxels.
+  SizeValueType stride = 1;
+  std::vector<SizeValueType> strides( ImageDimension );
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    strides[d] = stride;
+    stride *= region.GetSize()[d];
+    }
+
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    const SizeValueType lineLength = region.GetSize()[d];
+    const SizeValueType radius = this->m_NeighborhoodPatchRadius[d];
+    if( radius == 0 || lineLength == 0 )
+      {
+      continue;
+      }
+
+    std::vector<double> prefix( lineLength + 1 );
+    std::vector<double> prefixOfSquares( lineLength + 1 );
+
+    const SizeValueType lineStride = strides[d];
+    for( SizeValueType outer = 0; outer < numberOfPixels; outer += lineStride * lineLength )
+      {
+      for( SizeValueType inner = 0; inner < lineStride; inner++ )
+        {
+        const SizeValueType start = outer + inner;
+
+        prefix[0] = prefixOfSquares[0] = 0.0;
+        for( SizeValueType k = 0; k < lineLength; k++ )
+          {
+          prefix[k + 1] = prefix[k] + sums[start + k * lineStride];
+          prefixOfSquares[k + 1] = prefixOfSquares[k] + sumsOfSquares[start + k * lineStride];
+          }
+        for( SizeValueType k = 0; k < lineLength; k++ )
+          {
+          const SizeValueType first = ( k > radius ) ? k - radius : 0;
+          const SizeValueType last = std::min( k + radius + 1, lineLength );
+          sums[start + k * lineStride] = prefix[last] - prefix[first];
+          sumsOfSquares[start + k * lineStride] = prefixOfSquares[last] - prefixOfSquares[first];
+          }
+        }
+      }
+    }
+
+  PatchMomentImages moments;
+  moments.m_Sum = RealImageType::New();
+  moments.m_Sum->CopyInformation( image );
+  moments.m_Sum->SetRegions( region );
+  moments.m_Sum->Allocate();
+  moments.m_SumOfSquares = RealImageType::New();
+  moments.m_SumOfSquares->CopyInformation( image );
+  moments.m_SumOfSquares->SetRegions( region );
+  moments.m_SumOfSquares->Allocate();
+
+  RealType *sumBuffer = moments.m_Sum->GetBufferPointer();
+  RealType *sumOfSquaresBuffer = moments.m_SumOfSquares->GetBufferPointer();
+  for( SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    bool isPatchInside = true;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      const SizeValueType k = ( n / strides[d] ) % region.GetSize()[d];
+      const SizeValueType radius = this->m_NeighborhoodPatchRadius[d];
+      if( k < radius || k + radius >= region.GetSize()[d] )
+        {
+        isPatchInside = false;
+        break;
+        }
+      }
+    if( isPatchInside )
+      {
+      sumBuffer[n] = static_cast<RealType>( sums[n] );
+      sumOfSquaresBuffer[n] = static_cast<RealType>( sumsOfSquares[n] );
+      }
+    else
+      {
+      sumBuffer[n] = sumOfSquaresBuffer[n] = std::numeric_limits<RealType>::quiet_NaN();
+      }
+    }
+
+  return moments;
+}
+
 template<typename TInputImage, typename TOutputImage>
 void
 NonLocalPatchBasedImageFilter<TInputImage, TOutputImage>
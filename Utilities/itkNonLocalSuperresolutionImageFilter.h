@@ -88,6 +88,10 @@ public:
   typedef typename Superclass::ConstNeighborhoodIteratorType  ConstNeighborhoodIteratorType;
   typedef typename Superclass::NeighborhoodOffsetListType     NeighborhoodOffsetListType;
 
+  typedef typename Superclass::PatchMomentImagesList          PatchMomentImagesList;
+  typedef typename Superclass::SearchCandidateCache           SearchCandidateCache;
+  typedef typename Superclass::SearchCandidateCacheList       SearchCandidateCacheList;
+
   typedef std::vector<RealType>                          ScaleLevelsArrayType;
 
   /**
@@ -187,6 +191,16 @@ public:
     }
   itkGetConstMacro( ScaleLevels, ScaleLevelsArrayType );
 
+  /**
+   * The patch similarities against the high resolution reference image do not
+   * change between scale levels, so the search candidates of each voxel are
+   * cached after the first level and only those are revisited at the following
+   * levels.  A candidate is dropped from the cache once its weight could not
+   * exceed this value at any remaining scale level.  Default = 1e-6.
+   */
+  itkSetMacro( SearchCandidatePruningWeight, RealType );
+  itkGetConstMacro( SearchCandidatePruningWeight, RealType );
+
   /**
    * Get the number of elapsed iterations.  This is a helper function for
    * reporting observations.
@@ -240,6 +254,10 @@ private:
 
   ScaleLevelsArrayType                                 m_ScaleLevels;
   SizeValueType                                        m_CurrentIteration;
+
+  PatchMomentImagesList                                m_HighResolutionPatchMomentImages;
+  SearchCandidateCacheList                             m_SearchCandidateCaches;
+  RealType                                             m_SearchCandidatePruningWeight;
 };
 
 } // end namespace itk
@@ -53,7 +53,8 @@ NonLocalSuperresolutionImageFilter<TInputImage, TOutputImage>
   m_PatchSimilaritySigma( 1.0 ),
   m_IntensityDifferenceSigma( 1.0 ),
   m_PerformInitialMeanCorrection( false ),
-  m_CurrentIteration( 0 )
+  m_CurrentIteration( 0 ),
+  m_SearchCandidatePruningWeight( 1.0e-6 )
 {
   this->SetNumberOfRequiredInputs( 2 );
 
@@ -250,6 +251,18 @@ NonLocalSuperresolutionImageFilter<TInputImage, TOutputImage>
       this->SetHighResolutionReferenceImage( meanCorrectedImage );
       }
 
+    // The reference image is fixed from here on, so its patch moments and
+    // the search candidates of each voxel can be shared by all scale levels.
+
+    const InputImageType *referenceImage = this->GetHighResolutionReferenceImage();
+    this->InitializeNeighborhoodPatchBufferOffsets( referenceImage->GetBufferedRegion() );
+
+    this->m_HighResolutionPatchMomentImages.clear();
+    this->m_HighResolutionPatchMomentImages.push_back( this->ComputePatchMomentImages( referenceImage ) );
+
+    this->m_SearchCandidateCaches.clear();
+    this->m_SearchCandidateCaches.resize( this->GetMultiThreader()->GetNumberOfWorkUnits() );
+
     this->AllocateOutputs();
     }
   else
@@ -286,6 +299,40 @@ NonLocalSuperresolutionImageFilter<TInputImage, TOutputImage>
   InputImageList highResolutionInputImageList;
   highResolutionInputImageList.push_back( const_cast<InputImageType *>( highResolutionInputImage ) );
 
+  const RealType scaleLevel = this->m_ScaleLevels[this->m_CurrentIteration];
+  const RealType intensityDifferenceThreshold = 3.0 * this->m_IntensityDifferenceSigma * itk::Math::sqr( scaleLevel );
+
+  // Candidates are kept for the remaining scale levels as long as they could
+  // still pass the intensity test and contribute a non-negligible weight at
+  // the largest of those levels.
+
+  RealType nextScaleLevel = 0.0;
+  for( SizeValueType n = this->m_CurrentIteration + 1; n < this->m_ScaleLevels.size(); n++ )
+    {
+    nextScaleLevel = std::max( nextScaleLevel, this->m_ScaleLevels[n] );
+    }
+  const RealType nextIntensityDifferenceThreshold = 3.0 * this->m_IntensityDifferenceSigma *
+    itk::Math::sqr( nextScaleLevel );
+  const RealType searchThreshold = std::max( intensityDifferenceThreshold, nextIntensityDifferenceThreshold );
+
+  SearchCandidateCache *cache = nullptr;
+  if( threadId < this->m_SearchCandidateCaches.size() )
+    {
+    cache = &( this->m_SearchCandidateCaches[threadId] );
+    }
+  const bool useCache = ( cache != nullptr && this->m_CurrentIteration > 0 && cache->IsValid( region ) );
+  const bool fillCache = ( cache != nullptr && nextScaleLevel > 0.0 );
+
+  SearchCandidateCache nextCache;
+  if( fillCache )
+    {
+    nextCache.m_Region = region;
+    nextCache.m_VoxelOffsets.reserve( region.GetNumberOfPixels() + 1 );
+    nextCache.m_VoxelOffsets.push_back( 0 );
+    }
+
+  SizeValueType voxelCount = 0;
+
   ConstNeighborhoodIteratorType It( this->GetNeighborhoodPatchRadius(), highResolutionInputImage, region );
 
   for( It.GoToBegin(); !It.IsAtEnd(); ++It )
@@ -294,48 +341,119 @@ NonLocalSuperresolutionImageFilter<TInputImage, TOutputImage>
 
     IndexType currentCenterIndex = It.GetIndex();
 
-    InputImagePixelVectorType highResolutionPatch =
-      this->VectorizeImageListPatch( highResolutionInputImageList, currentCenterIndex, true );
+    RealType centerPixel = It.GetCenterPixel();
+
+    RealType weightedIntensitySum = 0.0;
+    RealType weightSum = 0.0;
 
-    for( SizeValueType i = 0; i < searchNeighborhoodSize; i++ )
+    auto visitCandidate = [&]( const SizeValueType i, const RealType intensityDifference, const RealType patchSimilarity )
       {
       IndexType searchIndex = currentCenterIndex + searchNeighborhoodOffsetList[i];
 
-      if( searchIndex == currentCenterIndex )
+      if( std::fabs( intensityDifference ) <= intensityDifferenceThreshold )
         {
-        continue;
+        RealType intensityWeight = itk::Math::sqr ( intensityDifference /
+          ( this->m_IntensityDifferenceSigma * scaleLevel ) );
+
+        RealType patchWeight = itk::Math::sqr ( patchSimilarity /
+          ( this->m_PatchSimilaritySigma * scaleLevel ) );
+
+        RealType weight = std::exp( -( intensityWeight + patchWeight ) );
+
+        weightedIntensitySum += weight * this->m_InterpolatedLowResolutionInputImage->GetPixel( searchIndex );
+        weightSum += weight;
         }
 
-      if( !outputImage->GetBufferedRegion().IsInside( searchIndex ) )
+      if( fillCache && std::fabs( intensityDifference ) <= nextIntensityDifferenceThreshold )
         {
-        continue;
+        RealType nextWeight = std::exp( -( itk::Math::sqr( intensityDifference /
+          ( this->m_IntensityDifferenceSigma * nextScaleLevel ) ) + itk::Math::sqr( patchSimilarity /
+          ( this->m_PatchSimilaritySigma * nextScaleLevel ) ) ) );
+        if( nextWeight >= this->m_SearchCandidatePruningWeight )
+          {
+          nextCache.m_SearchOffsetIndices.push_back( static_cast<unsigned int>( i ) );
+          nextCache.m_PatchSimilarities.push_back( patchSimilarity );
+          }
         }
+      };
+
+    if( useCache )
+      {
+      for( SizeValueType k = cache->m_VoxelOffsets[voxelCount]; k < cache->m_VoxelOffsets[voxelCount + 1]; k++ )
+        {
+        const SizeValueType i = cache->m_SearchOffsetIndices[k];
+        IndexType searchIndex = currentCenterIndex + searchNeighborhoodOffsetList[i];
+
+        RealType intensityDifference = centerPixel - highResolutionInputImage->GetPixel( searchIndex );
 
-      RealType intensityDifference =
-        It.GetCenterPixel() - highResolutionInputImage->GetPixel( searchIndex );
+        visitCandidate( i, intensityDifference, cache->m_PatchSimilarities[k] );
+        }
+      }
+    else
+      {
+      InputImagePixelVectorType highResolutionPatch =
+        this->VectorizeImageListPatch( highResolutionInputImageList, currentCenterIndex, true );
 
-      if( std::fabs( intensityDifference ) > 3.0 * this->m_IntensityDifferenceSigma *
-        itk::Math::sqr ( this->m_ScaleLevels[this->m_CurrentIteration] ) )
+      double highResolutionPatchSumOfSquares = 0.0;
+      for( SizeValueType j = 0; j < highResolutionPatch.size(); j++ )
         {
-        continue;
+        highResolutionPatchSumOfSquares += itk::Math::sqr( static_cast<double>( highResolutionPatch[j] ) );
         }
 
-      RealType patchSimilarity = this->ComputeNeighborhoodPatchSimilarity(
-        highResolutionInputImageList, searchIndex, highResolutionPatch, true );
+      for( SizeValueType i = 0; i < searchNeighborhoodSize; i++ )
+        {
+        IndexType searchIndex = currentCenterIndex + searchNeighborhoodOffsetList[i];
 
-      RealType intensityWeight = itk::Math::sqr ( intensityDifference /
-        ( this->m_IntensityDifferenceSigma * this->m_ScaleLevels[this->m_CurrentIteration] ) );
+        if( searchIndex == currentCenterIndex )
+          {
+          continue;
+          }
 
-      RealType patchWeight = itk::Math::sqr ( patchSimilarity /
-        ( this->m_PatchSimilaritySigma * this->m_ScaleLevels[this->m_CurrentIteration] ) );
+        if( !outputImage->GetBufferedRegion().IsInside( searchIndex ) )
+          {
+          continue;
+          }
 
-      RealType weight = std::exp( -( intensityWeight + patchWeight ) );
+        RealType intensityDifference = centerPixel - highResolutionInputImage->GetPixel( searchIndex );
+
+        if( std::fabs( intensityDifference ) > searchThreshold )
+          {
+          continue;
+          }
+
+        RealType patchSimilarity = this->ComputeNeighborhoodPatchSimilarity(
+          highResolutionInputImageList, searchIndex, highResolutionPatch, true,
+          this->m_HighResolutionPatchMomentImages, highResolutionPatchSumOfSquares );
+
+        visitCandidate( i, intensityDifference, patchSimilarity );
+        }
+      }
 
+    if( weightSum > 0.0 )
+      {
       outputImage->SetPixel( currentCenterIndex, outputImage->GetPixel( currentCenterIndex )
-        + weight * this->m_InterpolatedLowResolutionInputImage->GetPixel( searchIndex ) );
+        + weightedIntensitySum );
 
       this->m_WeightSumImage->SetPixel( currentCenterIndex,
-        this->m_WeightSumImage->GetPixel( currentCenterIndex ) + weight );
+        this->m_WeightSumImage->GetPixel( currentCenterIndex ) + weightSum );
+      }
+
+    if( fillCache )
+      {
+      nextCache.m_VoxelOffsets.push_back( nextCache.m_SearchOffsetIndices.size() );
+      }
+    ++voxelCount;
+    }
+
+  if( cache != nullptr )
+    {
+    if( fillCache )
+      {
+      std::swap( *cache, nextCache );
+      }
+    else
+      {
+      cache->Clear();
       }
     }
 }
@@ -0,0 +1,108 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef __itkStreamingResampleImageFilter_h
+#define __itkStreamingResampleImageFilter_h
+
+#include "itkResampleImageFilter.h"
+
+namespace itk
+{
+/** \class StreamingResampleImageFilter
+ * \brief Resample filter which requests only the part of the input that the
+ * requested output region maps to.
+ *
+ * ResampleImageFilter requests the largest possible region of its input
+ * because it cannot assume anything about the transform.  This subclass
+ * instead maps every voxel on the boundary faces of the requested output
+ * region, and a lattice of its interior every SamplingStride voxels, through
+ * the transform and requests the bounding box of the mapped points in the
+ * input, padded by PaddingRadius voxels to accommodate the support of the
+ * interpolator.
+ *
+ * When the filter is placed between a streaming reader and a writer with
+ * several stream divisions, peak memory is bounded by the size of a single
+ * output slab and the input region it maps to.  The bounding box covers the
+ * whole mapped region as long as the transform does not fold, which holds for
+ * the linear and diffeomorphic transforms produced by ANTs.  Interpolators with global support (B-spline) see the slab input
+ * with mirrored boundaries, so a larger padding should be used with them.
+ *
+ * \ingroup GeometricTransform
+ */
+template <typename TInputImage, typename TOutputImage,
+          typename TInterpolatorPrecisionType = double,
+          typename TTransformPrecisionType = TInterpolatorPrecisionType>
+class StreamingResampleImageFilter :
+  public ResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType, TTransformPrecisionType>
+{
+public:
+  /** Standard class typedefs. */
+  typedef StreamingResampleImageFilter Self;
+  typedef ResampleImageFilter<TInputImage, TOutputImage,
+                              TInterpolatorPrecisionType, TTransformPrecisionType> Superclass;
+  typedef SmartPointer<Self>       Pointer;
+  typedef SmartPointer<const Self> ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro( Self );
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro( StreamingResampleImageFilter, ResampleImageFilter );
+
+  itkStaticConstMacro( ImageDimension, unsigned int, TOutputImage::ImageDimension );
+
+  typedef TInputImage                           InputImageType;
+  typedef TOutputImage                          OutputImageType;
+  typedef typename InputImageType::RegionType   InputImageRegionType;
+  typedef typename OutputImageType::RegionType  OutputImageRegionType;
+  typedef typename Superclass::TransformType    TransformType;
+
+  typedef Point<TTransformPrecisionType, ImageDimension>           PointType;
+  typedef ContinuousIndex<TTransformPrecisionType, ImageDimension> ContinuousIndexType;
+
+  /** Number of input voxels added on each side of the mapped bounding box. */
+  itkSetMacro( PaddingRadius, unsigned int );
+  itkGetConstMacro( PaddingRadius, unsigned int );
+
+  /** Spacing (in output voxels) of the interior lattice mapped through the
+   * transform, in addition to every voxel of the region boundary. */
+  itkSetClampMacro( SamplingStride, unsigned int, 1, NumericTraits<unsigned int>::max() );
+  itkGetConstMacro( SamplingStride, unsigned int );
+
+protected:
+  StreamingResampleImageFilter();
+  ~StreamingResampleImageFilter() override = default;
+  void PrintSelf( std::ostream & os, Indent indent ) const override;
+
+  /** Request the bounding region of the input which the requested output
+   * region maps to rather than the whole input. */
+  void GenerateInputRequestedRegion() override;
+
+private:
+  StreamingResampleImageFilter( const Self & ) = delete;
+  void operator=( const Self & ) = delete;
+
+  unsigned int m_PaddingRadius;
+  unsigned int m_SamplingStride;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkStreamingResampleImageFilter.hxx"
+#endif
+
+#endif
@@ -0,0 +1,208 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef __itkStreamingResampleImageFilter_hxx
+#define __itkStreamingResampleImageFilter_hxx
+
+#include "itkStreamingResampleImageFilter.h"
+
+#include <cmath>
+#include <vector>
+
+namespace itk
+{
+template <typename TInputImage, typename TOutputImage, typename TInterpolatorPrecisionType,
+          typename TTransformPrecisionType>
+StreamingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType, TTransformPrecisionType>
+::StreamingResampleImageFilter() :
+  m_PaddingRadius( 2 ),
+  m_SamplingStride( 4 )
+{
+}
+
+template <typename TInputImage, typename TOutputImage, typename TInterpolatorPrecisionType,
+          typename TTransformPrecisionType>
+void
+StreamingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType, TTransformPrecisionType>
+::GenerateInputRequestedRegion()
+{
+  if( !this->GetInterpolator() )
+    {
+    itkExceptionMacro( << "Interpolator not set" );
+    }
+  if( !this->GetTransform() )
+    {
+    itkExceptionMacro( << "Transform not set" );
+    }
+
+  InputImageType * inputPtr = const_cast<InputImageType *>( this->GetInput() );
+  OutputImageType * outputPtr = this->GetOutput();
+  if( !inputPtr || !outputPtr )
+    {
+    return;
+    }
+
+  const InputImageRegionType & largestRegion = inputPtr->GetLargestPossibleRegion();
+  const OutputImageRegionType & outputRegion = outputPtr->GetRequestedRegion();
+  const TransformType * transform = this->GetTransform();
+
+  ContinuousIndexType minimumIndex;
+  ContinuousIndexType maximumIndex;
+  minimumIndex.Fill( NumericTraits<TTransformPrecisionType>::max() );
+  maximumIndex.Fill( NumericTraits<TTransformPrecisionType>::NonpositiveMin() );
+  bool isAnyPointMapped = false;
+
+  // Map every output index of a lattice (the product of the coordinate lists of
+  // the axes) and grow the bounding box of the mapped input indices.
+  auto mapLattice = [&]( const std::vector<std::vector<IndexValueType> > & lattice )
+    {
+    std::vector<SizeValueType> counter( ImageDimension, 0 );
+    bool isDone = false;
+    while( !isDone )
+      {
+      typename OutputImageType::IndexType outputIndex;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        outputIndex[d] = lattice[d][counter[d]];
+        }
+
+      PointType outputPoint;
+      outputPtr->TransformIndexToPhysicalPoint( outputIndex, outputPoint );
+      const PointType inputPoint = transform->TransformPoint( outputPoint );
+
+      ContinuousIndexType inputIndex;
+      inputPtr->TransformPhysicalPointToContinuousIndex( inputPoint, inputIndex );
+
+      bool isFinite = true;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        isFinite = isFinite && std::isfinite( inputIndex[d] );
+        }
+      if( isFinite )
+        {
+        isAnyPointMapped = true;
+        for( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          minimumIndex[d] = std::min( minimumIndex[d], inputIndex[d] );
+          maximumIndex[d] = std::max( maximumIndex[d], inputIndex[d] );
+          }
+        }
+
+      // odometer increment over the lattice
+      isDone = true;
+      for( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        if( ++counter[d] < lattice[d].size() )
+          {
+          isDone = false;
+          break;
+          }
+        counter[d] = 0;
+        }
+      }
+    };
+
+  if( outputRegion.GetNumberOfPixels() > 0 )
+    {
+    // Every voxel of the boundary faces of the output region:  as long as the
+    // transform does not fold, the mapped boundary encloses the mapped region.
+    std::vector<std::vector<IndexValueType> > allIndices( ImageDimension );
+    std::vector<IndexValueType>               firstIndex( ImageDimension );
+    std::vector<IndexValueType>               lastIndex( ImageDimension );
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      firstIndex[d] = outputRegion.GetIndex()[d];
+      lastIndex[d] = firstIndex[d] + static_cast<IndexValueType>( outputRegion.GetSize()[d] ) - 1;
+      for( IndexValueType i = firstIndex[d]; i <= lastIndex[d]; i++ )
+        {
+        allIndices[d].push_back( i );
+        }
+      }
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      std::vector<std::vector<IndexValueType> > face( allIndices );
+      face[d].assign( 1, firstIndex[d] );
+      mapLattice( face );
+      if( lastIndex[d] != firstIndex[d] )
+        {
+        face[d].assign( 1, lastIndex[d] );
+        mapLattice( face );
+        }
+      }
+
+    // and the interior on a lattice of SamplingStride voxels
+    std::vector<std::vector<IndexValueType> > lattice( ImageDimension );
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      for( IndexValueType i = firstIndex[d]; i < lastIndex[d]; i += this->m_SamplingStride )
+        {
+        lattice[d].push_back( i );
+        }
+      lattice[d].push_back( lastIndex[d] );
+      }
+    mapLattice( lattice );
+    }
+
+  InputImageRegionType inputRegion;
+  if( isAnyPointMapped )
+    {
+    typename InputImageType::IndexType inputStartIndex;
+    typename InputImageType::SizeType inputSize;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      const IndexValueType lower = static_cast<IndexValueType>( std::floor( minimumIndex[d] ) )
+        - static_cast<IndexValueType>( this->m_PaddingRadius );
+      const IndexValueType upper = static_cast<IndexValueType>( std::ceil( maximumIndex[d] ) )
+        + static_cast<IndexValueType>( this->m_PaddingRadius );
+      inputStartIndex[d] = lower;
+      inputSize[d] = static_cast<SizeValueType>( upper - lower + 1 );
+      }
+    inputRegion.SetIndex( inputStartIndex );
+    inputRegion.SetSize( inputSize );
+    }
+
+  if( !isAnyPointMapped || !inputRegion.Crop( largestRegion ) )
+    {
+    // The requested output lies entirely outside of the input.  Request a
+    // single voxel so that the pipeline stays valid; every output voxel
+    // then receives the default pixel value.
+    typename InputImageType::SizeType unitSize;
+    unitSize.Fill( 1 );
+    inputRegion.SetIndex( largestRegion.GetIndex() );
+    inputRegion.SetSize( unitSize );
+    }
+
+  itkDebugMacro( "Requesting input region " << inputRegion
+                 << " for output region " << outputRegion );
+
+  inputPtr->SetRequestedRegion( inputRegion );
+}
+
+template <typename TInputImage, typename TOutputImage, typename TInterpolatorPrecisionType,
+          typename TTransformPrecisionType>
+void
+StreamingResampleImageFilter<TInputImage, TOutputImage, TInterpolatorPrecisionType, TTransformPrecisionType>
+::PrintSelf( std::ostream & os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "PaddingRadius: " << this->m_PaddingRadius << std::endl;
+  os << indent << "SamplingStride: " << this->m_SamplingStride << std::endl;
+}
+} // end namespace itk
+
+#endif
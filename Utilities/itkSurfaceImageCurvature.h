@@ -20,9 +20,56 @@
 #include "itkGradientRecursiveGaussianImageFilter.h"
 #include "itkGradientImageFilter.h"
 #include "itkVectorLinearInterpolateImageFunction.h"
+#include <unordered_set>
+#include <vector>
 
 namespace itk
 {
+/** Quick node class to help get the geodesic neighborhood
+*/
+
+template <typename TSurface>
+class GeodesicNode
+{
+public:
+
+  /** Image related types. */
+  typedef TSurface                      ImageType;
+  typedef typename ImageType::IndexType IndexType;
+
+  unsigned long neighborhoodindex;
+  float         distance;
+  bool          connected;
+  IndexType     imageindex;
+
+  GeodesicNode()
+  {
+    distance = 0.0;
+    connected = false;
+    neighborhoodindex = 0;
+  }
+
+  GeodesicNode(unsigned long i, float d, bool t, IndexType ind)
+  {
+    distance = d;
+    connected = t;
+    neighborhoodindex = i;
+    imageindex = ind;
+  }
+
+  ~GeodesicNode() = default;
+};
+
+template <typename pclass>
+class GeodesicNodePriority /* defines the comparison operator for the prioritiy queue */
+{
+public:
+  bool operator()( pclass N1, pclass N2)
+  {
+    return N1.distance > N2.distance;
+  }
+};
+
 /** \class SurfaceImageCurvature
  *
  * This class takes a surface as input and creates a local
@@ -56,6 +103,7 @@ public:
     ImageType;
   typedef typename ImageType::IndexType           IndexType;
   typedef typename ImageType::SizeType            SizeType;
+  typedef typename ImageType::OffsetType          OffsetType;
   typedef ImageRegionIteratorWithIndex<ImageType> ImageIteratorType;
   /** Image dimension. */
   static constexpr unsigned int SurfaceDimension = TSurface::ImageDimension;
@@ -65,6 +113,7 @@ public:
   typedef typename Superclass::PointType  FixedVectorType;
   typedef typename Superclass::PointType  PointType;
   typedef typename Superclass::MatrixType MatrixType;
+  typedef typename Superclass::PointContainerType PointContainerType;
   typedef typename ImageType::PointType ImagePointType;
 
   typedef  Image<PixelType, itkGetStaticConstMacro(ImageDimension)>
@@ -102,7 +151,9 @@ public:
   void  FindGeodesicNeighborhood();
 
   /** This applies one of the algorithms for finding the local curvature
-      and frame.  The default is joshi. */
+      and frame.  The default is joshi.  Surface voxels are split across
+      the work units (see SetNumberOfWorkUnits); each work unit uses its own
+      copy of the per-point state. */
   void ComputeFrameOverDomain(unsigned int which = 0) override;
 
   ImageType * GetInput();
@@ -248,19 +299,42 @@ protected:
       the fast marching image filter. */
 private:
 
+  /** Returns a copy that shares the input, gradient and function images and
+   * the parameters of this object but owns its own neighborhood scratch
+   * state, so that copies can process disjoint surface points concurrently. */
+  Pointer CreateWorker();
+
+  /** Frame and curvature estimation at one surface point; returns the value
+   * written to the function image by ComputeFrameOverDomain. */
+  RealType ComputeFunctionAtSurfacePoint( const ImagePointType & pt, unsigned int which );
+
+  /** Offsets searched by the neighborhood functions, rebuilt whenever the
+   * neighborhood radius changes. */
+  void InitializeNeighborhoodOffsets();
+
+  unsigned long GeodesicNodeKey( const IndexType & index ) const;
+
+  typedef GeodesicNode<ImageType> GeodesicNodeType;
+
   PixelType                m_SurfaceLabel;
   OutputImagePointer       m_FunctionImage;
   RealType                 m_NeighborhoodRadius;
   SizeType                 m_ImageSize;
   GradientImagePointer     m_GradientImage;
-  NeighborhoodIteratorType m_ti;
-  NeighborhoodIteratorType m_ti2;
   bool                     m_UseLabel;
   float                    m_kSign;
   float                    m_Threshold;
   float                    m_Area;
   RealType                 m_MinSpacing;
   typename VectorInterpolatorType::Pointer m_Vinterp;
+
+  RealType                          m_OffsetTableRadius;
+  std::vector<OffsetType>           m_EuclideanOffsets;
+  std::vector<OffsetType>           m_GeodesicOffsets;
+  std::vector<float>                m_GeodesicOffsetDistances;
+  std::vector<GeodesicNodeType>     m_GeodesicQueue;
+  std::unordered_set<unsigned long> m_GeodesicVisited;
+  PointContainerType                m_NeighborScratch;
 };
 } // namespace itk
 
@@ -20,57 +20,11 @@
 // #include "itkLevelSetCurvatureFunction.h"
 #include "itkCastImageFilter.h"
 #include "itkDiscreteGaussianImageFilter.h"
-#include <queue>
-#include <map>
+#include "itkMultiThreaderBase.h"
 #include <algorithm>
 
 namespace itk
 {
-/** Quick node class to help get the geodesic neighborhood
-*/
-
-template <typename TSurface>
-class GeodesicNode
-{
-public:
-
-  /** Image related types. */
-  typedef TSurface                      ImageType;
-  typedef typename ImageType::IndexType IndexType;
-
-  unsigned long neighborhoodindex;
-  float         distance;
-  bool          connected;
-  IndexType     imageindex;
-
-  GeodesicNode()
-  {
-    distance = 0.0;
-    connected = false;
-    neighborhoodindex = 0;
-  }
-
-  GeodesicNode(unsigned long i, float d, bool t, IndexType ind)
-  {
-    distance = d;
-    connected = t;
-    neighborhoodindex = i;
-    imageindex = ind;
-  }
-
-  ~GeodesicNode() = default;
-};
-
-template <typename pclass>
-class GeodesicNodePriority /* defines the comparison operator for the prioritiy queue */
-{
-public:
-  bool operator()( pclass N1, pclass N2)
-  {
-    return N1.distance > N2.distance;
-  }
-};
-
 template <typename TSurface>
 SurfaceImageCurvature<TSurface>
 ::SurfaceImageCurvature()
@@ -86,6 +40,137 @@ SurfaceImageCurvature<TSurface>
   m_FunctionImage = nullptr;
   this->m_Vinterp = nullptr;
   this->m_MinSpacing = itk::NumericTraits<RealType>::max() ;
+  this->m_OffsetTableRadius = -1;
+}
+
+template <typename TSurface>
+typename SurfaceImageCurvature<TSurface>::Pointer
+SurfaceImageCurvature<TSurface>
+::CreateWorker()
+{
+  Pointer worker = Self::New();
+
+  worker->m_FunctionImage = this->m_FunctionImage;
+  typename ImageType::Pointer input = this->GetInput();
+  worker->SetInputImage( input );
+
+  worker->m_SurfaceLabel = this->m_SurfaceLabel;
+  worker->m_NeighborhoodRadius = this->m_NeighborhoodRadius;
+  worker->m_ImageSize = this->m_ImageSize;
+  worker->m_GradientImage = this->m_GradientImage;
+  worker->m_Vinterp = this->m_Vinterp;
+  worker->m_UseLabel = this->m_UseLabel;
+  worker->m_kSign = this->m_kSign;
+  worker->m_Threshold = this->m_Threshold;
+  worker->m_MinSpacing = this->m_MinSpacing;
+  worker->m_Sigma = this->m_Sigma;
+  worker->m_UseGeodesicNeighborhood = this->m_UseGeodesicNeighborhood;
+  worker->m_Debug = this->m_Debug;
+
+  return worker;
+}
+
+template <typename TSurface>
+void
+SurfaceImageCurvature<TSurface>
+::InitializeNeighborhoodOffsets()
+{
+  if( this->m_OffsetTableRadius == this->m_NeighborhoodRadius )
+    {
+    return;
+    }
+  this->m_OffsetTableRadius = this->m_NeighborhoodRadius;
+
+  // Both tables list offsets in NeighborhoodIterator order (first dimension
+  // fastest) so that points are visited in the same order as before.
+  const long rad = (long)(this->m_NeighborhoodRadius);
+  const long width = 2 * rad + 1;
+  long       total = 1;
+  for( unsigned int k = 0; k < ImageDimension; k++ )
+    {
+    total *= width;
+    }
+
+  this->m_EuclideanOffsets.clear();
+  for( long n = 0; n < total; n++ )
+    {
+    OffsetType off;
+    long       remainder = n;
+    bool       isorigin = true;
+    float      dist = 0.0;
+    for( unsigned int k = 0; k < ImageDimension; k++ )
+      {
+      off[k] = remainder % width - rad;
+      remainder /= width;
+      if( off[k] != 0 )
+        {
+        isorigin = false;
+        }
+      RealType delt = -static_cast<RealType>( off[k] );
+      dist += delt * delt;
+      }
+    dist = sqrt(dist);
+    if( !isorigin && dist <= this->m_NeighborhoodRadius )
+      {
+      this->m_EuclideanOffsets.push_back( off );
+      }
+    }
+
+  this->m_GeodesicOffsets.clear();
+  this->m_GeodesicOffsetDistances.clear();
+  long faceTotal = 1;
+  for( unsigned int k = 0; k < ImageDimension; k++ )
+    {
+    faceTotal *= 3;
+    }
+  for( long n = 0; n < faceTotal; n++ )
+    {
+    OffsetType off;
+    long       remainder = n;
+    bool       isorigin = true;
+    float      dist = 0.0;
+    for( unsigned int k = 0; k < ImageDimension; k++ )
+      {
+      off[k] = remainder % 3 - 1;
+      remainder /= 3;
+      if( off[k] != 0 )
+        {
+        isorigin = false;
+        }
+      dist += (float)( -off[k] ) * ( -off[k] );
+      }
+    // the center is always already connected when it is expanded
+    if( !isorigin )
+      {
+      this->m_GeodesicOffsets.push_back( off );
+      this->m_GeodesicOffsetDistances.push_back( sqrt(dist) );
+      }
+    }
+}
+
+template <typename TSurface>
+unsigned long
+SurfaceImageCurvature<TSurface>
+::GeodesicNodeKey( const IndexType & index ) const
+{
+  unsigned long longindex = 0;
+
+  for( unsigned int k = 0; k < ImageDimension; k++ )
+    {
+    if( k == 0 )
+      {
+      longindex = index[0];
+      }
+    if( k == 1 )
+      {
+      longindex = index[1] + longindex + index[0] * m_ImageSize[0];
+      }
+    if( k == 2 )
+      {
+      longindex = index[2] + longindex + index[2] * m_ImageSize[0] * m_ImageSize[1];
+      }
+    }
+  return longindex;
 }
 
 template <typename TSurface>
@@ -155,53 +240,40 @@ template <typename TSurface>
 void  SurfaceImageCurvature<TSurface>::FindEuclideanNeighborhood
   (typename SurfaceImageCurvature<TSurface>::PointType rootpoint)
 {
+  this->InitializeNeighborhoodOffsets();
+
+  ImageType * image = this->GetInput();
+
   this->m_AveragePoint = this->m_Origin;
-  this->m_PointList.insert(this->m_PointList.begin(), this->m_Origin);
-  typename ImageType::SizeType rad;
   IndexType oindex, index;
   typename ImageType::PointType tempp;
   tempp[0] = rootpoint[0];
   tempp[1] = rootpoint[1];
   tempp[2] = rootpoint[2];
   this->m_FunctionImage->TransformPhysicalPointToIndex( tempp, oindex );
-  for( unsigned int i = 0; i < ImageDimension; i++ )
-    {
-    rad[i] = (long)(m_NeighborhoodRadius);
-    }
-  m_ti.SetLocation(oindex);
-  unsigned int temp = 0;
-  for( temp = 0; temp < m_ti.Size(); temp++ )
+
+  // Points are gathered in offset order and prepended as one block, which
+  // leaves the list ordered as if each had been inserted at the front.
+  this->m_NeighborScratch.clear();
+  this->m_NeighborScratch.push_back( this->m_Origin );
+  for( unsigned int n = 0; n < this->m_EuclideanOffsets.size(); n++ )
     {
-    index = m_ti.GetIndex(temp);
-    if( this->IsValidIndex( index) )
-      {
-      float pix = m_ti.GetPixel( temp );
-      if( this->IsValidSurface( pix, index) )
+    index = oindex + this->m_EuclideanOffsets[n];
+    if( this->IsValidIndex( index ) && this->IsValidSurface( image->GetPixel( index ), index ) )
       {
       PointType p;
       typename ImageType::PointType ipt;
       this->m_FunctionImage->TransformIndexToPhysicalPoint( index, ipt );
-      float     dist = 0.0;
-      bool      isorigin = true;
       for( unsigned int k = 0; k < ImageDimension; k++ )
         {
-        if( index[k] != oindex[k] )
-          {
-          isorigin = false;
-          }
         p[k] = ipt[k];
-        RealType delt = static_cast<RealType>(oindex[k]) -
-          static_cast<RealType>(index[k]);
-        dist +=  delt*delt;
-        }
-      dist = sqrt(dist);
-      if( !isorigin && dist <= (m_NeighborhoodRadius) )
-        {
-        this->m_AveragePoint = this->m_AveragePoint + p;
-        this->m_PointList.insert(this->m_PointList.begin(), p);
         }
-      } } // test valid index and valid surface
+      this->m_AveragePoint = this->m_AveragePoint + p;
+      this->m_NeighborScratch.push_back( p );
+      }
     }
+  this->m_PointList.insert( this->m_PointList.begin(),
+                            this->m_NeighborScratch.rbegin(), this->m_NeighborScratch.rend() );
 
   unsigned int npts = this->m_PointList.size();
   if( npts > 0 )
@@ -225,137 +297,78 @@ void  SurfaceImageCurvature<TSurface>::FindEuclideanNeighborhood
 template <typename TSurface>
 void  SurfaceImageCurvature<TSurface>::FindGeodesicNeighborhood()
 {
-  typedef std::priority_queue
-    <GeodesicNode<ImageType>, std::vector<GeodesicNode<ImageType> >,
-     GeodesicNodePriority<GeodesicNode<ImageType> > >  QType;
+  this->InitializeNeighborhoodOffsets();
+
+  ImageType * image = this->GetInput();
 
-  QType                                            nodeq;
-  std::map<unsigned int, GeodesicNode<ImageType> > nodes;
+  // The queue is a binary heap in a reused buffer, driven exactly as
+  // std::priority_queue would be; the visited set replaces the node map.
+  std::vector<GeodesicNodeType> &          nodeq = this->m_GeodesicQueue;
+  std::unordered_set<unsigned long> &      connected = this->m_GeodesicVisited;
+  GeodesicNodePriority<GeodesicNodeType>   priority;
+  nodeq.clear();
+  connected.clear();
 
   this->m_AveragePoint = this->m_Origin;
 
-  this->m_PointList.insert(this->m_PointList.begin(), this->m_Origin);
+  this->m_NeighborScratch.clear();
+  this->m_NeighborScratch.push_back( this->m_Origin );
 
-  typename ImageType::SizeType rad;
   IndexType oindex, index;
-
-  float         dist = 0.0;
-  unsigned int  k = 0;
-  unsigned long longindex = 0;
   for( unsigned int i = 0; i < ImageDimension; i++ )
     {
-    rad[i] = (long)(m_NeighborhoodRadius);
     oindex[i] = (long) (this->m_Origin[i] + 0.5);
     }
-  index = oindex;
-  for( k = 0; k < ImageDimension; k++ )
-    {
-    if( k == 0 )
-      {
-      longindex = index[0];
-      }
-    if( k == 1 )
-      {
-      longindex = index[1] + longindex + index[0] * m_ImageSize[0];
-      }
-    if( k == 2 )
-      {
-      longindex = index[2] + longindex + index[2] * m_ImageSize[0] * m_ImageSize[1];
-      }
-    }
-  GeodesicNode<ImageType> gnode(longindex, 0.0, true, oindex);
-  nodes[longindex] = gnode;
-  nodeq.push(gnode);
+  GeodesicNodeType gnode( this->GeodesicNodeKey( oindex ), 0.0, true, oindex );
+  connected.insert( gnode.neighborhoodindex );
+  nodeq.push_back( gnode );
+  std::push_heap( nodeq.begin(), nodeq.end(), priority );
 
   float lastdist = 0.0;
 
-// if ( this->m_Origin[1]==146 && this->m_Origin[0] > 167 )
-// if ( this->m_Origin[1]==146 && this->m_Origin[0] == 168 && this->m_Origin[2]==215)
-// {
-// std::cout << " origin " << this->m_Origin << std::endl;
-// }
-
   while( !nodeq.empty() && lastdist <= m_NeighborhoodRadius )
     {
-    GeodesicNode<ImageType> g = nodeq.top();
+    GeodesicNodeType g = nodeq.front();
 
     lastdist = g.distance;
 
-    PointType q;
-
-//    if ( g.distance < 2.0)
-//    {
-//      this->m_PointList.insert(this->m_PointList.begin(),q);
-//      nodes[g.neighborhoodindex].connected=true;
-//    }
-//    else
     if( lastdist <= m_NeighborhoodRadius )
       {
-      m_ti2.SetLocation(g.imageindex);
-      for( unsigned int jj = 0; jj < m_ti2.Size(); jj++ )
+      for( unsigned int jj = 0; jj < this->m_GeodesicOffsets.size(); jj++ )
         {
-        index = m_ti2.GetIndex(jj);
-
-        if(  // m_ti2.GetPixel(jj) == m_SurfaceLabel &&
-          this->IsValidSurface( m_ti2.GetPixel(jj), index) &&
-          index[0] < m_ImageSize[0] - m_NeighborhoodRadius &&
-          index[0] >  m_NeighborhoodRadius &&
-          index[1] < m_ImageSize[1] - m_NeighborhoodRadius &&
-          index[1] >  m_NeighborhoodRadius &&
-          index[2] < m_ImageSize[2] - m_NeighborhoodRadius &&
-          index[2] >  m_NeighborhoodRadius )
+        index = g.imageindex + this->m_GeodesicOffsets[jj];
+
+        if( index[0] < m_ImageSize[0] - m_NeighborhoodRadius &&
+            index[0] >  m_NeighborhoodRadius &&
+            index[1] < m_ImageSize[1] - m_NeighborhoodRadius &&
+            index[1] >  m_NeighborhoodRadius &&
+            index[2] < m_ImageSize[2] - m_NeighborhoodRadius &&
+            index[2] >  m_NeighborhoodRadius &&
+            this->IsValidSurface( image->GetPixel( index ), index ) )
           {
-          longindex = 0;
-          dist = 0;
-          for( k = 0; k < ImageDimension; k++ )
+          const unsigned long longindex = this->GeodesicNodeKey( index );
+          const float         dist = this->m_GeodesicOffsetDistances[jj];
+          if( connected.find( longindex ) == connected.end() && (dist + lastdist) <= m_NeighborhoodRadius )
             {
-            if( k == 0 )
-              {
-              longindex = index[0];
-              }
-            if( k == 1 )
+            PointType q;
+            for( unsigned int k = 0; k < ImageDimension; k++ )
               {
-              longindex = index[1] + longindex + index[0] * m_ImageSize[0];
+              q[k] = (RealType) index[k];
               }
-            if( k == 2 )
-              {
-              longindex = index[2] + longindex + index[2] * m_ImageSize[0] * m_ImageSize[1];
-              }
-            q[k] = (RealType) index[k];
-//            dist+=(g.imageindex[k]-oindex[k])*(g.imageindex[k]-oindex[k]);
-//            dist+=(index[k]-oindex[k])*(index[k]-oindex[k]);
-            dist += (float)(g.imageindex[k] - index[k]) * (g.imageindex[k] - index[k]);
-            }
-          dist = sqrt(dist);
-
-// if ( this->m_Origin[1]==146 && this->m_Origin[0] == 168 && this->m_Origin[2]==215)
-// {
-// std::cout << " testing point " << index << " longind " << longindex << " dist " << dist <<
-// " bool " << nodes[longindex].connected << std::endl;
-// }
-//          if (!nodes[longindex].connected ) //&& !nodes[g.neighborhoodindex].connected)
-          if( !nodes[longindex].connected &&  (dist + lastdist) <= m_NeighborhoodRadius )
-            {
-            GeodesicNode<ImageType> _gnode(longindex, dist + lastdist, true, index);
-//            GeodesicNode<ImageType> _gnode(longindex,dist,true,index);
-            nodes[longindex] = _gnode;
-            nodeq.push(_gnode);
-// if ( this->m_Origin[1]==146 && this->m_Origin[0] == 168 && this->m_Origin[2]==215)
-// /{
-// std::cout << " inserting point " << index << std::endl;
-// }
-            this->m_PointList.insert(this->m_PointList.begin(), q);
+            connected.insert( longindex );
+            nodeq.push_back( GeodesicNodeType( longindex, dist + lastdist, true, index ) );
+            std::push_heap( nodeq.begin(), nodeq.end(), priority );
+            this->m_NeighborScratch.push_back( q );
             this->m_AveragePoint = this->m_AveragePoint + q;
             }
-//          else if ( dist > 0 && dist+lastdist < nodes[longindex].distance )
-//          {
-//            nodes[longindex].distance=dist+lastdist;
-//          }
           }
         }
       }
-    nodeq.pop();
+    std::pop_heap( nodeq.begin(), nodeq.end(), priority );
+    nodeq.pop_back();
     }
+  this->m_PointList.insert( this->m_PointList.begin(),
+                            this->m_NeighborScratch.rbegin(), this->m_NeighborScratch.rend() );
 
   this->m_AveragePoint = this->m_AveragePoint / ( (float)this->m_PointList.size() );
 }
@@ -424,16 +437,6 @@ void  SurfaceImageCurvature<TSurface>
     return;
     }
 
-  typename ImageType::SizeType rad;
-  typename ImageType::SizeType rad2;
-  for( unsigned int t = 0; t < ImageDimension; t++ )
-    {
-    rad[t] = (unsigned long) (this->m_NeighborhoodRadius);
-    rad2[t] = 1;
-    }
-  this->m_ti.Initialize( rad, image, image->GetLargestPossibleRegion() );
-  this->m_ti2.Initialize( rad2, image, image->GetLargestPossibleRegion() );
-
   typedef itk::ImageRegionIteratorWithIndex<TSurface> IteratorType;
   IteratorType Iterator( image, image->GetLargestPossibleRegion().GetSize() );
   bool         wmgmcurv = true;
@@ -838,32 +841,15 @@ SurfaceImageCurvature<TSurface>
   tempimage->SetLargestPossibleRegion( image->GetLargestPossibleRegion() );
   tempimage->SetBufferedRegion( image->GetLargestPossibleRegion() );
   tempimage->Allocate();
-
-  typename ImageType::SizeType rad;
-  typename ImageType::SizeType rad2;
-  for( unsigned int t = 0; t < ImageDimension; t++ )
-    {
-    rad[t] = (unsigned long) (this->m_NeighborhoodRadius);
-    rad2[t] = 1;
-    }
-
-  this->m_ti.Initialize( rad, this->GetInput(), image->GetLargestPossibleRegion() );
-  this->m_ti2.Initialize( rad2, this->GetInput(), image->GetLargestPossibleRegion() );
+  tempimage->FillBuffer( 0 );
 
   IndexType index;
 
-  typename ImageType::RegionType requestedRegion;
-  ImageIteratorType ti( this->GetInput(), this->GetInput()->GetLargestPossibleRegion() );
-
-  //  std::cout << " begin integrate ";
-
-  ti.GoToBegin();
-  unsigned int ct = 0;
-  //  std::cout << " begin while " << std::endl;
-  while( !ti.IsAtEnd()  )
+  std::vector<IndexType> surfaceIndices;
+  ImageIteratorType      ti( this->GetInput(), this->GetInput()->GetLargestPossibleRegion() );
+  for( ti.GoToBegin(); !ti.IsAtEnd(); ++ti )
     {
     index = ti.GetIndex();
-    tempimage->SetPixel(index, 0);
     if(    // ti.Get() == this->m_SurfaceLabel &&
       (this->IsValidSurface(ti.Get(), index) ) &&
       index[0] < this->m_ImageSize[0] - this->m_NeighborhoodRadius &&
@@ -873,21 +859,46 @@ SurfaceImageCurvature<TSurface>
       index[2] < this->m_ImageSize[2] - this->m_NeighborhoodRadius &&
       index[2] >  this->m_NeighborhoodRadius )
       {
-      PointType p;
-      ct++;
-      for( unsigned int k = 0; k < ImageDimension; k++ )
-        {
-        p[k] = (RealType) index[k];
-        }
-      this->SetOrigin(p);
-//          std::cout << " find nhood ";
-      this->FindNeighborhood();
-      RealType area = this->IntegrateFunctionOverNeighborhood(norm);
-      tempimage->SetPixel(index, area);
+      surfaceIndices.push_back( index );
       }
-    ++ti;
     }
 
+  // Each work unit integrates an interleaved set of blocks of surface points
+  // with its own copy of the neighborhood state.
+  const SizeValueType numberOfPoints = surfaceIndices.size();
+  const SizeValueType pointsPerBlock = 64;
+  const SizeValueType numberOfBlocks = ( numberOfPoints + pointsPerBlock - 1 ) / pointsPerBlock;
+  const unsigned int  numberOfWorkUnits = std::max( 1u, this->GetNumberOfWorkUnits() );
+
+  std::vector<Pointer> workers( numberOfWorkUnits );
+  for( unsigned int n = 0; n < numberOfWorkUnits; n++ )
+    {
+    workers[n] = this->CreateWorker();
+    }
+
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, numberOfWorkUnits,
+    [&]( SizeValueType workUnit )
+      {
+      Self * worker = workers[workUnit];
+      for( SizeValueType block = workUnit; block < numberOfBlocks; block += numberOfWorkUnits )
+        {
+        const SizeValueType last = std::min( numberOfPoints, ( block + 1 ) * pointsPerBlock );
+        for( SizeValueType n = block * pointsPerBlock; n < last; n++ )
+          {
+          PointType p;
+          for( unsigned int k = 0; k < ImageDimension; k++ )
+            {
+            p[k] = (RealType) surfaceIndices[n][k];
+            }
+          worker->SetOrigin(p);
+          worker->FindNeighborhood();
+          RealType area = worker->IntegrateFunctionOverNeighborhood(norm);
+          tempimage->SetPixel(surfaceIndices[n], area);
+          }
+        }
+      }, nullptr );
+
   this->CopyImageToFunctionImage(tempimage, this->m_FunctionImage);
 
   return 0;
@@ -1029,90 +1040,58 @@ void  SurfaceImageCurvature<TSurface>
 }
 
 template <typename TSurface>
-void  SurfaceImageCurvature<TSurface>
-::ComputeFrameOverDomain(unsigned int which)
+typename SurfaceImageCurvature<TSurface>::RealType
+SurfaceImageCurvature<TSurface>
+::ComputeFunctionAtSurfacePoint( const ImagePointType & pt, unsigned int which )
 {
-  ImageType* image = this->GetInput();
-  if( !image )
+  PointType p;
+  for( unsigned int k = 0; k < ImageDimension; k++ )
     {
-    return;
+    p[k] = pt[k];
     }
-  for ( unsigned int d = 0; d < ImageDimension; d++ )
-    if ( image->GetSpacing()[d] < this->m_MinSpacing )
-      this->m_MinSpacing = image->GetSpacing()[d];
-  IndexType index;
-  typename ImageType::RegionType requestedRegion;
-  this->m_ImageSize = image->GetLargestPossibleRegion().GetSize();
-  ImageIteratorType ti( image, image->GetLargestPossibleRegion() );
-
-  // std::exception();
-// Get Normals First!
-  this->EstimateNormalsFromGradient();
-
-  unsigned int  ct = 1;
-  unsigned long ct2 = 0;
-  RealType      kpix = 0;
-
-  double thresh = 0.0;
-
-  ti.GoToBegin();
-  while( !ti.IsAtEnd()  )
+  RealType kpix = 0.0;
+  this->SetOrigin(p);
+  this->EstimateFrameFromGradient( pt );
+  // The Weingarten map variants rebuild the point list from the gradient,
+  // so only the frame methods need the neighborhood search.
+  if( which <= 2 || which == 4 )
     {
-    index = ti.GetIndex();
-    typename ImageType::PointType pt;
-    image->TransformIndexToPhysicalPoint( index, pt );
-    kpix = 0.0;
-    if(  // ti.Get() == this->m_SurfaceLabel &&
-      this->IsValidSurface(ti.Get(), index) &&
-      index[0] < this->m_ImageSize[0] - 2 * this->m_NeighborhoodRadius &&
-      index[0] >  2 * this->m_NeighborhoodRadius &&
-      index[1] < this->m_ImageSize[1] - 2 * this->m_NeighborhoodRadius &&
-      index[1] >  2 * this->m_NeighborhoodRadius &&
-      index[2] < this->m_ImageSize[2] - 2 * this->m_NeighborhoodRadius &&
-      index[2] >  2 * this->m_NeighborhoodRadius ) //
+    this->FindNeighborhood();
+    }
+  switch( which )
+    {
+    case ( 0 ):
       {
-      PointType p;
-      for( unsigned int k = 0; k < ImageDimension; k++ )
-        {
-        p[k] = pt[k];
-        }
-      this->SetOrigin(p);
-      this->EstimateFrameFromGradient( pt );
-      this->FindNeighborhood();
-      switch( which )
-        {
-        case ( 0 ):
-          {
-          this->ComputeJoshiFrame( this->m_Origin);
-          }
-          break;
-        case ( 1 ):
-          {
-          this->JainMeanAndGaussianCurvature( this->m_Origin);
-          }
-          break;
-        case ( 2 ):
-          {
-          this->ShimshoniFrame(this->m_Origin);
-          }
-          break;
-        case ( 3 ):
-          {
-          this->WeingartenMapGradients();
-          }
-          break;
-        case ( 4 ):
-          {
-          kpix = this->ComputeMeanEuclideanDistance();
-          }
-          break;
-        default:
-          {
-          this->WeingartenMapGradients();
-          }
-        }
+      this->ComputeJoshiFrame( this->m_Origin);
+      }
+      break;
+    case ( 1 ):
+      {
+      this->JainMeanAndGaussianCurvature( this->m_Origin);
+      }
+      break;
+    case ( 2 ):
+      {
+      this->ShimshoniFrame(this->m_Origin);
+      }
+      break;
+    case ( 3 ):
+      {
+      this->WeingartenMapGradients();
+      }
+      break;
+    case ( 4 ):
+      {
+      kpix = this->ComputeMeanEuclideanDistance();
+      }
+      break;
+    default:
+      {
+      this->WeingartenMapGradients();
+      }
+    }
 
-      //      this->PrintFrame();
+  //      this->PrintFrame();
 
 //       bool geterror = false;
 //       if( geterror )
@@ -1135,49 +1114,109 @@ void  SurfaceImageCurvature<TSurface>
 //         // std::cout << " best error " << error << std::endl;
 //         }
 
-      kpix = 0;
-      float fval = this->m_GaussianKappa;
-      fval = this->m_MeanKappa;
+  kpix = 0;
+  float fval = this->m_GaussianKappa;
+  fval = this->m_MeanKappa;
 //      if( fabs(fval) > 1 )
 //        {
 //        fval = 0;
 //        }
-      kpix = this->m_kSign * fval; // sulci
-      if( std::isnan(kpix)  || std::isinf(kpix) )
-        {
-        this->m_Kappa1 = 0.0;
-        this->m_Kappa2 = 0.0;
-        this->m_MeanKappa = 0.0;
-        this->m_GaussianKappa = 0.0;
-        this->m_Area = 0.0;
-        kpix = 0.0;
-        }
-      if( which == 5 )
-        {
-        kpix = this->CharacterizeSurface();
-        }
-      if( which == 6 )
-        {
-        kpix = this->m_GaussianKappa;
-        }
-      if( which == 7 )
-        {
-        kpix = this->m_Area;
-        }
-      ct++;
-      this->m_PointList.clear();
-      }
-    thresh += kpix;
-    float offset = 0;
-    if( which == 5 )
+  kpix = this->m_kSign * fval; // sulci
+  if( std::isnan(kpix)  || std::isinf(kpix) )
+    {
+    this->m_Kappa1 = 0.0;
+    this->m_Kappa2 = 0.0;
+    this->m_MeanKappa = 0.0;
+    this->m_GaussianKappa = 0.0;
+    this->m_Area = 0.0;
+    kpix = 0.0;
+    }
+  if( which == 5 )
+    {
+    kpix = this->CharacterizeSurface();
+    }
+  if( which == 6 )
+    {
+    kpix = this->m_GaussianKappa;
+    }
+  if( which == 7 )
+    {
+    kpix = this->m_Area;
+    }
+  this->m_PointList.clear();
+  return kpix;
+}
+
+template <typename TSurface>
+void  SurfaceImageCurvature<TSurface>
+::ComputeFrameOverDomain(unsigned int which)
+{
+  ImageType* image = this->GetInput();
+  if( !image )
+    {
+    return;
+    }
+  for ( unsigned int d = 0; d < ImageDimension; d++ )
+    if ( image->GetSpacing()[d] < this->m_MinSpacing )
+      this->m_MinSpacing = image->GetSpacing()[d];
+  IndexType index;
+  this->m_ImageSize = image->GetLargestPossibleRegion().GetSize();
+  ImageIteratorType ti( image, image->GetLargestPossibleRegion() );
+
+// Get Normals First!
+  this->EstimateNormalsFromGradient();
+
+  // Points away from the surface keep a zero function value.
+  this->m_FunctionImage->FillBuffer( 0 );
+
+  std::vector<IndexType> surfaceIndices;
+  for( ti.GoToBegin(); !ti.IsAtEnd(); ++ti )
+    {
+    index = ti.GetIndex();
+    if(  // ti.Get() == this->m_SurfaceLabel &&
+      this->IsValidSurface(ti.Get(), index) &&
+      index[0] < this->m_ImageSize[0] - 2 * this->m_NeighborhoodRadius &&
+      index[0] >  2 * this->m_NeighborhoodRadius &&
+      index[1] < this->m_ImageSize[1] - 2 * this->m_NeighborhoodRadius &&
+      index[1] >  2 * this->m_NeighborhoodRadius &&
+      index[2] < this->m_ImageSize[2] - 2 * this->m_NeighborhoodRadius &&
+      index[2] >  2 * this->m_NeighborhoodRadius ) //
       {
-      offset = 0;
+      surfaceIndices.push_back( index );
       }
-//    if (  ()  && ( )  ) kpix=0;
-    this->m_FunctionImage->SetPixel( index, offset + kpix );
-    ct2++;
-    ++ti;
     }
+
+  // Each work unit processes an interleaved set of blocks of surface points
+  // with its own copy of the frame and neighborhood state; the shared images
+  // are only read, and each point writes its own function image voxel.
+  const SizeValueType numberOfPoints = surfaceIndices.size();
+  const SizeValueType pointsPerBlock = 64;
+  const SizeValueType numberOfBlocks = ( numberOfPoints + pointsPerBlock - 1 ) / pointsPerBlock;
+  const unsigned int  numberOfWorkUnits = std::max( 1u, this->GetNumberOfWorkUnits() );
+
+  std::vector<Pointer> workers( numberOfWorkUnits );
+  for( unsigned int n = 0; n < numberOfWorkUnits; n++ )
+    {
+    workers[n] = this->CreateWorker();
+    }
+
+  MultiThreaderBase::Pointer threader = MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, numberOfWorkUnits,
+    [&]( SizeValueType workUnit )
+      {
+      Self * worker = workers[workUnit];
+      for( SizeValueType block = workUnit; block < numberOfBlocks; block += numberOfWorkUnits )
+        {
+        const SizeValueType last = std::min( numberOfPoints, ( block + 1 ) * pointsPerBlock );
+        for( SizeValueType n = block * pointsPerBlock; n < last; n++ )
+          {
+          typename ImageType::PointType pt;
+          image->TransformIndexToPhysicalPoint( surfaceIndices[n], pt );
+          this->m_FunctionImage->SetPixel( surfaceIndices[n],
+                                           worker->ComputeFunctionAtSurfacePoint( pt, which ) );
+          }
+        }
+      }, nullptr );
 }
 
 template <typename TSurface>